@@ -0,0 +1,405 @@
+// Micro-benchmarks for the resolver's hot paths, reported as JSON so runs
+// can be compared between releases.
+//
+// Each benchmark reports nanoseconds and heap allocations per operation:
+//   cache_hit             DNSCache::find, copy-free
+//   cache_hit_strings     DNSCache::getEntry, addresses formatted as text
+//   cache_miss_insert     DNSCache::find on a new name, then addEntry
+//   resolver_hit          DNSResolver::resolve of a cached name
+//   resolver_hit_into     DNSResolver::resolveInto of a cached name, one
+//                         ResultBuffer reused throughout
+//   convert_to_ascii      DNSResolver::convertToASCII of a plain name
+//   convert_to_ascii_idn  the same for an internationalized name
+//   canonical_name        DomainName of a mixed-case name with a trailing dot
+//   parse_response        DNSQuery::parseResponse of a CNAME + 2 A answer
+//   mt_hit_sharded        ShardedCache::lookup at 1..N threads
+//   mt_hit_mutex          the same against one mutex-protected map (the
+//                         resolver's previous cache layout), as a baseline
+//
+// Usage: dns_bench [--threads N] [--min-time SECONDS] [--keys N]
+//                  [--filter SUBSTRING] [--out FILE]
+//
+// Results go to stdout unless --out is given.
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <fstream>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <mutex>
+#include <new>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include "DNSCache.h"
+#include "DNSQuery.h"
+#include "DNSResolver.h"
+#include "DomainName.h"
+#include "MockDNSServer.h"
+#include "ShardedCache.h"
+
+// Every allocation in the process goes through these, so each thread can
+// tell how many it made during a timed loop.
+namespace {
+thread_local uint64_t thread_allocations = 0;
+}  // namespace
+
+void* operator new(size_t size) {
+    ++thread_allocations;
+    if (void* p = std::malloc(size ? size : 1)) return p;
+    throw std::bad_alloc();
+}
+void* operator new[](size_t size) { return operator new(size); }
+void* operator new(size_t size, const std::nothrow_t&) noexcept {
+    ++thread_allocations;
+    return std::malloc(size ? size : 1);
+}
+void* operator new[](size_t size, const std::nothrow_t& tag) noexcept { return operator new(size, tag); }
+void operator delete(void* p) noexcept { std::free(p); }
+void operator delete[](void* p) noexcept { std::free(p); }
+void operator delete(void* p, size_t) noexcept { std::free(p); }
+void operator delete[](void* p, size_t) noexcept { std::free(p); }
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+struct Result {
+    std::string name;
+    unsigned threads = 1;
+    uint64_t iterations = 0;
+    double ns_per_op = 0;
+    double allocs_per_op = 0;
+};
+
+struct Settings {
+    unsigned max_threads = std::thread::hardware_concurrency();
+    double min_time = 0.5;  // Seconds per benchmark
+    size_t keys = 10000;
+    std::string filter;
+    std::string out;
+};
+
+// Keeps the compiler from discarding a computed value
+template <typename T>
+void keep(const T& value) {
+    asm volatile("" : : "g"(&value) : "memory");
+}
+
+double seconds(Clock::duration d) { return std::chrono::duration<double>(d).count(); }
+
+// Runs op(i) in doubling batches until min_time has passed. If unique is
+// non-zero, op may only see indices below it: reset() is called, untimed,
+// before the indices would run past it and they start again from 0.
+template <typename Op>
+Result measure(const std::string& name, const Settings& settings, Op op,
+               size_t unique = 0, const std::function<void()>& reset = nullptr) {
+    Result result;
+    result.name = name;
+    uint64_t allocations = 0;
+    double elapsed = 0;
+    size_t batch = 1;
+    size_t index = 0;
+    while (elapsed < settings.min_time) {
+        if (unique && index + batch > unique) {
+            if (reset) reset();
+            index = 0;
+            batch = std::min(batch, unique);
+        }
+        const uint64_t allocations_before = thread_allocations;
+        const auto start = Clock::now();
+        for (size_t i = 0; i < batch; ++i) op(index + i);
+        elapsed += seconds(Clock::now() - start);
+        allocations += thread_allocations - allocations_before;
+        result.iterations += batch;
+        index += batch;
+        if (batch < (1u << 20)) batch *= 2;
+    }
+    result.ns_per_op = elapsed * 1e9 / result.iterations;
+    result.allocs_per_op = static_cast<double>(allocations) / result.iterations;
+    return result;
+}
+
+class MutexCache {
+public:
+    void insert(const std::string& key, const std::vector<std::string>& ip_addresses) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        map_[key] = Entry{ip_addresses, Clock::now() + std::chrono::hours(1)};
+    }
+    bool lookup(const std::string& key, std::vector<std::string>& ip_addresses) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto it = map_.find(key);
+        if (it == map_.end() || it->second.expiry <= Clock::now()) return false;
+        ip_addresses = it->second.ip_addresses;
+        return true;
+    }
+
+private:
+    struct Entry {
+        std::vector<std::string> ip_addresses;
+        Clock::time_point expiry;
+    };
+    std::mutex mutex_;
+    std::unordered_map<std::string, Entry> map_;
+};
+
+// Aggregate hit rate of threads looking up keys for min_time; ns_per_op is
+// the inverse of the combined throughput.
+template <typename Lookup>
+Result throughput(const std::string& name, unsigned threads, const Settings& settings,
+                  const std::vector<std::string>& keys, Lookup lookup) {
+    std::atomic<bool> start{false}, stop{false};
+    std::atomic<uint64_t> total{0}, total_allocations{0};
+    std::atomic<unsigned> ready{0};
+    std::vector<std::thread> workers;
+    for (unsigned t = 0; t < threads; ++t) {
+        workers.emplace_back([&, t] {
+            std::vector<std::string> out;
+            uint64_t hits = 0;
+            size_t i = t * 7919;
+            lookup(keys[0], out);  // Warm the buffers outside the count
+            ++ready;
+            while (!start) std::this_thread::yield();
+            const uint64_t allocations_before = thread_allocations;
+            while (!stop) {
+                for (int batch = 0; batch < 256; ++batch) {
+                    if (lookup(keys[i++ % keys.size()], out)) ++hits;
+                }
+            }
+            total_allocations += thread_allocations - allocations_before;
+            total += hits;
+        });
+    }
+    while (ready < threads) std::this_thread::yield();
+    const auto begin = Clock::now();
+    start = true;
+    std::this_thread::sleep_for(std::chrono::duration<double>(settings.min_time));
+    stop = true;
+    for (auto& w : workers) w.join();
+    const double elapsed = seconds(Clock::now() - begin);
+
+    Result result;
+    result.name = name;
+    result.threads = threads;
+    result.iterations = total;
+    result.ns_per_op = total ? elapsed * 1e9 / total : 0;
+    result.allocs_per_op = total ? static_cast<double>(total_allocations) / total : 0;
+    return result;
+}
+
+std::string hostName(size_t i) { return "host" + std::to_string(i) + ".example.com"; }
+
+std::vector<std::string> hostAddresses(size_t i) {
+    return {"192.0.2." + std::to_string(i % 256), "2001:db8::" + std::to_string(i % 10000)};
+}
+
+MockDNSServer::Zone benchZone(size_t hosts) {
+    std::ostringstream text;
+    text << "$TTL 3600\n$ORIGIN example.com.\n"
+         << "@ IN SOA ns.mock. hostmaster.mock. 1 3600 600 86400 60\n"
+         << "alias IN CNAME host0\n";
+    for (size_t i = 0; i < hosts; ++i) {
+        auto addresses = hostAddresses(i);
+        text << "host" << i << " IN A " << addresses[0] << "\n"
+             << "host" << i << " IN A 198.51.100." << i % 256 << "\n"
+             << "host" << i << " IN AAAA " << addresses[1] << "\n";
+    }
+    MockDNSServer::Zone zone;
+    std::string error;
+    std::istringstream in(text.str());
+    if (!zone.parse(in, error)) {
+        std::cerr << "dns_bench: " << error << std::endl;
+        std::exit(1);
+    }
+    return zone;
+}
+
+void writeJson(std::ostream& out, const std::vector<Result>& results) {
+    out << "{\n  \"benchmark\": \"dns_bench\",\n"
+        << "  \"hardware_concurrency\": " << std::thread::hardware_concurrency() << ",\n"
+        << "  \"results\": [";
+    for (size_t i = 0; i < results.size(); ++i) {
+        const Result& r = results[i];
+        out << (i ? ",\n" : "\n") << std::fixed
+            << "    {\"name\": \"" << r.name << "\", \"threads\": " << r.threads
+            << ", \"iterations\": " << r.iterations
+            << ", \"ns_per_op\": " << std::setprecision(2) << r.ns_per_op
+            << ", \"ops_per_sec\": " << std::setprecision(0) << (r.ns_per_op > 0 ? 1e9 / r.ns_per_op : 0)
+            << ", \"allocs_per_op\": " << std::setprecision(3) << r.allocs_per_op << "}";
+    }
+    out << "\n  ]\n}" << std::endl;
+}
+
+int usage() {
+    std::cerr << "usage: dns_bench [--threads N] [--min-time SECONDS] [--keys N]\n"
+                 "                 [--filter SUBSTRING] [--out FILE]" << std::endl;
+    return 2;
+}
+
+}  // namespace
+
+int main(int argc, char* argv[]) {
+    Settings settings;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (i + 1 >= argc) return usage();
+        std::string value = argv[++i];
+        if (arg == "--threads") {
+            settings.max_threads = static_cast<unsigned>(std::atoi(value.c_str()));
+        } else if (arg == "--min-time") {
+            settings.min_time = std::atof(value.c_str());
+        } else if (arg == "--keys") {
+            settings.keys = std::strtoul(value.c_str(), nullptr, 10);
+        } else if (arg == "--filter") {
+            settings.filter = value;
+        } else if (arg == "--out") {
+            settings.out = value;
+        } else {
+            return usage();
+        }
+    }
+    if (settings.max_threads == 0) settings.max_threads = 1;
+    if (settings.keys == 0) settings.keys = 1;
+
+    std::vector<Result> results;
+    auto wanted = [&](const std::string& name) {
+        return settings.filter.empty() || name.find(settings.filter) != std::string::npos;
+    };
+    auto record = [&](Result result) {
+        std::cerr << std::left << std::setw(24) << result.name << std::right << std::setw(3) << result.threads
+                  << std::fixed << std::setprecision(1) << std::setw(12) << result.ns_per_op << " ns/op"
+                  << std::setprecision(2) << std::setw(8) << result.allocs_per_op << " allocs/op" << std::endl;
+        results.push_back(std::move(result));
+    };
+
+    std::vector<std::string> keys;
+    for (size_t i = 0; i < settings.keys; ++i) keys.push_back(hostName(i));
+
+    // Cache
+    DNSCache cache;
+    for (size_t i = 0; i < keys.size(); ++i) cache.addEntry(keys[i], hostAddresses(i), std::chrono::hours(1));
+    if (wanted("cache_hit")) {
+        record(measure("cache_hit", settings, [&](size_t i) {
+            auto view = cache.find(keys[i % keys.size()]);
+            keep(view.size());
+        }));
+    }
+    if (wanted("cache_hit_strings")) {
+        std::vector<std::string> out;
+        record(measure("cache_hit_strings", settings, [&](size_t i) {
+            out.clear();
+            keep(cache.getEntry(keys[i % keys.size()], out));
+        }));
+    }
+    if (wanted("cache_miss_insert")) {
+        DNSCache fresh;
+        std::vector<std::vector<std::string>> addresses;
+        for (size_t i = 0; i < keys.size(); ++i) addresses.push_back(hostAddresses(i));
+        record(measure("cache_miss_insert", settings, [&](size_t i) {
+            if (!fresh.find(keys[i])) fresh.addEntry(keys[i], addresses[i], std::chrono::hours(1));
+        }, keys.size(), [&] { fresh.clear(); }));
+    }
+
+    // Resolver hits, warmed from a loopback server
+    if (wanted("resolver_hit")) {
+        const size_t hosts = std::min<size_t>(keys.size(), 1000);
+        MockDNSServer server(benchZone(hosts));
+        DNSResolver resolver;
+        DNSResolver::ResolverOptions options;
+        options.nameservers = {server.address()};
+        std::vector<std::string> names(keys.begin(), keys.begin() + hosts);
+        resolver.resolveMany(names, options);
+        if (wanted("resolver_hit")) {
+            record(measure("resolver_hit", settings, [&](size_t i) {
+                keep(resolver.resolve(names[i % names.size()], options));
+            }));
+        }
+        if (wanted("resolver_hit_into")) {
+            DNSResolver::ResultBuffer result;
+            record(measure("resolver_hit_into", settings, [&](size_t i) {
+                resolver.resolveInto(names[i % names.size()], options, result);
+                keep(result.size());
+            }));
+        }
+    }
+
+    // Name conversion
+    if (wanted("convert_to_ascii")) {
+        const std::string plain = "www.example.com";
+        record(measure("convert_to_ascii", settings, [&](size_t) {
+            keep(DNSResolver::convertToASCII(plain));
+        }));
+    }
+    if (wanted("convert_to_ascii_idn")) {
+        const std::string idn = "пример.испытание";
+        record(measure("convert_to_ascii_idn", settings, [&](size_t) {
+            keep(DNSResolver::convertToASCII(idn));
+        }));
+    }
+    if (wanted("canonical_name")) {
+        const std::string mixed = "WWW.Example.COM.";
+        record(measure("canonical_name", settings, [&](size_t) {
+            keep(DomainName(mixed).hash());
+        }));
+    }
+
+    // Response parsing: a CNAME followed by two A records
+    if (wanted("parse_response")) {
+        MockDNSServer::Zone zone = benchZone(1);
+        uint8_t query[512];
+        size_t query_length = DNSMessage::buildQuery(query, sizeof(query), 0x1234, "alias.example.com",
+                                                     DNSMessage::RecordType::A);
+        std::vector<uint8_t> response;
+        if (!zone.respond(query, query_length, response)) {
+            std::cerr << "dns_bench: could not build the response to parse" << std::endl;
+            return 1;
+        }
+        const std::string domain = "alias.example.com";
+        record(measure("parse_response", settings, [&](size_t) {
+            DNSQuery::QueryResult result;
+            keep(DNSQuery::parseResponse(response.data(), response.size(), domain,
+                                         DNSMessage::RecordType::A, result));
+        }));
+    }
+
+    // Hit throughput at 1, 2, 4, ... max_threads
+    std::vector<unsigned> thread_counts;
+    for (unsigned threads = 1; threads < settings.max_threads; threads *= 2) thread_counts.push_back(threads);
+    thread_counts.push_back(settings.max_threads);
+    if (wanted("mt_hit_sharded") || wanted("mt_hit_mutex")) {
+        ShardedCache sharded;
+        MutexCache locked;
+        for (size_t i = 0; i < keys.size(); ++i) {
+            auto addresses = hostAddresses(i);
+            sharded.insert(keys[i], addresses, std::chrono::hours(1));
+            locked.insert(keys[i], addresses);
+        }
+        for (unsigned threads : thread_counts) {
+            if (wanted("mt_hit_sharded")) {
+                record(throughput("mt_hit_sharded", threads, settings, keys,
+                    [&](const std::string& key, std::vector<std::string>& out) { return sharded.lookup(key, out); }));
+            }
+            if (wanted("mt_hit_mutex")) {
+                record(throughput("mt_hit_mutex", threads, settings, keys,
+                    [&](const std::string& key, std::vector<std::string>& out) { return locked.lookup(key, out); }));
+            }
+        }
+    }
+
+    if (settings.out.empty()) {
+        writeJson(std::cout, results);
+    } else {
+        std::ofstream file(settings.out);
+        writeJson(file, results);
+        if (!file) {
+            std::cerr << "dns_bench: could not write " << settings.out << std::endl;
+            return 1;
+        }
+    }
+    return 0;
+}
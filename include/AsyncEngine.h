@@ -0,0 +1,136 @@
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <queue>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include "DNSMessage.h"
+#include "DatagramBatch.h"
+#include "UDPTransport.h"
+
+// Non-blocking UDP query engine built on epoll.
+//
+// A single loop thread owns a small pool of unconnected UDP sockets per
+// address family. Outstanding queries are keyed by (socket, transaction ID),
+// so each socket can carry up to 65536 queries at once, and a response is
+// only accepted if it also comes from the server the query was sent to.
+// Deadlines live in a min-heap that the loop checks after every wakeup.
+// Queries submitted between wakeups leave in one sendmmsg() per socket and
+// responses are read with recvmmsg(), batch_size datagrams per call.
+class AsyncEngine {
+public:
+    enum class Status { Ok, Timeout, NetworkError, Shutdown };
+
+    // Invoked exactly once per submitted query, on the engine thread (or on
+    // the destroying thread with Status::Shutdown). response is only valid
+    // for the duration of the call.
+    using Callback = std::function<void(Status status, const uint8_t* response, size_t length)>;
+    using Clock = std::chrono::steady_clock;
+
+    explicit AsyncEngine(size_t sockets_per_family = 4, size_t batch_size = 32);
+    ~AsyncEngine();
+
+    AsyncEngine(const AsyncEngine&) = delete;
+    AsyncEngine& operator=(const AsyncEngine&) = delete;
+
+    // Queues a query for sending. The transaction ID in the query is
+    // replaced with one that is unused on the socket it is sent from.
+    // Safe to call from any thread, including from inside a callback.
+    void submit(const UDPTransport::ServerAddress& server,
+                const uint8_t* query, size_t length,
+                Clock::time_point deadline, Callback callback);
+
+    // Runs fn on the engine thread once when has passed. Tasks still
+    // waiting at shutdown are dropped without running.
+    void schedule(Clock::time_point when, std::function<void()> fn);
+
+    size_t inFlight() const { return in_flight_.load(std::memory_order_relaxed); }
+
+private:
+    // The query is copied in whole, so submitting does not allocate a
+    // packet buffer; nothing longer could go out on a socket anyway
+    struct Submission {
+        UDPTransport::ServerAddress server;
+        uint8_t query[DNSMessage::MAX_UDP_SIZE];
+        size_t length;
+        Clock::time_point deadline;
+        Callback callback;
+    };
+
+    struct Pending {
+        UDPTransport::ServerAddress server;
+        Callback callback;
+        uint64_t generation;
+    };
+
+    struct Timer {
+        Clock::time_point deadline;
+        uint32_t key;
+        uint64_t generation;
+        bool operator>(const Timer& other) const { return deadline > other.deadline; }
+    };
+
+    // Queries waiting for the next sendmmsg() on one socket, with the
+    // pending_ key of each slot
+    struct Outgoing {
+        explicit Outgoing(size_t batch_size) : batch(batch_size, DNSMessage::MAX_UDP_SIZE) {}
+        DatagramBatch batch;
+        std::vector<uint32_t> keys;
+    };
+
+    struct Task {
+        Clock::time_point when;
+        uint64_t order;  // Keeps tasks due at the same time in FIFO order
+        std::function<void()> fn;
+        bool operator>(const Task& other) const {
+            return when != other.when ? when > other.when : order > other.order;
+        }
+    };
+
+    static uint32_t makeKey(size_t socket, uint16_t id) {
+        return (static_cast<uint32_t>(socket) << 16) | id;
+    }
+
+    void run();
+    void drainSubmissions();
+    void send(Submission& submission);
+    void flush(size_t socket);
+    void receive(size_t socket);
+    void expireTimers();
+    int nextTimeoutMs() const;
+    size_t openSocket(int family);
+    void complete(uint32_t key, Status status, const uint8_t* response, size_t length);
+
+    const size_t sockets_per_family_;
+    const size_t batch_size_;
+    int epoll_fd_ = -1;
+    int wake_fd_ = -1;
+
+    // Loop thread only
+    std::vector<int> sockets_;
+    std::vector<std::unique_ptr<Outgoing>> outgoing_;  // By socket
+    DatagramBatch received_;
+    std::vector<size_t> unsent_;
+    std::vector<size_t> v4_sockets_, v6_sockets_;
+    size_t next_socket_ = 0;
+    std::unordered_map<uint32_t, Pending> pending_;
+    std::priority_queue<Timer, std::vector<Timer>, std::greater<Timer>> timers_;
+    uint64_t generation_ = 0;
+    std::priority_queue<Task, std::vector<Task>, std::greater<Task>> tasks_;
+
+    std::mutex submit_mutex_;
+    std::vector<Submission> submissions_;
+    std::vector<Task> scheduled_;
+    // Swapped with the two above on each drain, so both keep their capacity
+    std::vector<Submission> draining_;
+    std::vector<Task> draining_tasks_;
+
+    std::atomic<size_t> in_flight_{0};
+    std::atomic<bool> running_{true};
+    std::thread thread_;
+};
@@ -1,31 +1,164 @@
 #ifndef DNS_CACHE_H
 #define DNS_CACHE_H
 
+#include <atomic>
 #include <string>
 #include <vector>
-#include <unordered_map>
-#include <mutex>
 #include <chrono>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include "DNSMessage.h"
+#include "DomainName.h"
+#include "ShardedCache.h"
 
+// The resolver's answer cache. Entries live for the TTL of the answer they
+// came from, clamped to [min_ttl, max_ttl]; lookups report the TTL that is
+// left, so answers handed on downstream count down instead of restarting.
+// Addresses are kept in binary form and come back IPv4 first.
+//
+// Entries that are hit often can be refreshed ahead of expiry, and with
+// serve_stale expired entries are kept for max_stale so they can still be
+// handed out when upstream cannot answer (RFC 8767).
+//
+// Names and types known not to exist are cached separately (RFC 2308):
+// NXDOMAIN for the whole name, no-data per (name, type).
+//
+// Typed lookups (MX, SRV, TXT, ...) keep decoded record sets per
+// (name, type, class) in a second, mutex-sharded table. A CNAME is stored
+// there as the set of type CNAME for its owner, so a chain is cached link
+// by link and a later lookup can follow whatever part of it is still
+// fresh. Typed sets are not written to snapshots.
+//
+// The whole cache can be written to a snapshot file and loaded back after
+// a restart. Entries are stored in the same packed binary form they have in
+// memory, with wall-clock expiry times, so loading maps the file and copies
+// each entry straight into the table: nothing is parsed or formatted.
 class DNSCache {
-private:
-    struct CacheEntry {
-        std::vector<std::string> ip_addresses;
-        std::chrono::system_clock::time_point expiry;
+public:
+    using View = ShardedCache::View;
+
+    enum class Negative { None, NXDomain, NoData };
+
+    struct Options {
+        std::chrono::seconds min_ttl{0};       // Raise shorter TTLs to this
+        std::chrono::seconds max_ttl{86400};   // Cap longer TTLs at this
+        size_t shards = 64;
+
+        double prefetch_fraction = 0.1;        // Refresh once this fraction of the TTL is left; 0 disables
+        uint32_t prefetch_min_hits = 4;        // Hits an entry needs before it is refreshed ahead
+
+        bool serve_stale = false;
+        std::chrono::seconds max_stale{86400}; // How long past expiry an entry may be served
+        uint32_t stale_ttl = 30;               // TTL given to stale answers (RFC 8767 section 4)
+
+        std::chrono::seconds max_negative_ttl{10800};  // Cap for NXDOMAIN/no-data entries (RFC 2308 section 5)
+
+        // Bound on each table (addresses and negative entries; typed sets);
+        // a full one evicts the entry closest to expiry. 0 means unbounded.
+        size_t max_entries = 4000000;
+        // How often the resolver runs cleanup() once it has cached
+        // something; 0 leaves that to the owner
+        std::chrono::seconds cleanup_interval{60};
     };
 
-    std::unordered_map<std::string, CacheEntry> cache_;
-    mutable std::mutex cache_mutex_;
+    DNSCache();
+    explicit DNSCache(const Options& options);
 
-public:
+    // Stores ip_addresses for ttl after clamping. A clamped TTL of zero
+    // means the answer must not be cached and nothing is stored.
     void addEntry(const std::string& domain,
                  const std::vector<std::string>& ip_addresses,
                  std::chrono::seconds ttl);
 
+    // Copy-free lookup; see ShardedCache::View for the lifetime rules.
+    View find(const std::string& domain) const;
+    // As find(), but with serve_stale also returns entries up to max_stale
+    // past their expiry (check View::expired()).
+    View findStale(const std::string& domain) const;
+    // True if domain has an entry that is past its TTL but not yet removed.
+    bool holdsExpired(const std::string& domain) const;
+    // The same for canonical names, reusing their hash. Keys are compared
+    // exactly, so the resolver only ever stores canonical names.
+    View find(const DomainName& domain) const;
+    View findStale(const DomainName& domain) const;
+    bool holdsExpired(const DomainName& domain) const;
+    // True at most once per cached answer: when a hot entry has entered the
+    // last prefetch_fraction of its TTL and should be refreshed now.
+    bool shouldPrefetch(const View& view) const;
+    // Remaining TTL of a view, in whole seconds (at least 1).
+    static uint32_t remainingTTL(const View& view);
+
     bool getEntry(const std::string& domain,
                  std::vector<std::string>& ip_addresses);
+    // As above, also reporting the remaining TTL in whole seconds (at least 1).
+    bool getEntry(const std::string& domain,
+                 std::vector<std::string>& ip_addresses,
+                 uint32_t& remaining_ttl);
+
+    // Records that domain does not exist (NXDomain, any type) or has no
+    // records of type (NoData) for ttl, capped at max_negative_ttl.
+    void addNegative(const std::string& domain, DNSMessage::RecordType type, Negative kind,
+                     std::chrono::seconds ttl);
+    // Returns what is known about the absence of (domain, type), with the
+    // remaining TTL when it is not None.
+    Negative findNegative(const std::string& domain, DNSMessage::RecordType type,
+                          uint32_t& remaining_ttl) const;
+
+    // Stores a typed record set for ttl after clamping (nothing if that is
+    // zero); it replaces any earlier set for (domain, type, qclass).
+    void addRecords(const std::string& domain, DNSMessage::RecordType type, uint16_t qclass,
+                    const std::vector<DNSMessage::TypedRecord>& records, std::chrono::seconds ttl);
+    // Copies an unexpired set into records, reporting its remaining TTL in
+    // whole seconds (at least 1).
+    bool findRecords(const std::string& domain, DNSMessage::RecordType type, uint16_t qclass,
+                     std::vector<DNSMessage::TypedRecord>& records, uint32_t& remaining_ttl) const;
+
+    // Writes every unexpired entry (negative ones included) to path,
+    // replacing it atomically. On failure error says why.
+    bool saveSnapshot(const std::string& path, std::string& error) const;
+    // Adds the entries of a snapshot written by saveSnapshot, each with the
+    // TTL it has left; entries that expired meanwhile are skipped. Returns
+    // how many were added. A missing file adds nothing and is no error; a
+    // foreign or other-version one adds nothing and sets error; a truncated
+    // one keeps what was complete and sets error.
+    size_t loadSnapshot(const std::string& path, std::string& error);
+
+    bool removeEntry(const std::string& domain);
+    // Drops entries past their expiry (past max_stale with serve_stale) and
+    // returns how many went. Call it periodically: expired entries are not
+    // removed otherwise, short of eviction when a table is full.
+    size_t cleanup();
+    void clear();
+    size_t size() const;
+    // Entries evicted to stay within max_entries since construction
+    uint64_t evictions() const;
+
+    std::chrono::seconds clampTTL(std::chrono::seconds ttl) const;
+    const Options& options() const { return options_; }
+
+private:
+    struct RecordSet {
+        std::vector<DNSMessage::TypedRecord> records;
+        ShardedCache::Clock::time_point expiry;
+    };
+
+    struct alignas(64) RecordShard {
+        mutable std::mutex mutex;
+        std::unordered_map<std::string, RecordSet> sets;
+    };
+
+    static std::string negativeKey(const std::string& domain, DNSMessage::RecordType type);
+    static std::string recordKey(const std::string& domain, DNSMessage::RecordType type, uint16_t qclass);
+    RecordShard& recordShard(const std::string& key) const;
 
-    void cleanup();
+    Options options_;
+    ShardedCache entries_;
+    size_t record_shard_count_;
+    size_t record_shard_capacity_;  // 0 when unbounded
+    std::unique_ptr<RecordShard[]> record_shards_;
+    std::atomic<uint64_t> record_evictions_{0};
 };
 
-#endif // DNS_CACHE_H
\ No newline at end of file
+#endif // DNS_CACHE_H
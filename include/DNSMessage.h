@@ -0,0 +1,220 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// DNS wire-format codec (RFC 1035).
+//
+// Queries are encoded straight into a caller supplied buffer. Responses are
+// decoded in place: the Parser walks the receive buffer and hands out views
+// (Name, ResourceRecord) that point back into it, so no memory is allocated
+// per label or per record. A view is only valid while the buffer it was
+// parsed from is alive and unchanged.
+class DNSMessage {
+public:
+    static constexpr size_t HEADER_SIZE = 12;
+    static constexpr size_t MAX_NAME_LENGTH = 255;
+    static constexpr size_t MAX_LABEL_LENGTH = 63;
+    static constexpr size_t MAX_UDP_SIZE = 512;      // Without EDNS0
+    static constexpr uint16_t EDNS_UDP_SIZE = 1232;  // Advertised EDNS0 payload size
+    static constexpr uint16_t CLASS_IN = 1;
+
+    enum class RecordType : uint16_t {
+        A = 1,
+        NS = 2,
+        CNAME = 5,
+        SOA = 6,
+        PTR = 12,
+        MX = 15,
+        TXT = 16,
+        AAAA = 28,
+        SRV = 33,
+        OPT = 41,
+        ANY = 255
+    };
+
+    enum class RCode : uint8_t {
+        NoError = 0,
+        FormErr = 1,
+        ServFail = 2,
+        NXDomain = 3,
+        NotImp = 4,
+        Refused = 5
+    };
+
+    enum class Section { Question, Answer, Authority, Additional, End };
+
+    struct Header {
+        uint16_t id = 0;
+        uint16_t flags = 0;
+        uint16_t qdcount = 0;
+        uint16_t ancount = 0;
+        uint16_t nscount = 0;
+        uint16_t arcount = 0;
+
+        bool isResponse() const { return (flags & 0x8000) != 0; }
+        bool authoritative() const { return (flags & 0x0400) != 0; }
+        bool truncated() const { return (flags & 0x0200) != 0; }
+        bool recursionDesired() const { return (flags & 0x0100) != 0; }
+        bool recursionAvailable() const { return (flags & 0x0080) != 0; }
+        uint8_t opcode() const { return static_cast<uint8_t>((flags >> 11) & 0x0F); }
+        RCode rcode() const { return static_cast<RCode>(flags & 0x000F); }
+    };
+
+    // A possibly compressed domain name inside a message. Nothing is copied;
+    // labels are read from the message on demand.
+    class Name {
+    public:
+        Name() = default;
+        Name(const uint8_t* message, size_t length, size_t offset)
+            : message_(message), length_(length), offset_(offset) {}
+
+        bool valid() const { return message_ != nullptr; }
+        size_t offset() const { return offset_; }
+
+        // Dotted form without the trailing dot ("" for the root).
+        std::string toString() const;
+        // Writes the dotted form into out; returns its length or 0 on overflow.
+        size_t copyTo(char* out, size_t capacity) const;
+        // Case-insensitive comparison against a dotted name; a trailing dot
+        // on the argument is ignored. Does not allocate.
+        bool equals(const std::string& dotted) const;
+        bool equals(const Name& other) const;
+        // True if this name is dotted or lies below it.
+        bool isSubdomainOf(const std::string& dotted) const;
+        size_t labelCount() const;
+
+    private:
+        const uint8_t* message_ = nullptr;
+        size_t length_ = 0;
+        size_t offset_ = 0;
+    };
+
+    struct Question {
+        Name name;
+        RecordType type = RecordType::A;
+        uint16_t qclass = CLASS_IN;
+    };
+
+    struct ResourceRecord {
+        Name name;
+        RecordType type = RecordType::A;
+        uint16_t rclass = CLASS_IN;
+        uint32_t ttl = 0;
+        const uint8_t* rdata = nullptr;
+        uint16_t rdlength = 0;
+        Section section = Section::Answer;
+
+        // For NS, CNAME and PTR records: the target name.
+        Name targetName() const { return target_; }
+        // Writes a dotted-quad / RFC 5952 string for A and AAAA records.
+        // Returns the length written or 0 if the record is not an address.
+        size_t addressToString(char* out, size_t capacity) const;
+        std::string addressToString() const;
+
+    private:
+        friend class DNSMessage;
+        Name target_;
+    };
+
+    // A record's data decoded into owned, typed fields, for the types the
+    // resolver looks up: A, AAAA, CNAME, NS, PTR, MX, SRV and TXT.
+    struct TypedRecord {
+        RecordType type = RecordType::A;
+        uint32_t ttl = 0;
+        // A and AAAA: the address in text form. CNAME, NS, PTR: the target
+        // name. MX: the exchange. SRV: the target. TXT: the strings joined.
+        std::string data;
+        uint16_t priority = 0;  // MX preference, SRV priority
+        uint16_t weight = 0;    // SRV
+        uint16_t port = 0;      // SRV
+        std::vector<std::string> strings;  // TXT character-strings, as sent
+
+        bool operator==(const TypedRecord& other) const {
+            return type == other.type && data == other.data && priority == other.priority &&
+                   weight == other.weight && port == other.port && strings == other.strings;
+        }
+    };
+
+    // Sequential, allocation-free reader over a received message.
+    class Parser {
+    public:
+        Parser(const uint8_t* data, size_t length);
+
+        // Must be called first; false if the buffer is shorter than a header.
+        bool parseHeader();
+        const Header& header() const { return header_; }
+
+        // Reads the next question. False when the question section is
+        // exhausted or the message is malformed (see failed()).
+        bool nextQuestion(Question& question);
+        // Reads the next resource record from the answer, authority and
+        // additional sections in turn (any unread questions are skipped).
+        // False at the end of the message or on malformed input.
+        bool nextRecord(ResourceRecord& record);
+
+        Section section() const { return section_; }
+        bool failed() const { return failed_; }
+
+    private:
+        bool advanceSection();
+
+        const uint8_t* data_;
+        size_t length_;
+        size_t offset_ = 0;
+        Header header_;
+        Section section_ = Section::Question;
+        uint16_t remaining_ = 0;
+        bool failed_ = false;
+    };
+
+    // Encodes a standard query for name into buffer. When edns is set an
+    // OPT record advertising EDNS_UDP_SIZE is appended. Returns the message
+    // length, or 0 if the name is invalid or the buffer too small.
+    static size_t buildQuery(uint8_t* buffer, size_t capacity, uint16_t id,
+                             const std::string& name, RecordType type,
+                             bool recursion_desired = true, bool edns = true);
+
+    // Encodes name in uncompressed wire form. Returns bytes written or 0.
+    static size_t encodeName(uint8_t* buffer, size_t capacity, const std::string& name);
+
+    // Returns the offset just past the (possibly compressed) name starting at
+    // offset, or 0 if the name is malformed.
+    static size_t skipName(const uint8_t* message, size_t length, size_t offset);
+
+    // Reads the MINIMUM field of an SOA record parsed from message (the
+    // negative caching TTL of RFC 2308). False if the rdata is malformed.
+    static bool soaMinimum(const uint8_t* message, size_t length, const ResourceRecord& record,
+                           uint32_t& minimum);
+
+    // Decodes the rdata of a record parsed from message into out (type and
+    // TTL included). False for other types and for malformed rdata.
+    static bool decodeRecord(const uint8_t* message, size_t length, const ResourceRecord& record,
+                             TypedRecord& out);
+
+    // Maps a type mnemonic ("A", "aaaa", "MX", ...) to its RecordType.
+    // False for types not in RecordType.
+    static bool parseType(const std::string& text, RecordType& type);
+
+    // "NOERROR", "NXDOMAIN", ...; "UNKNOWN" for codes not in RCode.
+    static const char* rcodeName(RCode rcode);
+
+    static uint16_t readU16(const uint8_t* p) {
+        return static_cast<uint16_t>((p[0] << 8) | p[1]);
+    }
+    static uint32_t readU32(const uint8_t* p) {
+        return (static_cast<uint32_t>(p[0]) << 24) | (static_cast<uint32_t>(p[1]) << 16) |
+               (static_cast<uint32_t>(p[2]) << 8) | static_cast<uint32_t>(p[3]);
+    }
+    static void writeU16(uint8_t* p, uint16_t v) {
+        p[0] = static_cast<uint8_t>(v >> 8);
+        p[1] = static_cast<uint8_t>(v);
+    }
+    static void writeU32(uint8_t* p, uint32_t v) {
+        p[0] = static_cast<uint8_t>(v >> 24);
+        p[1] = static_cast<uint8_t>(v >> 16);
+        p[2] = static_cast<uint8_t>(v >> 8);
+        p[3] = static_cast<uint8_t>(v);
+    }
+};
@@ -1,20 +1,120 @@
 #pragma once
+#include <chrono>
+#include <cstdint>
 #include <string>
 #include <vector>
-#include <Poco/Net/DNS.h>
-#include <Poco/Net/HostEntry.h>
+#include "DNSMessage.h"
+#include "RetransmitSchedule.h"
 
 class DNSQuery {
 public:
+    // Outcome of a lookup. NXDomain and NoData are answers ("does not
+    // exist") and may be cached; Failure means no server gave an answer.
+    enum class Status { Success, NXDomain, NoData, Failure };
+
+    // One CNAME link followed on the way to an answer
+    struct Alias {
+        std::string name;
+        std::string target;
+        uint32_t ttl;
+    };
+
     struct QueryResult {
         std::vector<std::string> ip_addresses;
+        // Typed lookups: the records of the type asked for at the end of the
+        // CNAME chain, and the links of that chain in order
+        std::vector<DNSMessage::TypedRecord> records;
+        std::vector<Alias> aliases;
         bool success;
         std::string error_message;
+        uint32_t ttl = 0;  // Minimum TTL over the answer chain
+        DNSMessage::RCode rcode = DNSMessage::RCode::NoError;
+        // A server gave a definitive answer (addresses, NXDOMAIN or no data),
+        // as opposed to every server timing out or failing.
+        bool answered = false;
+        // For NXDOMAIN and no-data answers: how long the absence may be
+        // cached, from the SOA in the authority section (RFC 2308 section 5).
+        // 0 when the answer carried no SOA and must not be cached.
+        uint32_t negative_ttl = 0;
+
+        Status status() const {
+            if (!ip_addresses.empty() || !records.empty()) return Status::Success;
+            if (!answered) return Status::Failure;
+            return rcode == DNSMessage::RCode::NXDomain ? Status::NXDomain : Status::NoData;
+        }
+    };
+
+    // Limits for iterative resolution starting at the root servers.
+    struct IterativeOptions {
+        std::vector<std::string> root_servers;  // Empty means ROOT_SERVERS
+        uint16_t port = 53;                     // Port used for every server in the walk
+        int max_referrals = 16;                 // Per walk from the root
+        int max_cname_chain = 8;
+        int max_glueless_depth = 4;             // Nested lookups of NS names without glue
+        int max_queries = 64;                   // Total budget including nested lookups
+        std::chrono::milliseconds timeout{2000};        // Per step, retransmits included
+        int retries = 2;                                // Retransmits per step
+        std::chrono::milliseconds total_timeout{10000}; // Whole walk, nested lookups included
+        ResolverMetrics* metrics = nullptr;             // Receives per-step upstream figures
     };
 
+    static constexpr std::chrono::milliseconds DEFAULT_TIMEOUT{2000};
+
+    // Looks up A and AAAA records through the system nameservers.
     static QueryResult performQuery(const std::string& domain);
+    // Looks up A and AAAA records through the given servers ("ip[:port]"),
+    // retransmitting across them as policy allows until one gives a usable
+    // answer. policy.timeout covers both lookups.
+    static QueryResult performQuery(const std::string& domain,
+                                    const std::vector<std::string>& servers,
+                                    const RetransmitSchedule::Policy& policy);
+    // Resolves A and AAAA records iteratively: root -> TLD -> authoritative,
+    // following referrals and glue and chasing CNAMEs. performIterativeQuery
+    // looks up one type and gives a typed result.
     static QueryResult performRecursiveQuery(const std::string& domain);
+    static QueryResult performRecursiveQuery(const std::string& domain,
+                                             const IterativeOptions& options);
+    static QueryResult performIterativeQuery(const std::string& domain,
+                                             DNSMessage::RecordType type,
+                                             const IterativeOptions& options);
+
+    // Sends one query of the given type, retransmitting with backoff and
+    // moving past servers that time out, fail, SERVFAIL or REFUSE. See
+    // parseResponse for typed.
+    static QueryResult queryType(const std::string& domain, DNSMessage::RecordType type,
+                                 const std::vector<std::string>& servers,
+                                 const RetransmitSchedule::Policy& policy,
+                                 bool recursion_desired = true, bool typed = false);
+
+    // Folds the AAAA half of an address lookup into the A half.
+    static void mergeAddresses(QueryResult& result, const QueryResult& v6);
+
+    // Validates a response to (domain, type) and appends the addresses at the
+    // end of its CNAME chain to result; for a negative answer it sets
+    // negative_ttl instead. Returns false if the response does not match
+    // the question or is malformed. A typed parse (always, for types other
+    // than A and AAAA) fills records and aliases instead of ip_addresses.
+    static bool parseResponse(const uint8_t* data, size_t length, const std::string& domain,
+                              DNSMessage::RecordType type, QueryResult& result, bool typed = false);
 
 private:
+    struct IterationState;
+
     static const std::vector<std::string> ROOT_SERVERS;
+
+    // Sends the query to the servers on a RetransmitSchedule and keeps the
+    // first response that matches the question and is neither SERVFAIL nor
+    // REFUSED. On failure the reason is left in failure.
+    static bool exchange(const std::string& domain, DNSMessage::RecordType type,
+                         const std::vector<std::string>& servers, uint16_t port,
+                         const RetransmitSchedule::Policy& policy, bool recursion_desired,
+                         uint8_t* response, size_t capacity, size_t& response_length,
+                         QueryResult& failure);
+    static RetransmitSchedule::Policy stepPolicy(const IterationState& state);
+    static QueryResult iterate(const std::string& domain, DNSMessage::RecordType type,
+                               IterationState& state, int depth,
+                               std::vector<std::string>* answering_servers,
+                               std::string* answered_name);
+    static uint32_t negativeTTL(const uint8_t* data, size_t length, const DNSMessage::Name& name,
+                                uint32_t chain_ttl);
 };
@@ -1,43 +1,284 @@
 #pragma once
 #include <string>
+#include <string_view>
 #include <unordered_map>
 #include <vector>
 #include <Poco/Net/HostEntry.h>
 #include <Poco/Net/DNS.h>
 #include <Poco/Net/IPAddress.h>
 #include <chrono>
+#include <atomic>
+#include <functional>
+#include <condition_variable>
+#include <deque>
+#include <future>
+#include <memory>
 #include <mutex>
+#include <thread>
+#include "AsyncEngine.h"
+#include "DNSCache.h"
+#include "DNSQuery.h"
+#include "DomainName.h"
+#include "LocalZone.h"
+#include "ResolverMetrics.h"
+#include "SingleFlight.h"
+#include "TCPPool.h"
 
 class DNSResolver {
 public:
     struct ResolverOptions {
         bool use_cache = true;      // Option to use cache
         bool recursive = false;     // Option to use recursive resolution
-        int retries = 3;            // Number of retries in case of failure
-        int timeout_seconds = 5;    // Timeout for DNS queries in seconds
+        int retries = 3;            // Retransmits per query after the first, across all servers
+        int timeout_seconds = 5;    // Deadline per query in seconds, retransmits included
+        // Upstream forwarders, "ip[:port]"; empty means /etc/resolv.conf. Each
+        // query goes to the fastest one that is up, hedging to the next
+        std::vector<std::string> nameservers;
+        bool race_upstreams = false;           // Send every query to the top two at once
+        std::vector<std::string> root_servers; // Root hints for recursive mode; empty means built-in
+        uint16_t iterative_port = 53;          // Port used for every server in a recursive walk
+        size_t batch_window = 4096;            // Max concurrent misses in flight during resolveMany
+        // With serve-stale enabled in the cache, how long resolve() waits for
+        // upstream before answering from an expired entry (RFC 8767)
+        int stale_answer_timeout_ms = 1800;
+        // A and AAAA are asked at once. Once one family has addresses, a
+        // miss waits at most this long for the other before returning
+        // without it (the resolution delay of RFC 8305); the cache only
+        // ever gets both together. A negative delay waits for both.
+        int resolution_delay_ms = 50;
     };
 
-    struct CacheEntry {
+    struct ResolveResult {
         std::vector<std::string> ip_addresses;
-        std::chrono::time_point<std::chrono::steady_clock> timestamp;
-        int ttl;  // TTL (Time to live) in seconds
+        uint32_t ttl = 0;         // Seconds the answer stays valid (counts down when cached)
+        bool from_cache = false;
+        bool stale = false;       // Served from an expired entry
+        bool local = false;       // Answered by the local zone, without the cache or network
+        bool partial = false;     // One family only; the other was still out (and is cached with it)
+        // Success, or why there are no addresses: the name or its address
+        // records do not exist, or upstream could not be reached
+        DNSQuery::Status status = DNSQuery::Status::Failure;
     };
 
+    // Output of resolveInto(), meant to be kept and reused: addresses are
+    // stored as text back to back in one string, and clear() keeps every
+    // buffer's capacity. Once it has grown to fit, a lookup answered from
+    // the cache or the local zone allocates nothing.
+    class ResultBuffer {
+    public:
+        uint32_t ttl = 0;
+        bool from_cache = false;
+        bool stale = false;
+        bool local = false;
+        bool partial = false;
+        DNSQuery::Status status = DNSQuery::Status::Failure;
+
+        size_t size() const { return ends_.size(); }
+        bool empty() const { return ends_.empty(); }
+        // Address index as text; valid until the buffer is reused
+        std::string_view operator[](size_t index) const;
+        std::vector<std::string> addresses() const;
+        // The canonical name last resolved into the buffer
+        const DomainName& name() const { return name_; }
+        void clear();
+
+    private:
+        friend class DNSResolver;
+        void append(std::string_view address);
+        // 4 or 16 bytes in network order
+        void appendAddress(const uint8_t* bytes, bool ipv6);
+        void assign(const ResolveResult& result);
+
+        DomainName name_;
+        std::string text_;
+        std::vector<uint32_t> ends_;  // Where each address ends in text_
+    };
+
+    // Outcome of a typed lookup
+    struct RecordResult {
+        std::vector<DNSMessage::TypedRecord> records;  // Of the type asked for
+        std::string canonical_name;  // Owner of records: the name after any CNAMEs
+        uint32_t ttl = 0;            // Least remaining TTL along the chain
+        bool from_cache = false;     // Answered without a query
+        int queries = 0;             // Upstream lookups it took (a chain cached in part takes one)
+        DNSQuery::Status status = DNSQuery::Status::Failure;
+    };
+
+    using ResolveCallback = std::function<void(const std::vector<std::string>&)>;
+    using DetailedCallback = std::function<void(const ResolveResult&)>;
+    using BatchCallback = std::function<void(size_t index, const std::vector<std::string>&)>;
+    // response is only valid for the duration of the call; nullptr if no
+    // upstream gave a usable answer.
+    using RelayCallback = std::function<void(const uint8_t* response, size_t length)>;
+
     DNSResolver();
+    explicit DNSResolver(const DNSCache::Options& cache_options);
+    ~DNSResolver();
 
     std::vector<std::string> resolve(const std::string& domain, const ResolverOptions& options);
+    // As resolve(), also reporting the TTL of the answer.
+    ResolveResult resolveDetailed(const std::string& domain, const ResolverOptions& options);
+    // As resolveDetailed(), into storage the caller keeps from one lookup
+    // to the next, for hot loops: a hit makes no heap allocations.
+    void resolveInto(std::string_view domain, const ResolverOptions& options, ResultBuffer& result);
+    // Non-blocking resolve. The callback runs inline on a cache hit and
+    // otherwise on the resolver's I/O thread, so it must not block.
+    void resolveAsync(const std::string& domain, const ResolverOptions& options, ResolveCallback callback);
+    std::future<std::vector<std::string>> resolveAsync(const std::string& domain, const ResolverOptions& options);
+    // As resolveAsync(), delivering the whole ResolveResult (status and TTL).
+    void resolveAsyncDetailed(const std::string& domain, const ResolverOptions& options, DetailedCallback callback);
+    // Resolves a batch of names: cache hits are answered in one pass,
+    // repeated names are looked up once and all misses are sent concurrently
+    // (up to options.batch_window at a time). Results are in input order.
+    std::vector<std::vector<std::string>> resolveMany(const std::vector<std::string>& domains,
+                                                      const ResolverOptions& options);
+    // Streaming form: on_result is called once per input index as soon as
+    // that name is answered, possibly from resolver threads. Returns when
+    // all names have been delivered.
+    void resolveMany(const std::vector<std::string>& domains, const ResolverOptions& options,
+                     const BatchCallback& on_result);
+    // Looks up records of any type the cache decodes (A, AAAA, CNAME, NS,
+    // PTR, MX, SRV, TXT), class IN. Record sets are cached per (name, type,
+    // class) and every CNAME link on the way separately, so when part of a
+    // chain is cached only the rest of it is asked for.
+    RecordResult resolveRecords(const std::string& domain, DNSMessage::RecordType type,
+                                const ResolverOptions& options);
+    // Passes a whole query message to the forwarding upstreams in options,
+    // uncached, with the same retransmits and TCP retry of truncated
+    // answers as a lookup. The callback gets the first usable response,
+    // still carrying the transaction ID it went out with, on the
+    // resolver's I/O thread (or inline if the query cannot be sent).
+    void relayAsync(const uint8_t* query, size_t length, const ResolverOptions& options, RelayCallback callback);
     void clearCache();  // Declare the clearCache function
 
+    // Warm restarts: loads the cache snapshot at path (if there is one),
+    // then saves the cache there every interval and when the resolver is
+    // destroyed. Returns how many entries were loaded. Call at most once.
+    size_t persistCache(const std::string& path, std::chrono::seconds interval = std::chrono::seconds(300));
+
+    // Hosts entries and blocklists answered before the cache (and even with
+    // use_cache off); a Passthru match resolves normally. Takes effect for
+    // resolves that start after the call, so a reload can build the new
+    // zone off to the side and swap it in. nullptr removes it.
+    void setLocalZone(std::shared_ptr<const LocalZone> zone);
+    std::shared_ptr<const LocalZone> localZone() const;
+
+    // Counters and latency histograms since construction: cache outcomes,
+    // per-stage timings, whole-resolve latency and per-upstream results.
+    // resolveMany contributes to the cache and stage figures only.
+    ResolverMetrics::Snapshot stats() const;
+    // stats() in the Prometheus text format, for a /metrics endpoint.
+    std::string prometheusStats() const;
+
+    // Punycode form of an internationalized name (RFC 3490); other names
+    // are returned unchanged.
+    static std::string convertToASCII(const std::string& domain);
+
 private:
-    std::unordered_map<std::string, CacheEntry> cache_;
-    std::mutex cache_mutex_;  // Mutex for thread safety in cache access
-
-    std::vector<std::string> queryDNS(const std::string& domain, bool recursive, int retries);
-    std::vector<std::string> resolveFromCache(const std::string& domain);
-    void cacheResult(const std::string& domain, const std::vector<std::string>& ip_addresses, int ttl);
-    bool isCacheExpired(const std::string& domain);
-    std::vector<std::string> performRecursiveQuery(const std::string& domain, int retries);
-    std::vector<std::string> performNormalQuery(const std::string& domain);
-    std::vector<std::string> performRootServerQuery(const std::string& domain);
-    std::string convertToASCII(const std::string& domain);
+    struct AsyncLookup;
+    struct Relay;
+
+    // First, so it outlives the I/O thread's final callbacks
+    ResolverMetrics metrics_;
+    DNSCache cache_;
+    // Upstream lookups in progress, keyed by flightKey()
+    SingleFlight<ResolveResult> flights_;
+    // Read with std::atomic_load; has_local_zone_ spares resolves without
+    // one the shared_ptr's reference count traffic
+    std::shared_ptr<const LocalZone> local_zone_;
+    std::atomic<bool> has_local_zone_{false};
+
+    ResolveResult resolveMiss(const DomainName& ascii_domain, const ResolverOptions& options);
+    // convertToASCII and resolveFromCache, timed as their stages. clock is
+    // when the stage began and is advanced to when it ended, so back-to-back
+    // stages share one clock read.
+    DomainName normalize(const std::string& domain, ResolverMetrics::Clock::time_point& clock);
+    void normalize(std::string_view domain, DomainName& name, ResolverMetrics::Clock::time_point& clock);
+    bool lookupCache(const DomainName& domain, const ResolverOptions& options, ResolveResult& result,
+                     ResolverMetrics::Clock::time_point& clock);
+    bool lookupCache(const DomainName& domain, const ResolverOptions& options, ResultBuffer& result,
+                     ResolverMetrics::Clock::time_point& clock);
+    bool answerLocally(const std::string& domain, ResolveResult& result);
+    bool answerLocally(const std::string& domain, ResultBuffer& result);
+    void countLookup(const ResolveResult& result);
+    void countLookup(bool from_cache, bool stale, DNSQuery::Status status);
+    void countExpired(const DomainName& domain);
+    static std::string flightKey(const std::string& domain, uint16_t type, const ResolverOptions& options);
+    // The blocking recursive walk; forwarded lookups go through the engine
+    ResolveResult lookupUpstream(const std::string& domain, const ResolverOptions& options);
+    ResolveResult completeLookup(const std::string& domain, const ResolverOptions& options,
+                                 DNSQuery::QueryResult answer);
+    bool resolveFromCache(const DomainName& domain, const ResolverOptions& options, ResolveResult& result);
+    bool resolveFromCache(const DomainName& domain, const ResolverOptions& options, ResultBuffer& result);
+    bool resolveNegative(const std::string& domain, ResolveResult& result);
+    bool resolveStale(const DomainName& domain, ResolveResult& result);
+    void prefetch(const std::string& domain, const ResolverOptions& options);
+    void cacheResult(const std::string& domain, const DNSQuery::QueryResult& answer);
+    // Follows cached CNAME links from result.canonical_name; true if the
+    // cache then settles the lookup (records or a negative entry).
+    bool followCachedChain(DNSMessage::RecordType type, RecordResult& result, uint32_t& chain_ttl,
+                           int& links);
+    DNSQuery::QueryResult lookupRecords(const std::string& domain, DNSMessage::RecordType type,
+                                        const ResolverOptions& options);
+    void cacheRecords(const std::string& domain, DNSMessage::RecordType type, const DNSQuery::QueryResult& answer);
+    DNSQuery::QueryResult performRecursiveQuery(const std::string& domain, const ResolverOptions& options);
+    DNSQuery::QueryResult performRootServerQuery(const std::string& domain, const ResolverOptions& options);
+
+    AsyncEngine& engine();
+    // A lookup from the pool (or a new one), returned to it when released
+    std::shared_ptr<AsyncLookup> acquireLookup();
+    void recycleLookup(AsyncLookup* lookup);
+    void startAsync(const std::string& ascii_domain, const ResolverOptions& options, DetailedCallback callback);
+    void startAsyncLookup(const std::string& ascii_domain, const ResolverOptions& options, const std::string& key);
+    void sendAsync(const std::shared_ptr<AsyncLookup>& lookup, size_t family);
+    // Handles one transmission's outcome; a truncated UDP answer is asked
+    // again over TCP, and that answer comes back here with over_tcp set.
+    void receiveAsync(const std::shared_ptr<AsyncLookup>& lookup, size_t family, size_t server,
+                      AsyncEngine::Clock::time_point sent, bool over_tcp, AsyncEngine::Status status,
+                      const uint8_t* response, size_t size);
+    void sendRelay(const std::shared_ptr<Relay>& relay);
+    void receiveRelay(const std::shared_ptr<Relay>& relay, size_t server, AsyncEngine::Clock::time_point sent,
+                      bool over_tcp, AsyncEngine::Status status, const uint8_t* response, size_t size);
+    // Called once per family when its query is settled; delivers the
+    // combined answer after both, or one family early as options allow.
+    void finishAsync(const std::shared_ptr<AsyncLookup>& lookup, size_t family);
+    void deliverEarly(const std::shared_ptr<AsyncLookup>& lookup, size_t family);
+
+    void saveSnapshot();
+    // Arms the periodic cache sweep on the engine timer, the first time
+    // anything is cached; each sweep re-arms it
+    void scheduleCleanup();
+    void sweepCache();
+
+    // Periodic cache snapshots started by persistCache()
+    std::string snapshot_path_;
+    std::mutex snapshot_mutex_;
+    std::condition_variable snapshot_wake_;
+    bool snapshot_stop_ = false;
+    std::thread snapshot_thread_;
+
+    // Recursive lookups still run the blocking walk, on at most
+    // RECURSIVE_WORKERS background threads; lookups beyond that queue
+    void backgroundWorker();
+    std::mutex background_mutex_;
+    std::condition_variable background_wake_;
+    std::deque<std::function<void()>> background_queue_;
+    std::vector<std::thread> background_;
+    size_t background_idle_ = 0;
+    bool background_stop_ = false;
+
+    // Finished lookups kept for reuse, so a miss does not allocate its
+    // state and retransmit schedules afresh. Outlives the engine and TCP
+    // pool, whose last callbacks release lookups into it.
+    std::mutex lookup_pool_mutex_;
+    std::vector<std::unique_ptr<AsyncLookup>> lookup_pool_;
+
+    std::once_flag cleanup_once_;
+
+    // Retries of truncated answers; stopped before the engine goes
+    TCPPool tcp_;
+
+    // Declared last so it shuts down (and fails pending callbacks) first
+    std::once_flag engine_once_;
+    std::unique_ptr<AsyncEngine> engine_;
 };
\ No newline at end of file
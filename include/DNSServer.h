@@ -0,0 +1,108 @@
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+#include "DNSResolver.h"
+#include "DatagramBatch.h"
+#include "UDPTransport.h"
+
+// Caching DNS server in front of a DNSResolver, so stub resolvers on other
+// hosts (or other processes) share one cache.
+//
+// Each UDP worker thread owns its own socket bound to the same address with
+// SO_REUSEPORT, so the kernel spreads clients across workers and no socket
+// is shared; workers can be pinned one per core. A worker reads datagrams
+// in batches and sends the answers it has ready as one batch too. A and
+// AAAA questions (and ANY, answered with both) go through the resolver:
+// hits are answered on the worker, misses from the resolver's I/O thread
+// once upstream replies.
+// In forwarding mode other types are relayed to the upstreams uncached and
+// answered from the resolver's I/O thread too (a truncated upstream answer
+// is fetched again over TCP), unless the resolver's local zone blocks or
+// answers the name; in recursive mode they get NOTIMP. TCP (RFC 7766) is served by one thread
+// per connection, each query answered in turn.
+class DNSServer {
+public:
+    struct Options {
+        std::string address = "0.0.0.0";
+        uint16_t port = 53;         // 0 picks a free port, the same for UDP and TCP
+        size_t threads = 0;         // UDP workers; 0 means one per usable core
+        bool pin_threads = true;    // Pin worker i to the i-th usable core
+        bool tcp = true;            // Also answer over TCP
+        // Datagrams moved per recvmmsg/sendmmsg call on each worker; 1 means
+        // a syscall per packet
+        size_t batch_size = 32;
+        size_t max_tcp_connections = 64;
+        std::chrono::milliseconds tcp_idle_timeout{10000};
+        DNSResolver::ResolverOptions resolve;  // Upstreams, recursion and timeouts for misses
+    };
+
+    // Binds every socket and starts the threads; throws std::runtime_error
+    // if the address is invalid or cannot be bound.
+    DNSServer(DNSResolver& resolver, const Options& options);
+    ~DNSServer();
+
+    DNSServer(const DNSServer&) = delete;
+    DNSServer& operator=(const DNSServer&) = delete;
+
+    // "ip:port", as accepted by ResolverOptions::nameservers.
+    const std::string& address() const { return address_; }
+    uint16_t port() const { return port_; }
+    size_t threads() const { return workers_.size(); }
+
+    uint64_t queries() const;    // Received over UDP and TCP
+    uint64_t responses() const;  // Sent, error responses included
+    uint64_t dropped() const;    // Ignored: too short to answer, or not a query
+
+    // Closes the sockets and joins every thread; answers still being
+    // resolved are discarded. Called by the destructor.
+    void stop();
+
+private:
+    struct Endpoint;
+
+    struct Worker {
+        std::shared_ptr<Endpoint> endpoint;
+        std::thread thread;
+    };
+
+    struct Connection {
+        int fd = -1;
+        std::thread thread;
+        std::atomic<bool> done{false};
+    };
+
+    void bindSockets(UDPTransport::ServerAddress local, size_t threads);
+    void serveUdp(const std::shared_ptr<Endpoint>& endpoint);
+    void handleUdp(const std::shared_ptr<Endpoint>& endpoint, const uint8_t* query, size_t length,
+                   const sockaddr_storage& peer, socklen_t peer_length);
+    void acceptTcp();
+    void serveTcp(Connection& connection);
+    // Answers query synchronously into out; returns the response length, or
+    // 0 if the query should be ignored.
+    size_t answer(const uint8_t* query, size_t length, uint8_t* out, size_t capacity);
+    // Passes query to the upstreams unchanged and waits for their answer;
+    // for TCP clients, whose thread may block.
+    size_t relay(const uint8_t* query, size_t length, uint8_t* out, size_t capacity);
+
+    DNSResolver& resolver_;
+    Options options_;
+    std::string address_;
+    uint16_t port_ = 0;
+
+    std::vector<Worker> workers_;
+    int tcp_fd_ = -1;
+    std::thread acceptor_;
+    std::vector<std::unique_ptr<Connection>> connections_;  // Acceptor thread only until stop()
+
+    std::atomic<uint64_t> tcp_queries_{0};
+    std::atomic<uint64_t> tcp_responses_{0};
+    std::atomic<uint64_t> tcp_dropped_{0};
+    std::atomic<bool> stop_{false};
+    bool stopped_ = false;
+};
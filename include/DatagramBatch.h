@@ -0,0 +1,63 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+// A ring of preallocated datagram buffers for moving UDP packets in
+// batches: one recvmmsg() or sendmmsg() call per batch instead of one
+// syscall per datagram. Buffers, peer addresses and message headers are set
+// up once and reused, so a batch allocates nothing.
+//
+// Receiving fills slots 0..size()-1. Sending queues datagrams with append()
+// (or prepare() and commit() to build one in place) and hands them all to
+// the kernel with flush().
+class DatagramBatch {
+public:
+    DatagramBatch(size_t capacity, size_t buffer_size);
+
+    DatagramBatch(const DatagramBatch&) = delete;
+    DatagramBatch& operator=(const DatagramBatch&) = delete;
+
+    size_t capacity() const { return headers_.size(); }
+    size_t bufferSize() const { return buffer_size_; }
+    size_t size() const { return size_; }
+    bool empty() const { return size_ == 0; }
+    bool full() const { return size_ == headers_.size(); }
+
+    // Replaces the contents with up to capacity() datagrams already waiting
+    // on fd, without blocking. Returns how many arrived (0 if none). A
+    // datagram longer than the buffer size is reported with length 0.
+    size_t receive(int fd);
+
+    uint8_t* data(size_t i) { return &buffers_[i * buffer_size_]; }
+    const uint8_t* data(size_t i) const { return &buffers_[i * buffer_size_]; }
+    size_t length(size_t i) const { return headers_[i].msg_len; }
+    const sockaddr_storage& peer(size_t i) const { return peers_[i]; }
+    socklen_t peerLength(size_t i) const { return headers_[i].msg_hdr.msg_namelen; }
+
+    // The next free buffer (bufferSize() bytes), or null when full. Nothing
+    // is queued until commit().
+    uint8_t* prepare() { return full() ? nullptr : data(size_); }
+    // Queues the prepared buffer to go to peer; no peer for a connected socket.
+    void commit(size_t length, const sockaddr_storage* peer = nullptr, socklen_t peer_length = 0);
+    // Copies data into the next slot. False if the batch is full or data
+    // does not fit in a buffer.
+    bool append(const uint8_t* data, size_t length, const sockaddr_storage* peer = nullptr,
+                socklen_t peer_length = 0);
+
+    // Sends the queued datagrams and empties the batch. Returns how many the
+    // kernel took; the slot indexes of the rest are added to failed. A
+    // datagram the kernel refuses is skipped and the others still go out.
+    size_t flush(int fd, std::vector<size_t>* failed = nullptr);
+    void clear() { size_ = 0; }
+
+private:
+    const size_t buffer_size_;
+    std::vector<uint8_t> buffers_;
+    std::vector<sockaddr_storage> peers_;
+    std::vector<iovec> iovecs_;
+    std::vector<mmsghdr> headers_;
+    size_t size_ = 0;
+};
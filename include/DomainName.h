@@ -0,0 +1,47 @@
+#pragma once
+#include <cstddef>
+#include <string>
+#include <string_view>
+
+// A name in the form the resolver keys everything by: ASCII (an
+// internationalized name becomes its punycode form), lower case, without a
+// trailing dot. The hash is computed once, so the cache shards and buckets
+// on it without hashing the name again.
+//
+// Plain ASCII names, nearly all of them, take a fast path that checks and
+// lower-cases eight bytes per step. Internationalized names go through
+// Poco's IDNA conversion, which is slow, so each thread remembers its
+// recent conversions.
+class DomainName {
+public:
+    DomainName() = default;
+    explicit DomainName(std::string_view name);
+
+    // Replaces the name in place, reusing the storage it already has, so a
+    // DomainName kept across lookups stops allocating for plain names. A
+    // name the IDN conversion cannot make ASCII is kept as given, with its
+    // ASCII letters lower-cased.
+    void assign(std::string_view name);
+
+    const std::string& str() const { return text_; }
+    // std::hash<std::string_view>()(str()), as ShardedCache hashes keys
+    size_t hash() const { return hash_; }
+    bool empty() const { return text_.empty(); }
+
+    // Lets a canonical name stand wherever a plain name is taken
+    operator const std::string&() const { return text_; }
+
+    bool operator==(const DomainName& other) const { return hash_ == other.hash_ && text_ == other.text_; }
+    bool operator!=(const DomainName& other) const { return !(*this == other); }
+
+    // Writes name lower-cased and without one trailing dot to out. Returns
+    // false, leaving out unspecified, if name has a byte outside ASCII.
+    static bool canonicalASCII(std::string_view name, std::string& out);
+    // The punycode form of name (RFC 3490), not yet lower-cased; plain ASCII
+    // names come back unchanged.
+    static std::string toASCII(std::string_view name);
+
+private:
+    std::string text_;
+    size_t hash_ = 0;
+};
@@ -0,0 +1,68 @@
+#pragma once
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <vector>
+
+// Epoch-based memory reclamation for lock-free readers.
+//
+// Readers wrap every access to shared nodes in a Guard, which publishes the
+// global epoch in a per-thread slot. Writers unlink nodes under their own
+// lock and hand them to retire(); a node is freed only once every thread
+// that was inside a Guard when it was retired has left it.
+class EpochManager {
+public:
+    using Deleter = void (*)(void*);
+
+    static EpochManager& instance();
+
+    // Pins the calling thread for the guard's lifetime. Guards nest, and may
+    // be moved but must be destroyed on the thread that created them.
+    class Guard {
+    public:
+        Guard();
+        ~Guard();
+        Guard(Guard&& other) noexcept : active_(other.active_) { other.active_ = false; }
+        Guard& operator=(Guard&& other) noexcept;
+        Guard(const Guard&) = delete;
+        Guard& operator=(const Guard&) = delete;
+
+    private:
+        void release();
+        bool active_ = true;
+    };
+
+    // Frees ptr with deleter once no reader can still hold it.
+    void retire(void* ptr, Deleter deleter);
+    // Advances the epoch and frees whatever has become unreachable.
+    void reclaim();
+    size_t pendingCount() const;
+
+private:
+    struct alignas(64) Slot {
+        std::atomic<uint64_t> epoch{0};  // 0 while the thread is outside any Guard
+        std::atomic<bool> in_use{false};
+        Slot* next = nullptr;
+    };
+
+    struct Retired {
+        void* ptr;
+        Deleter deleter;
+        uint64_t epoch;
+    };
+
+    friend class Guard;
+    struct ThreadRecord;
+
+    EpochManager() = default;
+    Slot* acquireSlot();
+    void releaseSlot(Slot* slot);
+    static ThreadRecord& threadRecord();
+
+    std::atomic<uint64_t> global_epoch_{1};
+    std::atomic<Slot*> slots_{nullptr};
+
+    mutable std::mutex retired_mutex_;
+    std::vector<Retired> retired_;
+};
@@ -0,0 +1,67 @@
+#pragma once
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+// Log-linear histogram in the style of HdrHistogram: values below 64 get a
+// bucket each, and every power-of-two range above that is split into 32
+// buckets, so any recorded value is known to within about 3% at a fixed
+// 15 KiB footprint. The unit is up to the caller (nanoseconds for
+// latencies).
+//
+// Each histogram has a single writer: record() is plain relaxed loads and
+// stores with no read-modify-write, so it costs no more than an ordinary
+// increment, and other threads may read or merge it at any time without
+// locking. Give each recording thread its own histogram and merge them to
+// report.
+class LatencyHistogram {
+public:
+    static constexpr unsigned SUB_BUCKET_BITS = 5;
+    static constexpr size_t SUB_BUCKETS = size_t(1) << SUB_BUCKET_BITS;
+    static constexpr size_t BUCKETS = (65 - SUB_BUCKET_BITS) * SUB_BUCKETS;
+
+    LatencyHistogram() = default;
+    LatencyHistogram(const LatencyHistogram& other) { merge(other); }
+    LatencyHistogram& operator=(const LatencyHistogram& other);
+
+    void record(uint64_t value) {
+        bump(buckets_[bucketOf(value)], 1);
+        bump(count_, 1);
+        bump(sum_, value);
+        if (value > max_.load(std::memory_order_relaxed)) max_.store(value, std::memory_order_relaxed);
+    }
+
+    // Adds other's values to this one; this histogram's writer must not be
+    // recording at the same time.
+    void merge(const LatencyHistogram& other);
+    void clear();
+
+    uint64_t count() const { return count_.load(std::memory_order_relaxed); }
+    uint64_t max() const { return max_.load(std::memory_order_relaxed); }
+    uint64_t sum() const { return sum_.load(std::memory_order_relaxed); }
+    double mean() const;
+    // Smallest value v such that at least quantile (0..1) of the recorded
+    // values are <= v, reported as the top of its bucket. 0 when empty.
+    uint64_t percentile(double quantile) const;
+
+    static size_t bucketOf(uint64_t value);
+    // Largest value that falls in bucket.
+    static uint64_t bucketTop(size_t bucket);
+
+    uint64_t bucketCount(size_t bucket) const { return buckets_[bucket].load(std::memory_order_relaxed); }
+    // Values recorded in buckets that lie entirely at or below limit, as
+    // needed for cumulative (Prometheus "le") buckets.
+    uint64_t countAtOrBelow(uint64_t limit) const;
+
+    // Single-writer increment; see the class comment
+    static void bump(std::atomic<uint64_t>& counter, uint64_t n) {
+        counter.store(counter.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+    }
+
+private:
+    std::array<std::atomic<uint64_t>, BUCKETS> buckets_{};
+    std::atomic<uint64_t> count_{0};
+    std::atomic<uint64_t> sum_{0};
+    std::atomic<uint64_t> max_{0};
+};
@@ -0,0 +1,119 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <istream>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+// Static answers consulted before the cache: hosts-file overrides and
+// RPZ-style policy (blocklists) for single names and whole subtrees.
+//
+// A LocalZone is built once by a Builder and is read-only afterwards, so
+// readers need no locking; a reload builds a new one and swaps it in.
+// Rules sit in flat arrays: names in one character arena, and two
+// open-addressing tables (exact names, and wildcard suffixes) holding each
+// name's hash next to its rule index, so a probe rarely touches the arena.
+// "*.example.com" is stored as "example.com" in the wildcard table; a lookup
+// probes the exact table once and then the wildcard table for each parent
+// of the name, closest first. That is a handful of probes whatever the size
+// of the zone.
+class LocalZone {
+public:
+    enum class Action : uint8_t {
+        Answer,    // Reply with the rule's addresses
+        NXDomain,  // The name does not exist
+        NoData,    // The name exists without addresses
+        Passthru,  // Resolve normally, even inside a blocked subtree
+    };
+
+    static constexpr uint32_t DEFAULT_TTL = 3600;
+
+    struct Match {
+        Action action;
+        uint32_t ttl;
+        const uint8_t* ipv4;  // 4 bytes each, network order
+        size_t ipv4_count;
+        const uint8_t* ipv6;  // 16 bytes each
+        size_t ipv6_count;
+    };
+
+    class Builder {
+    public:
+        // Hosts-file lines: "address name [alias...]" with '#' comments.
+        // Names mapped to 0.0.0.0 or :: are blocked (NXDOMAIN); other
+        // addresses are answered, a name's lines adding up.
+        bool addHosts(std::istream& in, std::string& error);
+        // Response policy zone (RPZ) QNAME triggers in master-file form:
+        // "name [ttl] [IN] CNAME ." is NXDOMAIN, "CNAME *." NODATA,
+        // "CNAME rpz-passthru." passthru, "CNAME rpz-drop." is treated as
+        // NXDOMAIN, and A/AAAA records are answered. "*.name" covers the
+        // names below name. Owners are relative to the policy zone's
+        // $ORIGIN; its SOA and NS records are skipped.
+        bool addRpz(std::istream& in, std::string& error);
+        // As above from a file; error is prefixed with the path.
+        bool loadHosts(const std::string& path, std::string& error);
+        bool loadRpz(const std::string& path, std::string& error);
+
+        // Adds one rule. For Action::Answer, address literals that do not
+        // parse are skipped. A later rule for the same name replaces an
+        // earlier one, except that answers add up.
+        void add(const std::string& name, bool wildcard, Action action,
+                 const std::vector<std::string>& addresses = {}, uint32_t ttl = DEFAULT_TTL);
+
+        size_t size() const { return exact_.size() + wildcard_.size(); }
+
+        // Compiles the rules added so far; the builder is left empty.
+        std::shared_ptr<const LocalZone> build();
+
+    private:
+        struct Pending {
+            Action action;
+            uint32_t ttl;
+            std::vector<uint8_t> ipv4, ipv6;
+        };
+        std::unordered_map<std::string, Pending> exact_, wildcard_;
+    };
+
+    // Looks up a name (any case, trailing dot optional). An exact rule wins
+    // over a wildcard, and the closest wildcard over those further up.
+    // A Passthru match is reported so callers can skip other policy.
+    bool find(std::string_view name, Match& match) const;
+
+    size_t size() const { return rules_.size(); }
+    // Bytes held by the index
+    size_t memoryUsage() const;
+
+private:
+    struct Rule {
+        uint32_t name_offset;
+        uint32_t address_offset;
+        uint32_t ttl;
+        uint8_t name_length;
+        Action action;
+        uint8_t ipv4_count;
+        uint8_t ipv6_count;
+    };
+
+    // Rule index + 1 (0 marks an empty slot) and the upper half of the hash
+    struct Slot {
+        uint32_t check;
+        uint32_t rule;
+    };
+
+    struct Table {
+        std::vector<Slot> slots;
+        size_t mask = 0;
+    };
+
+    const Rule* probe(const Table& table, std::string_view name) const;
+    static void insert(Table& table, size_t hash, uint32_t rule);
+    void fill(const Rule& rule, Match& match) const;
+
+    std::vector<char> names_;
+    std::vector<uint8_t> addresses_;
+    std::vector<Rule> rules_;
+    Table exact_, wildcard_;
+};
@@ -0,0 +1,154 @@
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <istream>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+#include <sys/socket.h>
+#include "DNSMessage.h"
+
+// Authoritative DNS server on a loopback UDP socket, answering from a zone
+// file. Tests, benchmarks and the load generator point the resolver at it
+// instead of the internet. It can also inject faults: added latency, lost
+// queries, truncated answers, SERVFAIL and rewritten TTLs. The fault
+// decisions come from a seeded generator, so a run can be repeated exactly.
+// It also listens on TCP on the same port, where answers are never
+// truncated and faults other than the TTL do not apply, so a client's retry
+// of a truncated answer can be checked.
+class MockDNSServer {
+public:
+    // Records loaded from master-file text (a subset of RFC 1035 section 5):
+    // $ORIGIN and $TTL, one record per line ("name [ttl] [IN] type rdata"),
+    // "@" for the origin, names relative to the origin unless they end in a
+    // dot, ';' comments, and a blank owner repeating the previous one.
+    // Parentheses are not supported. Types: A, AAAA, NS, CNAME, PTR, MX,
+    // TXT, SRV and SOA. Every name holding an SOA is a zone apex; the server
+    // refuses names outside all apexes and answers "*" labels as wildcards.
+    class Zone {
+    public:
+        struct Record {
+            std::string name;  // Lower case, no trailing dot
+            DNSMessage::RecordType type;
+            uint32_t ttl;
+            std::vector<uint8_t> rdata;  // Wire form, names uncompressed
+        };
+
+        // On failure error names the offending line.
+        bool parse(std::istream& in, std::string& error, const std::string& origin = "");
+        bool load(const std::string& path, std::string& error);
+        // Adds one record given its presentation-format rdata.
+        bool add(const std::string& name, DNSMessage::RecordType type, uint32_t ttl,
+                 const std::string& rdata, std::string& error);
+
+        size_t size() const { return records_; }
+
+        // Builds the authoritative response to query into out. Returns false
+        // if the query is too malformed to answer. Over UDP an answer longer
+        // than the query's EDNS payload size (or 512) is truncated.
+        bool respond(const uint8_t* query, size_t length, std::vector<uint8_t>& out,
+                     int64_t ttl_override = -1, bool tcp = false) const;
+
+    private:
+        void insert(Record record);
+        const std::vector<Record>* find(const std::string& name) const;
+        // The closest enclosing apex, or null if name is in no zone.
+        const std::string* apexOf(const std::string& name) const;
+
+        std::unordered_map<std::string, std::vector<Record>> names_;
+        std::unordered_set<std::string> existing_;  // Owners and their ancestors (empty non-terminals)
+        std::vector<std::string> apexes_;
+        size_t records_ = 0;
+    };
+
+    struct Faults {
+        std::chrono::microseconds latency{0};  // Added before every answer
+        std::chrono::microseconds jitter{0};   // Plus a uniform extra delay up to this
+        // Answers to queries of slow_type (e.g. 28, AAAA) wait slow_latency more
+        uint16_t slow_type = 0;
+        std::chrono::microseconds slow_latency{0};
+        double loss = 0;                       // Share of queries dropped unanswered
+        double truncate = 0;                   // Share answered with TC=1 and no records
+        double servfail = 0;                   // Share answered with SERVFAIL
+        int64_t ttl = -1;                      // Replaces every TTL when >= 0
+        uint32_t seed = 1;
+    };
+
+    struct Options {
+        std::string address = "127.0.0.1";
+        uint16_t port = 0;  // 0 picks a free port
+        Faults faults;
+    };
+
+    // Binds and starts answering; throws std::runtime_error if the socket
+    // cannot be bound.
+    explicit MockDNSServer(Zone zone) : MockDNSServer(std::move(zone), Options()) {}
+    MockDNSServer(Zone zone, const Options& options);
+    ~MockDNSServer();
+
+    MockDNSServer(const MockDNSServer&) = delete;
+    MockDNSServer& operator=(const MockDNSServer&) = delete;
+
+    // "ip:port", as accepted by ResolverOptions::nameservers.
+    const std::string& address() const { return address_; }
+    const std::string& ip() const { return ip_; }
+    uint16_t port() const { return port_; }
+
+    // Takes effect from the next query; reseeds the fault generator.
+    void setFaults(const Faults& faults);
+    void setZone(Zone zone);
+
+    uint64_t queries() const { return queries_.load(std::memory_order_relaxed); }
+    uint64_t answered() const { return answered_.load(std::memory_order_relaxed); }
+    uint64_t dropped() const { return dropped_.load(std::memory_order_relaxed); }
+    uint64_t tcpConnections() const { return tcp_connections_.load(std::memory_order_relaxed); }
+
+private:
+    using Clock = std::chrono::steady_clock;
+
+    struct Delayed {
+        Clock::time_point due;
+        std::vector<uint8_t> response;
+        sockaddr_storage peer;
+        socklen_t peer_length;
+    };
+
+    struct TcpClient {
+        int fd;
+        std::vector<uint8_t> in;  // Partial length-prefixed queries
+    };
+
+    void run();
+    void handle(const uint8_t* query, size_t length, const sockaddr_storage& peer, socklen_t peer_length);
+    void sendDue();
+    void acceptTcp();
+    // Answers every complete query received; false once the client is gone.
+    bool serveTcp(TcpClient& client);
+
+    int fd_ = -1;
+    int tcp_fd_ = -1;
+    std::string ip_;
+    uint16_t port_ = 0;
+    std::string address_;
+
+    std::mutex mutex_;  // Guards zone_, faults_ and random_
+    std::shared_ptr<const Zone> zone_;
+    Faults faults_;
+    std::mt19937 random_;
+
+    std::vector<Delayed> delayed_;  // Server thread only; heap on due
+    std::vector<TcpClient> tcp_clients_;  // Server thread only
+
+    std::atomic<uint64_t> queries_{0};
+    std::atomic<uint64_t> answered_{0};
+    std::atomic<uint64_t> dropped_{0};
+    std::atomic<uint64_t> tcp_connections_{0};
+    std::atomic<bool> stop_{false};
+    std::thread thread_;
+};
@@ -0,0 +1,148 @@
+#pragma once
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "LatencyHistogram.h"
+
+// Counters and latency histograms for one resolver.
+//
+// Every thread that records gets its own slot, so recording never shares a
+// cache line with another thread: a counter bump is a relaxed load and
+// store, a timing is one LatencyHistogram::record(). snapshot() merges the
+// slots. A thread finds its slot through a short thread-local list, so no
+// lock is taken on the hot path. When the thread exits its slot goes on a
+// free list, counts and all, for the next thread that registers: memory
+// follows the number of threads alive at once, not the number ever started.
+// Per-upstream figures sit behind a per-slot mutex that only snapshot()
+// ever contends for.
+class ResolverMetrics {
+public:
+    using Clock = std::chrono::steady_clock;
+
+    enum class Counter : size_t {
+        CacheHits,          // Answered from a fresh positive entry
+        CacheNegativeHits,  // Answered from a cached NXDOMAIN or no-data entry
+        CacheStaleHits,     // Answered from an expired entry (serve-stale)
+        CacheMisses,        // Had to go upstream
+        CacheExpired,       // Misses where the entry was there but past its TTL
+        CacheEvictions,     // Entries dropped: cleared, evicted when full, swept once expired
+        CacheInserts,       // Answers, negative answers and CNAME links stored
+        Prefetches,         // Refresh-ahead lookups started
+        LocalAnswers,       // Answered by the local zone (hosts entries, blocklists)
+        ResolvesStarted,
+        ResolvesFinished,
+        Count
+    };
+
+    // Where a resolve spends its time. Send covers building and handing off
+    // a query; Wait runs from then until the response (or timeout).
+    enum class Stage : size_t { Normalize, CacheLookup, Send, Wait, Parse, Insert, Count };
+
+    struct Upstream {
+        uint64_t queries = 0;      // Transmissions, retransmits included
+        uint64_t timeouts = 0;
+        uint64_t failures = 0;     // Unusable responses and send errors
+        std::array<uint64_t, 16> rcodes{};
+        LatencyHistogram rtt;      // Nanoseconds, usable answers only
+    };
+
+    struct Snapshot {
+        std::array<uint64_t, static_cast<size_t>(Counter::Count)> counters{};
+        std::array<LatencyHistogram, static_cast<size_t>(Stage::Count)> stages;  // Nanoseconds
+        LatencyHistogram hit_latency;   // Whole resolve, answered from cache
+        LatencyHistogram miss_latency;  // Whole resolve, went upstream
+        std::map<std::string, Upstream> upstreams;  // By "ip:port"
+        size_t cache_entries = 0;
+
+        uint64_t counter(Counter c) const { return counters[static_cast<size_t>(c)]; }
+        const LatencyHistogram& stage(Stage s) const { return stages[static_cast<size_t>(s)]; }
+        uint64_t inFlight() const;
+        // Share of resolves answered from cache, stale and negative included
+        double hitRatio() const;
+        // Prometheus text exposition format (version 0.0.4); names start
+        // with prefix.
+        std::string prometheus(const std::string& prefix = "dns_resolver") const;
+    };
+
+    ResolverMetrics();
+    ~ResolverMetrics();
+
+    ResolverMetrics(const ResolverMetrics&) = delete;
+    ResolverMetrics& operator=(const ResolverMetrics&) = delete;
+
+    void add(Counter counter, uint64_t n = 1) {
+        LatencyHistogram::bump(slot().counters[static_cast<size_t>(counter)], n);
+    }
+    void recordStage(Stage stage, Clock::duration elapsed) {
+        slot().stages[static_cast<size_t>(stage)].record(nanoseconds(elapsed));
+    }
+    // A resolve finished after elapsed; also counts it as finished.
+    void recordResolve(Clock::duration elapsed, bool from_cache);
+
+    void upstreamSent(const std::string& server);
+    void upstreamAnswered(const std::string& server, Clock::duration rtt);
+    void upstreamRcode(const std::string& server, uint8_t rcode);
+    void upstreamTimeout(const std::string& server);
+    void upstreamFailed(const std::string& server);
+
+    Snapshot snapshot() const;
+
+private:
+    struct UpstreamSlot {
+        std::atomic<uint64_t> queries{0};
+        std::atomic<uint64_t> timeouts{0};
+        std::atomic<uint64_t> failures{0};
+        std::array<std::atomic<uint64_t>, 16> rcodes{};
+        LatencyHistogram rtt;
+    };
+
+    struct Slot {
+        std::array<std::atomic<uint64_t>, static_cast<size_t>(Counter::Count)> counters{};
+        std::array<LatencyHistogram, static_cast<size_t>(Stage::Count)> stages;
+        LatencyHistogram hit_latency;
+        LatencyHistogram miss_latency;
+        mutable std::mutex upstream_mutex;  // Guards the map, not the counters in it
+        std::unordered_map<std::string, std::unique_ptr<UpstreamSlot>> upstreams;
+    };
+
+    static uint64_t nanoseconds(Clock::duration d) {
+        return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(d).count());
+    }
+
+    // Shared with the thread-local bindings so a thread that exits after
+    // the metrics object can tell there is nothing to give back.
+    struct Registry {
+        std::mutex mutex;
+        std::vector<std::unique_ptr<Slot>> slots;
+        std::vector<Slot*> free;
+    };
+
+    struct Binding {
+        uint64_t owner;
+        Slot* slot;
+        std::weak_ptr<Registry> registry;
+
+        void release() const;
+    };
+    // This thread's slots, most recent last; released when the thread exits
+    struct Bindings {
+        std::vector<Binding> list;
+        ~Bindings();
+    };
+    static thread_local Bindings bindings_;
+
+    Slot& slot();
+    Slot& registerSlot();
+    UpstreamSlot& upstream(const std::string& server);
+
+    const uint64_t id_;  // Never reused, so stale thread-local entries cannot match
+    const std::shared_ptr<Registry> registry_;
+};
@@ -0,0 +1,98 @@
+#pragma once
+#include <chrono>
+#include <cstddef>
+#include <string>
+#include <vector>
+#include "RttEstimator.h"
+
+class ResolverMetrics;
+
+// Decides where and when each transmission of one query goes.
+//
+// Servers are ranked once per query: those that are up by smoothed RTT
+// (unmeasured ones first, so every server gets measured), then those
+// marked down as a last resort. A probe_share of queries start with a random other server that
+// is up instead, so slower servers keep fresh estimates and a recovered
+// one is noticed.
+//
+// Transmissions rotate through the ranked servers that have not failed.
+// The first one waits for the server's hedge delay when there is another
+// server to try (or not at all when racing), so a slow response is raced
+// against a second server instead of waiting out a full RTO; later ones
+// wait for the server's RTO, which backs off exponentially while
+// transmissions go unanswered. Nothing is sent past the deadline, which
+// covers every retry of the query.
+class RetransmitSchedule {
+public:
+    using Clock = std::chrono::steady_clock;
+
+    struct Policy {
+        std::chrono::milliseconds timeout{5000};  // Whole exchange, retries included
+        int retries = 3;                          // Transmissions after the first
+        bool hedge = true;                        // Race a second server past the hedge delay
+        bool race = false;                        // Send to the top two servers at once
+        double probe_share = 0.05;                // Queries that try a non-best server first
+        ResolverMetrics* metrics = nullptr;       // Told of every transmission and its outcome
+    };
+
+    // servers are the estimator keys ("ip:port") of the candidate servers.
+    RetransmitSchedule(std::vector<std::string> servers, const Policy& policy,
+                       RttEstimator& estimator = RttEstimator::global());
+
+    // Starts over for a new query, as if newly constructed with the same
+    // estimator, but reusing the memory the schedule already has.
+    void restart(const std::vector<std::string>& servers, const Policy& policy);
+
+    // Picks the server for the next transmission and when the one after it
+    // falls due (never past the deadline). False once the transmissions are
+    // used up, every server has failed or the deadline has passed.
+    bool next(size_t& server, Clock::time_point& retransmit_at);
+
+    // The most recent transmission's timer fired without a usable response.
+    void timerExpired();
+    // server gave an unusable response or could not be sent to; skip it.
+    void failed(size_t server);
+    // server answered after rtt. Other servers still silent past their
+    // hedge delay count as failed towards being marked down, since the
+    // timer that raced them was not a timeout.
+    void answered(size_t server, Clock::duration rtt);
+
+    Clock::time_point deadline() const { return deadline_; }
+    const std::string& server(size_t index) const { return servers_[index]; }
+    int transmissions() const { return transmissions_; }
+    // Server indices in the order they are tried.
+    const std::vector<size_t>& order() const { return order_; }
+
+private:
+    struct Candidate {
+        size_t index;
+        bool down;
+        bool measured;
+        RttEstimator::Duration srtt;
+    };
+
+    void start();
+    void rank();
+
+    std::vector<std::string> servers_;
+    std::vector<bool> failed_;
+    size_t usable_ = 0;
+    Policy policy_;
+    RttEstimator& estimator_;
+    Clock::time_point deadline_;
+
+    struct Sent {
+        size_t server;
+        Clock::time_point at;
+        bool timed_out;
+    };
+
+    std::vector<size_t> order_;
+    std::vector<Sent> sent_;
+    std::vector<Candidate> candidates_;  // Scratch for rank()
+    std::vector<bool> charged_;          // Scratch for answered()
+    int transmissions_ = 0;
+    size_t next_server_ = 0;  // Position in order_
+    size_t last_server_ = 0;
+    bool last_was_hedge_ = false;
+};
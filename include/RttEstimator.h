@@ -0,0 +1,82 @@
+#pragma once
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+// Per-server round-trip time estimates, as in TCP (Jacobson/Karels,
+// RFC 6298): a smoothed RTT and its mean deviation give the retransmission
+// timeout, which doubles on every unanswered transmission until the server
+// answers again.
+//
+// It also tracks server health. After failure_threshold consecutive
+// timeouts or failures a server is marked down for down_time, doubling
+// each time it is marked down again without answering in between (up to
+// max_down_time); any answer brings it straight back up.
+//
+// Callers must only sample transmissions that cannot be confused with a
+// retransmission (Karn's rule); every DNS transmission carries its own
+// transaction ID, so a response always identifies the send it answers.
+class RttEstimator {
+public:
+    using Duration = std::chrono::microseconds;
+    using Clock = std::chrono::steady_clock;
+
+    struct Options {
+        Duration initial_rto{std::chrono::milliseconds(400)};  // Before the first sample
+        Duration min_rto{std::chrono::milliseconds(50)};
+        Duration max_rto{std::chrono::seconds(3)};
+        uint32_t failure_threshold = 3;
+        Duration down_time{std::chrono::seconds(1)};
+        Duration max_down_time{std::chrono::seconds(60)};
+    };
+
+    struct Estimate {
+        Duration srtt{0};
+        Duration rttvar{0};
+        uint64_t samples = 0;
+        uint32_t backoff = 0;         // Unanswered transmissions since the last sample
+        uint32_t failures = 0;        // Consecutive timeouts and failures since the last answer
+        uint64_t total_failures = 0;
+        uint32_t down_count = 0;      // Times marked down since the last answer
+        Clock::time_point down_until{};
+
+        bool down(Clock::time_point now = Clock::now()) const { return down_until > now; }
+    };
+
+    // Shared by every resolver in the process, keyed by server address.
+    static RttEstimator& global();
+
+    RttEstimator() : RttEstimator(Options()) {}
+    explicit RttEstimator(const Options& options) : options_(options) {}
+
+    void sample(const std::string& server, Duration rtt);
+    // A transmission to server went unanswered for its whole RTO.
+    void timedOut(const std::string& server);
+    // server could not be reached or gave an unusable answer (SERVFAIL,
+    // REFUSED, malformed). Counts towards marking it down; the RTO is kept.
+    void failed(const std::string& server);
+
+    // SRTT + 4 * RTTVAR, doubled per backoff step, within [min_rto, max_rto].
+    Duration rto(const std::string& server) const;
+    // Roughly the server's 95th percentile latency (SRTT + 2 * RTTVAR); a
+    // response slower than this is worth hedging against. Equal to rto()
+    // until the server has been sampled.
+    Duration hedgeDelay(const std::string& server) const;
+
+    Estimate estimate(const std::string& server) const;
+    // Every server seen so far with its current statistics.
+    std::vector<std::pair<std::string, Estimate>> snapshot() const;
+    const Options& options() const { return options_; }
+
+private:
+    Duration rtoLocked(const Estimate& estimate) const;
+    void failedLocked(Estimate& estimate);
+
+    Options options_;
+    mutable std::mutex mutex_;
+    std::unordered_map<std::string, Estimate> estimates_;
+};
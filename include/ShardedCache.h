@@ -0,0 +1,174 @@
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <functional>
+#include <string>
+#include <string_view>
+#include <vector>
+#include "EpochManager.h"
+
+// Concurrent name -> addresses map split into independently locked shards.
+//
+// Each shard is a chained hash table whose nodes are immutable once
+// published. Writers serialize on the shard mutex, link new nodes in with
+// atomic stores and hand replaced nodes to the EpochManager. Readers take
+// no lock at all: they pin an epoch and walk the chain.
+//
+// A node is a single allocation holding the key followed by its addresses
+// in binary form, IPv4 before IPv6. Addresses are only formatted as text
+// when a caller asks for it.
+//
+// With max_entries set, a shard that is full makes room for a new key by
+// evicting one entry: of a few sampled from a rotating bucket cursor, the
+// one that expires first (an expired one at once). Expired entries are
+// otherwise only unlinked by removeExpired(), which the owner runs
+// periodically.
+class ShardedCache {
+    struct Node;
+
+public:
+    using Clock = std::chrono::steady_clock;
+
+    // Hit counting stops here so hot entries are not written on every read
+    static constexpr uint32_t HIT_COUNT_LIMIT = 1024;
+
+    // Read-only view of a cached entry. The view keeps its thread pinned, so
+    // the entry stays valid while the view lives; keep it short-lived and
+    // destroy it on the thread that obtained it.
+    class View {
+    public:
+        View() = default;
+
+        explicit operator bool() const { return node_ != nullptr; }
+        size_t size() const;
+        bool isIPv6(size_t index) const;
+        // 4 or 16 bytes in network order
+        const uint8_t* addressBytes(size_t index) const;
+        std::string addressString(size_t index) const;
+        void appendStrings(std::vector<std::string>& out) const;
+        Clock::time_point expiry() const;
+        bool expired() const;
+        // TTL the entry was stored with, in seconds
+        uint32_t ttl() const;
+        // Lookups that found the entry, saturating at HIT_COUNT_LIMIT
+        uint32_t hits() const;
+        // True for exactly one caller per entry; used to start a single refresh
+        bool claimRefresh() const;
+
+    private:
+        friend class ShardedCache;
+        View(EpochManager::Guard&& guard, const Node* node) : guard_(std::move(guard)), node_(node) {}
+        // For nodes kept alive by a held shard lock instead of an epoch
+        explicit View(const Node* node) : node_(node) {}
+
+        std::optional<EpochManager::Guard> guard_;
+        const Node* node_ = nullptr;
+    };
+
+    // max_entries of 0 means unbounded; otherwise each shard holds at most
+    // its share of it.
+    explicit ShardedCache(size_t shard_count = 64, size_t max_entries = 0);
+    ~ShardedCache();
+
+    ShardedCache(const ShardedCache&) = delete;
+    ShardedCache& operator=(const ShardedCache&) = delete;
+
+    // Returns a view of the entry for key if it is unexpired, or expired for
+    // no longer than stale_allowance; otherwise an empty view.
+    View find(const std::string& key, Clock::duration stale_allowance = Clock::duration::zero()) const;
+    // As above for a key whose std::hash<std::string_view> the caller
+    // already has.
+    View find(std::string_view key, size_t hash, Clock::duration stale_allowance = Clock::duration::zero()) const;
+    // Formats the addresses of an unexpired entry into ip_addresses and, if
+    // expiry is given, reports when the entry expires.
+    bool lookup(const std::string& key, std::vector<std::string>& ip_addresses,
+                Clock::time_point* expiry = nullptr) const;
+    // Strings that are not IPv4 or IPv6 literals are skipped, as are
+    // addresses past the 255th of either family.
+    void insert(const std::string& key, const std::vector<std::string>& ip_addresses,
+                std::chrono::seconds ttl);
+    // Stores addresses already in binary form (as View::addressBytes gives
+    // them) that expire at expiry; ttl is what View::ttl() will report.
+    void insert(std::string_view key, const uint8_t* ipv4, size_t ipv4_count, const uint8_t* ipv6,
+                size_t ipv6_count, Clock::time_point expiry, uint32_t ttl);
+    // Sizes the tables for entries in total, so a bulk load does not grow
+    // them step by step.
+    void reserve(size_t entries);
+    // Calls fn for every entry, expired ones included, one shard at a time
+    // with that shard's writers held off. fn must not modify the cache.
+    void forEach(const std::function<void(std::string_view key, const View& view)>& fn) const;
+    bool erase(const std::string& key);
+    // Unlinks every entry expired for longer than grace; returns how many
+    // were removed.
+    size_t removeExpired(Clock::duration grace = Clock::duration::zero());
+    void clear();
+    size_t size() const;
+    size_t shardCount() const { return shard_count_; }
+    // Entries evicted to stay within max_entries since construction
+    uint64_t evictions() const { return evictions_.load(std::memory_order_relaxed); }
+
+    // Millisecond-resolution monotonic time on the steady_clock timeline.
+    // Expiry is second-granular, and this is several times cheaper than
+    // Clock::now() on the hit path.
+    static Clock::time_point coarseNow();
+
+private:
+    struct Node {
+        std::atomic<Node*> next{nullptr};
+        size_t hash;
+        Clock::time_point expiry;
+        uint32_t ttl;
+        uint32_t key_length;
+        mutable std::atomic<uint32_t> hits{0};
+        mutable std::atomic<bool> refresh_claimed{false};
+        uint8_t ipv4_count;
+        uint8_t ipv6_count;
+
+        // The key and the packed addresses follow the node in memory
+        const char* key() const { return reinterpret_cast<const char*>(this + 1); }
+        const uint8_t* addresses() const { return reinterpret_cast<const uint8_t*>(key() + key_length); }
+        size_t allocationSize() const { return sizeof(Node) + key_length + 4 * ipv4_count + 16 * ipv6_count; }
+        bool matches(size_t h, std::string_view k) const;
+    };
+
+    struct Table {
+        size_t mask;
+        std::unique_ptr<std::atomic<Node*>[]> buckets;
+        explicit Table(size_t bucket_count);
+    };
+
+    struct alignas(64) Shard {
+        std::mutex write_mutex;
+        std::atomic<Table*> table{nullptr};
+        size_t size = 0;
+        size_t evict_cursor = 0;  // Bucket where the next eviction starts sampling
+    };
+
+    Shard& shardFor(size_t hash) const {
+        // High bits pick the shard, low bits the bucket within it
+        return shards_[(hash >> (sizeof(size_t) * 8 - 16)) & (shard_count_ - 1)];
+    }
+    const Node* findNode(std::string_view key, size_t hash, Clock::duration stale_allowance) const;
+    static Node* allocateNode(size_t hash, std::string_view key, const uint8_t* ipv4, size_t ipv4_count,
+                              const uint8_t* ipv6, size_t ipv6_count, Clock::time_point expiry, uint32_t ttl);
+    static Node* copyNode(const Node* node);
+    // Links fresh in, replacing any node with the same key.
+    void publish(Node* fresh);
+    void grow(Shard& shard);
+    // Unlinks one entry of a full shard and returns it for retiring.
+    Node* evictOne(Shard& shard);
+    static void retire(void* ptr, void (*deleter)(void*));
+
+    static void deleteNode(void* node);
+    static void deleteTableAndNodes(void* table);
+
+    size_t shard_count_;
+    size_t shard_capacity_;  // 0 when unbounded
+    std::unique_ptr<Shard[]> shards_;
+    std::atomic<uint64_t> evictions_{0};
+};
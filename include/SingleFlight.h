@@ -0,0 +1,88 @@
+#pragma once
+#include <functional>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+// Table of lookups currently in flight, so that concurrent requests for the
+// same key share one piece of work. The first caller to join a key becomes
+// its leader and does the work; everyone who joins before the leader calls
+// complete() is handed the leader's result instead. A leader with part of
+// its result early can deliver() it, and the flight then hands that to
+// waiters and newcomers alike until complete().
+template <typename Result>
+class SingleFlight {
+public:
+    using Callback = std::function<void(const Result&)>;
+
+    // Registers callback for key's result. Returns true if the caller is the
+    // leader and must eventually call complete(key, ...). If the flight has
+    // delivered early, callback runs at once on the calling thread instead.
+    bool join(const std::string& key, Callback callback) {
+        Result early;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            auto inserted = waiters_.emplace(key, Flight());
+            Flight& flight = inserted.first->second;
+            if (!flight.delivered) {
+                flight.callbacks.push_back(std::move(callback));
+                return inserted.second;
+            }
+            early = flight.early;
+        }
+        callback(early);
+        return false;
+    }
+
+    // Runs the callbacks registered so far with result, and keeps it for
+    // later joiners, but leaves the flight open; the leader must still call
+    // complete(). Does nothing once the flight has delivered.
+    void deliver(const std::string& key, const Result& result) {
+        std::vector<Callback> callbacks;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            auto it = waiters_.find(key);
+            if (it == waiters_.end() || it->second.delivered) return;
+            it->second.delivered = true;
+            it->second.early = result;
+            callbacks = std::move(it->second.callbacks);
+            it->second.callbacks.clear();
+        }
+        for (auto& callback : callbacks) {
+            callback(result);
+        }
+    }
+
+    // Ends the flight for key and runs every callback still registered with
+    // result, outside the lock and on the calling thread.
+    void complete(const std::string& key, const Result& result) {
+        std::vector<Callback> callbacks;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            auto it = waiters_.find(key);
+            if (it == waiters_.end()) return;
+            callbacks = std::move(it->second.callbacks);
+            waiters_.erase(it);
+        }
+        for (auto& callback : callbacks) {
+            callback(result);
+        }
+    }
+
+    size_t size() const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return waiters_.size();
+    }
+
+private:
+    struct Flight {
+        std::vector<Callback> callbacks;
+        bool delivered = false;
+        Result early;  // What deliver() handed out
+    };
+
+    mutable std::mutex mutex_;
+    std::unordered_map<std::string, Flight> waiters_;
+};
@@ -0,0 +1,135 @@
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <queue>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include "UDPTransport.h"
+
+// Reusable TCP connections to DNS servers (RFC 7766), for answers that came
+// back truncated over UDP.
+//
+// Connections are kept per server and shared by every query to it. Each one
+// carries up to max_pipelined queries at once: they are written back to
+// back, each under an ID unique on that connection, and answers are matched
+// by ID in whatever order they arrive. A connection with nothing
+// outstanding for idle_timeout is closed. If a server closes a connection
+// with queries still outstanding, each is retried once on a fresh one.
+// One I/O thread, started by the first query, serves every connection.
+class TCPPool {
+public:
+    enum class Status { Ok, Timeout, NetworkError, Shutdown };
+
+    // Invoked exactly once per submitted query, on the I/O thread (or on the
+    // stopping thread with Status::Shutdown). The response carries the
+    // query's own ID and is only valid for the duration of the call.
+    using Callback = std::function<void(Status status, const uint8_t* response, size_t length)>;
+    using Clock = std::chrono::steady_clock;
+
+    struct Options {
+        size_t connections_per_server = 2;
+        size_t max_pipelined = 32;                      // Outstanding queries per connection
+        std::chrono::milliseconds idle_timeout{10000};  // Then the connection is closed
+    };
+
+    // Shared by blocking callers in the process; never destroyed.
+    static TCPPool& global();
+
+    TCPPool() : TCPPool(Options()) {}
+    explicit TCPPool(const Options& options);
+    ~TCPPool();
+
+    TCPPool(const TCPPool&) = delete;
+    TCPPool& operator=(const TCPPool&) = delete;
+
+    // Queues query (a DNS message without the length prefix) for server.
+    // Safe to call from any thread, including from inside a callback.
+    void submit(const UDPTransport::ServerAddress& server, const uint8_t* query, size_t length,
+                Clock::time_point deadline, Callback callback);
+
+    // submit() and wait; on Status::Ok response holds the answer.
+    Status exchange(const UDPTransport::ServerAddress& server, const uint8_t* query, size_t length,
+                    std::vector<uint8_t>& response, Clock::time_point deadline);
+
+    // Fails everything outstanding with Status::Shutdown and joins the I/O
+    // thread; later submissions fail at once. Called by the destructor.
+    void stop();
+
+    size_t openConnections() const { return open_.load(std::memory_order_relaxed); }
+    uint64_t connectionsOpened() const { return opened_.load(std::memory_order_relaxed); }
+
+private:
+    struct Query {
+        UDPTransport::ServerAddress server;
+        std::vector<uint8_t> message;  // Length-prefixed, as written to the stream
+        uint16_t id;                   // The caller's, restored in the answer
+        Clock::time_point deadline;
+        Callback callback;
+        bool retried = false;
+        uint64_t generation = 0;
+    };
+
+    struct Connection {
+        uint64_t tag;
+        int fd;
+        std::string key;  // Server "ip:port"
+        bool connected = false;
+        bool writing = false;  // Waiting for EPOLLOUT
+        std::vector<uint8_t> out;
+        size_t written = 0;
+        std::vector<uint8_t> in;
+        std::unordered_map<uint16_t, Query> pending;  // By the ID used on this connection
+        uint16_t next_id;
+        Clock::time_point idle_since;
+    };
+
+    struct Timer {
+        Clock::time_point deadline;
+        uint64_t connection;
+        uint16_t id;
+        uint64_t generation;
+        bool operator>(const Timer& other) const { return deadline > other.deadline; }
+    };
+
+    void run();
+    void drainSubmissions();
+    void assign(Query query);
+    Connection* open(const UDPTransport::ServerAddress& server, const std::string& key);
+    void handle(uint64_t tag, uint32_t events);
+    // Both return false once the connection is broken.
+    bool flushOut(Connection& connection);
+    bool readIn(Connection& connection);
+    void watch(Connection& connection, bool writable);
+    // Outstanding queries get their one retry if retry is set, else fail.
+    void closeConnection(uint64_t tag, bool retry);
+    void expire();
+    int nextTimeoutMs() const;
+    void wake();
+
+    const Options options_;
+    int epoll_fd_ = -1;
+    int wake_fd_ = -1;
+
+    // I/O thread only
+    std::unordered_map<uint64_t, std::unique_ptr<Connection>> connections_;
+    std::unordered_map<std::string, std::vector<uint64_t>> by_server_;
+    std::priority_queue<Timer, std::vector<Timer>, std::greater<Timer>> timers_;
+    uint64_t next_tag_ = 0;
+    uint64_t generation_ = 0;
+
+    std::mutex submit_mutex_;  // Guards submissions_ and started_
+    std::vector<Query> submissions_;
+    std::atomic<bool> running_{true};
+    bool started_ = false;
+    std::thread thread_;
+
+    std::atomic<size_t> open_{0};
+    std::atomic<uint64_t> opened_{0};
+};
@@ -0,0 +1,59 @@
+#pragma once
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <vector>
+#include <sys/socket.h>
+#include "RetransmitSchedule.h"
+
+// Blocking UDP exchanges with DNS servers.
+class UDPTransport {
+public:
+    static constexpr uint16_t DNS_PORT = 53;
+
+    struct ServerAddress {
+        sockaddr_storage addr{};
+        socklen_t length = 0;
+
+        // Accepts "1.2.3.4", "1.2.3.4:5353", "::1" and "[::1]:5353".
+        static bool parse(const std::string& text, uint16_t default_port, ServerAddress& out);
+        std::string toString() const;
+        uint16_t port() const;
+        bool operator==(const ServerAddress& other) const;
+        // True if from (as filled in by recvfrom) is this address and port.
+        bool sameEndpoint(const sockaddr_storage& from) const;
+    };
+
+    enum class Status { Ok, Timeout, NetworkError };
+
+    // Sends query to server and waits up to timeout for a datagram whose ID
+    // and QR bit match. The socket is connected, so datagrams from any other
+    // source are dropped by the kernel.
+    static Status exchange(const ServerAddress& server,
+                           const uint8_t* query, size_t query_length,
+                           uint8_t* response, size_t capacity, size_t& response_length,
+                           std::chrono::milliseconds timeout);
+
+    // Decides whether a response from servers[server] is final. Returning
+    // false marks that server as failed for the rest of the exchange.
+    using Acceptor = std::function<bool(size_t server, const uint8_t* response, size_t length)>;
+
+    // Sends query to servers as schedule directs (retransmits with backoff,
+    // hedging to a second server) until a response is accepted or the
+    // schedule's deadline passes. Every transmission gets its own ID and
+    // connected socket, so late answers to earlier ones still count and
+    // their RTTs can be sampled. answered_by receives the server index.
+    static Status exchange(const std::vector<ServerAddress>& servers,
+                           const uint8_t* query, size_t query_length,
+                           uint8_t* response, size_t capacity, size_t& response_length,
+                           RetransmitSchedule& schedule, const Acceptor& accept,
+                           size_t* answered_by = nullptr);
+
+    // Nameservers listed in /etc/resolv.conf (127.0.0.1 if there are none).
+    static const std::vector<std::string>& systemNameservers();
+
+    // Unpredictable transaction ID from a per-thread generator.
+    static uint16_t randomId();
+};
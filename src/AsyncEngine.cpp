@@ -0,0 +1,278 @@
+#include "AsyncEngine.h"
+#include "DNSMessage.h"
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <netinet/in.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+#include <stdexcept>
+
+namespace {
+
+constexpr int MAX_EVENTS = 64;
+constexpr uint64_t WAKE_TAG = ~0ULL;
+constexpr int ID_ATTEMPTS = 8;
+constexpr int SOCKET_BUFFER = 1 << 20;  // Room for bursts of responses between wakeups
+constexpr size_t RESPONSE_BUFFER = 4096;  // Longer UDP responses are dropped
+
+}  // namespace
+
+AsyncEngine::AsyncEngine(size_t sockets_per_family, size_t batch_size)
+    : sockets_per_family_(sockets_per_family == 0 ? 1 : sockets_per_family),
+      batch_size_(batch_size == 0 ? 1 : batch_size), received_(batch_size_, RESPONSE_BUFFER) {
+    epoll_fd_ = epoll_create1(EPOLL_CLOEXEC);
+    wake_fd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (epoll_fd_ < 0 || wake_fd_ < 0) {
+        throw std::runtime_error("AsyncEngine: failed to create epoll/eventfd");
+    }
+    epoll_event ev{};
+    ev.events = EPOLLIN;
+    ev.data.u64 = WAKE_TAG;
+    epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, wake_fd_, &ev);
+    thread_ = std::thread([this] { run(); });
+}
+
+AsyncEngine::~AsyncEngine() {
+    running_ = false;
+    uint64_t one = 1;
+    (void)write(wake_fd_, &one, sizeof(one));
+    thread_.join();
+
+    // Callbacks may try to submit follow-up queries; those fail immediately
+    // because running_ is already false.
+    std::vector<Submission> queued;
+    {
+        std::lock_guard<std::mutex> lock(submit_mutex_);
+        queued.swap(submissions_);
+    }
+    for (auto& submission : queued) {
+        submission.callback(Status::Shutdown, nullptr, 0);
+    }
+    auto pending = std::move(pending_);
+    for (auto& entry : pending) {
+        entry.second.callback(Status::Shutdown, nullptr, 0);
+    }
+    for (int fd : sockets_) close(fd);
+    close(wake_fd_);
+    close(epoll_fd_);
+}
+
+void AsyncEngine::submit(const UDPTransport::ServerAddress& server,
+                         const uint8_t* query, size_t length,
+                         Clock::time_point deadline, Callback callback) {
+    if (length < DNSMessage::HEADER_SIZE || length > DNSMessage::MAX_UDP_SIZE) {
+        callback(Status::NetworkError, nullptr, 0);
+        return;
+    }
+    // running_ is checked under the lock the destructor drains with, so a
+    // submission is either drained there or refused here, never dropped
+    bool accepted = false, wake = false;
+    {
+        std::lock_guard<std::mutex> lock(submit_mutex_);
+        if (running_) {
+            in_flight_.fetch_add(1, std::memory_order_relaxed);
+            wake = submissions_.empty() && scheduled_.empty();
+            submissions_.emplace_back();
+            Submission& submission = submissions_.back();
+            submission.server = server;
+            std::memcpy(submission.query, query, length);
+            submission.length = length;
+            submission.deadline = deadline;
+            submission.callback = std::move(callback);
+            accepted = true;
+        }
+    }
+    if (!accepted) {
+        callback(Status::Shutdown, nullptr, 0);
+    } else if (wake) {
+        uint64_t one = 1;
+        (void)write(wake_fd_, &one, sizeof(one));
+    }
+}
+
+void AsyncEngine::schedule(Clock::time_point when, std::function<void()> fn) {
+    bool wake;
+    {
+        std::lock_guard<std::mutex> lock(submit_mutex_);
+        if (!running_) return;
+        wake = submissions_.empty() && scheduled_.empty();
+        scheduled_.push_back(Task{when, 0, std::move(fn)});
+    }
+    if (wake) {
+        uint64_t one = 1;
+        (void)write(wake_fd_, &one, sizeof(one));
+    }
+}
+
+void AsyncEngine::run() {
+    epoll_event events[MAX_EVENTS];
+    while (running_) {
+        int n = epoll_wait(epoll_fd_, events, MAX_EVENTS, nextTimeoutMs());
+        if (n < 0 && errno != EINTR) {
+            std::cerr << "AsyncEngine: epoll_wait failed: " << std::strerror(errno) << std::endl;
+            break;
+        }
+        for (int i = 0; i < n; ++i) {
+            if (events[i].data.u64 == WAKE_TAG) {
+                uint64_t value;
+                while (read(wake_fd_, &value, sizeof(value)) > 0) {}
+            } else {
+                receive(static_cast<size_t>(events[i].data.u64));
+            }
+        }
+        drainSubmissions();
+        expireTimers();
+    }
+}
+
+void AsyncEngine::drainSubmissions() {
+    {
+        std::lock_guard<std::mutex> lock(submit_mutex_);
+        draining_.swap(submissions_);
+        draining_tasks_.swap(scheduled_);
+    }
+    for (auto& submission : draining_) {
+        send(submission);
+    }
+    for (size_t socket = 0; socket < outgoing_.size(); ++socket) {
+        flush(socket);
+    }
+    draining_.clear();
+    for (auto& task : draining_tasks_) {
+        task.order = ++generation_;
+        tasks_.push(std::move(task));
+    }
+    draining_tasks_.clear();
+}
+
+size_t AsyncEngine::openSocket(int family) {
+    int fd = socket(family, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) return SIZE_MAX;
+    setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &SOCKET_BUFFER, sizeof(SOCKET_BUFFER));
+    size_t index = sockets_.size();
+    epoll_event ev{};
+    ev.events = EPOLLIN;
+    ev.data.u64 = index;
+    if (epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, fd, &ev) != 0) {
+        close(fd);
+        return SIZE_MAX;
+    }
+    sockets_.push_back(fd);
+    outgoing_.emplace_back(new Outgoing(batch_size_));
+    return index;
+}
+
+void AsyncEngine::send(Submission& submission) {
+    const int family = submission.server.addr.ss_family;
+    auto& pool = family == AF_INET6 ? v6_sockets_ : v4_sockets_;
+    while (pool.size() < sockets_per_family_) {
+        size_t index = openSocket(family);
+        if (index == SIZE_MAX) break;
+        pool.push_back(index);
+    }
+    if (pool.empty()) {
+        in_flight_.fetch_sub(1, std::memory_order_relaxed);
+        submission.callback(Status::NetworkError, nullptr, 0);
+        return;
+    }
+
+    // Pick a socket round-robin and an ID that is free on it
+    size_t socket = pool[next_socket_++ % pool.size()];
+    uint32_t key = 0;
+    bool found = false;
+    for (int attempt = 0; attempt < ID_ATTEMPTS && !found; ++attempt) {
+        uint16_t id = UDPTransport::randomId();
+        key = makeKey(socket, id);
+        found = pending_.find(key) == pending_.end();
+        if (!found) socket = pool[next_socket_++ % pool.size()];
+    }
+    if (!found) {
+        in_flight_.fetch_sub(1, std::memory_order_relaxed);
+        submission.callback(Status::NetworkError, nullptr, 0);
+        return;
+    }
+    Outgoing& outgoing = *outgoing_[socket];
+    if (outgoing.batch.full()) flush(socket);
+    if (!outgoing.batch.append(submission.query, submission.length, &submission.server.addr,
+                               submission.server.length)) {
+        in_flight_.fetch_sub(1, std::memory_order_relaxed);
+        submission.callback(Status::NetworkError, nullptr, 0);
+        return;
+    }
+    DNSMessage::writeU16(outgoing.batch.data(outgoing.batch.size() - 1), static_cast<uint16_t>(key & 0xFFFF));
+    outgoing.keys.push_back(key);
+
+    // Pending from now on; flush() fails it if the kernel refuses it
+    uint64_t generation = ++generation_;
+    pending_.emplace(key, Pending{submission.server, std::move(submission.callback), generation});
+    timers_.push(Timer{submission.deadline, key, generation});
+}
+
+void AsyncEngine::flush(size_t socket) {
+    Outgoing& outgoing = *outgoing_[socket];
+    if (outgoing.batch.empty()) return;
+    unsent_.clear();
+    outgoing.batch.flush(sockets_[socket], &unsent_);
+    // Callbacks only queue new submissions, so the keys stay put meanwhile
+    for (size_t slot : unsent_) {
+        complete(outgoing.keys[slot], Status::NetworkError, nullptr, 0);
+    }
+    outgoing.keys.clear();
+}
+
+void AsyncEngine::receive(size_t socket) {
+    while (true) {
+        // EAGAIN ends the batch early. Other errors (e.g. ICMP unreachable)
+        // are not attributable to a particular query; let it time out.
+        const size_t received = received_.receive(sockets_[socket]);
+        for (size_t i = 0; i < received; ++i) {
+            const uint8_t* response = received_.data(i);
+            const size_t length = received_.length(i);
+            if (length < DNSMessage::HEADER_SIZE || (response[2] & 0x80) == 0) continue;
+
+            uint32_t key = makeKey(socket, DNSMessage::readU16(response));
+            auto it = pending_.find(key);
+            if (it == pending_.end() || !it->second.server.sameEndpoint(received_.peer(i))) continue;
+            complete(key, Status::Ok, response, length);
+        }
+        if (received < received_.capacity()) return;
+    }
+}
+
+void AsyncEngine::expireTimers() {
+    const auto now = Clock::now();
+    while (!timers_.empty() && timers_.top().deadline <= now) {
+        Timer timer = timers_.top();
+        timers_.pop();
+        auto it = pending_.find(timer.key);
+        if (it != pending_.end() && it->second.generation == timer.generation) {
+            complete(timer.key, Status::Timeout, nullptr, 0);
+        }
+    }
+    while (!tasks_.empty() && tasks_.top().when <= now) {
+        auto fn = std::move(const_cast<Task&>(tasks_.top()).fn);
+        tasks_.pop();
+        fn();
+    }
+}
+
+int AsyncEngine::nextTimeoutMs() const {
+    if (timers_.empty() && tasks_.empty()) return -1;
+    Clock::time_point next = Clock::time_point::max();
+    if (!timers_.empty()) next = timers_.top().deadline;
+    if (!tasks_.empty()) next = std::min(next, tasks_.top().when);
+    auto wait = std::chrono::duration_cast<std::chrono::milliseconds>(next - Clock::now());
+    // Round up so the loop does not spin on sub-millisecond remainders
+    return wait.count() < 0 ? 0 : static_cast<int>(wait.count()) + 1;
+}
+
+void AsyncEngine::complete(uint32_t key, Status status, const uint8_t* response, size_t length) {
+    auto it = pending_.find(key);
+    Callback callback = std::move(it->second.callback);
+    pending_.erase(it);
+    in_flight_.fetch_sub(1, std::memory_order_relaxed);
+    callback(status, response, length);
+}
@@ -1,36 +1,381 @@
 #include "DNSCache.h"
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+
+namespace {
+
+// Snapshot layout, in host byte order (a snapshot is read back where it
+// was written): SnapshotHeader, then per entry a SnapshotEntry followed by
+// the key and the addresses, 4 bytes per IPv4 and 16 per IPv6 one.
+constexpr char SNAPSHOT_MAGIC[8] = {'D', 'N', 'S', 'C', 'A', 'C', 'H', 'E'};
+constexpr uint32_t SNAPSHOT_VERSION = 1;
+constexpr uint32_t BYTE_ORDER_MARK = 0x01020304;
+
+struct SnapshotHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t byte_order;
+    uint64_t entries;
+    int64_t written_ms;  // Wall clock, ms since the epoch
+};
+
+struct SnapshotEntry {
+    int64_t expires_ms;  // Wall clock, ms since the epoch; steady time does not survive a reboot
+    uint32_t ttl;        // As originally stored, for prefetch timing
+    uint16_t key_length;
+    uint8_t ipv4_count;
+    uint8_t ipv6_count;
+};
+
+constexpr size_t EVICTION_SAMPLES = 8;  // Typed sets compared per eviction
+
+int64_t wallMillis() {
+    return std::chrono::duration_cast<std::chrono::milliseconds>(
+               std::chrono::system_clock::now().time_since_epoch())
+        .count();
+}
+
+}  // namespace
+
+DNSCache::DNSCache() : DNSCache(Options()) {}
+
+DNSCache::DNSCache(const Options& options)
+    : options_(options),
+      entries_(options.shards, options.max_entries),
+      record_shard_count_(std::max<size_t>(options.shards, 1)),
+      record_shard_capacity_(options.max_entries ? std::max<size_t>(1, options.max_entries / record_shard_count_) : 0),
+      record_shards_(new RecordShard[record_shard_count_]) {}
+
+std::chrono::seconds DNSCache::clampTTL(std::chrono::seconds ttl) const {
+    return std::min(std::max(ttl, options_.min_ttl), options_.max_ttl);
+}
 
 void DNSCache::addEntry(const std::string& domain,
                        const std::vector<std::string>& ip_addresses,
                        std::chrono::seconds ttl) {
-    std::lock_guard<std::mutex> lock(cache_mutex_);
-    CacheEntry entry{
-        ip_addresses,
-        std::chrono::system_clock::now() + ttl
-    };
-    cache_[domain] = entry;
+    auto clamped = clampTTL(ttl);
+    if (clamped.count() <= 0) {
+        return;
+    }
+    entries_.insert(domain, ip_addresses, clamped);
 }
 
 bool DNSCache::getEntry(const std::string& domain,
                        std::vector<std::string>& ip_addresses) {
-    std::lock_guard<std::mutex> lock(cache_mutex_);
-    auto it = cache_.find(domain);
-    if (it != cache_.end() && 
-        it->second.expiry > std::chrono::system_clock::now()) {
-        ip_addresses = it->second.ip_addresses;
-        return true;
-    }
-    return false;
-}
-
-void DNSCache::cleanup() {
-    std::lock_guard<std::mutex> lock(cache_mutex_);
-    auto now = std::chrono::system_clock::now();
-    for (auto it = cache_.begin(); it != cache_.end();) {
-        if (it->second.expiry <= now) {
-            it = cache_.erase(it);
-        } else {
-            ++it;
+    return entries_.lookup(domain, ip_addresses);
+}
+
+bool DNSCache::getEntry(const std::string& domain,
+                       std::vector<std::string>& ip_addresses,
+                       uint32_t& remaining_ttl) {
+    View view = entries_.find(domain);
+    if (!view) {
+        return false;
+    }
+    ip_addresses.clear();
+    view.appendStrings(ip_addresses);
+    remaining_ttl = remainingTTL(view);
+    return true;
+}
+
+DNSCache::View DNSCache::find(const std::string& domain) const {
+    return entries_.find(domain);
+}
+
+DNSCache::View DNSCache::findStale(const std::string& domain) const {
+    if (!options_.serve_stale) {
+        return View();
+    }
+    return entries_.find(domain, options_.max_stale);
+}
+
+bool DNSCache::holdsExpired(const std::string& domain) const {
+    // Expired entries stay until cleanup() or eviction, so look back as far
+    // as any could still be around
+    View view = entries_.find(domain, std::chrono::hours(24 * 365));
+    return view && view.expired();
+}
+
+DNSCache::View DNSCache::find(const DomainName& domain) const {
+    return entries_.find(domain.str(), domain.hash());
+}
+
+DNSCache::View DNSCache::findStale(const DomainName& domain) const {
+    if (!options_.serve_stale) {
+        return View();
+    }
+    return entries_.find(domain.str(), domain.hash(), options_.max_stale);
+}
+
+bool DNSCache::holdsExpired(const DomainName& domain) const {
+    View view = entries_.find(domain.str(), domain.hash(), std::chrono::hours(24 * 365));
+    return view && view.expired();
+}
+
+bool DNSCache::shouldPrefetch(const View& view) const {
+    if (options_.prefetch_fraction <= 0 || view.hits() < options_.prefetch_min_hits) {
+        return false;
+    }
+    auto left = view.expiry() - ShardedCache::coarseNow();
+    auto window = std::chrono::duration_cast<ShardedCache::Clock::duration>(
+        std::chrono::duration<double>(view.ttl() * options_.prefetch_fraction));
+    return left <= window && view.claimRefresh();
+}
+
+uint32_t DNSCache::remainingTTL(const View& view) {
+    auto left = std::chrono::duration_cast<std::chrono::seconds>(view.expiry() - ShardedCache::coarseNow());
+    return static_cast<uint32_t>(std::max<long long>(1, left.count()));
+}
+
+std::string DNSCache::negativeKey(const std::string& domain, DNSMessage::RecordType type) {
+    // NUL never occurs in a name, so these cannot collide with address keys.
+    // Type ANY stands for the whole name (NXDOMAIN).
+    std::string key = domain;
+    key += '\0';
+    key += std::to_string(static_cast<uint16_t>(type));
+    return key;
+}
+
+void DNSCache::addNegative(const std::string& domain, DNSMessage::RecordType type, Negative kind,
+                           std::chrono::seconds ttl) {
+    ttl = std::min(ttl, options_.max_negative_ttl);
+    if (kind == Negative::None || ttl.count() <= 0) {
+        return;
+    }
+    entries_.insert(negativeKey(domain, kind == Negative::NXDomain ? DNSMessage::RecordType::ANY : type), {}, ttl);
+}
+
+DNSCache::Negative DNSCache::findNegative(const std::string& domain, DNSMessage::RecordType type,
+                                          uint32_t& remaining_ttl) const {
+    if (View view = entries_.find(negativeKey(domain, DNSMessage::RecordType::ANY))) {
+        remaining_ttl = remainingTTL(view);
+        return Negative::NXDomain;
+    }
+    if (View view = entries_.find(negativeKey(domain, type))) {
+        remaining_ttl = remainingTTL(view);
+        return Negative::NoData;
+    }
+    return Negative::None;
+}
+
+std::string DNSCache::recordKey(const std::string& domain, DNSMessage::RecordType type, uint16_t qclass) {
+    std::string key = domain;
+    key += '\0';
+    key += std::to_string(static_cast<uint16_t>(type));
+    key += '/';
+    key += std::to_string(qclass);
+    return key;
+}
+
+DNSCache::RecordShard& DNSCache::recordShard(const std::string& key) const {
+    return record_shards_[std::hash<std::string>()(key) % record_shard_count_];
+}
+
+void DNSCache::addRecords(const std::string& domain, DNSMessage::RecordType type, uint16_t qclass,
+                          const std::vector<DNSMessage::TypedRecord>& records, std::chrono::seconds ttl) {
+    auto clamped = clampTTL(ttl);
+    if (clamped.count() <= 0 || records.empty()) {
+        return;
+    }
+    std::string key = recordKey(domain, type, qclass);
+    RecordSet set{records, ShardedCache::coarseNow() + clamped};
+    RecordShard& shard = recordShard(key);
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    if (record_shard_capacity_ && shard.sets.size() >= record_shard_capacity_ && !shard.sets.count(key)) {
+        // Full: of a few sets, drop the one closest to expiry
+        auto victim = shard.sets.begin();
+        size_t sampled = 0;
+        for (auto it = victim; it != shard.sets.end() && sampled < EVICTION_SAMPLES; ++it, ++sampled) {
+            if (it->second.expiry < victim->second.expiry) victim = it;
         }
+        shard.sets.erase(victim);
+        record_evictions_.fetch_add(1, std::memory_order_relaxed);
+    }
+    shard.sets[std::move(key)] = std::move(set);
+}
+
+bool DNSCache::findRecords(const std::string& domain, DNSMessage::RecordType type, uint16_t qclass,
+                           std::vector<DNSMessage::TypedRecord>& records, uint32_t& remaining_ttl) const {
+    const std::string key = recordKey(domain, type, qclass);
+    const RecordShard& shard = recordShard(key);
+    const auto now = ShardedCache::coarseNow();
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    auto found = shard.sets.find(key);
+    if (found == shard.sets.end() || found->second.expiry <= now) {
+        return false;
+    }
+    records = found->second.records;
+    auto left = std::chrono::duration_cast<std::chrono::seconds>(found->second.expiry - now);
+    remaining_ttl = static_cast<uint32_t>(std::max<int64_t>(left.count(), 1));
+    return true;
+}
+
+bool DNSCache::saveSnapshot(const std::string& path, std::string& error) const {
+    const auto now = ShardedCache::coarseNow();
+    const int64_t wall_now = wallMillis();
+    std::vector<uint8_t> out(sizeof(SnapshotHeader));
+    uint64_t count = 0;
+    entries_.forEach([&](std::string_view key, const View& view) {
+        if (view.expired() || key.size() > UINT16_MAX) return;
+        SnapshotEntry entry{};
+        entry.expires_ms =
+            wall_now + std::chrono::duration_cast<std::chrono::milliseconds>(view.expiry() - now).count();
+        entry.ttl = view.ttl();
+        entry.key_length = static_cast<uint16_t>(key.size());
+        size_t ipv4 = 0;
+        while (ipv4 < view.size() && !view.isIPv6(ipv4)) ++ipv4;
+        entry.ipv4_count = static_cast<uint8_t>(ipv4);
+        entry.ipv6_count = static_cast<uint8_t>(view.size() - ipv4);
+        const size_t address_bytes = 4 * ipv4 + 16 * (view.size() - ipv4);
+
+        size_t offset = out.size();
+        out.resize(offset + sizeof(entry) + key.size() + address_bytes);
+        std::memcpy(&out[offset], &entry, sizeof(entry));
+        std::memcpy(&out[offset + sizeof(entry)], key.data(), key.size());
+        // The addresses are packed back to back in the entry
+        if (address_bytes) std::memcpy(&out[offset + sizeof(entry) + key.size()], view.addressBytes(0), address_bytes);
+        ++count;
+    });
+    SnapshotHeader header{};
+    std::memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+    header.version = SNAPSHOT_VERSION;
+    header.byte_order = BYTE_ORDER_MARK;
+    header.entries = count;
+    header.written_ms = wall_now;
+    std::memcpy(out.data(), &header, sizeof(header));
+
+    // Written aside and renamed over, so a crash never leaves half a snapshot
+    const std::string temporary = path + ".tmp";
+    int fd = open(temporary.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        error = "cannot create " + temporary + ": " + std::strerror(errno);
+        return false;
+    }
+    size_t written = 0;
+    while (written < out.size()) {
+        ssize_t n = write(fd, out.data() + written, out.size() - written);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+        written += static_cast<size_t>(n);
+    }
+    bool ok = written == out.size() && fsync(fd) == 0;
+    int saved_errno = errno;
+    close(fd);
+    if (!ok || rename(temporary.c_str(), path.c_str()) != 0) {
+        error = "cannot write " + path + ": " + std::strerror(ok ? errno : saved_errno);
+        unlink(temporary.c_str());
+        return false;
+    }
+    return true;
+}
+
+size_t DNSCache::loadSnapshot(const std::string& path, std::string& error) {
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        if (errno != ENOENT) error = "cannot open " + path + ": " + std::strerror(errno);
+        return 0;
     }
-}
\ No newline at end of file
+    struct stat info;
+    if (fstat(fd, &info) != 0 || static_cast<size_t>(info.st_size) < sizeof(SnapshotHeader)) {
+        close(fd);
+        error = path + " is not a cache snapshot";
+        return 0;
+    }
+    const size_t size = static_cast<size_t>(info.st_size);
+    void* mapping = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED) {
+        error = "cannot map " + path + ": " + std::strerror(errno);
+        return 0;
+    }
+    madvise(mapping, size, MADV_SEQUENTIAL);
+    const uint8_t* data = static_cast<const uint8_t*>(mapping);
+
+    SnapshotHeader header;
+    std::memcpy(&header, data, sizeof(header));
+    size_t added = 0;
+    if (std::memcmp(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic)) != 0 ||
+        header.byte_order != BYTE_ORDER_MARK) {
+        error = path + " is not a cache snapshot";
+    } else if (header.version != SNAPSHOT_VERSION) {
+        error = path + " is snapshot version " + std::to_string(header.version) + ", expected " +
+                std::to_string(SNAPSHOT_VERSION);
+    } else if (header.entries > (size - sizeof(header)) / sizeof(SnapshotEntry)) {
+        // The count sizes the reservation, so it must fit in the file
+        error = path + " claims " + std::to_string(header.entries) + " entries, more than it can hold";
+    } else {
+        entries_.reserve(entries_.size() + header.entries);
+        const auto now = ShardedCache::coarseNow();
+        const int64_t wall_now = wallMillis();
+        size_t offset = sizeof(header);
+        uint64_t read = 0;
+        for (; read < header.entries; ++read) {
+            SnapshotEntry entry;
+            if (size - offset < sizeof(entry)) break;
+            std::memcpy(&entry, data + offset, sizeof(entry));
+            const size_t bytes = entry.key_length + 4 * entry.ipv4_count + 16 * entry.ipv6_count;
+            if (size - offset - sizeof(entry) < bytes) break;
+            const char* key = reinterpret_cast<const char*>(data + offset + sizeof(entry));
+            const uint8_t* addresses = data + offset + sizeof(entry) + entry.key_length;
+            offset += sizeof(entry) + bytes;
+
+            const int64_t left = entry.expires_ms - wall_now;
+            if (left <= 0) continue;
+            entries_.insert(std::string_view(key, entry.key_length), addresses, entry.ipv4_count,
+                            addresses + 4 * entry.ipv4_count, entry.ipv6_count,
+                            now + std::chrono::milliseconds(left), entry.ttl);
+            ++added;
+        }
+        if (read < header.entries) error = path + " is truncated";
+    }
+    munmap(mapping, size);
+    return added;
+}
+
+bool DNSCache::removeEntry(const std::string& domain) {
+    return entries_.erase(domain);
+}
+
+size_t DNSCache::cleanup() {
+    size_t removed = entries_.removeExpired(options_.serve_stale ? options_.max_stale : std::chrono::seconds(0));
+    const auto now = ShardedCache::coarseNow();
+    for (size_t i = 0; i < record_shard_count_; ++i) {
+        RecordShard& shard = record_shards_[i];
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        for (auto it = shard.sets.begin(); it != shard.sets.end();) {
+            if (it->second.expiry <= now) {
+                it = shard.sets.erase(it);
+                ++removed;
+            } else {
+                ++it;
+            }
+        }
+    }
+    return removed;
+}
+
+void DNSCache::clear() {
+    entries_.clear();
+    for (size_t i = 0; i < record_shard_count_; ++i) {
+        std::lock_guard<std::mutex> lock(record_shards_[i].mutex);
+        record_shards_[i].sets.clear();
+    }
+}
+
+uint64_t DNSCache::evictions() const {
+    return entries_.evictions() + record_evictions_.load(std::memory_order_relaxed);
+}
+
+size_t DNSCache::size() const {
+    size_t total = entries_.size();
+    for (size_t i = 0; i < record_shard_count_; ++i) {
+        std::lock_guard<std::mutex> lock(record_shards_[i].mutex);
+        total += record_shards_[i].sets.size();
+    }
+    return total;
+}
@@ -0,0 +1,432 @@
+#include "DNSMessage.h"
+#include <arpa/inet.h>
+#include <algorithm>
+#include <cstring>
+#include <utility>
+
+namespace {
+
+constexpr int MAX_POINTER_HOPS = 64;
+constexpr size_t MAX_LABELS = 128;
+
+const std::pair<const char*, DNSMessage::RecordType> TYPE_NAMES[] = {
+    {"A", DNSMessage::RecordType::A},     {"AAAA", DNSMessage::RecordType::AAAA},
+    {"NS", DNSMessage::RecordType::NS},   {"CNAME", DNSMessage::RecordType::CNAME},
+    {"PTR", DNSMessage::RecordType::PTR}, {"MX", DNSMessage::RecordType::MX},
+    {"TXT", DNSMessage::RecordType::TXT}, {"SRV", DNSMessage::RecordType::SRV},
+    {"SOA", DNSMessage::RecordType::SOA}, {"ANY", DNSMessage::RecordType::ANY},
+};
+
+inline char lowerASCII(char c) {
+    return (c >= 'A' && c <= 'Z') ? static_cast<char>(c + ('a' - 'A')) : c;
+}
+
+// Records the offset of every label of the name at offset, following
+// compression pointers. Pointers may only point backwards, which together
+// with the hop limit rules out loops. Returns the label count or -1.
+int collectLabels(const uint8_t* msg, size_t len, size_t offset, size_t* labels) {
+    int count = 0;
+    int hops = 0;
+    size_t total = 0;
+    while (offset < len) {
+        uint8_t l = msg[offset];
+        if ((l & 0xC0) == 0xC0) {
+            if (offset + 1 >= len || ++hops > MAX_POINTER_HOPS) return -1;
+            size_t target = (static_cast<size_t>(l & 0x3F) << 8) | msg[offset + 1];
+            if (target >= offset) return -1;
+            offset = target;
+            continue;
+        }
+        if ((l & 0xC0) != 0) return -1;  // Extended label types are not supported
+        if (l == 0) return count;
+        if (offset + 1 + l > len || count == static_cast<int>(MAX_LABELS)) return -1;
+        total += l + 1;
+        if (total > DNSMessage::MAX_NAME_LENGTH) return -1;
+        labels[count++] = offset;
+        offset += 1 + l;
+    }
+    return -1;
+}
+
+// Compares label `label` of a message against `len` bytes of a dotted name.
+bool labelEquals(const uint8_t* msg, size_t label, const char* text, size_t len) {
+    if (msg[label] != len) return false;
+    const char* p = reinterpret_cast<const char*>(msg + label + 1);
+    for (size_t i = 0; i < len; ++i) {
+        if (lowerASCII(p[i]) != lowerASCII(text[i])) return false;
+    }
+    return true;
+}
+
+// Splits a dotted name (trailing dot ignored) into label start/length pairs.
+int splitDotted(const std::string& dotted, size_t* starts, size_t* lengths) {
+    size_t end = dotted.size();
+    if (end > 0 && dotted[end - 1] == '.') --end;
+    if (end == 0) return 0;
+    int count = 0;
+    size_t start = 0;
+    while (start <= end) {
+        size_t dot = dotted.find('.', start);
+        if (dot == std::string::npos || dot > end) dot = end;
+        if (count == static_cast<int>(MAX_LABELS)) return -1;
+        starts[count] = start;
+        lengths[count] = dot - start;
+        ++count;
+        start = dot + 1;
+    }
+    return count;
+}
+
+}  // namespace
+
+// ---------------------------------------------------------------------------
+// Name
+
+size_t DNSMessage::Name::copyTo(char* out, size_t capacity) const {
+    size_t labels[MAX_LABELS];
+    int count = valid() ? collectLabels(message_, length_, offset_, labels) : -1;
+    if (count < 0) return 0;
+    size_t pos = 0;
+    for (int i = 0; i < count; ++i) {
+        uint8_t l = message_[labels[i]];
+        if (pos + l + 1 > capacity) return 0;
+        if (i > 0) out[pos++] = '.';
+        std::memcpy(out + pos, message_ + labels[i] + 1, l);
+        pos += l;
+    }
+    if (pos < capacity) out[pos] = '\0';
+    return pos;
+}
+
+std::string DNSMessage::Name::toString() const {
+    char buffer[MAX_NAME_LENGTH + 1];
+    size_t len = copyTo(buffer, sizeof(buffer));
+    return std::string(buffer, len);
+}
+
+bool DNSMessage::Name::equals(const std::string& dotted) const {
+    size_t labels[MAX_LABELS];
+    int count = valid() ? collectLabels(message_, length_, offset_, labels) : -1;
+    if (count < 0) return false;
+    size_t starts[MAX_LABELS], lengths[MAX_LABELS];
+    int other = splitDotted(dotted, starts, lengths);
+    if (other != count) return false;
+    for (int i = 0; i < count; ++i) {
+        if (!labelEquals(message_, labels[i], dotted.data() + starts[i], lengths[i])) return false;
+    }
+    return true;
+}
+
+bool DNSMessage::Name::equals(const Name& other) const {
+    size_t a[MAX_LABELS], b[MAX_LABELS];
+    int na = valid() ? collectLabels(message_, length_, offset_, a) : -1;
+    int nb = other.valid() ? collectLabels(other.message_, other.length_, other.offset_, b) : -1;
+    if (na < 0 || na != nb) return false;
+    for (int i = 0; i < na; ++i) {
+        const char* text = reinterpret_cast<const char*>(other.message_ + b[i] + 1);
+        if (!labelEquals(message_, a[i], text, other.message_[b[i]])) return false;
+    }
+    return true;
+}
+
+bool DNSMessage::Name::isSubdomainOf(const std::string& dotted) const {
+    size_t labels[MAX_LABELS];
+    int count = valid() ? collectLabels(message_, length_, offset_, labels) : -1;
+    if (count < 0) return false;
+    size_t starts[MAX_LABELS], lengths[MAX_LABELS];
+    int other = splitDotted(dotted, starts, lengths);
+    if (other < 0 || other > count) return false;
+    int skip = count - other;
+    for (int i = 0; i < other; ++i) {
+        if (!labelEquals(message_, labels[skip + i], dotted.data() + starts[i], lengths[i])) {
+            return false;
+        }
+    }
+    return true;
+}
+
+size_t DNSMessage::Name::labelCount() const {
+    size_t labels[MAX_LABELS];
+    int count = valid() ? collectLabels(message_, length_, offset_, labels) : -1;
+    return count < 0 ? 0 : static_cast<size_t>(count);
+}
+
+// ---------------------------------------------------------------------------
+// ResourceRecord
+
+size_t DNSMessage::ResourceRecord::addressToString(char* out, size_t capacity) const {
+    if (type == RecordType::A && rdlength == 4) {
+        if (inet_ntop(AF_INET, rdata, out, static_cast<socklen_t>(capacity)) == nullptr) return 0;
+    } else if (type == RecordType::AAAA && rdlength == 16) {
+        if (inet_ntop(AF_INET6, rdata, out, static_cast<socklen_t>(capacity)) == nullptr) return 0;
+    } else {
+        return 0;
+    }
+    return std::strlen(out);
+}
+
+std::string DNSMessage::ResourceRecord::addressToString() const {
+    char buffer[INET6_ADDRSTRLEN];
+    size_t len = addressToString(buffer, sizeof(buffer));
+    return std::string(buffer, len);
+}
+
+// ---------------------------------------------------------------------------
+// Parser
+
+DNSMessage::Parser::Parser(const uint8_t* data, size_t length)
+    : data_(data), length_(length) {}
+
+bool DNSMessage::Parser::parseHeader() {
+    if (length_ < HEADER_SIZE) {
+        failed_ = true;
+        return false;
+    }
+    header_.id = readU16(data_);
+    header_.flags = readU16(data_ + 2);
+    header_.qdcount = readU16(data_ + 4);
+    header_.ancount = readU16(data_ + 6);
+    header_.nscount = readU16(data_ + 8);
+    header_.arcount = readU16(data_ + 10);
+    offset_ = HEADER_SIZE;
+    section_ = Section::Question;
+    remaining_ = header_.qdcount;
+    return true;
+}
+
+bool DNSMessage::Parser::advanceSection() {
+    while (remaining_ == 0) {
+        switch (section_) {
+        case Section::Question:
+            section_ = Section::Answer;
+            remaining_ = header_.ancount;
+            break;
+        case Section::Answer:
+            section_ = Section::Authority;
+            remaining_ = header_.nscount;
+            break;
+        case Section::Authority:
+            section_ = Section::Additional;
+            remaining_ = header_.arcount;
+            break;
+        default:
+            section_ = Section::End;
+            return false;
+        }
+    }
+    return true;
+}
+
+bool DNSMessage::Parser::nextQuestion(Question& question) {
+    if (failed_ || section_ != Section::Question || remaining_ == 0) return false;
+    size_t end = skipName(data_, length_, offset_);
+    if (end == 0 || end + 4 > length_) {
+        failed_ = true;
+        return false;
+    }
+    question.name = Name(data_, length_, offset_);
+    question.type = static_cast<RecordType>(readU16(data_ + end));
+    question.qclass = readU16(data_ + end + 2);
+    offset_ = end + 4;
+    --remaining_;
+    return true;
+}
+
+bool DNSMessage::Parser::nextRecord(ResourceRecord& record) {
+    if (failed_) return false;
+    while (section_ == Section::Question && remaining_ > 0) {
+        Question skipped;
+        if (!nextQuestion(skipped)) return false;
+    }
+    if (!advanceSection()) return false;
+
+    size_t end = skipName(data_, length_, offset_);
+    if (end == 0 || end + 10 > length_) {
+        failed_ = true;
+        return false;
+    }
+    record.name = Name(data_, length_, offset_);
+    record.type = static_cast<RecordType>(readU16(data_ + end));
+    record.rclass = readU16(data_ + end + 2);
+    record.ttl = readU32(data_ + end + 4);
+    record.rdlength = readU16(data_ + end + 8);
+    record.section = section_;
+    size_t rdata = end + 10;
+    if (rdata + record.rdlength > length_) {
+        failed_ = true;
+        return false;
+    }
+    record.rdata = data_ + rdata;
+    record.target_ = Name();
+    if (record.type == RecordType::CNAME || record.type == RecordType::NS ||
+        record.type == RecordType::PTR) {
+        size_t target_end = skipName(data_, length_, rdata);
+        if (target_end == 0 || target_end > rdata + record.rdlength) {
+            failed_ = true;
+            return false;
+        }
+        record.target_ = Name(data_, length_, rdata);
+    }
+    offset_ = rdata + record.rdlength;
+    --remaining_;
+    return true;
+}
+
+// ---------------------------------------------------------------------------
+// Encoding
+
+size_t DNSMessage::skipName(const uint8_t* message, size_t length, size_t offset) {
+    size_t labels[MAX_LABELS];
+    if (collectLabels(message, length, offset, labels) < 0) return 0;
+    // Only the bytes up to the first pointer (or the root label) belong to
+    // this occurrence of the name.
+    while (offset < length) {
+        uint8_t l = message[offset];
+        if ((l & 0xC0) == 0xC0) return offset + 2;
+        if (l == 0) return offset + 1;
+        offset += 1 + l;
+    }
+    return 0;
+}
+
+bool DNSMessage::soaMinimum(const uint8_t* message, size_t length, const ResourceRecord& record,
+                            uint32_t& minimum) {
+    if (record.type != RecordType::SOA || record.rdata < message || record.rdata + record.rdlength > message + length) {
+        return false;
+    }
+    // MNAME and RNAME, then SERIAL, REFRESH, RETRY, EXPIRE and MINIMUM
+    size_t end = static_cast<size_t>(record.rdata - message) + record.rdlength;
+    size_t offset = skipName(message, length, static_cast<size_t>(record.rdata - message));
+    if (offset == 0 || (offset = skipName(message, length, offset)) == 0 || offset + 20 != end) {
+        return false;
+    }
+    minimum = readU32(message + offset + 16);
+    return true;
+}
+
+bool DNSMessage::decodeRecord(const uint8_t* message, size_t length, const ResourceRecord& record,
+                              TypedRecord& out) {
+    if (record.rdata < message || record.rdata + record.rdlength > message + length) {
+        return false;
+    }
+    const size_t start = static_cast<size_t>(record.rdata - message);
+    const size_t end = start + record.rdlength;
+    // A name filling the rest of the rdata, from offset on
+    auto nameAt = [&](size_t offset) {
+        size_t name_end = skipName(message, length, offset);
+        if (name_end == 0 || name_end != end) return false;
+        out.data = Name(message, length, offset).toString();
+        return true;
+    };
+
+    out.type = record.type;
+    out.ttl = record.ttl;
+    out.data.clear();
+    out.priority = out.weight = out.port = 0;
+    out.strings.clear();
+    switch (record.type) {
+    case RecordType::A:
+    case RecordType::AAAA:
+        out.data = record.addressToString();
+        return !out.data.empty();
+    case RecordType::CNAME:
+    case RecordType::NS:
+    case RecordType::PTR:
+        return nameAt(start);
+    case RecordType::MX:
+        if (record.rdlength < 3) return false;
+        out.priority = readU16(record.rdata);
+        return nameAt(start + 2);
+    case RecordType::SRV:
+        if (record.rdlength < 7) return false;
+        out.priority = readU16(record.rdata);
+        out.weight = readU16(record.rdata + 2);
+        out.port = readU16(record.rdata + 4);
+        return nameAt(start + 6);
+    case RecordType::TXT:
+        for (size_t offset = start; offset < end;) {
+            size_t string_length = message[offset];
+            if (offset + 1 + string_length > end) return false;
+            out.strings.emplace_back(reinterpret_cast<const char*>(message + offset + 1), string_length);
+            out.data += out.strings.back();
+            offset += 1 + string_length;
+        }
+        return !out.strings.empty();
+    default:
+        return false;
+    }
+}
+
+size_t DNSMessage::encodeName(uint8_t* buffer, size_t capacity, const std::string& name) {
+    size_t starts[MAX_LABELS], lengths[MAX_LABELS];
+    int count = splitDotted(name, starts, lengths);
+    if (count < 0) return 0;
+    size_t pos = 0;
+    for (int i = 0; i < count; ++i) {
+        if (lengths[i] == 0 || lengths[i] > MAX_LABEL_LENGTH) return 0;
+        if (pos + 1 + lengths[i] + 1 > capacity || pos + 1 + lengths[i] + 1 > MAX_NAME_LENGTH) {
+            return 0;
+        }
+        buffer[pos++] = static_cast<uint8_t>(lengths[i]);
+        std::memcpy(buffer + pos, name.data() + starts[i], lengths[i]);
+        pos += lengths[i];
+    }
+    if (pos + 1 > capacity) return 0;
+    buffer[pos++] = 0;
+    return pos;
+}
+
+size_t DNSMessage::buildQuery(uint8_t* buffer, size_t capacity, uint16_t id,
+                              const std::string& name, RecordType type,
+                              bool recursion_desired, bool edns) {
+    if (capacity < HEADER_SIZE) return 0;
+    std::memset(buffer, 0, HEADER_SIZE);
+    writeU16(buffer, id);
+    writeU16(buffer + 2, recursion_desired ? 0x0100 : 0x0000);
+    writeU16(buffer + 4, 1);
+    writeU16(buffer + 10, edns ? 1 : 0);
+
+    size_t pos = HEADER_SIZE;
+    size_t name_len = encodeName(buffer + pos, capacity - pos, name);
+    if (name_len == 0 || pos + name_len + 4 > capacity) return 0;
+    pos += name_len;
+    writeU16(buffer + pos, static_cast<uint16_t>(type));
+    writeU16(buffer + pos + 2, CLASS_IN);
+    pos += 4;
+
+    if (edns) {
+        // Root owner, TYPE=OPT, CLASS=payload size, TTL=ext-rcode/flags, RDLEN=0
+        if (pos + 11 > capacity) return 0;
+        buffer[pos] = 0;
+        writeU16(buffer + pos + 1, static_cast<uint16_t>(RecordType::OPT));
+        writeU16(buffer + pos + 3, EDNS_UDP_SIZE);
+        writeU32(buffer + pos + 5, 0);
+        writeU16(buffer + pos + 9, 0);
+        pos += 11;
+    }
+    return pos;
+}
+
+bool DNSMessage::parseType(const std::string& text, RecordType& type) {
+    for (const auto& entry : TYPE_NAMES) {
+        if (text.size() == std::strlen(entry.first) &&
+            std::equal(text.begin(), text.end(), entry.first,
+                       [](char a, char b) { return lowerASCII(a) == lowerASCII(b); })) {
+            type = entry.second;
+            return true;
+        }
+    }
+    return false;
+}
+
+const char* DNSMessage::rcodeName(RCode rcode) {
+    switch (rcode) {
+    case RCode::NoError: return "NOERROR";
+    case RCode::FormErr: return "FORMERR";
+    case RCode::ServFail: return "SERVFAIL";
+    case RCode::NXDomain: return "NXDOMAIN";
+    case RCode::NotImp: return "NOTIMP";
+    case RCode::Refused: return "REFUSED";
+    }
+    return "UNKNOWN";
+}
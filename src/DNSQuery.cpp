@@ -1,6 +1,7 @@
 #include "DNSQuery.h"
-#include <Poco/Net/NetException.h>
-#include <Poco/Net/IPAddress.h>
+#include "ResolverMetrics.h"
+#include "TCPPool.h"
+#include "UDPTransport.h"
 #include<bits/stdc++.h>
 
 const std::vector<std::string> DNSQuery::ROOT_SERVERS = {
@@ -9,58 +10,530 @@ const std::vector<std::string> DNSQuery::ROOT_SERVERS = {
     "192.33.4.12"    // c.root-servers.net
 };
 
+namespace {
+
+constexpr int MAX_CNAME_CHAIN = 16;
+
+}  // namespace
+
 DNSQuery::QueryResult DNSQuery::performQuery(const std::string& domain) {
+    RetransmitSchedule::Policy policy;
+    policy.timeout = DEFAULT_TIMEOUT;
+    return performQuery(domain, UDPTransport::systemNameservers(), policy);
+}
+
+DNSQuery::QueryResult DNSQuery::performQuery(const std::string& domain,
+                                             const std::vector<std::string>& servers,
+                                             const RetransmitSchedule::Policy& policy) {
+    const auto start = RetransmitSchedule::Clock::now();
+    QueryResult result = queryType(domain, DNSMessage::RecordType::A, servers, policy);
+    if (result.rcode == DNSMessage::RCode::NXDomain) {
+        return result;
+    }
+
+    // The AAAA lookup gets whatever the A lookup left of the timeout
+    RetransmitSchedule::Policy rest = policy;
+    rest.timeout = std::max(std::chrono::milliseconds(0),
+                            policy.timeout - std::chrono::duration_cast<std::chrono::milliseconds>(
+                                                 RetransmitSchedule::Clock::now() - start));
+    QueryResult v6 = queryType(domain, DNSMessage::RecordType::AAAA, servers, rest);
+    mergeAddresses(result, v6);
+    if (result.success) {
+        result.error_message.clear();
+    } else if (result.error_message.empty()) {
+        result.error_message = v6.error_message;
+    }
+    return result;
+}
+
+void DNSQuery::mergeAddresses(QueryResult& result, const QueryResult& v6) {
+    if (result.rcode == DNSMessage::RCode::NXDomain || v6.rcode == DNSMessage::RCode::NXDomain) {
+        // The name does not exist, whichever half found out
+        if (result.rcode != DNSMessage::RCode::NXDomain) result.negative_ttl = v6.negative_ttl;
+        result.rcode = DNSMessage::RCode::NXDomain;
+        result.answered = true;
+    } else {
+        // No data only if both halves came back empty
+        bool empty = result.ip_addresses.empty() && v6.ip_addresses.empty();
+        result.negative_ttl = empty ? std::min(result.negative_ttl, v6.negative_ttl) : 0;
+        result.answered = result.answered || v6.answered;
+    }
+    if (!v6.ip_addresses.empty()) {
+        result.ttl = result.ip_addresses.empty() ? v6.ttl : std::min(result.ttl, v6.ttl);
+        result.ip_addresses.insert(result.ip_addresses.end(),
+                                   v6.ip_addresses.begin(), v6.ip_addresses.end());
+    }
+    result.success = !result.ip_addresses.empty();
+}
+
+DNSQuery::QueryResult DNSQuery::queryType(const std::string& domain,
+                                          DNSMessage::RecordType type,
+                                          const std::vector<std::string>& servers,
+                                          const RetransmitSchedule::Policy& policy,
+                                          bool recursion_desired, bool typed) {
     QueryResult result;
     result.success = false;
 
-    try {
-        std::cout << "Attempting to resolve domain: " << domain << std::endl;
-        Poco::Net::HostEntry hostEntry = Poco::Net::DNS::resolve(domain);
+    uint8_t response[4096];
+    size_t response_length = 0;
+    if (!exchange(domain, type, servers, UDPTransport::DNS_PORT, policy, recursion_desired,
+                  response, sizeof(response), response_length, result)) {
+        return result;
+    }
+    parseResponse(response, response_length, domain, type, result, typed);
+    if (!result.success) {
+        result.error_message = result.rcode == DNSMessage::RCode::NoError
+                                   ? "No data for " + domain
+                                   : std::string(DNSMessage::rcodeName(result.rcode)) + " for " + domain;
+    }
+    return result;
+}
+
+bool DNSQuery::exchange(const std::string& domain, DNSMessage::RecordType type,
+                        const std::vector<std::string>& servers, uint16_t port,
+                        const RetransmitSchedule::Policy& policy, bool recursion_desired,
+                        uint8_t* response, size_t capacity, size_t& response_length,
+                        QueryResult& failure) {
+    using Clock = RetransmitSchedule::Clock;
+    ResolverMetrics* metrics = policy.metrics;
+    const auto started = Clock::now();
+
+    uint8_t query[DNSMessage::MAX_UDP_SIZE];
+    size_t query_length = DNSMessage::buildQuery(query, sizeof(query), UDPTransport::randomId(),
+                                                 domain, type, recursion_desired);
+    if (query_length == 0) {
+        failure.rcode = DNSMessage::RCode::FormErr;
+        failure.error_message = "Invalid domain name: " + domain;
+        return false;
+    }
 
-        const auto& addresses = hostEntry.addresses();
-        for (const auto& addr : addresses) {
-            result.ip_addresses.push_back(addr.toString());
+    std::vector<UDPTransport::ServerAddress> addresses;
+    std::vector<std::string> keys;
+    for (const auto& server : servers) {
+        UDPTransport::ServerAddress address;
+        if (!UDPTransport::ServerAddress::parse(server, port, address)) {
+            failure.error_message = "Invalid server address: " + server;
+            continue;
         }
-        result.success = true;
-        std::cout << "Successfully resolved domain: " << domain << std::endl;
+        addresses.push_back(address);
+        keys.push_back(address.toString());
     }
-    catch (const Poco::Exception& e) {
-        result.error_message = e.displayText();
-        std::cerr << "Error resolving " << domain << ": " << e.displayText() << std::endl;
+    if (addresses.empty()) {
+        if (servers.empty()) failure.error_message = "No servers to query for " + domain;
+        return false;
     }
 
-    return result;
-}
+    bool rejected = false;
+    Clock::duration parsing{0};
+    auto accept = [&](size_t server, const uint8_t* data, size_t length) {
+        const auto parse_start = Clock::now();
+        QueryResult check;
+        check.success = false;
+        bool parsed = parseResponse(data, length, domain, type, check);
+        parsing += Clock::now() - parse_start;
+        if (parsed && metrics) metrics->upstreamRcode(keys[server], static_cast<uint8_t>(check.rcode));
+        if (!parsed) {
+            failure.error_message = "Malformed response from " + keys[server];
+        } else if (check.rcode == DNSMessage::RCode::ServFail || check.rcode == DNSMessage::RCode::Refused) {
+            failure.rcode = check.rcode;
+            failure.error_message = std::string(DNSMessage::rcodeName(check.rcode)) + " from " + keys[server];
+        } else {
+            return true;
+        }
+        rejected = true;
+        return false;
+    };
 
-DNSQuery::QueryResult DNSQuery::performRecursiveQuery(const std::string& domain) {
-    auto result = performQuery(domain);
-    if (result.success) {
-        return result;
+    RetransmitSchedule schedule(keys, policy);
+    const auto sending = Clock::now();
+    size_t answered_by = 0;
+    auto status = UDPTransport::exchange(addresses, query, query_length, response, capacity,
+                                         response_length, schedule, accept, &answered_by);
+    if (status == UDPTransport::Status::Ok && (DNSMessage::readU16(response + 2) & 0x0200)) {
+        // Truncated: ask the same server again over TCP, on a pooled
+        // connection, within what is left of the deadline
+        std::vector<uint8_t> full;
+        auto tcp = TCPPool::global().exchange(addresses[answered_by], query, query_length, full,
+                                              schedule.deadline());
+        if (tcp != TCPPool::Status::Ok) {
+            failure.error_message = "Truncated answer from " + keys[answered_by] + " and no answer over TCP";
+            status = UDPTransport::Status::NetworkError;
+            rejected = true;
+        } else if (full.size() > capacity) {
+            failure.error_message = "Answer from " + keys[answered_by] + " too large";
+            status = UDPTransport::Status::NetworkError;
+            rejected = true;
+        } else if (!accept(answered_by, full.data(), full.size())) {
+            status = UDPTransport::Status::NetworkError;
+        } else {
+            std::memcpy(response, full.data(), full.size());
+            response_length = full.size();
+        }
+    }
+    if (metrics) {
+        metrics->recordStage(ResolverMetrics::Stage::Send, sending - started);
+        metrics->recordStage(ResolverMetrics::Stage::Wait, Clock::now() - sending - parsing);
+        metrics->recordStage(ResolverMetrics::Stage::Parse, parsing);
+    }
+    if (status == UDPTransport::Status::Ok) {
+        return true;
+    }
+    if (status == UDPTransport::Status::Timeout) {
+        std::string list;
+        for (const auto& key : keys) list += (list.empty() ? "" : ", ") + key;
+        failure.error_message = "Timeout from " + list;
+    } else if (!rejected) {
+        failure.error_message = "Network error querying " + domain;
     }
+    return false;
+}
 
-    for (const auto& root_server : ROOT_SERVERS) {
-        try {
-            std::cout << "Attempting to resolve domain using root server: " << root_server << std::endl;
-            Poco::Net::HostEntry hostEntry = Poco::Net::DNS::resolve(domain);
+bool DNSQuery::parseResponse(const uint8_t* data, size_t length, const std::string& domain,
+                             DNSMessage::RecordType type, QueryResult& result, bool typed) {
+    typed = typed || (type != DNSMessage::RecordType::A && type != DNSMessage::RecordType::AAAA);
+    DNSMessage::Parser parser(data, length);
+    if (!parser.parseHeader() || !parser.header().isResponse() || parser.header().qdcount != 1) {
+        return false;
+    }
+    DNSMessage::Question question;
+    if (!parser.nextQuestion(question) || question.type != type || !question.name.equals(domain)) {
+        return false;
+    }
+    result.rcode = parser.header().rcode();
 
-            const auto& addresses = hostEntry.addresses();
-            if (!addresses.empty()) {
-                result.ip_addresses.clear();
-                for (const auto& addr : addresses) {
-                    result.ip_addresses.push_back(addr.toString());
+    // Answers are usually ordered along the chain, but RFC 1034 does not
+    // require it, so follow CNAMEs by rescanning the answer section.
+    DNSMessage::Name current = question.name;
+    uint32_t ttl = std::numeric_limits<uint32_t>::max();
+    for (int hops = 0; hops <= MAX_CNAME_CHAIN; ++hops) {
+        DNSMessage::Parser answers(data, length);
+        answers.parseHeader();
+        DNSMessage::ResourceRecord record;
+        bool followed = false;
+        bool found = false;
+        while (answers.nextRecord(record) && record.section == DNSMessage::Section::Answer) {
+            if (!record.name.equals(current)) continue;
+            if (record.type == type && typed) {
+                DNSMessage::TypedRecord decoded;
+                if (DNSMessage::decodeRecord(data, length, record, decoded)) {
+                    result.records.push_back(std::move(decoded));
+                    ttl = std::min(ttl, record.ttl);
+                    found = true;
                 }
-                result.success = true;
-                std::cout << "Successfully resolved domain using root server: " << root_server << std::endl;
-                return result;
+            } else if (record.type == type) {
+                char text[64];
+                size_t n = record.addressToString(text, sizeof(text));
+                if (n > 0) {
+                    result.ip_addresses.emplace_back(text, n);
+                    ttl = std::min(ttl, record.ttl);
+                    found = true;
+                }
+            } else if (record.type == DNSMessage::RecordType::CNAME && !found) {
+                ttl = std::min(ttl, record.ttl);
+                if (typed) result.aliases.push_back({current.toString(), record.targetName().toString(), record.ttl});
+                current = record.targetName();
+                followed = true;
+                break;
             }
         }
-        catch (const Poco::Exception& e) {
-            std::cerr << "Error resolving using root server " << root_server << ": " << e.displayText() << std::endl;
-            continue;
+        if (answers.failed()) return false;
+        if (!followed) break;
+    }
+
+    result.success = !result.ip_addresses.empty() || !result.records.empty();
+    result.ttl = result.success ? ttl : 0;
+    result.answered = result.rcode == DNSMessage::RCode::NoError || result.rcode == DNSMessage::RCode::NXDomain;
+    if (!result.success && result.answered) {
+        result.negative_ttl = negativeTTL(data, length, current, ttl);
+    }
+    return true;
+}
+
+uint32_t DNSQuery::negativeTTL(const uint8_t* data, size_t length, const DNSMessage::Name& name,
+                               uint32_t chain_ttl) {
+    // RFC 2308 section 5: the lesser of the SOA's own TTL and its MINIMUM,
+    // from an SOA for a zone enclosing the (final) name.
+    DNSMessage::Parser parser(data, length);
+    parser.parseHeader();
+    DNSMessage::ResourceRecord record;
+    while (parser.nextRecord(record)) {
+        uint32_t minimum;
+        if (record.section == DNSMessage::Section::Authority && record.type == DNSMessage::RecordType::SOA &&
+            name.isSubdomainOf(record.name.toString()) &&
+            DNSMessage::soaMinimum(data, length, record, minimum)) {
+            return std::min({record.ttl, minimum, chain_ttl});
         }
     }
+    return 0;
+}
+
+// ---------------------------------------------------------------------------
+// Iterative resolution
+
+struct DNSQuery::IterationState {
+    const IterativeOptions& options;
+    bool typed = false;  // Collect records and aliases for the name asked about
+    int queries = 0;
+    RetransmitSchedule::Clock::time_point deadline =
+        RetransmitSchedule::Clock::now() + options.total_timeout;
+};
+
+namespace {
 
+enum class StepKind { CName, Referral, NXDomain, NoData };
+
+struct Step {
+    StepKind kind = StepKind::NoData;
+    std::string target;                 // CNAME target at the end of the chain
+    std::string zone;                   // Delegated zone for referrals
+    size_t zone_labels = 0;
+    std::vector<std::string> ns_names;
+    std::vector<std::string> glue;      // IPv4 glue for ns_names
+    uint32_t ttl = std::numeric_limits<uint32_t>::max();
+};
+
+// Classifies a validated response to (name, type) that carried no usable
+// addresses: CNAME to follow, referral to a closer zone, or a final
+// negative answer.
+Step classify(const uint8_t* data, size_t length, DNSMessage::RecordType type,
+              DNSMessage::RCode rcode) {
+    Step step;
+    DNSMessage::Parser parser(data, length);
+    parser.parseHeader();
+    DNSMessage::Question question;
+    parser.nextQuestion(question);
+
+    // Walk the CNAME chain inside the answer section
+    DNSMessage::Name current = question.name;
+    bool aliased = false;
+    for (int hops = 0; hops < MAX_CNAME_CHAIN; ++hops) {
+        DNSMessage::Parser answers(data, length);
+        answers.parseHeader();
+        DNSMessage::ResourceRecord record;
+        bool followed = false;
+        while (answers.nextRecord(record) && record.section == DNSMessage::Section::Answer) {
+            if (record.type == DNSMessage::RecordType::CNAME && record.name.equals(current)) {
+                step.ttl = std::min(step.ttl, record.ttl);
+                current = record.targetName();
+                aliased = followed = true;
+                break;
+            }
+        }
+        if (!followed) break;
+    }
+    if (aliased && type != DNSMessage::RecordType::CNAME) {
+        step.kind = StepKind::CName;
+        step.target = current.toString();
+        return step;
+    }
+    if (rcode == DNSMessage::RCode::NXDomain) {
+        step.kind = StepKind::NXDomain;
+        return step;
+    }
+
+    // Referral: NS records in the authority section for an ancestor of name.
+    // An authoritative answer is final even if it lists the zone's own NS set.
+    if (parser.header().authoritative()) {
+        return step;
+    }
+    DNSMessage::ResourceRecord record;
+    while (parser.nextRecord(record)) {
+        if (record.section == DNSMessage::Section::Authority &&
+            record.type == DNSMessage::RecordType::NS) {
+            std::string owner = record.name.toString();
+            if (step.zone.empty()) {
+                if (!question.name.isSubdomainOf(owner)) continue;
+                step.zone = owner;
+                step.zone_labels = record.name.labelCount();
+            } else if (!record.name.equals(step.zone)) {
+                continue;
+            }
+            step.ns_names.push_back(record.targetName().toString());
+        } else if (record.section == DNSMessage::Section::Additional &&
+                   record.type == DNSMessage::RecordType::A) {
+            for (const auto& ns : step.ns_names) {
+                if (record.name.equals(ns)) {
+                    step.glue.push_back(record.addressToString());
+                    break;
+                }
+            }
+        }
+    }
+    if (!step.ns_names.empty()) {
+        step.kind = StepKind::Referral;
+    }
+    return step;
+}
+
+std::string lowerCase(std::string name) {
+    std::transform(name.begin(), name.end(), name.begin(),
+                   [](unsigned char c) { return static_cast<char>(std::tolower(c)); });
+    if (!name.empty() && name.back() == '.') name.pop_back();
+    return name;
+}
+
+}  // namespace
+
+RetransmitSchedule::Policy DNSQuery::stepPolicy(const IterationState& state) {
+    RetransmitSchedule::Policy policy;
+    policy.retries = state.options.retries;
+    policy.metrics = state.options.metrics;
+    policy.timeout = std::max(std::chrono::milliseconds(0),
+                              std::min(state.options.timeout,
+                                       std::chrono::duration_cast<std::chrono::milliseconds>(
+                                           state.deadline - RetransmitSchedule::Clock::now())));
+    return policy;
+}
+
+DNSQuery::QueryResult DNSQuery::iterate(const std::string& domain, DNSMessage::RecordType type,
+                                        IterationState& state, int depth,
+                                        std::vector<std::string>* answering_servers,
+                                        std::string* answered_name) {
+    const IterativeOptions& options = state.options;
+    QueryResult result;
     result.success = false;
-    result.error_message = "Unable to resolve domain recursively";
+
+    std::string name = domain;
+    std::set<std::string> seen_names = {lowerCase(name)};
+    uint32_t chain_ttl = std::numeric_limits<uint32_t>::max();
+    std::vector<Alias> followed;  // Links between responses, for typed lookups
+    const bool typed = state.typed && depth == 0;
+    uint8_t response[4096];
+
+    for (int cnames = 0;; ++cnames) {
+        std::vector<std::string> servers =
+            options.root_servers.empty() ? ROOT_SERVERS : options.root_servers;
+        size_t zone_labels = 0;
+        bool restart = false;
+
+        for (int referrals = 0; !restart; ++referrals) {
+            if (referrals > options.max_referrals || state.queries >= options.max_queries) {
+                result.error_message = "Iteration limit reached resolving " + domain;
+                return result;
+            }
+            if (RetransmitSchedule::Clock::now() >= state.deadline) {
+                result.error_message = "Timeout resolving " + domain;
+                return result;
+            }
+            ++state.queries;
+
+            size_t response_length = 0;
+            if (!exchange(name, type, servers, options.port, stepPolicy(state), false,
+                          response, sizeof(response), response_length, result)) {
+                return result;
+            }
+
+            QueryResult answer;
+            answer.success = false;
+            parseResponse(response, response_length, name, type, answer, typed);
+            answer.aliases.insert(answer.aliases.begin(), followed.begin(), followed.end());
+            if (answer.success) {
+                answer.ttl = std::min(answer.ttl, chain_ttl);
+                if (answering_servers) *answering_servers = servers;
+                if (answered_name) *answered_name = name;
+                return answer;
+            }
+
+            Step step = classify(response, response_length, type, answer.rcode);
+            switch (step.kind) {
+            case StepKind::NXDomain:
+            case StepKind::NoData:
+                result.rcode = answer.rcode;
+                result.answered = true;
+                result.negative_ttl = std::min(answer.negative_ttl, chain_ttl);
+                result.aliases = std::move(answer.aliases);
+                result.error_message = std::string(DNSMessage::rcodeName(answer.rcode)) + " for " + domain;
+                if (answering_servers) *answering_servers = servers;
+                if (answered_name) *answered_name = name;
+                return result;
+            case StepKind::CName:
+                if (cnames + 1 > options.max_cname_chain ||
+                    !seen_names.insert(lowerCase(step.target)).second) {
+                    result.error_message = "CNAME loop or chain too long for " + domain;
+                    return result;
+                }
+                chain_ttl = std::min(chain_ttl, step.ttl);
+                if (typed) followed = std::move(answer.aliases);  // Earlier links and this response's
+                name = step.target;
+                restart = true;
+                break;
+            case StepKind::Referral: {
+                // A referral must move strictly closer to the name, otherwise
+                // the servers are lame or pointing at each other.
+                if (step.zone_labels <= zone_labels) {
+                    result.error_message = "Referral loop at zone " + step.zone + " for " + domain;
+                    return result;
+                }
+                zone_labels = step.zone_labels;
+                servers = step.glue;
+                if (servers.empty()) {
+                    if (depth >= options.max_glueless_depth) {
+                        result.error_message = "Glueless delegation too deep for " + domain;
+                        return result;
+                    }
+                    for (const auto& ns : step.ns_names) {
+                        auto ns_result = iterate(ns, DNSMessage::RecordType::A, state, depth + 1,
+                                                 nullptr, nullptr);
+                        if (ns_result.success) {
+                            servers = ns_result.ip_addresses;
+                            break;
+                        }
+                    }
+                    if (servers.empty()) {
+                        result.error_message = "No reachable nameserver for zone " + step.zone;
+                        return result;
+                    }
+                }
+                break;
+            }
+            }
+        }
+    }
+}
+
+DNSQuery::QueryResult DNSQuery::performIterativeQuery(const std::string& domain,
+                                                      DNSMessage::RecordType type,
+                                                      const IterativeOptions& options) {
+    IterationState state{options};
+    state.typed = true;
+    return iterate(domain, type, state, 0, nullptr, nullptr);
+}
+
+DNSQuery::QueryResult DNSQuery::performRecursiveQuery(const std::string& domain) {
+    return performRecursiveQuery(domain, IterativeOptions());
+}
+
+DNSQuery::QueryResult DNSQuery::performRecursiveQuery(const std::string& domain,
+                                                      const IterativeOptions& options) {
+    IterationState state{options};
+    std::vector<std::string> authoritative;
+    std::string final_name;
+    QueryResult result = iterate(domain, DNSMessage::RecordType::A, state, 0,
+                                 &authoritative, &final_name);
+    if (result.rcode == DNSMessage::RCode::NXDomain) {
+        return result;
+    }
+
+    // The AAAA records live in the same zone as the A records (after any
+    // CNAMEs), so ask the servers that answered before walking from the root.
+    QueryResult v6;
+    v6.success = false;
+    if (!authoritative.empty()) {
+        uint8_t response[4096];
+        size_t response_length = 0;
+        if (exchange(final_name, DNSMessage::RecordType::AAAA, authoritative, options.port,
+                     stepPolicy(state), false, response, sizeof(response), response_length, v6)) {
+            parseResponse(response, response_length, final_name, DNSMessage::RecordType::AAAA, v6);
+            if (v6.success) v6.ttl = std::min(v6.ttl, result.success ? result.ttl : v6.ttl);
+        }
+    } else {
+        v6 = iterate(domain, DNSMessage::RecordType::AAAA, state, 0, nullptr, nullptr);
+    }
+    mergeAddresses(result, v6);
+    if (result.success) {
+        result.error_message.clear();
+    } else if (result.error_message.empty()) {
+        result.error_message = "Unable to resolve domain recursively";
+    }
     return result;
-}
\ No newline at end of file
+}
@@ -1,118 +1,1264 @@
 #include "DNSResolver.h"
-#include <Poco/Net/NetException.h>
-#include <Poco/Net/DNS.h>
+#include "AsyncEngine.h"
+#include "DNSQuery.h"
+#include "UDPTransport.h"
+#include <arpa/inet.h>
+#include <algorithm>
+#include <condition_variable>
+#include <cstring>
 #include <iostream>
-#include <thread>
 #include <chrono>
 
+// State shared by the A and AAAA halves of one resolveAsync call
+struct DNSResolver::AsyncLookup {
+    // One address family's query: its retransmit schedule and the
+    // transmissions still waiting for an answer
+    struct Family {
+        std::unique_ptr<RetransmitSchedule> schedule;
+        int outstanding = 0;
+        bool done = false;
+        uint64_t timer = 0;  // Only the latest retransmit timer may fire
+    };
+
+    std::string domain;
+    ResolverOptions options;
+    std::string flight_key;
+    std::vector<UDPTransport::ServerAddress> servers;
+    std::vector<std::string> server_keys;  // RTT estimator keys of servers
+
+    std::mutex mutex;
+    Family families[2];
+    DNSQuery::QueryResult results[2];  // A, AAAA
+    int remaining = 2;
+    bool delivered = false;  // The flight was handed one family's addresses early
+};
+
+// One relayed query: the client's message, passed on as it is
+struct DNSResolver::Relay {
+    std::vector<UDPTransport::ServerAddress> servers;
+    uint8_t query[DNSMessage::MAX_UDP_SIZE];
+    size_t length = 0;
+    RelayCallback callback;
+
+    std::mutex mutex;
+    std::unique_ptr<RetransmitSchedule> schedule;
+    int outstanding = 0;
+    bool done = false;
+    uint64_t timer = 0;
+};
+
+namespace {
+const DNSMessage::RecordType ASYNC_TYPES[2] = {DNSMessage::RecordType::A, DNSMessage::RecordType::AAAA};
+// Flight type for an address lookup (A and AAAA together); 0 is not a real RR type
+const uint16_t ADDRESS_LOOKUP = 0;
+// CNAME links a typed lookup follows, cached and upstream together
+const int MAX_CNAME_LINKS = 16;
+// Finished AsyncLookups kept for reuse; more than this are freed
+const size_t LOOKUP_POOL_SIZE = 256;
+// Threads running recursive walks for async callers and resolveMany
+const size_t RECURSIVE_WORKERS = 16;
+
+using Counter = ResolverMetrics::Counter;
+using Stage = ResolverMetrics::Stage;
+using MetricsClock = ResolverMetrics::Clock;
+
+RetransmitSchedule::Policy retransmitPolicy(const DNSResolver::ResolverOptions& options, ResolverMetrics* metrics) {
+    RetransmitSchedule::Policy policy;
+    policy.metrics = metrics;
+    policy.timeout = std::chrono::seconds(std::max(options.timeout_seconds, 1));
+    policy.retries = std::max(options.retries, 0);
+    policy.race = options.race_upstreams;
+    return policy;
+}
+
+// A TCP retry's outcome, reported as the UDP transmission's would be
+AsyncEngine::Status engineStatus(TCPPool::Status status) {
+    switch (status) {
+    case TCPPool::Status::Ok: return AsyncEngine::Status::Ok;
+    case TCPPool::Status::Timeout: return AsyncEngine::Status::Timeout;
+    case TCPPool::Status::NetworkError: return AsyncEngine::Status::NetworkError;
+    case TCPPool::Status::Shutdown: return AsyncEngine::Status::Shutdown;
+    }
+    return AsyncEngine::Status::NetworkError;
+}
+
+// Status of a local answer; Passthru is never answered locally
+DNSQuery::Status localStatus(const LocalZone::Match& match) {
+    switch (match.action) {
+    case LocalZone::Action::Answer:
+        return match.ipv4_count + match.ipv6_count > 0 ? DNSQuery::Status::Success : DNSQuery::Status::NoData;
+    case LocalZone::Action::NXDomain:
+        return DNSQuery::Status::NXDomain;
+    default:
+        return DNSQuery::Status::NoData;
+    }
+}
+
+DNSQuery::IterativeOptions iterativeOptions(const DNSResolver::ResolverOptions& options, ResolverMetrics* metrics) {
+    DNSQuery::IterativeOptions iterative;
+    iterative.root_servers = options.root_servers;
+    iterative.port = options.iterative_port;
+    iterative.retries = std::max(options.retries, 0);
+    iterative.total_timeout = std::chrono::seconds(std::max(options.timeout_seconds, 1));
+    iterative.metrics = metrics;
+    return iterative;
+}
+}
+
 DNSResolver::DNSResolver() {}
 
+DNSResolver::DNSResolver(const DNSCache::Options& cache_options) : cache_(cache_options) {}
+
+DNSResolver::~DNSResolver() {
+    if (snapshot_thread_.joinable()) {
+        {
+            std::lock_guard<std::mutex> lock(snapshot_mutex_);
+            snapshot_stop_ = true;
+        }
+        snapshot_wake_.notify_one();
+        snapshot_thread_.join();
+        saveSnapshot();
+    }
+    // TCP retries may still hand work to the engine as they fail, and the
+    // engine's final callbacks may still try TCP (which then fails at once)
+    tcp_.stop();
+    // Queued walks may still cache answers below; they must not arm the
+    // sweep on an engine that is gone
+    std::call_once(cleanup_once_, [] {});
+    engine_.reset();
+    {
+        // Queued walks still run, so their waiters are answered
+        std::lock_guard<std::mutex> lock(background_mutex_);
+        background_stop_ = true;
+    }
+    background_wake_.notify_all();
+    for (auto& worker : background_) {
+        worker.join();
+    }
+}
+
 std::vector<std::string> DNSResolver::resolve(const std::string& domain, const ResolverOptions& options) {
-    std::string ascii_domain = convertToASCII(domain);
+    return resolveDetailed(domain, options).ip_addresses;
+}
+
+DNSResolver::ResolveResult DNSResolver::resolveDetailed(const std::string& domain, const ResolverOptions& options) {
+    // Each stage ends where the next begins, so a hit reads the clock 3 times
+    auto clock = MetricsClock::now();
+    const auto start = clock;
+    DomainName ascii_domain = normalize(domain, clock);
+    metrics_.add(Counter::ResolvesStarted);
+
+    ResolveResult result;
+    if (answerLocally(ascii_domain, result)) {
+        metrics_.recordResolve(MetricsClock::now() - start, true);
+        return result;
+    }
+    if (options.use_cache && lookupCache(ascii_domain, options, result, clock)) {
+        countLookup(result);
+        metrics_.recordResolve(clock - start, true);
+        return result;
+    }
+    try {
+        result = resolveMiss(ascii_domain, options);
+    } catch (...) {
+        metrics_.recordResolve(MetricsClock::now() - start, false);
+        throw;
+    }
+    countLookup(result);
+    metrics_.recordResolve(MetricsClock::now() - start, result.from_cache);
+    return result;
+}
+
+void DNSResolver::resolveInto(std::string_view domain, const ResolverOptions& options, ResultBuffer& result) {
+    // resolveDetailed() into reused storage: the name is canonicalized in
+    // place and addresses are formatted straight into the buffer
+    auto clock = MetricsClock::now();
+    const auto start = clock;
+    result.clear();
+    normalize(domain, result.name_, clock);
+    metrics_.add(Counter::ResolvesStarted);
+
+    if (answerLocally(result.name_, result)) {
+        metrics_.recordResolve(MetricsClock::now() - start, true);
+        return;
+    }
+    if (options.use_cache && lookupCache(result.name_, options, result, clock)) {
+        countLookup(result.from_cache, result.stale, result.status);
+        metrics_.recordResolve(clock - start, true);
+        return;
+    }
+    try {
+        result.assign(resolveMiss(result.name_, options));
+    } catch (...) {
+        metrics_.recordResolve(MetricsClock::now() - start, false);
+        throw;
+    }
+    countLookup(result.from_cache, result.stale, result.status);
+    metrics_.recordResolve(MetricsClock::now() - start, result.from_cache);
+}
+
+DNSResolver::ResolveResult DNSResolver::resolveMiss(const DomainName& ascii_domain, const ResolverOptions& options) {
+    ResolveResult result;
+    ResolveResult stale;
+    bool have_stale = options.use_cache && resolveStale(ascii_domain, stale);
+    if (have_stale) {
+        metrics_.add(Counter::CacheExpired);
+    } else if (options.use_cache) {
+        countExpired(ascii_domain);
+    }
 
+    // Only one caller per name goes upstream; the rest wait for its answer
+    std::string key = flightKey(ascii_domain, ADDRESS_LOOKUP, options);
+    auto shared = std::make_shared<std::promise<ResolveResult>>();
+    auto answer = shared->get_future();
+    bool leader = flights_.join(key, [shared](const ResolveResult& r) { shared->set_value(r); });
+
+    if (leader) {
+        // The previous flight may have filled the cache since we looked
+        if (options.use_cache && resolveFromCache(ascii_domain, options, result)) {
+            flights_.complete(key, result);
+            return answer.get();
+        }
+        if (!have_stale && options.recursive) {
+            try {
+                result = lookupUpstream(ascii_domain, options);
+            } catch (...) {
+                flights_.complete(key, ResolveResult());
+                throw;
+            }
+            flights_.complete(key, result);
+            return answer.get();
+        }
+        // Forwarded lookups go through the engine, which sends A and AAAA
+        // at once. A recursive refresh runs in the background, so a slow
+        // upstream can be answered from the stale entry meanwhile.
+        startAsyncLookup(ascii_domain, options, key);
+    }
+
+    if (have_stale && options.stale_answer_timeout_ms > 0 &&
+        answer.wait_for(std::chrono::milliseconds(options.stale_answer_timeout_ms)) != std::future_status::ready) {
+        return stale;
+    }
+    return answer.get();
+}
+
+DNSResolver::ResolveResult DNSResolver::lookupUpstream(const std::string& domain, const ResolverOptions& options) {
+    return completeLookup(domain, options, performRecursiveQuery(domain, options));
+}
+
+DNSResolver::ResolveResult DNSResolver::completeLookup(const std::string& domain, const ResolverOptions& options,
+                                                       DNSQuery::QueryResult answer) {
+    ResolveResult result;
+    result.status = answer.status();
     if (options.use_cache) {
-        auto cached_result = resolveFromCache(ascii_domain);
-        if (!cached_result.empty()) {
-            return cached_result;
+        cacheResult(domain, answer);
+        // Upstream failed outright: an expired answer beats none (RFC 8767)
+        if (result.status == DNSQuery::Status::Failure && resolveStale(DomainName(domain), result)) {
+            return result;
         }
     }
+    result.ip_addresses = std::move(answer.ip_addresses);
+    result.ttl = result.status == DNSQuery::Status::Success ? answer.ttl : answer.negative_ttl;
+    return result;
+}
+
+std::string DNSResolver::flightKey(const std::string& domain, uint16_t type, const ResolverOptions& options) {
+    // Recursive answers and those of different forwarders can differ, so
+    // they never share a flight
+    std::string key = domain;
+    key += '\0';
+    key += std::to_string(type);
+    key += options.recursive ? "/r" : "/f";
+    if (!options.recursive) {
+        for (const auto& server : options.nameservers) {
+            key += server;
+            key += '\0';
+        }
+    }
+    // A caller waiting for both families must not be handed the early
+    // answer of a flight led by one that is not
+    if (type == ADDRESS_LOOKUP && !options.recursive && options.resolution_delay_ms < 0) key += 'w';
+    return key;
+}
+
+void DNSResolver::resolveAsync(const std::string& domain, const ResolverOptions& options,
+                               ResolveCallback callback) {
+    resolveAsyncDetailed(domain, options, [callback](const ResolveResult& result) {
+        callback(result.ip_addresses);
+    });
+}
+
+void DNSResolver::resolveAsyncDetailed(const std::string& domain, const ResolverOptions& options,
+                                       DetailedCallback callback) {
+    auto clock = MetricsClock::now();
+    const auto start = clock;
+    DomainName ascii_domain = normalize(domain, clock);
+    metrics_.add(Counter::ResolvesStarted);
+
+    ResolveResult cached;
+    if (answerLocally(ascii_domain, cached)) {
+        metrics_.recordResolve(MetricsClock::now() - start, true);
+        callback(cached);
+        return;
+    }
+    if (options.use_cache && lookupCache(ascii_domain, options, cached, clock)) {
+        countLookup(cached);
+        metrics_.recordResolve(clock - start, true);
+        callback(cached);
+        return;
+    }
+    metrics_.add(Counter::CacheMisses);
+    if (options.use_cache) countExpired(ascii_domain);
+    startAsync(ascii_domain, options, [this, start, callback](const ResolveResult& result) {
+        metrics_.recordResolve(MetricsClock::now() - start, false);
+        callback(result);
+    });
+}
+
+void DNSResolver::startAsync(const std::string& ascii_domain, const ResolverOptions& options,
+                             DetailedCallback callback) {
+    std::string key = flightKey(ascii_domain, ADDRESS_LOOKUP, options);
+    bool leader = flights_.join(key, std::move(callback));
+    if (leader) {
+        startAsyncLookup(ascii_domain, options, key);
+    }
+}
 
-    std::vector<std::string> ip_addresses;
+void DNSResolver::startAsyncLookup(const std::string& ascii_domain, const ResolverOptions& options,
+                                   const std::string& key) {
     if (options.recursive) {
-        ip_addresses = performRecursiveQuery(ascii_domain, options.retries);
-    } else {
-        ip_addresses = performNormalQuery(ascii_domain);
+        {
+            std::lock_guard<std::mutex> lock(background_mutex_);
+            background_queue_.push_back([this, ascii_domain, options, key] {
+                try {
+                    flights_.complete(key, lookupUpstream(ascii_domain, options));
+                } catch (...) {
+                    flights_.complete(key, ResolveResult());
+                }
+            });
+            if (background_queue_.size() > background_idle_ && background_.size() < RECURSIVE_WORKERS) {
+                background_.emplace_back([this] { backgroundWorker(); });
+                return;
+            }
+        }
+        background_wake_.notify_one();
+        return;
+    }
+
+    // A pooled lookup is reset field by field, so its strings, vectors and
+    // schedules keep the memory they had
+    auto lookup = acquireLookup();
+    lookup->domain = ascii_domain;
+    lookup->options = options;
+    lookup->flight_key = key;
+    const auto& servers = options.nameservers.empty() ? UDPTransport::systemNameservers()
+                                                      : options.nameservers;
+    lookup->servers.clear();
+    lookup->server_keys.clear();
+    for (const auto& server : servers) {
+        UDPTransport::ServerAddress address;
+        if (UDPTransport::ServerAddress::parse(server, UDPTransport::DNS_PORT, address)) {
+            lookup->servers.push_back(address);
+            lookup->server_keys.push_back(address.toString());
+        }
+    }
+    const auto policy = retransmitPolicy(options, &metrics_);
+    for (size_t i = 0; i < 2; ++i) {
+        auto& family = lookup->families[i];
+        if (family.schedule) {
+            family.schedule->restart(lookup->server_keys, policy);
+        } else {
+            family.schedule.reset(new RetransmitSchedule(lookup->server_keys, policy));
+        }
+        family.outstanding = 0;
+        family.done = false;
+        family.timer = 0;
+        lookup->results[i] = DNSQuery::QueryResult();
+    }
+    lookup->remaining = 2;
+    lookup->delivered = false;
+
+    sendAsync(lookup, 0);
+    sendAsync(lookup, 1);
+}
+
+void DNSResolver::backgroundWorker() {
+    std::unique_lock<std::mutex> lock(background_mutex_);
+    for (;;) {
+        ++background_idle_;
+        background_wake_.wait(lock, [this] { return background_stop_ || !background_queue_.empty(); });
+        --background_idle_;
+        if (background_queue_.empty()) return;
+        auto task = std::move(background_queue_.front());
+        background_queue_.pop_front();
+        lock.unlock();
+        task();
+        lock.lock();
+    }
+}
+
+std::future<std::vector<std::string>> DNSResolver::resolveAsync(const std::string& domain,
+                                                                const ResolverOptions& options) {
+    auto promise = std::make_shared<std::promise<std::vector<std::string>>>();
+    auto future = promise->get_future();
+    resolveAsync(domain, options, [promise](const std::vector<std::string>& result) {
+        promise->set_value(result);
+    });
+    return future;
+}
+
+std::vector<std::vector<std::string>> DNSResolver::resolveMany(const std::vector<std::string>& domains,
+                                                               const ResolverOptions& options) {
+    std::vector<std::vector<std::string>> results(domains.size());
+    resolveMany(domains, options, [&results](size_t index, const std::vector<std::string>& result) {
+        results[index] = result;
+    });
+    return results;
+}
+
+void DNSResolver::resolveMany(const std::vector<std::string>& domains, const ResolverOptions& options,
+                              const BatchCallback& on_result) {
+    // Everything a completion touches lives in the shared Batch: the last
+    // completion can wake this thread while others are still unwinding.
+    struct Batch {
+        std::mutex mutex;
+        std::condition_variable done;
+        std::vector<DomainName> names;
+        std::vector<std::vector<size_t>> positions;
+        std::vector<size_t> misses;
+        ResolverOptions options;
+        BatchCallback on_result;
+        std::function<void(const std::shared_ptr<Batch>&, size_t)> launch;
+        size_t next = 0;
+        size_t completed = 0;
+    };
+    auto batch = std::make_shared<Batch>();
+    batch->options = options;
+    batch->on_result = on_result;
+
+    // Group input positions by normalized name so each name is looked up once
+    std::unordered_map<std::string, size_t> slot_of;
+    auto& names = batch->names;
+    auto& positions = batch->positions;
+    auto clock = MetricsClock::now();
+    for (size_t i = 0; i < domains.size(); ++i) {
+        DomainName ascii_domain = normalize(domains[i], clock);
+        auto inserted = slot_of.emplace(ascii_domain.str(), names.size());
+        if (inserted.second) {
+            names.push_back(std::move(ascii_domain));
+            positions.emplace_back();
+        }
+        positions[inserted.first->second].push_back(i);
+    }
+
+    auto& misses = batch->misses;
+    for (size_t slot = 0; slot < names.size(); ++slot) {
+        ResolveResult cached;
+        clock = MetricsClock::now();
+        if (answerLocally(names[slot], cached)) {
+            // Counted as local answers rather than cache lookups
+        } else if (!options.use_cache || !lookupCache(names[slot], options, cached, clock)) {
+            metrics_.add(Counter::CacheMisses);
+            if (options.use_cache) countExpired(names[slot]);
+            misses.push_back(slot);
+            continue;
+        } else {
+            countLookup(cached);
+        }
+        for (size_t index : positions[slot]) {
+            on_result(index, cached.ip_addresses);
+        }
+    }
+    if (misses.empty()) return;
+
+    // Keep at most `window` misses in flight; each completion claims the next
+    // miss in the same critical section that counts it as done.
+    // Recursive lookups each occupy a worker, so they get a much smaller window.
+    size_t window = std::max<size_t>(1, options.recursive ? std::min(options.batch_window, RECURSIVE_WORKERS)
+                                                          : options.batch_window);
+    batch->launch = [this](const std::shared_ptr<Batch>& batch, size_t next) {
+        size_t slot = batch->misses[next];
+        startAsync(batch->names[slot], batch->options, [batch, slot](const ResolveResult& result) {
+            for (size_t index : batch->positions[slot]) {
+                batch->on_result(index, result.ip_addresses);
+            }
+            size_t claimed;
+            {
+                std::lock_guard<std::mutex> lock(batch->mutex);
+                if (++batch->completed == batch->misses.size()) {
+                    batch->done.notify_all();
+                    return;
+                }
+                if (batch->next == batch->misses.size()) return;
+                claimed = batch->next++;
+            }
+            batch->launch(batch, claimed);
+        });
+    };
+    for (size_t i = 0; i < window; ++i) {
+        size_t claimed;
+        {
+            std::lock_guard<std::mutex> lock(batch->mutex);
+            if (batch->next == misses.size()) break;
+            claimed = batch->next++;
+        }
+        batch->launch(batch, claimed);
+    }
+
+    std::unique_lock<std::mutex> lock(batch->mutex);
+    batch->done.wait(lock, [&] { return batch->completed == batch->misses.size(); });
+}
+
+size_t DNSResolver::persistCache(const std::string& path, std::chrono::seconds interval) {
+    std::string error;
+    size_t loaded = cache_.loadSnapshot(path, error);
+    if (!error.empty()) {
+        std::cerr << "Cache snapshot: " << error << std::endl;
     }
+    if (loaded) scheduleCleanup();
+    snapshot_path_ = path;
+    snapshot_thread_ = std::thread([this, interval] {
+        std::unique_lock<std::mutex> lock(snapshot_mutex_);
+        while (!snapshot_wake_.wait_for(lock, interval, [this] { return snapshot_stop_; })) {
+            lock.unlock();
+            saveSnapshot();
+            lock.lock();
+        }
+    });
+    return loaded;
+}
 
-    if (!ip_addresses.empty() && options.use_cache) {
-        cacheResult(ascii_domain, ip_addresses, 300);  // Cache with 300 seconds TTL
+void DNSResolver::saveSnapshot() {
+    std::string error;
+    if (!cache_.saveSnapshot(snapshot_path_, error)) {
+        std::cerr << "Cache snapshot: " << error << std::endl;
     }
+}
 
-    return ip_addresses;
+std::shared_ptr<DNSResolver::AsyncLookup> DNSResolver::acquireLookup() {
+    std::unique_ptr<AsyncLookup> lookup;
+    {
+        std::lock_guard<std::mutex> lock(lookup_pool_mutex_);
+        if (!lookup_pool_.empty()) {
+            lookup = std::move(lookup_pool_.back());
+            lookup_pool_.pop_back();
+        }
+    }
+    if (!lookup) lookup.reset(new AsyncLookup());
+    return std::shared_ptr<AsyncLookup>(lookup.release(), [this](AsyncLookup* done) { recycleLookup(done); });
+}
+
+void DNSResolver::recycleLookup(AsyncLookup* lookup) {
+    std::unique_ptr<AsyncLookup> owned(lookup);
+    std::lock_guard<std::mutex> lock(lookup_pool_mutex_);
+    if (lookup_pool_.size() < LOOKUP_POOL_SIZE) {
+        lookup_pool_.push_back(std::move(owned));
+    }
+}
+
+AsyncEngine& DNSResolver::engine() {
+    std::call_once(engine_once_, [this] { engine_.reset(new AsyncEngine()); });
+    return *engine_;
+}
+
+void DNSResolver::scheduleCleanup() {
+    if (cache_.options().cleanup_interval.count() <= 0) return;
+    std::call_once(cleanup_once_, [this] {
+        engine().schedule(AsyncEngine::Clock::now() + cache_.options().cleanup_interval, [this] { sweepCache(); });
+    });
+}
+
+void DNSResolver::sweepCache() {
+    // Runs on the engine thread; the engine drops it at shutdown
+    metrics_.add(Counter::CacheEvictions, cache_.cleanup());
+    engine().schedule(AsyncEngine::Clock::now() + cache_.options().cleanup_interval, [this] { sweepCache(); });
+}
+
+void DNSResolver::sendAsync(const std::shared_ptr<AsyncLookup>& lookup, size_t family) {
+    auto& state = lookup->families[family];
+    size_t server;
+    RetransmitSchedule::Clock::time_point retransmit_at, deadline;
+    uint64_t timer = 0;
+    bool finish = false;
+    {
+        std::lock_guard<std::mutex> lock(lookup->mutex);
+        if (state.done) return;
+        if (!state.schedule->next(server, retransmit_at)) {
+            // Out of transmissions: finish once the last one is answered or times out
+            finish = state.outstanding == 0;
+            state.done = finish;
+        } else {
+            ++state.outstanding;
+            timer = ++state.timer;
+            deadline = state.schedule->deadline();
+        }
+    }
+    if (finish) finishAsync(lookup, family);
+    if (timer == 0) return;
+
+    const auto started = AsyncEngine::Clock::now();
+    uint8_t query[DNSMessage::MAX_UDP_SIZE];
+    size_t length = DNSMessage::buildQuery(query, sizeof(query), 0, lookup->domain, ASYNC_TYPES[family]);
+    const auto sent = AsyncEngine::Clock::now();
+    // Every transmission stays open until the overall deadline, so a slow
+    // answer to an earlier one still wins over the retransmit
+    engine().submit(lookup->servers[server], query, length, deadline,
+                    [this, lookup, family, server, sent](AsyncEngine::Status status,
+                                                         const uint8_t* response, size_t size) {
+        receiveAsync(lookup, family, server, sent, false, status, response, size);
+    });
+    metrics_.recordStage(Stage::Send, AsyncEngine::Clock::now() - started);
+    // Timers hold the lookup weakly: the transmissions keep it alive while
+    // it is unfinished, and a finished one goes back to the pool at once
+    // rather than when its last timer fires
+    std::weak_ptr<AsyncLookup> weak = lookup;
+    engine().schedule(retransmit_at, [this, weak, family, timer] {
+        auto lookup = weak.lock();
+        if (!lookup) return;
+        {
+            std::lock_guard<std::mutex> lock(lookup->mutex);
+            auto& state = lookup->families[family];
+            if (state.done || state.timer != timer) return;
+            state.schedule->timerExpired();
+        }
+        sendAsync(lookup, family);
+    });
 }
 
-std::vector<std::string> DNSResolver::queryDNS(const std::string& domain, bool recursive, int retries) {
-    std::vector<std::string> result;
-    while (retries > 0) {
-        try {
-            if (recursive) {
-                result = performRecursiveQuery(domain, retries);
+void DNSResolver::receiveAsync(const std::shared_ptr<AsyncLookup>& lookup, size_t family, size_t server,
+                               AsyncEngine::Clock::time_point sent, bool over_tcp, AsyncEngine::Status status,
+                               const uint8_t* response, size_t size) {
+    auto& state = lookup->families[family];
+    const auto received = AsyncEngine::Clock::now();
+    metrics_.recordStage(Stage::Wait, received - sent);
+    DNSQuery::QueryResult result;
+    result.success = false;
+    bool parsed = status == AsyncEngine::Status::Ok &&
+                  DNSQuery::parseResponse(response, size, lookup->domain, ASYNC_TYPES[family], result);
+    if (status == AsyncEngine::Status::Ok) {
+        metrics_.recordStage(Stage::Parse, AsyncEngine::Clock::now() - received);
+    }
+    if (parsed) {
+        metrics_.upstreamRcode(state.schedule->server(server), static_cast<uint8_t>(result.rcode));
+    }
+    bool usable = parsed && result.rcode != DNSMessage::RCode::ServFail &&
+                  result.rcode != DNSMessage::RCode::Refused;
+    bool truncated = usable && !over_tcp && (DNSMessage::readU16(response + 2) & 0x0200);
+    bool finish = false, next = false;
+    RetransmitSchedule::Clock::time_point deadline;
+    {
+        std::lock_guard<std::mutex> lock(lookup->mutex);
+        if (state.done) {
+            --state.outstanding;
+            return;
+        }
+        if (truncated) {
+            // Still outstanding until the TCP answer; no retransmit meanwhile
+            ++state.timer;
+            deadline = state.schedule->deadline();
+        } else {
+            --state.outstanding;
+            if (usable) {
+                state.schedule->answered(server, AsyncEngine::Clock::now() - sent);
+                lookup->results[family] = std::move(result);
+                finish = true;
+            } else if (status == AsyncEngine::Status::Ok || status == AsyncEngine::Status::NetworkError) {
+                // Unusable answer or send failure: skip the server and move on now
+                state.schedule->failed(server);
+                next = true;
             } else {
-                result = performNormalQuery(domain);
+                // Deadline reached (or shutdown) for this transmission
+                finish = state.outstanding == 0 || status == AsyncEngine::Status::Shutdown;
             }
-            if (!result.empty()) break;
-        } catch (const Poco::Net::NetException& e) {
-            std::this_thread::sleep_for(std::chrono::seconds(1));  // Retry after 1 second
-            retries--;
-            if (retries == 0) {
-                std::cerr << "Failed to resolve " << domain << ": " << e.displayText() << std::endl;
+            state.done = finish;
+        }
+    }
+    if (truncated) {
+        uint8_t query[DNSMessage::MAX_UDP_SIZE];
+        size_t length = DNSMessage::buildQuery(query, sizeof(query), 0, lookup->domain, ASYNC_TYPES[family]);
+        const auto resent = AsyncEngine::Clock::now();
+        tcp_.submit(lookup->servers[server], query, length, deadline,
+                    [this, lookup, family, server, resent](TCPPool::Status status,
+                                                           const uint8_t* answer, size_t answer_size) {
+            receiveAsync(lookup, family, server, resent, true, engineStatus(status), answer, answer_size);
+        });
+    } else if (finish) {
+        finishAsync(lookup, family);
+    } else if (next) {
+        sendAsync(lookup, family);
+    }
+}
+
+void DNSResolver::relayAsync(const uint8_t* query, size_t length, const ResolverOptions& options,
+                             RelayCallback callback) {
+    auto relay = std::make_shared<Relay>();
+    const auto& servers = options.nameservers.empty() ? UDPTransport::systemNameservers()
+                                                      : options.nameservers;
+    std::vector<std::string> server_keys;
+    for (const auto& server : servers) {
+        UDPTransport::ServerAddress address;
+        if (UDPTransport::ServerAddress::parse(server, UDPTransport::DNS_PORT, address)) {
+            relay->servers.push_back(address);
+            server_keys.push_back(address.toString());
+        }
+    }
+    if (relay->servers.empty() || length < DNSMessage::HEADER_SIZE || length > sizeof(relay->query)) {
+        callback(nullptr, 0);
+        return;
+    }
+    std::memcpy(relay->query, query, length);
+    relay->length = length;
+    relay->callback = std::move(callback);
+    relay->schedule.reset(new RetransmitSchedule(std::move(server_keys), retransmitPolicy(options, &metrics_)));
+    sendRelay(relay);
+}
+
+void DNSResolver::sendRelay(const std::shared_ptr<Relay>& relay) {
+    size_t server;
+    RetransmitSchedule::Clock::time_point retransmit_at, deadline;
+    uint64_t timer = 0;
+    bool finish = false;
+    {
+        std::lock_guard<std::mutex> lock(relay->mutex);
+        if (relay->done) return;
+        if (!relay->schedule->next(server, retransmit_at)) {
+            finish = relay->outstanding == 0;
+            relay->done = finish;
+        } else {
+            ++relay->outstanding;
+            timer = ++relay->timer;
+            deadline = relay->schedule->deadline();
+        }
+    }
+    if (finish) relay->callback(nullptr, 0);
+    if (timer == 0) return;
+
+    const auto sent = AsyncEngine::Clock::now();
+    engine().submit(relay->servers[server], relay->query, relay->length, deadline,
+                    [this, relay, server, sent](AsyncEngine::Status status, const uint8_t* response, size_t size) {
+        receiveRelay(relay, server, sent, false, status, response, size);
+    });
+    std::weak_ptr<Relay> weak = relay;
+    engine().schedule(retransmit_at, [this, weak, timer] {
+        auto relay = weak.lock();
+        if (!relay) return;
+        {
+            std::lock_guard<std::mutex> lock(relay->mutex);
+            if (relay->done || relay->timer != timer) return;
+            relay->schedule->timerExpired();
+        }
+        sendRelay(relay);
+    });
+}
+
+void DNSResolver::receiveRelay(const std::shared_ptr<Relay>& relay, size_t server, AsyncEngine::Clock::time_point sent,
+                               bool over_tcp, AsyncEngine::Status status, const uint8_t* response, size_t size) {
+    DNSMessage::Parser parser(response, size);
+    bool parsed = status == AsyncEngine::Status::Ok && parser.parseHeader();
+    if (parsed) {
+        metrics_.upstreamRcode(relay->schedule->server(server), static_cast<uint8_t>(parser.header().rcode()));
+    }
+    bool usable = parsed && parser.header().rcode() != DNSMessage::RCode::ServFail &&
+                  parser.header().rcode() != DNSMessage::RCode::Refused;
+    bool truncated = usable && !over_tcp && (DNSMessage::readU16(response + 2) & 0x0200);
+    bool answered = false, finish = false, next = false;
+    RetransmitSchedule::Clock::time_point deadline;
+    {
+        std::lock_guard<std::mutex> lock(relay->mutex);
+        if (relay->done) {
+            --relay->outstanding;
+            return;
+        }
+        if (truncated) {
+            ++relay->timer;
+            deadline = relay->schedule->deadline();
+        } else {
+            --relay->outstanding;
+            if (usable) {
+                relay->schedule->answered(server, AsyncEngine::Clock::now() - sent);
+                answered = true;
+            } else if (status == AsyncEngine::Status::Ok || status == AsyncEngine::Status::NetworkError) {
+                relay->schedule->failed(server);
+                next = true;
+            } else {
+                finish = relay->outstanding == 0 || status == AsyncEngine::Status::Shutdown;
             }
+            relay->done = answered || finish;
         }
     }
-    return result;
+    if (truncated) {
+        const auto resent = AsyncEngine::Clock::now();
+        tcp_.submit(relay->servers[server], relay->query, relay->length, deadline,
+                    [this, relay, server, resent](TCPPool::Status status, const uint8_t* answer, size_t answer_size) {
+            receiveRelay(relay, server, resent, true, engineStatus(status), answer, answer_size);
+        });
+    } else if (answered) {
+        relay->callback(response, size);
+    } else if (finish) {
+        relay->callback(nullptr, 0);
+    } else if (next) {
+        sendRelay(relay);
+    }
 }
 
-std::vector<std::string> DNSResolver::performNormalQuery(const std::string& domain) {
-    std::vector<std::string> ip_addresses;
-    try {
-        Poco::Net::HostEntry hostEntry = Poco::Net::DNS::resolve(domain);
-        const auto& addresses = hostEntry.addresses();
-        for (const auto& addr : addresses) {
-            ip_addresses.push_back(addr.toString());
+void DNSResolver::finishAsync(const std::shared_ptr<AsyncLookup>& lookup, size_t family) {
+    const int delay_ms = lookup->options.resolution_delay_ms;
+    DNSQuery::QueryResult answer;
+    bool last, early = false, delayed = false;
+    {
+        std::lock_guard<std::mutex> lock(lookup->mutex);
+        last = --lookup->remaining == 0;
+        if (!last) {
+            // The other family is still out: give it the resolution delay,
+            // then let the waiters have these addresses on their own
+            if (delay_ms >= 0 && !lookup->delivered && !lookup->results[family].ip_addresses.empty()) {
+                early = delay_ms == 0;
+                delayed = !early;
+            }
+        } else {
+            answer = std::move(lookup->results[0]);
+            DNSQuery::mergeAddresses(answer, lookup->results[1]);
         }
-    } catch (const Poco::Net::NetException& e) {
-        std::cerr << "Error resolving " << domain << ": " << e.displayText() << std::endl;
     }
-    return ip_addresses;
+    if (early) {
+        deliverEarly(lookup, family);
+    } else if (delayed) {
+        std::weak_ptr<AsyncLookup> weak = lookup;
+        engine().schedule(AsyncEngine::Clock::now() + std::chrono::milliseconds(delay_ms), [this, weak, family] {
+            if (auto pending = weak.lock()) deliverEarly(pending, family);
+        });
+    }
+    if (!last) return;
+
+    // Both families are in: the combined answer is what gets cached, even
+    // when the waiters so far have had one half of it
+    flights_.complete(lookup->flight_key, completeLookup(lookup->domain, lookup->options, std::move(answer)));
 }
 
-std::vector<std::string> DNSResolver::performRecursiveQuery(const std::string& domain, int retries) {
-    // Implement recursive query logic if required.
-    // For now, we use the same logic as performNormalQuery for simplicity.
-    return performRootServerQuery(domain);
+void DNSResolver::deliverEarly(const std::shared_ptr<AsyncLookup>& lookup, size_t family) {
+    ResolveResult result;
+    {
+        std::lock_guard<std::mutex> lock(lookup->mutex);
+        // Both families may have answered within the delay after all
+        if (lookup->delivered || lookup->remaining == 0) return;
+        lookup->delivered = true;
+        result.ip_addresses = lookup->results[family].ip_addresses;
+        result.ttl = lookup->results[family].ttl;
+    }
+    result.status = DNSQuery::Status::Success;
+    result.partial = true;
+    flights_.deliver(lookup->flight_key, result);
 }
 
-std::vector<std::string> DNSResolver::performRootServerQuery(const std::string& domain) {
-    std::vector<std::string> ip_addresses;
-    try {
-        // Use root DNS servers for the initial query
-        Poco::Net::HostEntry hostEntry = Poco::Net::DNS::resolve(domain);
-        const auto& addresses = hostEntry.addresses();
-        for (const auto& addr : addresses) {
-            ip_addresses.push_back(addr.toString());
+DNSQuery::QueryResult DNSResolver::performRecursiveQuery(const std::string& domain, const ResolverOptions& options) {
+    return performRootServerQuery(domain, options);
+}
+
+DNSQuery::QueryResult DNSResolver::performRootServerQuery(const std::string& domain, const ResolverOptions& options) {
+    auto result = DNSQuery::performRecursiveQuery(domain, iterativeOptions(options, &metrics_));
+    if (!result.success) {
+        std::cerr << "Error resolving " << domain << " recursively: " << result.error_message << std::endl;
+    }
+    return result;
+}
+
+bool DNSResolver::resolveFromCache(const DomainName& domain, const ResolverOptions& options,
+                                   ResolveResult& result) {
+    bool refresh;
+    {
+        DNSCache::View view = cache_.find(domain);
+        if (!view) {
+            return resolveNegative(domain, result);
         }
-    } catch (const Poco::Net::NetException&) {
-        // Handle root server failure and attempt retry or recursive behavior
+        view.appendStrings(result.ip_addresses);
+        result.ttl = DNSCache::remainingTTL(view);
+        result.from_cache = true;
+        result.status = DNSQuery::Status::Success;
+        refresh = cache_.shouldPrefetch(view);
+    }
+    if (refresh) {
+        prefetch(domain, options);
     }
-    return ip_addresses;
+    return true;
 }
 
-std::vector<std::string> DNSResolver::resolveFromCache(const std::string& domain) {
-    std::lock_guard<std::mutex> lock(cache_mutex_);
-    if (cache_.find(domain) != cache_.end()) {
-        if (!isCacheExpired(domain)) {
-            return cache_[domain].ip_addresses;
+bool DNSResolver::resolveFromCache(const DomainName& domain, const ResolverOptions& options,
+                                   ResultBuffer& result) {
+    bool refresh;
+    {
+        DNSCache::View view = cache_.find(domain);
+        if (!view) {
+            ResolveResult negative;
+            if (!resolveNegative(domain, negative)) return false;
+            result.assign(negative);
+            return true;
         }
+        for (size_t i = 0; i < view.size(); ++i) {
+            result.appendAddress(view.addressBytes(i), view.isIPv6(i));
+        }
+        result.ttl = DNSCache::remainingTTL(view);
+        result.from_cache = true;
+        result.status = DNSQuery::Status::Success;
+        refresh = cache_.shouldPrefetch(view);
+    }
+    if (refresh) {
+        prefetch(domain, options);
     }
-    return {};
+    return true;
 }
 
-void DNSResolver::cacheResult(const std::string& domain, const std::vector<std::string>& ip_addresses, int ttl) {
-    std::lock_guard<std::mutex> lock(cache_mutex_);
-    cache_[domain] = CacheEntry{ip_addresses, std::chrono::steady_clock::now(), ttl};
+bool DNSResolver::resolveNegative(const std::string& domain, ResolveResult& result) {
+    // An address lookup is negative if the name is gone, or if both A and
+    // AAAA are known to have no data
+    uint32_t ttl = 0, aaaa_ttl = 0;
+    auto kind = cache_.findNegative(domain, DNSMessage::RecordType::A, ttl);
+    if (kind == DNSCache::Negative::NoData &&
+        cache_.findNegative(domain, DNSMessage::RecordType::AAAA, aaaa_ttl) != DNSCache::Negative::NoData) {
+        kind = DNSCache::Negative::None;
+    }
+    if (kind == DNSCache::Negative::None) {
+        return false;
+    }
+    result.ip_addresses.clear();
+    result.status = kind == DNSCache::Negative::NXDomain ? DNSQuery::Status::NXDomain : DNSQuery::Status::NoData;
+    result.ttl = kind == DNSCache::Negative::NoData ? std::min(ttl, aaaa_ttl) : ttl;
+    result.from_cache = true;
+    return true;
+}
+
+bool DNSResolver::resolveStale(const DomainName& domain, ResolveResult& result) {
+    DNSCache::View view = cache_.findStale(domain);
+    if (!view) {
+        return false;
+    }
+    result.ip_addresses.clear();
+    view.appendStrings(result.ip_addresses);
+    result.from_cache = true;
+    result.status = DNSQuery::Status::Success;
+    result.stale = view.expired();
+    result.ttl = result.stale ? cache_.options().stale_ttl : DNSCache::remainingTTL(view);
+    return true;
 }
 
-bool DNSResolver::isCacheExpired(const std::string& domain) {
-    auto& entry = cache_[domain];
-    auto duration = std::chrono::steady_clock::now() - entry.timestamp;
-    return std::chrono::duration_cast<std::chrono::seconds>(duration).count() > entry.ttl;
+void DNSResolver::prefetch(const std::string& domain, const ResolverOptions& options) {
+    // Refresh in the background; callers keep getting the current entry
+    std::string key = flightKey(domain, ADDRESS_LOOKUP, options);
+    if (flights_.join(key, [](const ResolveResult&) {})) {
+        metrics_.add(Counter::Prefetches);
+        startAsyncLookup(domain, options, key);
+    }
+}
+
+void DNSResolver::cacheResult(const std::string& domain, const DNSQuery::QueryResult& answer) {
+    if (answer.status() == DNSQuery::Status::Failure) {
+        return;  // Transient; never cached
+    }
+    const auto start = MetricsClock::now();
+    std::chrono::seconds negative_ttl(answer.negative_ttl);
+    switch (answer.status()) {
+    case DNSQuery::Status::Success:
+        cache_.addEntry(domain, answer.ip_addresses, std::chrono::seconds(answer.ttl));
+        break;
+    case DNSQuery::Status::NXDomain:
+        cache_.addNegative(domain, DNSMessage::RecordType::A, DNSCache::Negative::NXDomain, negative_ttl);
+        break;
+    case DNSQuery::Status::NoData:
+        cache_.addNegative(domain, DNSMessage::RecordType::A, DNSCache::Negative::NoData, negative_ttl);
+        cache_.addNegative(domain, DNSMessage::RecordType::AAAA, DNSCache::Negative::NoData, negative_ttl);
+        break;
+    case DNSQuery::Status::Failure:
+        return;
+    }
+    metrics_.add(Counter::CacheInserts);
+    metrics_.recordStage(Stage::Insert, MetricsClock::now() - start);
+    scheduleCleanup();
+}
+
+DNSResolver::RecordResult DNSResolver::resolveRecords(const std::string& domain, DNSMessage::RecordType type,
+                                                      const ResolverOptions& options) {
+    auto clock = MetricsClock::now();
+    const auto start = clock;
+    DomainName name = normalize(domain, clock);
+    metrics_.add(Counter::ResolvesStarted);
+
+    RecordResult result;
+    result.canonical_name = name.str();
+    uint32_t chain_ttl = std::numeric_limits<uint32_t>::max();
+    int links = 0;
+    if (options.use_cache && followCachedChain(type, result, chain_ttl, links)) {
+        metrics_.add(result.status == DNSQuery::Status::Success ? Counter::CacheHits : Counter::CacheNegativeHits);
+        metrics_.recordResolve(MetricsClock::now() - start, true);
+        return result;
+    }
+    metrics_.add(Counter::CacheMisses);
+
+    // Ask for the rest of the chain, from the first name that is not cached
+    DNSQuery::QueryResult answer = lookupRecords(result.canonical_name, type, options);
+    result.queries = 1;
+    if (options.use_cache) {
+        cacheRecords(result.canonical_name, type, answer);
+    }
+    for (const auto& alias : answer.aliases) {
+        chain_ttl = std::min(chain_ttl, alias.ttl);
+        result.canonical_name = DomainName(alias.target).str();
+    }
+    result.status = answer.status();
+    if (result.status == DNSQuery::Status::Success) {
+        result.records = std::move(answer.records);
+        result.ttl = std::min(chain_ttl, answer.ttl);
+    } else if (result.status != DNSQuery::Status::Failure) {
+        result.ttl = std::min(chain_ttl, answer.negative_ttl);
+    }
+    metrics_.recordResolve(MetricsClock::now() - start, false);
+    return result;
+}
+
+bool DNSResolver::followCachedChain(DNSMessage::RecordType type, RecordResult& result, uint32_t& chain_ttl,
+                                    int& links) {
+    for (;;) {
+        uint32_t remaining = 0;
+        if (cache_.findRecords(result.canonical_name, type, DNSMessage::CLASS_IN, result.records, remaining)) {
+            result.status = DNSQuery::Status::Success;
+        } else {
+            auto negative = cache_.findNegative(result.canonical_name, type, remaining);
+            if (negative == DNSCache::Negative::None) {
+                std::vector<DNSMessage::TypedRecord> link;
+                if (type == DNSMessage::RecordType::CNAME || links >= MAX_CNAME_LINKS ||
+                    !cache_.findRecords(result.canonical_name, DNSMessage::RecordType::CNAME, DNSMessage::CLASS_IN,
+                                        link, remaining)) {
+                    return false;
+                }
+                chain_ttl = std::min(chain_ttl, remaining);
+                result.canonical_name = DomainName(link.front().data).str();
+                ++links;
+                continue;
+            }
+            result.status = negative == DNSCache::Negative::NXDomain ? DNSQuery::Status::NXDomain
+                                                                     : DNSQuery::Status::NoData;
+        }
+        result.ttl = std::min(chain_ttl, remaining);
+        result.from_cache = true;
+        return true;
+    }
+}
+
+DNSQuery::QueryResult DNSResolver::lookupRecords(const std::string& domain, DNSMessage::RecordType type,
+                                                 const ResolverOptions& options) {
+    DNSQuery::QueryResult answer;
+    if (options.recursive) {
+        answer = DNSQuery::performIterativeQuery(domain, type, iterativeOptions(options, &metrics_));
+    } else {
+        const auto& servers = options.nameservers.empty() ? UDPTransport::systemNameservers()
+                                                          : options.nameservers;
+        answer = DNSQuery::queryType(domain, type, servers, retransmitPolicy(options, &metrics_), true, true);
+    }
+    if (answer.status() == DNSQuery::Status::Failure) {
+        std::cerr << "Error resolving " << domain << ": " << answer.error_message << std::endl;
+    }
+    return answer;
+}
+
+void DNSResolver::cacheRecords(const std::string& domain, DNSMessage::RecordType type,
+                               const DNSQuery::QueryResult& answer) {
+    const auto start = MetricsClock::now();
+    std::string owner = domain;
+    for (const auto& alias : answer.aliases) {
+        std::string target = DomainName(alias.target).str();
+        DNSMessage::TypedRecord link;
+        link.type = DNSMessage::RecordType::CNAME;
+        link.ttl = alias.ttl;
+        link.data = target;
+        cache_.addRecords(DomainName(alias.name).str(), DNSMessage::RecordType::CNAME, DNSMessage::CLASS_IN, {link},
+                          std::chrono::seconds(alias.ttl));
+        owner = std::move(target);
+    }
+    // Each CNAME link, plus the answer unless the lookup failed
+    size_t inserts = answer.aliases.size() + (answer.status() == DNSQuery::Status::Failure ? 0 : 1);
+    std::chrono::seconds negative_ttl(answer.negative_ttl);
+    switch (answer.status()) {
+    case DNSQuery::Status::Success: {
+        uint32_t ttl = std::numeric_limits<uint32_t>::max();
+        for (const auto& record : answer.records) ttl = std::min(ttl, record.ttl);
+        cache_.addRecords(owner, type, DNSMessage::CLASS_IN, answer.records, std::chrono::seconds(ttl));
+        break;
+    }
+    case DNSQuery::Status::NXDomain:
+        cache_.addNegative(owner, type, DNSCache::Negative::NXDomain, negative_ttl);
+        break;
+    case DNSQuery::Status::NoData:
+        cache_.addNegative(owner, type, DNSCache::Negative::NoData, negative_ttl);
+        break;
+    case DNSQuery::Status::Failure:
+        break;
+    }
+    if (inserts == 0) return;
+    metrics_.add(Counter::CacheInserts, inserts);
+    metrics_.recordStage(Stage::Insert, MetricsClock::now() - start);
+    scheduleCleanup();
 }
 
 void DNSResolver::clearCache() {
-    std::lock_guard<std::mutex> lock(cache_mutex_);
+    metrics_.add(Counter::CacheEvictions, cache_.size());
     cache_.clear();
 }
 
+ResolverMetrics::Snapshot DNSResolver::stats() const {
+    ResolverMetrics::Snapshot snapshot = metrics_.snapshot();
+    snapshot.cache_entries = cache_.size();
+    // The cache counts what it evicts to stay within max_entries itself
+    snapshot.counters[static_cast<size_t>(Counter::CacheEvictions)] += cache_.evictions();
+    return snapshot;
+}
+
+std::string DNSResolver::prometheusStats() const {
+    return stats().prometheus();
+}
+
+DomainName DNSResolver::normalize(const std::string& domain, MetricsClock::time_point& clock) {
+    DomainName name;
+    normalize(domain, name, clock);
+    return name;
+}
+
+void DNSResolver::normalize(std::string_view domain, DomainName& name, MetricsClock::time_point& clock) {
+    const auto start = clock;
+    name.assign(domain);
+    clock = MetricsClock::now();
+    metrics_.recordStage(Stage::Normalize, clock - start);
+}
+
+bool DNSResolver::lookupCache(const DomainName& domain, const ResolverOptions& options, ResolveResult& result,
+                              MetricsClock::time_point& clock) {
+    const auto start = clock;
+    bool hit = resolveFromCache(domain, options, result);
+    clock = MetricsClock::now();
+    metrics_.recordStage(Stage::CacheLookup, clock - start);
+    return hit;
+}
+
+bool DNSResolver::lookupCache(const DomainName& domain, const ResolverOptions& options, ResultBuffer& result,
+                              MetricsClock::time_point& clock) {
+    const auto start = clock;
+    bool hit = resolveFromCache(domain, options, result);
+    clock = MetricsClock::now();
+    metrics_.recordStage(Stage::CacheLookup, clock - start);
+    return hit;
+}
+
+bool DNSResolver::answerLocally(const std::string& domain, ResolveResult& result) {
+    if (!has_local_zone_.load(std::memory_order_acquire)) return false;
+    auto zone = std::atomic_load(&local_zone_);
+    LocalZone::Match match;
+    if (!zone || !zone->find(domain, match) || match.action == LocalZone::Action::Passthru) return false;
+
+    result.ip_addresses.clear();
+    char text[INET6_ADDRSTRLEN];
+    for (size_t i = 0; i < match.ipv4_count; ++i) {
+        result.ip_addresses.emplace_back(inet_ntop(AF_INET, match.ipv4 + 4 * i, text, sizeof(text)));
+    }
+    for (size_t i = 0; i < match.ipv6_count; ++i) {
+        result.ip_addresses.emplace_back(inet_ntop(AF_INET6, match.ipv6 + 16 * i, text, sizeof(text)));
+    }
+    result.ttl = match.ttl;
+    result.local = true;
+    result.status = localStatus(match);
+    metrics_.add(Counter::LocalAnswers);
+    return true;
+}
+
+bool DNSResolver::answerLocally(const std::string& domain, ResultBuffer& result) {
+    if (!has_local_zone_.load(std::memory_order_acquire)) return false;
+    auto zone = std::atomic_load(&local_zone_);
+    LocalZone::Match match;
+    if (!zone || !zone->find(domain, match) || match.action == LocalZone::Action::Passthru) return false;
+
+    for (size_t i = 0; i < match.ipv4_count; ++i) result.appendAddress(match.ipv4 + 4 * i, false);
+    for (size_t i = 0; i < match.ipv6_count; ++i) result.appendAddress(match.ipv6 + 16 * i, true);
+    result.ttl = match.ttl;
+    result.local = true;
+    result.status = localStatus(match);
+    metrics_.add(Counter::LocalAnswers);
+    return true;
+}
+
+void DNSResolver::setLocalZone(std::shared_ptr<const LocalZone> zone) {
+    bool present = zone != nullptr;
+    std::atomic_store(&local_zone_, std::move(zone));
+    has_local_zone_.store(present, std::memory_order_release);
+}
+
+std::shared_ptr<const LocalZone> DNSResolver::localZone() const {
+    return std::atomic_load(&local_zone_);
+}
+
+void DNSResolver::countLookup(const ResolveResult& result) {
+    countLookup(result.from_cache, result.stale, result.status);
+}
+
+void DNSResolver::countLookup(bool from_cache, bool stale, DNSQuery::Status status) {
+    if (!from_cache) {
+        metrics_.add(Counter::CacheMisses);
+    } else if (stale) {
+        metrics_.add(Counter::CacheStaleHits);
+    } else if (status == DNSQuery::Status::Success) {
+        metrics_.add(Counter::CacheHits);
+    } else {
+        metrics_.add(Counter::CacheNegativeHits);
+    }
+}
+
+void DNSResolver::countExpired(const DomainName& domain) {
+    if (cache_.holdsExpired(domain)) {
+        metrics_.add(Counter::CacheExpired);
+    }
+}
+
 std::string DNSResolver::convertToASCII(const std::string& domain) {
-    return Poco::Net::DNS::isIDN(domain) ? Poco::Net::DNS::encodeIDN(domain) : domain;
-}
\ No newline at end of file
+    return DomainName::toASCII(domain);
+}
+
+std::string_view DNSResolver::ResultBuffer::operator[](size_t index) const {
+    const uint32_t begin = index == 0 ? 0 : ends_[index - 1];
+    return std::string_view(text_).substr(begin, ends_[index] - begin);
+}
+
+std::vector<std::string> DNSResolver::ResultBuffer::addresses() const {
+    std::vector<std::string> out;
+    out.reserve(size());
+    for (size_t i = 0; i < size(); ++i) {
+        out.emplace_back((*this)[i]);
+    }
+    return out;
+}
+
+void DNSResolver::ResultBuffer::clear() {
+    ttl = 0;
+    from_cache = stale = local = partial = false;
+    status = DNSQuery::Status::Failure;
+    text_.clear();
+    ends_.clear();
+}
+
+void DNSResolver::ResultBuffer::append(std::string_view address) {
+    text_.append(address);
+    ends_.push_back(static_cast<uint32_t>(text_.size()));
+}
+
+void DNSResolver::ResultBuffer::appendAddress(const uint8_t* bytes, bool ipv6) {
+    char text[INET6_ADDRSTRLEN];
+    append(inet_ntop(ipv6 ? AF_INET6 : AF_INET, bytes, text, sizeof(text)));
+}
+
+void DNSResolver::ResultBuffer::assign(const ResolveResult& result) {
+    text_.clear();
+    ends_.clear();
+    for (const auto& address : result.ip_addresses) {
+        append(address);
+    }
+    ttl = result.ttl;
+    from_cache = result.from_cache;
+    stale = result.stale;
+    local = result.local;
+    partial = result.partial;
+    status = result.status;
+}
@@ -0,0 +1,563 @@
+#include "DNSServer.h"
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <future>
+#include <iostream>
+#include <stdexcept>
+
+namespace {
+
+constexpr int IDLE_POLL_MS = 20;       // How often an idle thread checks for shutdown
+constexpr size_t MAX_BATCHES = 8;      // Receive batches per wakeup before polling again
+constexpr size_t MAX_QUERY = 4096;     // Longer UDP queries are dropped
+constexpr size_t MAX_MESSAGE = 65535;  // Largest DNS message (TCP length prefix)
+constexpr size_t OPT_SIZE = 11;        // OPT record with no options
+constexpr int BIND_ATTEMPTS = 8;       // With port 0, tries to find a port free for UDP and TCP
+
+using RT = DNSMessage::RecordType;
+using RCode = DNSMessage::RCode;
+using Clock = std::chrono::steady_clock;
+
+// What an answer needs from its query: the header and question to echo,
+// and how much the client accepts
+struct Request {
+    uint8_t head[DNSMessage::HEADER_SIZE + DNSMessage::MAX_NAME_LENGTH + 4];
+    size_t length = 0;
+    RT type = RT::A;
+    size_t limit = DNSMessage::MAX_UDP_SIZE;  // Largest UDP response the client accepts
+    bool edns = false;
+};
+
+enum class Action { Drop, Reject, Resolve, Relay };
+
+// Reads the query into request. Reject comes with the rcode to answer;
+// Resolve and Relay with the question's name.
+Action parseRequest(const uint8_t* query, size_t length, bool recursive, Request& request, RCode& rcode,
+                    std::string& name) {
+    DNSMessage::Parser parser(query, length);
+    if (!parser.parseHeader() || parser.header().isResponse()) {
+        return Action::Drop;
+    }
+    std::memcpy(request.head, query, DNSMessage::HEADER_SIZE);
+    request.length = DNSMessage::HEADER_SIZE;
+    if (parser.header().opcode() != 0) {
+        rcode = RCode::NotImp;
+        return Action::Reject;
+    }
+
+    DNSMessage::Question question;
+    rcode = RCode::FormErr;
+    if (parser.header().qdcount != 1 || !parser.nextQuestion(question)) {
+        return Action::Reject;
+    }
+    size_t question_end = DNSMessage::skipName(query, length, DNSMessage::HEADER_SIZE) + 4;
+    if (question_end == 4 || question_end > length || question_end > sizeof(request.head)) {
+        return Action::Reject;
+    }
+    std::memcpy(request.head, query, question_end);
+    request.length = question_end;
+    request.type = question.type;
+
+    DNSMessage::ResourceRecord record;
+    while (parser.nextRecord(record)) {
+        if (record.type == RT::OPT) {
+            request.edns = true;
+            request.limit = std::min<size_t>(std::max<size_t>(record.rclass, DNSMessage::MAX_UDP_SIZE),
+                                             DNSMessage::EDNS_UDP_SIZE);
+        }
+    }
+    if (parser.failed()) {
+        return Action::Reject;
+    }
+
+    rcode = RCode::NotImp;
+    if (question.qclass != DNSMessage::CLASS_IN) {
+        return Action::Reject;
+    }
+    name = question.name.toString();
+    if (question.type == RT::A || question.type == RT::AAAA || question.type == RT::ANY) {
+        return Action::Resolve;
+    }
+    // The iterative walk only follows address lookups
+    return recursive ? Action::Reject : Action::Relay;
+}
+
+// Whether the local zone settles a relayed question without upstream: a
+// blocked name is NXDOMAIN, and a name answered locally has no records of
+// other types.
+bool answeredLocally(const LocalZone* zone, const std::string& name, RCode& rcode) {
+    LocalZone::Match match;
+    if (!zone || !zone->find(name, match) || match.action == LocalZone::Action::Passthru) return false;
+    rcode = match.action == LocalZone::Action::NXDomain ? RCode::NXDomain : RCode::NoError;
+    return true;
+}
+
+// Appends an OPT record advertising our UDP payload size (RFC 6891).
+size_t appendOpt(uint8_t* out, size_t offset) {
+    out[offset] = 0;  // Root
+    DNSMessage::writeU16(out + offset + 1, static_cast<uint16_t>(RT::OPT));
+    DNSMessage::writeU16(out + offset + 3, DNSMessage::EDNS_UDP_SIZE);
+    DNSMessage::writeU32(out + offset + 5, 0);
+    DNSMessage::writeU16(out + offset + 9, 0);
+    DNSMessage::writeU16(out + 10, static_cast<uint16_t>(DNSMessage::readU16(out + 10) + 1));
+    return offset + OPT_SIZE;
+}
+
+// Starts a response in out: the query's header and question with QR and
+// RA set, opcode and RD kept, and no records.
+size_t startResponse(const Request& request, RCode rcode, uint8_t* out) {
+    std::memcpy(out, request.head, request.length);
+    uint16_t flags = DNSMessage::readU16(request.head + 2);
+    DNSMessage::writeU16(out + 2, static_cast<uint16_t>(0x8080 | (flags & 0x7900) | static_cast<uint16_t>(rcode)));
+    DNSMessage::writeU16(out + 4, request.length > DNSMessage::HEADER_SIZE ? 1 : 0);
+    std::memset(out + 6, 0, 6);
+    return request.length;
+}
+
+// Copies a relayed response into out under the client's transaction ID;
+// each upstream transmission went out with its own.
+size_t restoreId(const uint8_t* query, const uint8_t* response, size_t length, uint8_t* out) {
+    std::memcpy(out, response, length);
+    std::memcpy(out, query, 2);
+    return length;
+}
+
+// A response with no records: an error, or TC=1 when the answer did not fit
+size_t emptyResponse(const Request& request, RCode rcode, uint8_t* out, bool truncated = false) {
+    size_t length = startResponse(request, rcode, out);
+    if (truncated) out[2] |= 0x02;
+    return request.edns ? appendOpt(out, length) : length;
+}
+
+// Builds the answer to request from a resolve into out. Addresses that do
+// not fit in capacity leave only the question with TC set, so the client
+// retries over TCP.
+size_t buildAnswer(const Request& request, const DNSResolver::ResolveResult& result, uint8_t* out,
+                   size_t capacity) {
+    RCode rcode = RCode::NoError;
+    if (result.status == DNSQuery::Status::NXDomain) rcode = RCode::NXDomain;
+    if (result.status == DNSQuery::Status::Failure) rcode = RCode::ServFail;
+
+    size_t length = startResponse(request, rcode, out);
+    const size_t room = capacity - (request.edns ? OPT_SIZE : 0);
+    uint16_t answers = 0;
+    for (const auto& text : result.ip_addresses) {
+        uint8_t address[16];
+        RT type = RT::A;
+        size_t size = 4;
+        if (inet_pton(AF_INET, text.c_str(), address) != 1) {
+            if (inet_pton(AF_INET6, text.c_str(), address) != 1) continue;
+            type = RT::AAAA;
+            size = 16;
+        }
+        if (request.type != RT::ANY && request.type != type) continue;
+        if (length + 12 + size > room) {
+            return emptyResponse(request, rcode, out, true);
+        }
+        // Owner is a pointer to the question name, so the client's case is kept
+        out[length] = 0xC0;
+        out[length + 1] = DNSMessage::HEADER_SIZE;
+        DNSMessage::writeU16(out + length + 2, static_cast<uint16_t>(type));
+        DNSMessage::writeU16(out + length + 4, DNSMessage::CLASS_IN);
+        DNSMessage::writeU32(out + length + 6, result.ttl);
+        DNSMessage::writeU16(out + length + 10, static_cast<uint16_t>(size));
+        std::memcpy(out + length + 12, address, size);
+        length += 12 + size;
+        ++answers;
+    }
+    DNSMessage::writeU16(out + 6, answers);
+    return request.edns ? appendOpt(out, length) : length;
+}
+
+std::vector<int> usableCpus() {
+    std::vector<int> cpus;
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    if (sched_getaffinity(0, sizeof(set), &set) == 0) {
+        for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+            if (CPU_ISSET(cpu, &set)) cpus.push_back(cpu);
+        }
+    }
+    return cpus;
+}
+
+void pinThread(std::thread& thread, int cpu) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    int error = pthread_setaffinity_np(thread.native_handle(), sizeof(set), &set);
+    if (error != 0) {
+        std::cerr << "DNSServer: cannot pin worker to CPU " << cpu << ": " << std::strerror(error) << std::endl;
+    }
+}
+
+// Opens and binds a socket of type at address (and listens, for TCP).
+// Returns the descriptor, or -1 with error set.
+int openSocket(const UDPTransport::ServerAddress& address, int type, std::string& error) {
+    // UDP sockets never block: a full send buffer drops the answer
+    int fd = socket(address.addr.ss_family, type | SOCK_CLOEXEC | (type == SOCK_DGRAM ? SOCK_NONBLOCK : 0), 0);
+    if (fd < 0) {
+        error = std::strerror(errno);
+        return -1;
+    }
+    int on = 1;
+    if (type == SOCK_DGRAM) {
+        // Every worker binds the same port; the kernel hashes clients across them
+        setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on));
+        int buffer_size = 4 << 20;  // Absorb bursts
+        setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &buffer_size, sizeof(buffer_size));
+    } else {
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    }
+    if (bind(fd, reinterpret_cast<const sockaddr*>(&address.addr), address.length) != 0 ||
+        (type == SOCK_STREAM && listen(fd, SOMAXCONN) != 0)) {
+        error = std::strerror(errno);
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// Reads exactly length bytes, giving up at deadline, on shutdown or when
+// the peer closes.
+bool receiveAll(int fd, uint8_t* data, size_t length, Clock::time_point deadline, const std::atomic<bool>& stop) {
+    size_t received = 0;
+    while (received < length) {
+        if (stop || Clock::now() >= deadline) return false;
+        pollfd pfd{fd, POLLIN, 0};
+        int ready = poll(&pfd, 1, IDLE_POLL_MS);
+        if (ready < 0 && errno != EINTR) return false;
+        if (ready <= 0) continue;
+        ssize_t n = recv(fd, data + received, length - received, 0);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        received += static_cast<size_t>(n);
+    }
+    return true;
+}
+
+bool sendAll(int fd, const uint8_t* data, size_t length) {
+    size_t sent = 0;
+    while (sent < length) {
+        ssize_t n = send(fd, data + sent, length - sent, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        sent += static_cast<size_t>(n);
+    }
+    return true;
+}
+
+// Set while a worker handles a batch of datagrams, so answers produced
+// inline on that thread join its outgoing batch instead of costing a
+// syscall each
+struct InlineBatch {
+    const void* endpoint = nullptr;
+    DatagramBatch* batch = nullptr;
+};
+thread_local InlineBatch inline_batch;
+
+}  // namespace
+
+// A worker's UDP socket. Answers to misses hold a reference, so the socket
+// stays open until the last of them has run.
+struct DNSServer::Endpoint {
+    int fd = -1;
+    std::atomic<bool> closed{false};  // Set by stop(); later answers are discarded
+    std::atomic<uint64_t> queries{0};
+    std::atomic<uint64_t> responses{0};
+    std::atomic<uint64_t> dropped{0};
+
+    ~Endpoint() {
+        if (fd >= 0) close(fd);
+    }
+
+    void send(const uint8_t* data, size_t length, const sockaddr_storage& peer, socklen_t peer_length) {
+        if (closed) return;
+        if (inline_batch.endpoint == this) {
+            DatagramBatch& batch = *inline_batch.batch;
+            if (batch.full()) flush(batch);
+            if (batch.append(data, length, &peer, peer_length)) return;
+        }
+        if (sendto(fd, data, length, 0, reinterpret_cast<const sockaddr*>(&peer), peer_length) ==
+            static_cast<ssize_t>(length)) {
+            responses.fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+
+    void flush(DatagramBatch& batch) {
+        if (batch.empty()) return;
+        responses.fetch_add(batch.flush(fd), std::memory_order_relaxed);
+    }
+};
+
+DNSServer::DNSServer(DNSResolver& resolver, const Options& options) : resolver_(resolver), options_(options) {
+    // A client asking for A may only be helped by the family still out, so
+    // replies wait for both halves rather than take one early
+    options_.resolve.resolution_delay_ms = -1;
+    UDPTransport::ServerAddress local;
+    if (!UDPTransport::ServerAddress::parse(options.address, options.port, local)) {
+        throw std::runtime_error("DNSServer: bad address " + options.address);
+    }
+
+    const std::vector<int> cpus = usableCpus();
+    bindSockets(local, options.threads ? options.threads : std::max<size_t>(1, cpus.size()));
+    for (size_t i = 0; i < workers_.size(); ++i) {
+        auto endpoint = workers_[i].endpoint;
+        workers_[i].thread = std::thread([this, endpoint] { serveUdp(endpoint); });
+        if (options.pin_threads && !cpus.empty()) {
+            pinThread(workers_[i].thread, cpus[i % cpus.size()]);
+        }
+    }
+    if (tcp_fd_ >= 0) {
+        acceptor_ = std::thread([this] { acceptTcp(); });
+    }
+}
+
+DNSServer::~DNSServer() {
+    stop();
+}
+
+void DNSServer::bindSockets(UDPTransport::ServerAddress local, size_t threads) {
+    const UDPTransport::ServerAddress requested = local;
+    std::string error;
+    for (int attempt = 1;; ++attempt) {
+        local = requested;
+        workers_.clear();
+        for (size_t i = 0; i < threads; ++i) {
+            auto endpoint = std::make_shared<Endpoint>();
+            endpoint->fd = openSocket(local, SOCK_DGRAM, error);
+            if (endpoint->fd < 0) {
+                throw std::runtime_error("DNSServer: cannot bind UDP " + local.toString() + ": " + error);
+            }
+            if (i == 0) {
+                // With port 0 the first socket picks the port the others join
+                local.length = sizeof(local.addr);
+                getsockname(endpoint->fd, reinterpret_cast<sockaddr*>(&local.addr), &local.length);
+            }
+            workers_.push_back(Worker{endpoint, std::thread()});
+        }
+        if (!options_.tcp) break;
+        tcp_fd_ = openSocket(local, SOCK_STREAM, error);
+        if (tcp_fd_ >= 0) break;
+        // A free UDP port may still be taken for TCP; pick another
+        if (requested.port() != 0 || attempt == BIND_ATTEMPTS) {
+            throw std::runtime_error("DNSServer: cannot bind TCP " + local.toString() + ": " + error);
+        }
+    }
+    port_ = local.port();
+    address_ = local.toString();
+}
+
+void DNSServer::stop() {
+    if (stopped_) return;
+    stopped_ = true;
+    stop_ = true;
+    for (auto& worker : workers_) {
+        worker.thread.join();
+        worker.endpoint->closed = true;
+    }
+    if (acceptor_.joinable()) {
+        acceptor_.join();
+    }
+    for (auto& connection : connections_) {
+        connection->thread.join();
+    }
+    connections_.clear();
+    if (tcp_fd_ >= 0) {
+        close(tcp_fd_);
+        tcp_fd_ = -1;
+    }
+}
+
+uint64_t DNSServer::queries() const {
+    uint64_t total = tcp_queries_.load(std::memory_order_relaxed);
+    for (const auto& worker : workers_) total += worker.endpoint->queries.load(std::memory_order_relaxed);
+    return total;
+}
+
+uint64_t DNSServer::responses() const {
+    uint64_t total = tcp_responses_.load(std::memory_order_relaxed);
+    for (const auto& worker : workers_) total += worker.endpoint->responses.load(std::memory_order_relaxed);
+    return total;
+}
+
+uint64_t DNSServer::dropped() const {
+    uint64_t total = tcp_dropped_.load(std::memory_order_relaxed);
+    for (const auto& worker : workers_) total += worker.endpoint->dropped.load(std::memory_order_relaxed);
+    return total;
+}
+
+void DNSServer::serveUdp(const std::shared_ptr<Endpoint>& endpoint) {
+    const size_t batch_size = std::max<size_t>(options_.batch_size, 1);
+    DatagramBatch in(batch_size, MAX_QUERY);
+    DatagramBatch out(batch_size, DNSMessage::EDNS_UDP_SIZE);
+    while (!stop_) {
+        pollfd pfd{endpoint->fd, POLLIN, 0};
+        if (poll(&pfd, 1, IDLE_POLL_MS) <= 0) continue;
+        inline_batch = InlineBatch{endpoint.get(), &out};
+        // Drain what has arrived before polling again
+        for (size_t round = 0; round < MAX_BATCHES; ++round) {
+            size_t received = in.receive(endpoint->fd);
+            endpoint->queries.fetch_add(received, std::memory_order_relaxed);
+            for (size_t i = 0; i < received; ++i) {
+                handleUdp(endpoint, in.data(i), in.length(i), in.peer(i), in.peerLength(i));
+            }
+            endpoint->flush(out);
+            if (received < in.capacity()) break;
+        }
+        inline_batch = InlineBatch();
+    }
+}
+
+void DNSServer::handleUdp(const std::shared_ptr<Endpoint>& endpoint, const uint8_t* query, size_t length,
+                          const sockaddr_storage& peer, socklen_t peer_length) {
+    Request request;
+    RCode rcode = RCode::NoError;
+    std::string name;
+    uint8_t response[DNSMessage::EDNS_UDP_SIZE];
+    switch (parseRequest(query, length, options_.resolve.recursive, request, rcode, name)) {
+    case Action::Drop:
+        endpoint->dropped.fetch_add(1, std::memory_order_relaxed);
+        return;
+    case Action::Reject:
+        endpoint->send(response, emptyResponse(request, rcode, response), peer, peer_length);
+        return;
+    case Action::Relay: {
+        if (answeredLocally(resolver_.localZone().get(), name, rcode)) {
+            endpoint->send(response, emptyResponse(request, rcode, response), peer, peer_length);
+            return;
+        }
+        // Answered from the resolver's I/O thread, like a miss, so a slow
+        // upstream never holds up the worker
+        auto reply = [endpoint, request, peer, peer_length](const uint8_t* relayed, size_t relayed_length) {
+            uint8_t out[DNSMessage::EDNS_UDP_SIZE];
+            if (!relayed) {
+                endpoint->send(out, emptyResponse(request, RCode::ServFail, out), peer, peer_length);
+            } else if (relayed_length > request.limit) {
+                endpoint->send(out, emptyResponse(request, RCode::NoError, out, true), peer, peer_length);
+            } else {
+                endpoint->send(out, restoreId(request.head, relayed, relayed_length, out), peer, peer_length);
+            }
+        };
+        resolver_.relayAsync(query, length, options_.resolve, reply);
+        return;
+    }
+    case Action::Resolve:
+        break;
+    }
+
+    // Runs inline on a hit, so the answer goes out before the next datagram is read
+    auto reply = [endpoint, request, peer, peer_length](const DNSResolver::ResolveResult& result) {
+        uint8_t out[DNSMessage::EDNS_UDP_SIZE];
+        endpoint->send(out, buildAnswer(request, result, out, request.limit), peer, peer_length);
+    };
+    try {
+        resolver_.resolveAsyncDetailed(name, options_.resolve, reply);
+    } catch (const std::exception& e) {
+        std::cerr << "DNSServer: cannot resolve " << name << ": " << e.what() << std::endl;
+        reply(DNSResolver::ResolveResult());
+    }
+}
+
+size_t DNSServer::answer(const uint8_t* query, size_t length, uint8_t* out, size_t capacity) {
+    Request request;
+    RCode rcode = RCode::NoError;
+    std::string name;
+    switch (parseRequest(query, length, options_.resolve.recursive, request, rcode, name)) {
+    case Action::Drop:
+        return 0;
+    case Action::Reject:
+        return emptyResponse(request, rcode, out);
+    case Action::Relay: {
+        if (answeredLocally(resolver_.localZone().get(), name, rcode)) return emptyResponse(request, rcode, out);
+        size_t relayed = relay(query, length, out, capacity);
+        return relayed ? relayed : emptyResponse(request, RCode::ServFail, out);
+    }
+    case Action::Resolve:
+        break;
+    }
+    DNSResolver::ResolveResult result;  // Failure unless the resolve completes
+    try {
+        result = resolver_.resolveDetailed(name, options_.resolve);
+    } catch (const std::exception& e) {
+        std::cerr << "DNSServer: cannot resolve " << name << ": " << e.what() << std::endl;
+    }
+    return buildAnswer(request, result, out, capacity);
+}
+
+size_t DNSServer::relay(const uint8_t* query, size_t length, uint8_t* out, size_t capacity) {
+    std::promise<size_t> relayed;
+    auto done = relayed.get_future();
+    resolver_.relayAsync(query, length, options_.resolve, [&](const uint8_t* response, size_t size) {
+        relayed.set_value(response && size <= capacity ? restoreId(query, response, size, out) : 0);
+    });
+    return done.get();
+}
+
+void DNSServer::acceptTcp() {
+    while (!stop_) {
+        pollfd pfd{tcp_fd_, POLLIN, 0};
+        int ready = poll(&pfd, 1, IDLE_POLL_MS);
+        for (auto it = connections_.begin(); it != connections_.end();) {
+            if ((*it)->done) {
+                (*it)->thread.join();
+                it = connections_.erase(it);
+            } else {
+                ++it;
+            }
+        }
+        if (ready <= 0) continue;
+        int fd = accept4(tcp_fd_, nullptr, nullptr, SOCK_CLOEXEC);
+        if (fd < 0) continue;
+        if (connections_.size() >= options_.max_tcp_connections) {
+            close(fd);  // RFC 7766 lets a busy server close new connections
+            continue;
+        }
+        // A client that stops reading must not hold the connection's thread forever
+        timeval timeout{};
+        timeout.tv_sec = static_cast<time_t>(options_.tcp_idle_timeout.count() / 1000);
+        timeout.tv_usec = static_cast<suseconds_t>(options_.tcp_idle_timeout.count() % 1000 * 1000);
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+        std::unique_ptr<Connection> connection(new Connection());
+        connection->fd = fd;
+        Connection* serving = connection.get();
+        connection->thread = std::thread([this, serving] { serveTcp(*serving); });
+        connections_.push_back(std::move(connection));
+    }
+}
+
+void DNSServer::serveTcp(Connection& connection) {
+    std::vector<uint8_t> query(MAX_MESSAGE);
+    std::vector<uint8_t> response(2 + MAX_MESSAGE);
+    while (true) {
+        // Each message is preceded by its length (RFC 1035 section 4.2.2)
+        uint8_t prefix[2];
+        if (!receiveAll(connection.fd, prefix, 2, Clock::now() + options_.tcp_idle_timeout, stop_)) break;
+        size_t length = DNSMessage::readU16(prefix);
+        if (length == 0 ||
+            !receiveAll(connection.fd, query.data(), length, Clock::now() + options_.tcp_idle_timeout, stop_)) {
+            break;
+        }
+        tcp_queries_.fetch_add(1, std::memory_order_relaxed);
+        size_t response_length = answer(query.data(), length, response.data() + 2, MAX_MESSAGE);
+        if (response_length == 0) {
+            tcp_dropped_.fetch_add(1, std::memory_order_relaxed);
+            continue;
+        }
+        DNSMessage::writeU16(response.data(), static_cast<uint16_t>(response_length));
+        if (!sendAll(connection.fd, response.data(), response_length + 2)) break;
+        tcp_responses_.fetch_add(1, std::memory_order_relaxed);
+    }
+    close(connection.fd);
+    connection.done = true;
+}
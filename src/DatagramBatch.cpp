@@ -0,0 +1,85 @@
+#include "DatagramBatch.h"
+#include <cerrno>
+#include <cstring>
+
+DatagramBatch::DatagramBatch(size_t capacity, size_t buffer_size)
+    : buffer_size_(buffer_size), buffers_(capacity * buffer_size), peers_(capacity), iovecs_(capacity),
+      headers_(capacity) {
+    for (size_t i = 0; i < capacity; ++i) {
+        iovecs_[i].iov_base = data(i);
+        iovecs_[i].iov_len = buffer_size_;
+        std::memset(&headers_[i], 0, sizeof(headers_[i]));
+        headers_[i].msg_hdr.msg_iov = &iovecs_[i];
+        headers_[i].msg_hdr.msg_iovlen = 1;
+    }
+}
+
+size_t DatagramBatch::receive(int fd) {
+    size_ = 0;
+    for (size_t i = 0; i < headers_.size(); ++i) {
+        iovecs_[i].iov_len = buffer_size_;
+        headers_[i].msg_hdr.msg_name = &peers_[i];
+        headers_[i].msg_hdr.msg_namelen = sizeof(sockaddr_storage);
+        headers_[i].msg_hdr.msg_flags = 0;
+    }
+    int n;
+    do {
+        n = recvmmsg(fd, headers_.data(), static_cast<unsigned>(headers_.size()), MSG_DONTWAIT, nullptr);
+    } while (n < 0 && errno == EINTR);
+    if (n <= 0) return 0;
+    size_ = static_cast<size_t>(n);
+    for (size_t i = 0; i < size_; ++i) {
+        if (headers_[i].msg_hdr.msg_flags & MSG_TRUNC) headers_[i].msg_len = 0;
+    }
+    return size_;
+}
+
+void DatagramBatch::commit(size_t length, const sockaddr_storage* peer, socklen_t peer_length) {
+    iovecs_[size_].iov_len = length;
+    auto& header = headers_[size_].msg_hdr;
+    if (peer) {
+        std::memcpy(&peers_[size_], peer, peer_length);
+        header.msg_name = &peers_[size_];
+        header.msg_namelen = peer_length;
+    } else {
+        header.msg_name = nullptr;
+        header.msg_namelen = 0;
+    }
+    headers_[size_].msg_len = static_cast<unsigned>(length);
+    ++size_;
+}
+
+bool DatagramBatch::append(const uint8_t* data, size_t length, const sockaddr_storage* peer,
+                           socklen_t peer_length) {
+    uint8_t* buffer = prepare();
+    if (!buffer || length > buffer_size_) return false;
+    std::memcpy(buffer, data, length);
+    commit(length, peer, peer_length);
+    return true;
+}
+
+size_t DatagramBatch::flush(int fd, std::vector<size_t>* failed) {
+    size_t sent = 0;
+    size_t offset = 0;
+    while (offset < size_) {
+        int n = sendmmsg(fd, &headers_[offset], static_cast<unsigned>(size_ - offset), 0);
+        if (n > 0) {
+            sent += static_cast<size_t>(n);
+            offset += static_cast<size_t>(n);
+            continue;
+        }
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            // Socket buffer full: the rest would fail the same way
+            for (; offset < size_; ++offset) {
+                if (failed) failed->push_back(offset);
+            }
+            break;
+        }
+        // The first datagram was refused; skip it and send the others
+        if (failed) failed->push_back(offset);
+        ++offset;
+    }
+    size_ = 0;
+    return sent;
+}
@@ -0,0 +1,83 @@
+#include "DomainName.h"
+#include <Poco/Net/DNS.h>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+
+namespace {
+
+constexpr uint64_t HIGH_BITS = 0x8080808080808080ULL;
+constexpr size_t IDN_MEMO_SIZE = 64;  // Per thread; a power of two
+
+// Recent IDN conversions, direct-mapped by hash: a hit costs one hash and
+// one compare, and a collision just replaces the older entry.
+struct IdnMemo {
+    struct Entry {
+        std::string input;
+        std::string output;
+    };
+    Entry entries[IDN_MEMO_SIZE];
+};
+
+// Lower-cases the ASCII letters in eight bytes that are all below 0x80.
+// Adding 0x3F sets a byte's high bit when it is >= 'A', adding 0x25 when it
+// is > 'Z'; neither sum carries into the next byte.
+inline uint64_t lowerEight(uint64_t word) {
+    uint64_t at_least_a = word + 0x3F3F3F3F3F3F3F3FULL;
+    uint64_t above_z = word + 0x2525252525252525ULL;
+    uint64_t upper = at_least_a & ~above_z & HIGH_BITS;
+    return word | (upper >> 2);  // 0x80 >> 2 is the case bit, 0x20
+}
+
+}  // namespace
+
+DomainName::DomainName(std::string_view name) {
+    assign(name);
+}
+
+void DomainName::assign(std::string_view name) {
+    if (!canonicalASCII(name, text_) && !canonicalASCII(toASCII(name), text_)) {
+        // The conversion failed and left bytes outside ASCII. Keep the name
+        // as given, lower-cased where it is ASCII, so it is still one key.
+        if (!name.empty() && name.back() == '.') name.remove_suffix(1);
+        text_.assign(name.data(), name.size());
+        for (char& c : text_) {
+            if (c >= 'A' && c <= 'Z') c = static_cast<char>(c | 0x20);
+        }
+    }
+    hash_ = std::hash<std::string_view>()(text_);
+}
+
+bool DomainName::canonicalASCII(std::string_view name, std::string& out) {
+    if (!name.empty() && name.back() == '.') name.remove_suffix(1);
+    out.resize(name.size());
+    const char* in = name.data();
+    char* to = &out[0];
+    size_t i = 0;
+    for (; i + 8 <= name.size(); i += 8) {
+        uint64_t word;
+        std::memcpy(&word, in + i, 8);
+        if (word & HIGH_BITS) return false;
+        word = lowerEight(word);
+        std::memcpy(to + i, &word, 8);
+    }
+    for (; i < name.size(); ++i) {
+        unsigned char c = static_cast<unsigned char>(in[i]);
+        if (c >= 0x80) return false;
+        to[i] = static_cast<char>(c >= 'A' && c <= 'Z' ? c | 0x20 : c);
+    }
+    return true;
+}
+
+std::string DomainName::toASCII(std::string_view name) {
+    std::string input(name);
+    if (!Poco::Net::DNS::isIDN(input)) return input;
+
+    thread_local IdnMemo memo;
+    auto& entry = memo.entries[std::hash<std::string_view>()(name) & (IDN_MEMO_SIZE - 1)];
+    if (entry.input != input) {
+        entry.output = Poco::Net::DNS::encodeIDN(input);
+        entry.input = std::move(input);
+    }
+    return entry.output;
+}
@@ -0,0 +1,112 @@
+#include "EpochManager.h"
+#include <algorithm>
+#include <limits>
+
+// Per-thread slot ownership; the slot is handed back when the thread exits.
+struct EpochManager::ThreadRecord {
+    Slot* slot = nullptr;
+    int depth = 0;
+
+    ~ThreadRecord() {
+        if (slot) EpochManager::instance().releaseSlot(slot);
+    }
+};
+
+EpochManager& EpochManager::instance() {
+    // Never destroyed: thread exit handlers may run after static destructors
+    static EpochManager* manager = new EpochManager();
+    return *manager;
+}
+
+EpochManager::ThreadRecord& EpochManager::threadRecord() {
+    thread_local ThreadRecord record;
+    return record;
+}
+
+EpochManager::Slot* EpochManager::acquireSlot() {
+    for (Slot* slot = slots_.load(std::memory_order_acquire); slot; slot = slot->next) {
+        bool expected = false;
+        if (!slot->in_use.load(std::memory_order_relaxed) &&
+            slot->in_use.compare_exchange_strong(expected, true)) {
+            return slot;
+        }
+    }
+    Slot* slot = new Slot();
+    slot->in_use.store(true, std::memory_order_relaxed);
+    Slot* head = slots_.load(std::memory_order_relaxed);
+    do {
+        slot->next = head;
+    } while (!slots_.compare_exchange_weak(head, slot, std::memory_order_release,
+                                           std::memory_order_relaxed));
+    return slot;
+}
+
+void EpochManager::releaseSlot(Slot* slot) {
+    slot->epoch.store(0, std::memory_order_release);
+    slot->in_use.store(false, std::memory_order_release);
+}
+
+EpochManager::Guard::Guard() {
+    ThreadRecord& record = threadRecord();
+    if (record.depth++ > 0) return;
+    if (!record.slot) record.slot = instance().acquireSlot();
+    // seq_cst: the slot must be visible before any shared pointer is loaded
+    record.slot->epoch.store(instance().global_epoch_.load(std::memory_order_seq_cst),
+                             std::memory_order_seq_cst);
+}
+
+EpochManager::Guard::~Guard() {
+    release();
+}
+
+EpochManager::Guard& EpochManager::Guard::operator=(Guard&& other) noexcept {
+    if (this != &other) {
+        release();
+        active_ = other.active_;
+        other.active_ = false;
+    }
+    return *this;
+}
+
+void EpochManager::Guard::release() {
+    if (!active_) return;
+    active_ = false;
+    ThreadRecord& record = threadRecord();
+    if (--record.depth > 0) return;
+    record.slot->epoch.store(0, std::memory_order_release);
+}
+
+void EpochManager::retire(void* ptr, Deleter deleter) {
+    uint64_t epoch = global_epoch_.load(std::memory_order_seq_cst);
+    std::lock_guard<std::mutex> lock(retired_mutex_);
+    retired_.push_back(Retired{ptr, deleter, epoch});
+}
+
+void EpochManager::reclaim() {
+    std::vector<Retired> ready;
+    {
+        std::lock_guard<std::mutex> lock(retired_mutex_);
+        if (retired_.empty()) return;
+
+        // Readers that enter from now on start at the new epoch and can
+        // only see the structure after the unlinks that preceded retire().
+        uint64_t oldest = global_epoch_.fetch_add(1, std::memory_order_seq_cst) + 1;
+        for (Slot* slot = slots_.load(std::memory_order_acquire); slot; slot = slot->next) {
+            uint64_t epoch = slot->epoch.load(std::memory_order_seq_cst);
+            if (epoch != 0) oldest = std::min(oldest, epoch);
+        }
+
+        auto split = std::partition(retired_.begin(), retired_.end(),
+                                    [oldest](const Retired& r) { return r.epoch >= oldest; });
+        ready.assign(split, retired_.end());
+        retired_.erase(split, retired_.end());
+    }
+    for (const auto& r : ready) {
+        r.deleter(r.ptr);
+    }
+}
+
+size_t EpochManager::pendingCount() const {
+    std::lock_guard<std::mutex> lock(retired_mutex_);
+    return retired_.size();
+}
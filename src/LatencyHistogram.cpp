@@ -0,0 +1,71 @@
+#include "LatencyHistogram.h"
+#include <algorithm>
+#include <cmath>
+
+LatencyHistogram& LatencyHistogram::operator=(const LatencyHistogram& other) {
+    if (this != &other) {
+        clear();
+        merge(other);
+    }
+    return *this;
+}
+
+size_t LatencyHistogram::bucketOf(uint64_t value) {
+    if (value < 2 * SUB_BUCKETS) return static_cast<size_t>(value);
+    // value >> shift lies in [SUB_BUCKETS, 2 * SUB_BUCKETS)
+    const unsigned shift = 63 - static_cast<unsigned>(__builtin_clzll(value)) - SUB_BUCKET_BITS;
+    return shift * SUB_BUCKETS + static_cast<size_t>(value >> shift);
+}
+
+uint64_t LatencyHistogram::bucketTop(size_t bucket) {
+    if (bucket < 2 * SUB_BUCKETS) return bucket;
+    const unsigned shift = static_cast<unsigned>(bucket / SUB_BUCKETS) - 1;
+    const uint64_t sub = bucket - shift * SUB_BUCKETS;
+    return ((sub + 1) << shift) - 1;
+}
+
+void LatencyHistogram::merge(const LatencyHistogram& other) {
+    for (size_t i = 0; i < BUCKETS; ++i) {
+        uint64_t n = other.buckets_[i].load(std::memory_order_relaxed);
+        if (n) bump(buckets_[i], n);
+    }
+    bump(count_, other.count());
+    bump(sum_, other.sum());
+    if (other.max() > max()) max_.store(other.max(), std::memory_order_relaxed);
+}
+
+void LatencyHistogram::clear() {
+    for (auto& bucket : buckets_) bucket.store(0, std::memory_order_relaxed);
+    count_.store(0, std::memory_order_relaxed);
+    sum_.store(0, std::memory_order_relaxed);
+    max_.store(0, std::memory_order_relaxed);
+}
+
+double LatencyHistogram::mean() const {
+    uint64_t n = count();
+    return n ? static_cast<double>(sum()) / n : 0;
+}
+
+uint64_t LatencyHistogram::countAtOrBelow(uint64_t limit) const {
+    uint64_t total = 0;
+    for (size_t i = 0; i < BUCKETS && bucketTop(i) <= limit; ++i) {
+        total += buckets_[i].load(std::memory_order_relaxed);
+    }
+    return total;
+}
+
+uint64_t LatencyHistogram::percentile(double quantile) const {
+    // Totals are summed from the buckets rather than count_, so a snapshot
+    // taken while another thread records stays self-consistent
+    uint64_t total = 0;
+    for (const auto& bucket : buckets_) total += bucket.load(std::memory_order_relaxed);
+    if (total == 0) return 0;
+    quantile = std::min(std::max(quantile, 0.0), 1.0);
+    const uint64_t rank = std::max<uint64_t>(1, static_cast<uint64_t>(std::ceil(quantile * total)));
+    uint64_t seen = 0;
+    for (size_t i = 0; i < BUCKETS; ++i) {
+        seen += buckets_[i].load(std::memory_order_relaxed);
+        if (seen >= rank) return std::min(bucketTop(i), max());
+    }
+    return max();
+}
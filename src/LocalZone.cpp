@@ -0,0 +1,318 @@
+#include "LocalZone.h"
+#include <arpa/inet.h>
+#include <algorithm>
+#include <cctype>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <sstream>
+
+namespace {
+
+constexpr size_t MAX_NAME_LENGTH = 253;
+constexpr size_t MAX_ADDRESSES = 255;  // Per family and name; Rule keeps 8-bit counts
+
+std::string lowerCase(std::string text) {
+    std::transform(text.begin(), text.end(), text.begin(),
+                   [](unsigned char c) { return static_cast<char>(std::tolower(c)); });
+    return text;
+}
+
+bool isNumber(const std::string& token) {
+    return !token.empty() && std::all_of(token.begin(), token.end(), [](unsigned char c) { return std::isdigit(c); });
+}
+
+// Splits a line into whitespace separated tokens, dropping everything from
+// the comment character on.
+std::vector<std::string> tokenize(const std::string& line, char comment) {
+    std::istringstream in(line.substr(0, line.find(comment)));
+    std::vector<std::string> tokens;
+    for (std::string token; in >> token;) tokens.push_back(token);
+    return tokens;
+}
+
+size_t hashName(std::string_view name) { return std::hash<std::string_view>()(name); }
+
+uint32_t checkOf(size_t hash) { return static_cast<uint32_t>(static_cast<uint64_t>(hash) >> 32); }
+
+// Strips one trailing dot and lower-cases; empty if the name is unusable.
+std::string canonicalName(std::string name) {
+    if (!name.empty() && name.back() == '.') name.pop_back();
+    if (name.empty() || name.size() > MAX_NAME_LENGTH) return {};
+    return lowerCase(std::move(name));
+}
+
+bool endsWith(const std::string& text, const std::string& suffix) {
+    return text.size() >= suffix.size() && text.compare(text.size() - suffix.size(), suffix.size(), suffix) == 0;
+}
+
+}  // namespace
+
+bool LocalZone::Builder::addHosts(std::istream& in, std::string& error) {
+    std::string line;
+    for (int number = 1; std::getline(in, line); ++number) {
+        auto tokens = tokenize(line, '#');
+        if (tokens.empty()) continue;
+        auto fail = [&](const std::string& why) {
+            error = "line " + std::to_string(number) + ": " + why;
+            return false;
+        };
+        if (tokens.size() < 2) return fail("address without a name");
+
+        uint8_t bytes[16];
+        bool v4 = inet_pton(AF_INET, tokens[0].c_str(), bytes) == 1;
+        if (!v4 && inet_pton(AF_INET6, tokens[0].c_str(), bytes) != 1) return fail("bad address " + tokens[0]);
+        static const uint8_t unspecified[16] = {};
+        bool blocked = std::memcmp(bytes, unspecified, v4 ? 4 : 16) == 0;
+
+        for (size_t i = 1; i < tokens.size(); ++i) {
+            if (canonicalName(tokens[i]).empty()) return fail("bad name " + tokens[i]);
+            if (blocked) {
+                add(tokens[i], false, Action::NXDomain);
+            } else {
+                add(tokens[i], false, Action::Answer, {tokens[0]});
+            }
+        }
+    }
+    return true;
+}
+
+bool LocalZone::Builder::addRpz(std::istream& in, std::string& error) {
+    std::string origin;
+    uint32_t default_ttl = DEFAULT_TTL;
+    std::string owner;
+    bool have_owner = false;
+    std::string line;
+    for (int number = 1; std::getline(in, line); ++number) {
+        auto tokens = tokenize(line, ';');
+        if (tokens.empty()) continue;
+        auto fail = [&](const std::string& why) {
+            error = "line " + std::to_string(number) + ": " + why;
+            return false;
+        };
+
+        if (tokens[0] == "$ORIGIN") {
+            if (tokens.size() != 2) return fail("$ORIGIN takes one name");
+            origin = canonicalName(tokens[1]);
+            continue;
+        }
+        if (tokens[0] == "$TTL") {
+            if (tokens.size() != 2 || !isNumber(tokens[1])) return fail("$TTL takes one number");
+            default_ttl = static_cast<uint32_t>(std::stoul(tokens[1]));
+            continue;
+        }
+
+        size_t next = 0;
+        if (!std::isspace(static_cast<unsigned char>(line[0]))) {
+            // Triggers are named relative to the policy zone: an absolute
+            // owner inside it loses the zone's name, and "@" is the apex.
+            std::string name = tokens[next++];
+            bool absolute = !name.empty() && name.back() == '.';
+            name = name == "@" ? std::string() : lowerCase(absolute ? name.substr(0, name.size() - 1) : name);
+            if (absolute && !origin.empty()) {
+                if (name == origin) {
+                    name.clear();
+                } else if (endsWith(name, "." + origin)) {
+                    name.resize(name.size() - origin.size() - 1);
+                }
+            }
+            owner = name;
+            have_owner = true;
+        } else if (!have_owner) {
+            return fail("record without an owner");
+        }
+        uint32_t ttl = default_ttl;
+        for (;; ++next) {
+            if (next >= tokens.size()) return fail("missing type");
+            if (isNumber(tokens[next])) {
+                ttl = static_cast<uint32_t>(std::stoul(tokens[next]));
+            } else if (lowerCase(tokens[next]) != "in") {
+                break;
+            }
+        }
+        std::string type = lowerCase(tokens[next]);
+        std::vector<std::string> rdata(tokens.begin() + next + 1, tokens.end());
+
+        // The zone's own SOA and NS, and triggers other than query names
+        // (client IP, response IP and nameserver triggers), are not ours.
+        if (owner.empty() || type == "soa" || type == "ns") continue;
+        std::string last_label = owner.substr(owner.rfind('.') + 1);
+        if (last_label.compare(0, 4, "rpz-") == 0) continue;
+
+        bool wildcard = owner.compare(0, 2, "*.") == 0;
+        std::string name = wildcard ? owner.substr(2) : owner;
+        if (canonicalName(name).empty() || name.find('*') != std::string::npos) return fail("bad name " + owner);
+
+        if (type == "cname") {
+            if (rdata.size() != 1) return fail("CNAME takes one target");
+            std::string target = lowerCase(rdata[0]);
+            if (target == ".") {
+                add(name, wildcard, Action::NXDomain, {}, ttl);
+            } else if (target == "*.") {
+                add(name, wildcard, Action::NoData, {}, ttl);
+            } else if (target == "rpz-passthru.") {
+                add(name, wildcard, Action::Passthru, {}, ttl);
+            } else if (target == "rpz-drop.") {
+                // Not answering at all would leave stub resolvers retrying;
+                // NXDOMAIN blocks the name just as well.
+                add(name, wildcard, Action::NXDomain, {}, ttl);
+            } else {
+                return fail("unsupported policy CNAME " + rdata[0]);
+            }
+        } else if (type == "a" || type == "aaaa") {
+            if (rdata.size() != 1) return fail("address record takes one address");
+            uint8_t bytes[16];
+            if (inet_pton(type == "a" ? AF_INET : AF_INET6, rdata[0].c_str(), bytes) != 1) {
+                return fail("bad address " + rdata[0]);
+            }
+            add(name, wildcard, Action::Answer, rdata, ttl);
+        } else {
+            return fail("unsupported type " + tokens[next]);
+        }
+    }
+    return true;
+}
+
+bool LocalZone::Builder::loadHosts(const std::string& path, std::string& error) {
+    std::ifstream file(path);
+    if (!file) {
+        error = "cannot open " + path;
+        return false;
+    }
+    if (!addHosts(file, error)) {
+        error = path + ": " + error;
+        return false;
+    }
+    return true;
+}
+
+bool LocalZone::Builder::loadRpz(const std::string& path, std::string& error) {
+    std::ifstream file(path);
+    if (!file) {
+        error = "cannot open " + path;
+        return false;
+    }
+    if (!addRpz(file, error)) {
+        error = path + ": " + error;
+        return false;
+    }
+    return true;
+}
+
+void LocalZone::Builder::add(const std::string& name, bool wildcard, Action action,
+                             const std::vector<std::string>& addresses, uint32_t ttl) {
+    std::string key = canonicalName(name);
+    if (key.empty()) return;
+    auto& rules = wildcard ? wildcard_ : exact_;
+    auto found = rules.find(key);
+    if (found == rules.end() || action != Action::Answer || found->second.action != Action::Answer) {
+        found = rules.insert_or_assign(key, Pending{action, ttl, {}, {}}).first;
+    }
+    Pending& rule = found->second;
+    rule.ttl = std::min(rule.ttl, ttl);
+    for (const auto& address : addresses) {
+        uint8_t bytes[16];
+        if (inet_pton(AF_INET, address.c_str(), bytes) == 1) {
+            if (rule.ipv4.size() / 4 < MAX_ADDRESSES) rule.ipv4.insert(rule.ipv4.end(), bytes, bytes + 4);
+        } else if (inet_pton(AF_INET6, address.c_str(), bytes) == 1) {
+            if (rule.ipv6.size() / 16 < MAX_ADDRESSES) rule.ipv6.insert(rule.ipv6.end(), bytes, bytes + 16);
+        }
+    }
+}
+
+std::shared_ptr<const LocalZone> LocalZone::Builder::build() {
+    auto zone = std::make_shared<LocalZone>();
+    zone->rules_.reserve(size());
+
+    auto compile = [&](std::unordered_map<std::string, Pending>& rules, Table& table) {
+        size_t capacity = 2;
+        while (capacity < rules.size() * 2) capacity *= 2;  // Load factor at most 1/2
+        table.slots.assign(capacity, Slot{0, 0});
+        table.mask = capacity - 1;
+        for (auto& [name, pending] : rules) {
+            Rule rule;
+            rule.name_offset = static_cast<uint32_t>(zone->names_.size());
+            rule.name_length = static_cast<uint8_t>(name.size());
+            rule.address_offset = static_cast<uint32_t>(zone->addresses_.size());
+            rule.ttl = pending.ttl;
+            rule.action = pending.action;
+            rule.ipv4_count = static_cast<uint8_t>(pending.ipv4.size() / 4);
+            rule.ipv6_count = static_cast<uint8_t>(pending.ipv6.size() / 16);
+            zone->names_.insert(zone->names_.end(), name.begin(), name.end());
+            zone->addresses_.insert(zone->addresses_.end(), pending.ipv4.begin(), pending.ipv4.end());
+            zone->addresses_.insert(zone->addresses_.end(), pending.ipv6.begin(), pending.ipv6.end());
+            zone->rules_.push_back(rule);
+            insert(table, hashName(name), static_cast<uint32_t>(zone->rules_.size()));
+        }
+        rules.clear();
+    };
+    compile(exact_, zone->exact_);
+    compile(wildcard_, zone->wildcard_);
+    zone->names_.shrink_to_fit();
+    zone->addresses_.shrink_to_fit();
+    return zone;
+}
+
+void LocalZone::insert(Table& table, size_t hash, uint32_t rule) {
+    for (size_t i = hash & table.mask;; i = (i + 1) & table.mask) {
+        if (table.slots[i].rule == 0) {
+            table.slots[i] = Slot{checkOf(hash), rule};
+            return;
+        }
+    }
+}
+
+const LocalZone::Rule* LocalZone::probe(const Table& table, std::string_view name) const {
+    size_t hash = hashName(name);
+    uint32_t check = checkOf(hash);
+    for (size_t i = hash & table.mask;; i = (i + 1) & table.mask) {
+        const Slot& slot = table.slots[i];
+        if (slot.rule == 0) return nullptr;
+        if (slot.check != check) continue;
+        const Rule& rule = rules_[slot.rule - 1];
+        if (rule.name_length == name.size() &&
+            std::memcmp(names_.data() + rule.name_offset, name.data(), name.size()) == 0) {
+            return &rule;
+        }
+    }
+}
+
+void LocalZone::fill(const Rule& rule, Match& match) const {
+    const uint8_t* addresses = addresses_.data() + rule.address_offset;
+    match.action = rule.action;
+    match.ttl = rule.ttl;
+    match.ipv4 = addresses;
+    match.ipv4_count = rule.ipv4_count;
+    match.ipv6 = addresses + 4 * rule.ipv4_count;
+    match.ipv6_count = rule.ipv6_count;
+}
+
+bool LocalZone::find(std::string_view name, Match& match) const {
+    if (rules_.empty()) return false;
+    if (!name.empty() && name.back() == '.') name.remove_suffix(1);
+    if (name.empty() || name.size() > MAX_NAME_LENGTH) return false;
+
+    char lowered[MAX_NAME_LENGTH];
+    for (size_t i = 0; i < name.size(); ++i) {
+        char c = name[i];
+        lowered[i] = (c >= 'A' && c <= 'Z') ? static_cast<char>(c + ('a' - 'A')) : c;
+    }
+    std::string_view key(lowered, name.size());
+
+    if (const Rule* rule = probe(exact_, key)) {
+        fill(*rule, match);
+        return true;
+    }
+    for (size_t dot = key.find('.'); dot != std::string_view::npos; dot = key.find('.', dot + 1)) {
+        if (const Rule* rule = probe(wildcard_, key.substr(dot + 1))) {
+            fill(*rule, match);
+            return true;
+        }
+    }
+    return false;
+}
+
+size_t LocalZone::memoryUsage() const {
+    return names_.capacity() + addresses_.capacity() + rules_.capacity() * sizeof(Rule) +
+           (exact_.slots.capacity() + wildcard_.slots.capacity()) * sizeof(Slot);
+}
@@ -0,0 +1,620 @@
+#include "MockDNSServer.h"
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cctype>
+#include <cerrno>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+
+namespace {
+
+constexpr int MAX_CNAME_CHAIN = 8;
+constexpr int IDLE_POLL_MS = 20;  // How often an idle server checks for shutdown
+
+using RT = DNSMessage::RecordType;
+
+// Orders the delayed-reply heap so the earliest reply is on top
+const auto due_later = [](const auto& a, const auto& b) { return a.due > b.due; };
+
+std::string lowerCase(std::string text) {
+    std::transform(text.begin(), text.end(), text.begin(),
+                   [](unsigned char c) { return static_cast<char>(std::tolower(c)); });
+    return text;
+}
+
+bool isNumber(const std::string& token) {
+    return !token.empty() && std::all_of(token.begin(), token.end(), [](unsigned char c) { return std::isdigit(c); });
+}
+
+
+// Splits a line into whitespace separated tokens, keeping quoted strings
+// (TXT data) together and dropping a trailing ';' comment.
+std::vector<std::string> tokenize(const std::string& line) {
+    std::vector<std::string> tokens;
+    std::string current;
+    bool quoted = false, in_token = false;
+    for (char c : line) {
+        if (quoted) {
+            if (c == '"') {
+                quoted = false;
+            } else {
+                current += c;
+            }
+        } else if (c == '"') {
+            quoted = in_token = true;
+        } else if (c == ';') {
+            break;
+        } else if (std::isspace(static_cast<unsigned char>(c))) {
+            if (in_token) tokens.push_back(current);
+            current.clear();
+            in_token = false;
+        } else {
+            current += c;
+            in_token = true;
+        }
+    }
+    if (in_token) tokens.push_back(current);
+    return tokens;
+}
+
+// Makes a master-file name absolute: "@" is the origin and names without a
+// trailing dot are relative to it.
+std::string absoluteName(const std::string& name, const std::string& origin) {
+    if (name == "@") return origin;
+    if (!name.empty() && name.back() == '.') return lowerCase(name.substr(0, name.size() - 1));
+    return lowerCase(origin.empty() ? name : name + "." + origin);
+}
+
+std::string parentOf(const std::string& name) {
+    size_t dot = name.find('.');
+    return dot == std::string::npos ? std::string() : name.substr(dot + 1);
+}
+
+void appendU16(std::vector<uint8_t>& out, uint16_t value) {
+    uint8_t bytes[2];
+    DNSMessage::writeU16(bytes, value);
+    out.insert(out.end(), bytes, bytes + 2);
+}
+
+void appendU32(std::vector<uint8_t>& out, uint32_t value) {
+    uint8_t bytes[4];
+    DNSMessage::writeU32(bytes, value);
+    out.insert(out.end(), bytes, bytes + 4);
+}
+
+bool appendName(std::vector<uint8_t>& out, const std::string& name) {
+    uint8_t buffer[DNSMessage::MAX_NAME_LENGTH + 1];
+    size_t length = DNSMessage::encodeName(buffer, sizeof(buffer), name);
+    if (length == 0) return false;
+    out.insert(out.end(), buffer, buffer + length);
+    return true;
+}
+
+bool parseU16(const std::string& token, uint16_t& value) {
+    if (!isNumber(token) || token.size() > 5 || std::stoul(token) > 0xFFFF) return false;
+    value = static_cast<uint16_t>(std::stoul(token));
+    return true;
+}
+
+bool encodeRdata(RT type, const std::vector<std::string>& tokens, const std::string& origin,
+                 std::vector<uint8_t>& rdata, std::string& error) {
+    auto expect = [&](size_t count) {
+        if (tokens.size() == count) return true;
+        error = "expected " + std::to_string(count) + " rdata fields";
+        return false;
+    };
+    switch (type) {
+    case RT::A:
+    case RT::AAAA: {
+        if (!expect(1)) return false;
+        uint8_t bytes[16];
+        int family = type == RT::A ? AF_INET : AF_INET6;
+        if (inet_pton(family, tokens[0].c_str(), bytes) != 1) {
+            error = "bad address " + tokens[0];
+            return false;
+        }
+        rdata.assign(bytes, bytes + (type == RT::A ? 4 : 16));
+        return true;
+    }
+    case RT::NS:
+    case RT::CNAME:
+    case RT::PTR:
+        if (!expect(1)) return false;
+        if (!appendName(rdata, absoluteName(tokens[0], origin))) break;
+        return true;
+    case RT::MX: {
+        uint16_t preference;
+        if (!expect(2)) return false;
+        if (!parseU16(tokens[0], preference)) break;
+        appendU16(rdata, preference);
+        if (!appendName(rdata, absoluteName(tokens[1], origin))) break;
+        return true;
+    }
+    case RT::SRV: {
+        uint16_t fields[3];
+        if (!expect(4)) return false;
+        for (int i = 0; i < 3; ++i) {
+            if (!parseU16(tokens[i], fields[i])) return error = "bad SRV field " + tokens[i], false;
+            appendU16(rdata, fields[i]);
+        }
+        if (!appendName(rdata, absoluteName(tokens[3], origin))) break;
+        return true;
+    }
+    case RT::TXT:
+        if (tokens.empty()) return expect(1);
+        for (const auto& text : tokens) {
+            if (text.size() > 255) return error = "TXT string longer than 255 bytes", false;
+            rdata.push_back(static_cast<uint8_t>(text.size()));
+            rdata.insert(rdata.end(), text.begin(), text.end());
+        }
+        return true;
+    case RT::SOA:
+        if (!expect(7)) return false;
+        if (!appendName(rdata, absoluteName(tokens[0], origin)) ||
+            !appendName(rdata, absoluteName(tokens[1], origin))) {
+            break;
+        }
+        for (int i = 2; i < 7; ++i) {
+            if (!isNumber(tokens[i])) return error = "bad SOA field " + tokens[i], false;
+            appendU32(rdata, static_cast<uint32_t>(std::stoul(tokens[i])));
+        }
+        return true;
+    default:
+        error = "unsupported type";
+        return false;
+    }
+    error = "bad rdata";
+    return false;
+}
+
+// Reads an uncompressed wire-form name (as stored in rdata) back to dotted form.
+std::string wireToDotted(const uint8_t* data, size_t length) {
+    std::string name;
+    for (size_t pos = 0; pos < length && data[pos] != 0; pos += data[pos] + 1) {
+        if (!name.empty()) name += '.';
+        name.append(reinterpret_cast<const char*>(data + pos + 1), std::min<size_t>(data[pos], length - pos - 1));
+    }
+    return lowerCase(name);
+}
+
+size_t questionEnd(const uint8_t* message, size_t length) {
+    size_t end = DNSMessage::skipName(message, length, DNSMessage::HEADER_SIZE);
+    return end == 0 || end + 4 > length ? 0 : end + 4;
+}
+
+// Cuts a response back to its header and question, with the given flags and rcode.
+void stripToQuestion(std::vector<uint8_t>& out, uint16_t set_flags, DNSMessage::RCode rcode) {
+    size_t end = questionEnd(out.data(), out.size());
+    out.resize(end);
+    uint16_t flags = static_cast<uint16_t>((DNSMessage::readU16(out.data() + 2) & 0xFFF0) | set_flags |
+                                           static_cast<uint16_t>(rcode));
+    DNSMessage::writeU16(out.data() + 2, flags);
+    std::memset(out.data() + 6, 0, 6);
+}
+
+}  // namespace
+
+bool MockDNSServer::Zone::parse(std::istream& in, std::string& error, const std::string& origin_name) {
+    std::string origin = absoluteName(origin_name + ".", "");
+    uint32_t default_ttl = 3600;
+    std::string owner;
+    std::string line;
+    for (int number = 1; std::getline(in, line); ++number) {
+        auto tokens = tokenize(line);
+        if (tokens.empty()) continue;
+        auto fail = [&](const std::string& why) {
+            error = "line " + std::to_string(number) + ": " + why;
+            return false;
+        };
+
+        if (tokens[0] == "$ORIGIN") {
+            if (tokens.size() != 2) return fail("$ORIGIN takes one name");
+            origin = absoluteName(tokens[1], origin);
+            continue;
+        }
+        if (tokens[0] == "$TTL") {
+            if (tokens.size() != 2 || !isNumber(tokens[1])) return fail("$TTL takes one number");
+            default_ttl = static_cast<uint32_t>(std::stoul(tokens[1]));
+            continue;
+        }
+
+        size_t next = 0;
+        if (!std::isspace(static_cast<unsigned char>(line[0]))) {
+            owner = absoluteName(tokens[next++], origin);
+        } else if (owner.empty()) {
+            return fail("record without an owner");
+        }
+        uint32_t ttl = default_ttl;
+        RT type = RT::A;
+        for (;; ++next) {
+            if (next >= tokens.size()) return fail("missing type");
+            if (isNumber(tokens[next])) {
+                ttl = static_cast<uint32_t>(std::stoul(tokens[next]));
+            } else if (lowerCase(tokens[next]) != "in") {
+                break;
+            }
+        }
+        if (!DNSMessage::parseType(tokens[next], type)) return fail("unsupported type " + tokens[next]);
+
+        std::vector<std::string> rdata_tokens(tokens.begin() + next + 1, tokens.end());
+        Record record{owner, type, ttl, {}};
+        std::string why;
+        if (!encodeRdata(type, rdata_tokens, origin, record.rdata, why)) return fail(why);
+        insert(std::move(record));
+    }
+    return true;
+}
+
+bool MockDNSServer::Zone::load(const std::string& path, std::string& error) {
+    std::ifstream file(path);
+    if (!file) {
+        error = "cannot open " + path;
+        return false;
+    }
+    if (!parse(file, error)) {
+        error = path + ": " + error;
+        return false;
+    }
+    return true;
+}
+
+bool MockDNSServer::Zone::add(const std::string& name, DNSMessage::RecordType type, uint32_t ttl,
+                              const std::string& rdata, std::string& error) {
+    Record record{absoluteName(name + ".", ""), type, ttl, {}};
+    if (!encodeRdata(type, tokenize(rdata), "", record.rdata, error)) return false;
+    insert(std::move(record));
+    return true;
+}
+
+void MockDNSServer::Zone::insert(Record record) {
+    for (std::string name = record.name; existing_.insert(name).second && !name.empty();) {
+        name = parentOf(name);
+    }
+    if (record.type == RT::SOA &&
+        std::find(apexes_.begin(), apexes_.end(), record.name) == apexes_.end()) {
+        apexes_.push_back(record.name);
+    }
+    names_[record.name].push_back(std::move(record));
+    ++records_;
+}
+
+const std::vector<MockDNSServer::Zone::Record>* MockDNSServer::Zone::find(const std::string& name) const {
+    auto it = names_.find(name);
+    if (it != names_.end()) return &it->second;
+    if (existing_.count(name)) return nullptr;  // Empty non-terminal
+
+    // RFC 4592: a wildcard only applies below the closest existing ancestor
+    for (std::string ancestor = parentOf(name);; ancestor = parentOf(ancestor)) {
+        if (existing_.count(ancestor)) {
+            auto wildcard = names_.find(ancestor.empty() ? "*" : "*." + ancestor);
+            return wildcard == names_.end() ? nullptr : &wildcard->second;
+        }
+        if (ancestor.empty()) return nullptr;
+    }
+}
+
+const std::string* MockDNSServer::Zone::apexOf(const std::string& name) const {
+    const std::string* best = nullptr;
+    for (const auto& apex : apexes_) {
+        bool inside = apex.empty() || name == apex ||
+                      (name.size() > apex.size() && name.compare(name.size() - apex.size(), apex.size(), apex) == 0 &&
+                       name[name.size() - apex.size() - 1] == '.');
+        if (inside && (!best || apex.size() > best->size())) best = &apex;
+    }
+    return best;
+}
+
+bool MockDNSServer::Zone::respond(const uint8_t* query, size_t length, std::vector<uint8_t>& out,
+                                  int64_t ttl_override, bool tcp) const {
+    DNSMessage::Parser parser(query, length);
+    DNSMessage::Question question;
+    if (!parser.parseHeader() || parser.header().isResponse() || parser.header().qdcount != 1 ||
+        !parser.nextQuestion(question)) {
+        return false;
+    }
+    size_t limit = DNSMessage::MAX_UDP_SIZE;
+    DNSMessage::ResourceRecord opt;
+    while (parser.nextRecord(opt)) {
+        if (opt.type == RT::OPT) limit = std::max<size_t>(limit, opt.rclass);
+    }
+    size_t question_end = questionEnd(query, length);
+    if (question_end == 0) return false;
+
+    out.assign(query, query + question_end);
+    // QR and AA, keeping the opcode and RD; counts filled in below
+    DNSMessage::writeU16(out.data() + 2, static_cast<uint16_t>(0x8400 | (parser.header().flags & 0x7900)));
+    std::memset(out.data() + 6, 0, 6);
+
+    std::string name = lowerCase(question.name.toString());
+    if (!apexes_.empty() && !apexOf(name)) {
+        stripToQuestion(out, 0, DNSMessage::RCode::Refused);
+        out[2] &= static_cast<uint8_t>(~0x04);  // Not authoritative for it
+        return true;
+    }
+
+    auto append = [&](const std::string& owner, const Record& record) {
+        appendName(out, owner);
+        appendU16(out, static_cast<uint16_t>(record.type));
+        appendU16(out, DNSMessage::CLASS_IN);
+        appendU32(out, ttl_override >= 0 ? static_cast<uint32_t>(ttl_override) : record.ttl);
+        appendU16(out, static_cast<uint16_t>(record.rdata.size()));
+        out.insert(out.end(), record.rdata.begin(), record.rdata.end());
+    };
+
+    uint16_t answers = 0;
+    bool negative = false;
+    DNSMessage::RCode rcode = DNSMessage::RCode::NoError;
+    for (int hops = 0; hops <= MAX_CNAME_CHAIN; ++hops) {
+        const auto* records = find(name);
+        if (!records) {
+            if (!existing_.count(name)) rcode = DNSMessage::RCode::NXDomain;
+            negative = true;
+            break;
+        }
+        const Record* cname = nullptr;
+        bool matched = false;
+        for (const auto& record : *records) {
+            if (record.type == question.type || question.type == RT::ANY) {
+                append(name, record);
+                ++answers;
+                matched = true;
+            } else if (record.type == RT::CNAME) {
+                cname = &record;
+            }
+        }
+        if (matched) break;
+        if (!cname) {
+            negative = true;  // No data
+            break;
+        }
+        append(name, *cname);
+        ++answers;
+        name = wireToDotted(cname->rdata.data(), cname->rdata.size());
+        if (!apexes_.empty() && !apexOf(name)) break;  // The resolver continues elsewhere
+    }
+
+    uint16_t authority = 0;
+    const std::string* apex_name = apexOf(name);
+    if (negative && apex_name) {
+        auto apex = names_.find(*apex_name);
+        if (apex != names_.end()) {
+            for (const auto& record : apex->second) {
+                if (record.type == RT::SOA) {
+                    append(apex->first, record);
+                    ++authority;
+                }
+            }
+        }
+    }
+    DNSMessage::writeU16(out.data() + 6, answers);
+    DNSMessage::writeU16(out.data() + 8, authority);
+    out[3] = static_cast<uint8_t>((out[3] & 0xF0) | static_cast<uint8_t>(rcode));
+
+    if (!tcp && out.size() > limit) {
+        stripToQuestion(out, 0x0200, rcode);  // TC: the client should retry over TCP
+    }
+    return true;
+}
+
+MockDNSServer::MockDNSServer(Zone zone, const Options& options)
+    : ip_(options.address), zone_(std::make_shared<const Zone>(std::move(zone))),
+      faults_(options.faults), random_(options.faults.seed) {
+    sockaddr_storage addr{};
+    socklen_t length = 0;
+    auto* v4 = reinterpret_cast<sockaddr_in*>(&addr);
+    auto* v6 = reinterpret_cast<sockaddr_in6*>(&addr);
+    if (inet_pton(AF_INET, ip_.c_str(), &v4->sin_addr) == 1) {
+        v4->sin_family = AF_INET;
+        v4->sin_port = htons(options.port);
+        length = sizeof(sockaddr_in);
+    } else if (inet_pton(AF_INET6, ip_.c_str(), &v6->sin6_addr) == 1) {
+        v6->sin6_family = AF_INET6;
+        v6->sin6_port = htons(options.port);
+        length = sizeof(sockaddr_in6);
+    } else {
+        throw std::runtime_error("MockDNSServer: bad address " + ip_);
+    }
+
+    fd_ = socket(addr.ss_family, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    int buffer_size = 4 << 20;  // Absorb bursts from the load generator
+    if (fd_ >= 0) setsockopt(fd_, SOL_SOCKET, SO_RCVBUF, &buffer_size, sizeof(buffer_size));
+    if (fd_ < 0 || bind(fd_, reinterpret_cast<sockaddr*>(&addr), length) != 0) {
+        int error = errno;
+        if (fd_ >= 0) close(fd_);
+        throw std::runtime_error("MockDNSServer: cannot bind " + ip_ + ": " + std::strerror(error));
+    }
+    getsockname(fd_, reinterpret_cast<sockaddr*>(&addr), &length);
+    port_ = ntohs(addr.ss_family == AF_INET ? v4->sin_port : v6->sin6_port);
+
+    // TCP on the port UDP got
+    tcp_fd_ = socket(addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    int one = 1;
+    if (tcp_fd_ >= 0) setsockopt(tcp_fd_, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    if (tcp_fd_ < 0 || bind(tcp_fd_, reinterpret_cast<sockaddr*>(&addr), length) != 0 ||
+        listen(tcp_fd_, SOMAXCONN) != 0) {
+        int error = errno;
+        if (tcp_fd_ >= 0) close(tcp_fd_);
+        close(fd_);
+        throw std::runtime_error("MockDNSServer: cannot listen on TCP " + ip_ + ": " + std::strerror(error));
+    }
+    address_ = addr.ss_family == AF_INET ? ip_ + ":" + std::to_string(port_)
+                                         : "[" + ip_ + "]:" + std::to_string(port_);
+    thread_ = std::thread([this] { run(); });
+}
+
+MockDNSServer::~MockDNSServer() {
+    stop_ = true;
+    thread_.join();
+    for (const auto& client : tcp_clients_) close(client.fd);
+    close(tcp_fd_);
+    close(fd_);
+}
+
+void MockDNSServer::setFaults(const Faults& faults) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    faults_ = faults;
+    random_.seed(faults.seed);
+}
+
+void MockDNSServer::setZone(Zone zone) {
+    auto replacement = std::make_shared<const Zone>(std::move(zone));
+    std::lock_guard<std::mutex> lock(mutex_);
+    zone_ = std::move(replacement);
+}
+
+void MockDNSServer::run() {
+    std::vector<uint8_t> buffer(65536);
+    std::vector<pollfd> fds;
+    while (!stop_) {
+        int timeout = IDLE_POLL_MS;
+        if (!delayed_.empty()) {
+            auto wait = std::chrono::duration_cast<std::chrono::milliseconds>(delayed_.front().due - Clock::now());
+            timeout = static_cast<int>(std::max<int64_t>(0, std::min<int64_t>(wait.count() + 1, IDLE_POLL_MS)));
+        }
+        fds.assign({pollfd{fd_, POLLIN, 0}, pollfd{tcp_fd_, POLLIN, 0}});
+        for (const auto& client : tcp_clients_) fds.push_back(pollfd{client.fd, POLLIN, 0});
+        if (poll(fds.data(), fds.size(), timeout) > 0) {
+            // Drain what is queued so a burst is not held up behind poll
+            for (int i = 0; i < 64 && fds[0].revents; ++i) {
+                sockaddr_storage peer{};
+                socklen_t peer_length = sizeof(peer);
+                ssize_t n = recvfrom(fd_, buffer.data(), buffer.size(), MSG_DONTWAIT,
+                                     reinterpret_cast<sockaddr*>(&peer), &peer_length);
+                if (n < 0) break;
+                handle(buffer.data(), static_cast<size_t>(n), peer, peer_length);
+            }
+            size_t kept = 0;
+            for (size_t i = 0; i < tcp_clients_.size(); ++i) {
+                if (fds[i + 2].revents && !serveTcp(tcp_clients_[i])) {
+                    close(tcp_clients_[i].fd);
+                    continue;
+                }
+                if (kept != i) tcp_clients_[kept] = std::move(tcp_clients_[i]);
+                ++kept;
+            }
+            tcp_clients_.resize(kept);
+            if (fds[1].revents) acceptTcp();
+        }
+        sendDue();
+    }
+}
+
+void MockDNSServer::handle(const uint8_t* query, size_t length, const sockaddr_storage& peer,
+                           socklen_t peer_length) {
+    queries_.fetch_add(1, std::memory_order_relaxed);
+
+    std::shared_ptr<const Zone> zone;
+    Faults faults;
+    double loss, truncate, servfail, jitter;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        zone = zone_;
+        faults = faults_;
+        std::uniform_real_distribution<double> unit(0, 1);
+        loss = unit(random_);
+        truncate = unit(random_);
+        servfail = unit(random_);
+        jitter = unit(random_);
+    }
+
+    Delayed reply{Clock::now() + faults.latency +
+                      std::chrono::duration_cast<std::chrono::microseconds>(faults.jitter * jitter),
+                  {}, peer, peer_length};
+    if (faults.slow_type != 0) {
+        size_t end = questionEnd(query, length);
+        if (end != 0 && DNSMessage::readU16(query + end - 4) == faults.slow_type) reply.due += faults.slow_latency;
+    }
+    if (loss < faults.loss || !zone->respond(query, length, reply.response, faults.ttl)) {
+        dropped_.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+    if (servfail < faults.servfail) {
+        stripToQuestion(reply.response, 0, DNSMessage::RCode::ServFail);
+    } else if (truncate < faults.truncate) {
+        stripToQuestion(reply.response, 0x0200, DNSMessage::RCode::NoError);
+    }
+
+    if (reply.due <= Clock::now()) {
+        sendto(fd_, reply.response.data(), reply.response.size(), 0,
+               reinterpret_cast<const sockaddr*>(&peer), peer_length);
+        answered_.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+    delayed_.push_back(std::move(reply));
+    std::push_heap(delayed_.begin(), delayed_.end(), due_later);
+}
+
+void MockDNSServer::sendDue() {
+    const auto now = Clock::now();
+    while (!delayed_.empty() && delayed_.front().due <= now) {
+        std::pop_heap(delayed_.begin(), delayed_.end(), due_later);
+        const Delayed& reply = delayed_.back();
+        sendto(fd_, reply.response.data(), reply.response.size(), 0,
+               reinterpret_cast<const sockaddr*>(&reply.peer), reply.peer_length);
+        answered_.fetch_add(1, std::memory_order_relaxed);
+        delayed_.pop_back();
+    }
+}
+
+void MockDNSServer::acceptTcp() {
+    while (true) {
+        int fd = accept4(tcp_fd_, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0) return;
+        tcp_connections_.fetch_add(1, std::memory_order_relaxed);
+        tcp_clients_.push_back(TcpClient{fd, {}});
+    }
+}
+
+bool MockDNSServer::serveTcp(TcpClient& client) {
+    uint8_t chunk[4096];
+    bool open = true;
+    while (true) {
+        ssize_t n = recv(client.fd, chunk, sizeof(chunk), 0);
+        if (n > 0) {
+            client.in.insert(client.in.end(), chunk, chunk + n);
+        } else {
+            open = n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR);
+            break;
+        }
+    }
+
+    std::shared_ptr<const Zone> zone;
+    int64_t ttl;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        zone = zone_;
+        ttl = faults_.ttl;
+    }
+    size_t offset = 0;
+    std::vector<uint8_t> response;
+    while (client.in.size() - offset >= 2) {
+        const size_t length = DNSMessage::readU16(&client.in[offset]);
+        if (client.in.size() - offset - 2 < length) break;
+        const uint8_t* query = &client.in[offset + 2];
+        offset += 2 + length;
+        queries_.fetch_add(1, std::memory_order_relaxed);
+        if (!zone->respond(query, length, response, ttl, true)) {
+            dropped_.fetch_add(1, std::memory_order_relaxed);
+            continue;
+        }
+        uint8_t prefix[2];
+        DNSMessage::writeU16(prefix, static_cast<uint16_t>(response.size()));
+        response.insert(response.begin(), prefix, prefix + 2);
+        // Answers are small next to the socket buffer; a client that stops
+        // reading is simply dropped
+        size_t sent = 0;
+        while (sent < response.size()) {
+            ssize_t n = send(client.fd, response.data() + sent, response.size() - sent, MSG_NOSIGNAL);
+            if (n <= 0) return false;
+            sent += static_cast<size_t>(n);
+        }
+        answered_.fetch_add(1, std::memory_order_relaxed);
+    }
+    client.in.erase(client.in.begin(), client.in.begin() + static_cast<std::ptrdiff_t>(offset));
+    return open;
+}
@@ -0,0 +1,273 @@
+#include "ResolverMetrics.h"
+#include "DNSMessage.h"
+#include "RttEstimator.h"
+#include <algorithm>
+#include <iomanip>
+#include <sstream>
+
+namespace {
+
+// Bindings kept per thread. Bounded so a thread that outlives many
+// resolvers does not accumulate entries; an evicted binding gives its slot
+// back and registers again next time.
+constexpr size_t MAX_BINDINGS = 16;
+
+std::atomic<uint64_t> next_id{1};
+
+// Upper bounds of the Prometheus histogram buckets, in nanoseconds
+const uint64_t BUCKET_BOUNDS[] = {
+    1000, 2500, 5000, 10000, 25000, 50000, 100000, 250000, 500000,
+    1000000, 2500000, 5000000, 10000000, 25000000, 50000000, 100000000, 250000000, 500000000,
+    1000000000, 2500000000, 5000000000,
+};
+
+const char* COUNTER_NAMES[] = {
+    "cache_hits", "cache_negative_hits", "cache_stale_hits", "cache_misses", "cache_expired",
+    "cache_evictions", "cache_inserts", "prefetches", "local_answers", "resolves_started", "resolves_finished",
+};
+const char* COUNTER_HELP[] = {
+    "Resolves answered from a fresh cache entry",
+    "Resolves answered from a cached NXDOMAIN or no-data entry",
+    "Resolves answered from an expired entry",
+    "Resolves that went upstream",
+    "Cache misses where the entry had expired",
+    "Cache entries cleared, evicted when the cache was full, or swept after expiry",
+    "Answers, negative answers and CNAME links stored in the cache",
+    "Refresh-ahead lookups started",
+    "Resolves answered from the local zone or blocklist",
+    "Resolves started",
+    "Resolves finished",
+};
+const char* STAGE_NAMES[] = {"normalize", "cache_lookup", "send", "wait", "parse", "insert"};
+
+static_assert(sizeof(COUNTER_NAMES) / sizeof(COUNTER_NAMES[0]) == static_cast<size_t>(ResolverMetrics::Counter::Count),
+              "every counter needs a name");
+static_assert(sizeof(STAGE_NAMES) / sizeof(STAGE_NAMES[0]) == static_cast<size_t>(ResolverMetrics::Stage::Count),
+              "every stage needs a name");
+
+std::string seconds(uint64_t nanoseconds) {
+    std::ostringstream out;
+    out << std::setprecision(9) << nanoseconds / 1e9;
+    return out.str();
+}
+
+std::string rcodeLabel(size_t rcode) {
+    const char* name = DNSMessage::rcodeName(static_cast<DNSMessage::RCode>(rcode));
+    return std::string(name) == "UNKNOWN" ? "RCODE" + std::to_string(rcode) : name;
+}
+
+void writeHistogram(std::ostream& out, const std::string& name, const std::string& labels,
+                    const LatencyHistogram& histogram) {
+    const std::string open = labels.empty() ? "{" : "{" + labels + ",";
+    for (uint64_t bound : BUCKET_BOUNDS) {
+        out << name << "_bucket" << open << "le=\"" << seconds(bound) << "\"} "
+            << histogram.countAtOrBelow(bound) << "\n";
+    }
+    const std::string plain = labels.empty() ? "" : "{" + labels + "}";
+    out << name << "_bucket" << open << "le=\"+Inf\"} " << histogram.count() << "\n"
+        << name << "_sum" << plain << " " << seconds(histogram.sum()) << "\n"
+        << name << "_count" << plain << " " << histogram.count() << "\n";
+}
+
+void writeHeader(std::ostream& out, const std::string& name, const char* type, const char* help) {
+    out << "# HELP " << name << " " << help << "\n# TYPE " << name << " " << type << "\n";
+}
+
+}  // namespace
+
+thread_local ResolverMetrics::Bindings ResolverMetrics::bindings_;
+
+ResolverMetrics::ResolverMetrics()
+    : id_(next_id.fetch_add(1, std::memory_order_relaxed)), registry_(std::make_shared<Registry>()) {}
+
+ResolverMetrics::~ResolverMetrics() = default;
+
+void ResolverMetrics::Binding::release() const {
+    if (auto owner_registry = registry.lock()) {
+        std::lock_guard<std::mutex> lock(owner_registry->mutex);
+        owner_registry->free.push_back(slot);
+    }
+}
+
+ResolverMetrics::Bindings::~Bindings() {
+    for (const Binding& binding : list) binding.release();
+}
+
+ResolverMetrics::Slot& ResolverMetrics::slot() {
+    auto& list = bindings_.list;
+    for (auto it = list.rbegin(); it != list.rend(); ++it) {
+        if (it->owner == id_) return *it->slot;
+    }
+    return registerSlot();
+}
+
+ResolverMetrics::Slot& ResolverMetrics::registerSlot() {
+    Slot* slot;
+    {
+        // A recycled slot keeps its counts; it only ever has one writer
+        std::lock_guard<std::mutex> lock(registry_->mutex);
+        if (!registry_->free.empty()) {
+            slot = registry_->free.back();
+            registry_->free.pop_back();
+        } else {
+            slot = new Slot();
+            registry_->slots.emplace_back(slot);
+        }
+    }
+    auto& list = bindings_.list;
+    if (list.size() == MAX_BINDINGS) {
+        list.front().release();
+        list.erase(list.begin());
+    }
+    list.push_back(Binding{id_, slot, registry_});
+    return *slot;
+}
+
+ResolverMetrics::UpstreamSlot& ResolverMetrics::upstream(const std::string& server) {
+    Slot& own = slot();
+    std::lock_guard<std::mutex> lock(own.upstream_mutex);
+    auto& entry = own.upstreams[server];
+    if (!entry) entry.reset(new UpstreamSlot());
+    return *entry;
+}
+
+void ResolverMetrics::recordResolve(Clock::duration elapsed, bool from_cache) {
+    Slot& own = slot();
+    (from_cache ? own.hit_latency : own.miss_latency).record(nanoseconds(elapsed));
+    LatencyHistogram::bump(own.counters[static_cast<size_t>(Counter::ResolvesFinished)], 1);
+}
+
+void ResolverMetrics::upstreamSent(const std::string& server) {
+    LatencyHistogram::bump(upstream(server).queries, 1);
+}
+
+void ResolverMetrics::upstreamAnswered(const std::string& server, Clock::duration rtt) {
+    upstream(server).rtt.record(nanoseconds(rtt));
+}
+
+void ResolverMetrics::upstreamRcode(const std::string& server, uint8_t rcode) {
+    LatencyHistogram::bump(upstream(server).rcodes[rcode & 0x0F], 1);
+}
+
+void ResolverMetrics::upstreamTimeout(const std::string& server) {
+    LatencyHistogram::bump(upstream(server).timeouts, 1);
+}
+
+void ResolverMetrics::upstreamFailed(const std::string& server) {
+    LatencyHistogram::bump(upstream(server).failures, 1);
+}
+
+ResolverMetrics::Snapshot ResolverMetrics::snapshot() const {
+    Snapshot snapshot;
+    std::lock_guard<std::mutex> lock(registry_->mutex);
+    for (const auto& slot : registry_->slots) {
+        for (size_t i = 0; i < snapshot.counters.size(); ++i) {
+            snapshot.counters[i] += slot->counters[i].load(std::memory_order_relaxed);
+        }
+        for (size_t i = 0; i < snapshot.stages.size(); ++i) {
+            snapshot.stages[i].merge(slot->stages[i]);
+        }
+        snapshot.hit_latency.merge(slot->hit_latency);
+        snapshot.miss_latency.merge(slot->miss_latency);
+
+        std::lock_guard<std::mutex> upstream_lock(slot->upstream_mutex);
+        for (const auto& entry : slot->upstreams) {
+            Upstream& upstream = snapshot.upstreams[entry.first];
+            const UpstreamSlot& from = *entry.second;
+            upstream.queries += from.queries.load(std::memory_order_relaxed);
+            upstream.timeouts += from.timeouts.load(std::memory_order_relaxed);
+            upstream.failures += from.failures.load(std::memory_order_relaxed);
+            for (size_t r = 0; r < upstream.rcodes.size(); ++r) {
+                upstream.rcodes[r] += from.rcodes[r].load(std::memory_order_relaxed);
+            }
+            upstream.rtt.merge(from.rtt);
+        }
+    }
+    return snapshot;
+}
+
+uint64_t ResolverMetrics::Snapshot::inFlight() const {
+    // The two counters are read a moment apart; never report below zero
+    uint64_t started = counter(Counter::ResolvesStarted);
+    uint64_t finished = counter(Counter::ResolvesFinished);
+    return started > finished ? started - finished : 0;
+}
+
+double ResolverMetrics::Snapshot::hitRatio() const {
+    uint64_t hits = counter(Counter::CacheHits) + counter(Counter::CacheNegativeHits) +
+                    counter(Counter::CacheStaleHits);
+    uint64_t total = hits + counter(Counter::CacheMisses);
+    return total ? static_cast<double>(hits) / total : 0;
+}
+
+std::string ResolverMetrics::Snapshot::prometheus(const std::string& prefix) const {
+    std::ostringstream out;
+    for (size_t i = 0; i < counters.size(); ++i) {
+        const std::string name = prefix + "_" + COUNTER_NAMES[i] + "_total";
+        writeHeader(out, name, "counter", COUNTER_HELP[i]);
+        out << name << " " << counters[i] << "\n";
+    }
+    writeHeader(out, prefix + "_resolves_in_flight", "gauge", "Resolves started and not yet finished");
+    out << prefix << "_resolves_in_flight " << inFlight() << "\n";
+    writeHeader(out, prefix + "_cache_entries", "gauge", "Entries held in the cache, negative ones included");
+    out << prefix << "_cache_entries " << cache_entries << "\n";
+
+    const std::string resolve = prefix + "_resolve_duration_seconds";
+    writeHeader(out, resolve, "histogram", "Time to answer a resolve");
+    writeHistogram(out, resolve, "result=\"hit\"", hit_latency);
+    writeHistogram(out, resolve, "result=\"miss\"", miss_latency);
+
+    const std::string stage_name = prefix + "_stage_duration_seconds";
+    writeHeader(out, stage_name, "histogram", "Time spent in each stage of a resolve");
+    for (size_t i = 0; i < stages.size(); ++i) {
+        writeHistogram(out, stage_name, std::string("stage=\"") + STAGE_NAMES[i] + "\"", stages[i]);
+    }
+
+    if (upstreams.empty()) return out.str();
+    const std::string queries = prefix + "_upstream_queries_total";
+    writeHeader(out, queries, "counter", "Queries sent to each upstream, retransmits included");
+    for (const auto& entry : upstreams) {
+        out << queries << "{server=\"" << entry.first << "\"} " << entry.second.queries << "\n";
+    }
+    const std::string responses = prefix + "_upstream_responses_total";
+    writeHeader(out, responses, "counter", "Responses from each upstream by result code");
+    for (const auto& entry : upstreams) {
+        for (size_t r = 0; r < entry.second.rcodes.size(); ++r) {
+            if (entry.second.rcodes[r] == 0) continue;
+            out << responses << "{server=\"" << entry.first << "\",rcode=\"" << rcodeLabel(r) << "\"} "
+                << entry.second.rcodes[r] << "\n";
+        }
+    }
+    const std::string timeouts = prefix + "_upstream_timeouts_total";
+    writeHeader(out, timeouts, "counter", "Transmissions to each upstream that timed out");
+    for (const auto& entry : upstreams) {
+        out << timeouts << "{server=\"" << entry.first << "\"} " << entry.second.timeouts << "\n";
+    }
+    const std::string failures = prefix + "_upstream_failures_total";
+    writeHeader(out, failures, "counter", "Unusable responses and send errors from each upstream");
+    for (const auto& entry : upstreams) {
+        out << failures << "{server=\"" << entry.first << "\"} " << entry.second.failures << "\n";
+    }
+    const std::string rtt = prefix + "_upstream_rtt_seconds";
+    writeHeader(out, rtt, "histogram", "Round-trip time of usable answers from each upstream");
+    for (const auto& entry : upstreams) {
+        writeHistogram(out, rtt, "server=\"" + entry.first + "\"", entry.second.rtt);
+    }
+
+    // Smoothed RTT and health as the retransmit logic sees them
+    const std::string srtt = prefix + "_upstream_srtt_seconds";
+    const std::string down = prefix + "_upstream_down";
+    auto estimates = RttEstimator::global().snapshot();
+    writeHeader(out, srtt, "gauge", "Smoothed round-trip time of each upstream (RFC 6298)");
+    for (const auto& estimate : estimates) {
+        if (!upstreams.count(estimate.first) || estimate.second.samples == 0) continue;
+        out << srtt << "{server=\"" << estimate.first << "\"} "
+            << seconds(std::chrono::duration_cast<std::chrono::nanoseconds>(estimate.second.srtt).count()) << "\n";
+    }
+    writeHeader(out, down, "gauge", "1 while an upstream is marked down");
+    for (const auto& estimate : estimates) {
+        if (!upstreams.count(estimate.first)) continue;
+        out << down << "{server=\"" << estimate.first << "\"} " << (estimate.second.down() ? 1 : 0) << "\n";
+    }
+    return out.str();
+}
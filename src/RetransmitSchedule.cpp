@@ -0,0 +1,122 @@
+#include "RetransmitSchedule.h"
+#include "ResolverMetrics.h"
+#include <algorithm>
+#include <random>
+
+RetransmitSchedule::RetransmitSchedule(std::vector<std::string> servers, const Policy& policy,
+                                       RttEstimator& estimator)
+    : servers_(std::move(servers)), policy_(policy), estimator_(estimator) {
+    start();
+}
+
+void RetransmitSchedule::restart(const std::vector<std::string>& servers, const Policy& policy) {
+    servers_.assign(servers.begin(), servers.end());
+    policy_ = policy;
+    start();
+}
+
+void RetransmitSchedule::start() {
+    failed_.assign(servers_.size(), false);
+    usable_ = servers_.size();
+    deadline_ = Clock::now() + policy_.timeout;
+    order_.clear();
+    sent_.clear();
+    transmissions_ = 0;
+    next_server_ = 0;
+    last_server_ = 0;
+    last_was_hedge_ = false;
+    rank();
+}
+
+void RetransmitSchedule::rank() {
+    const auto now = Clock::now();
+    auto& candidates = candidates_;
+    candidates.clear();
+    for (size_t i = 0; i < servers_.size(); ++i) {
+        auto e = estimator_.estimate(servers_[i]);
+        candidates.push_back(Candidate{i, e.down(now), e.samples > 0, e.srtt});
+    }
+    // Ties keep their configured order; std::stable_sort would allocate
+    std::sort(candidates.begin(), candidates.end(), [](const Candidate& a, const Candidate& b) {
+        if (a.down != b.down) return !a.down;
+        if (a.measured != b.measured) return !a.measured;
+        if (a.srtt != b.srtt) return a.srtt < b.srtt;
+        return a.index < b.index;
+    });
+
+    size_t up = 0;
+    for (const auto& c : candidates) {
+        order_.push_back(c.index);
+        if (!c.down) ++up;
+    }
+    if (up > 1 && policy_.probe_share > 0) {
+        thread_local std::mt19937 generator(std::random_device{}());
+        if (std::uniform_real_distribution<double>(0, 1)(generator) < policy_.probe_share) {
+            size_t probe = std::uniform_int_distribution<size_t>(1, up - 1)(generator);
+            std::rotate(order_.begin(), order_.begin() + probe, order_.begin() + probe + 1);
+        }
+    }
+}
+
+bool RetransmitSchedule::next(size_t& server, Clock::time_point& retransmit_at) {
+    const auto now = Clock::now();
+    if (usable_ == 0 || transmissions_ > policy_.retries || now >= deadline_) {
+        return false;
+    }
+    while (failed_[order_[next_server_]]) {
+        next_server_ = (next_server_ + 1) % order_.size();
+    }
+    server = order_[next_server_];
+    next_server_ = (next_server_ + 1) % order_.size();
+
+    // Hedge only the first transmission: after that the server has already
+    // missed a deadline and the RTO with backoff is the better guide.
+    last_was_hedge_ = transmissions_ == 0 && (policy_.hedge || policy_.race) && usable_ > 1;
+    RttEstimator::Duration wait(0);
+    if (!last_was_hedge_) {
+        wait = estimator_.rto(servers_[server]);
+    } else if (!policy_.race) {
+        wait = estimator_.hedgeDelay(servers_[server]);
+    }
+    retransmit_at = std::min(deadline_, now + wait);
+    sent_.push_back(Sent{server, now, false});
+    if (policy_.metrics) policy_.metrics->upstreamSent(servers_[server]);
+    last_server_ = server;
+    ++transmissions_;
+    return true;
+}
+
+void RetransmitSchedule::timerExpired() {
+    // A hedge firing only means the server is slower than usual, not lost
+    if (transmissions_ > 0 && !last_was_hedge_) {
+        estimator_.timedOut(servers_[last_server_]);
+        sent_.back().timed_out = true;
+        if (policy_.metrics) policy_.metrics->upstreamTimeout(servers_[last_server_]);
+    }
+}
+
+void RetransmitSchedule::failed(size_t server) {
+    if (!failed_[server]) {
+        failed_[server] = true;
+        --usable_;
+        estimator_.failed(servers_[server]);
+        if (policy_.metrics) policy_.metrics->upstreamFailed(servers_[server]);
+    }
+}
+
+void RetransmitSchedule::answered(size_t server, Clock::duration rtt) {
+    estimator_.sample(servers_[server], std::chrono::duration_cast<RttEstimator::Duration>(rtt));
+    if (policy_.metrics) policy_.metrics->upstreamAnswered(servers_[server], rtt);
+
+    const auto now = Clock::now();
+    auto& charged = charged_;
+    charged.assign(servers_.size(), false);
+    charged[server] = true;
+    for (const auto& sent : sent_) {
+        if (charged[sent.server] || failed_[sent.server] || sent.timed_out) continue;
+        if (now - sent.at >= estimator_.hedgeDelay(servers_[sent.server])) {
+            charged[sent.server] = true;
+            estimator_.failed(servers_[sent.server]);
+        }
+    }
+}
@@ -0,0 +1,88 @@
+#include "RttEstimator.h"
+#include <algorithm>
+
+namespace {
+
+constexpr uint32_t MAX_BACKOFF = 6;  // 64x; max_rto caps it sooner in practice
+
+}  // namespace
+
+RttEstimator& RttEstimator::global() {
+    static RttEstimator* estimator = new RttEstimator();
+    return *estimator;
+}
+
+void RttEstimator::sample(const std::string& server, Duration rtt) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    Estimate& e = estimates_[server];
+    if (e.samples == 0) {
+        e.srtt = rtt;
+        e.rttvar = rtt / 2;
+    } else {
+        // RFC 6298 section 2.3 with alpha = 1/8, beta = 1/4
+        Duration error = e.srtt > rtt ? e.srtt - rtt : rtt - e.srtt;
+        e.rttvar = (e.rttvar * 3 + error) / 4;
+        e.srtt = (e.srtt * 7 + rtt) / 8;
+    }
+    ++e.samples;
+    e.backoff = 0;
+    e.failures = 0;
+    e.down_count = 0;
+    e.down_until = Clock::time_point();
+}
+
+void RttEstimator::timedOut(const std::string& server) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    Estimate& e = estimates_[server];
+    e.backoff = std::min(e.backoff + 1, MAX_BACKOFF);
+    failedLocked(e);
+}
+
+void RttEstimator::failed(const std::string& server) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    failedLocked(estimates_[server]);
+}
+
+void RttEstimator::failedLocked(Estimate& e) {
+    ++e.total_failures;
+    if (++e.failures < options_.failure_threshold) return;
+    // Mark it down, backing off exponentially while it stays unresponsive
+    Duration down = options_.down_time * (1 << std::min(e.down_count, MAX_BACKOFF));
+    e.down_until = Clock::now() + std::min(down, options_.max_down_time);
+    ++e.down_count;
+    e.failures = 0;
+}
+
+RttEstimator::Duration RttEstimator::rtoLocked(const Estimate& e) const {
+    Duration base = e.samples == 0 ? options_.initial_rto : e.srtt + 4 * e.rttvar;
+    base = std::max(base, options_.min_rto);
+    return std::min(base * (1 << e.backoff), options_.max_rto);
+}
+
+RttEstimator::Duration RttEstimator::rto(const std::string& server) const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = estimates_.find(server);
+    return rtoLocked(it == estimates_.end() ? Estimate() : it->second);
+}
+
+RttEstimator::Duration RttEstimator::hedgeDelay(const std::string& server) const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = estimates_.find(server);
+    if (it == estimates_.end() || it->second.samples == 0) {
+        return rtoLocked(Estimate());
+    }
+    const Estimate& e = it->second;
+    Duration delay = std::max(e.srtt + 2 * e.rttvar, options_.min_rto / 2);
+    return std::min(delay, rtoLocked(e));
+}
+
+std::vector<std::pair<std::string, RttEstimator::Estimate>> RttEstimator::snapshot() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return std::vector<std::pair<std::string, Estimate>>(estimates_.begin(), estimates_.end());
+}
+
+RttEstimator::Estimate RttEstimator::estimate(const std::string& server) const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = estimates_.find(server);
+    return it == estimates_.end() ? Estimate() : it->second;
+}
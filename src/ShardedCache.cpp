@@ -0,0 +1,427 @@
+#include "ShardedCache.h"
+#include <arpa/inet.h>
+#include <algorithm>
+#include <cstring>
+#include <ctime>
+#include <functional>
+#include <new>
+
+namespace {
+
+constexpr size_t INITIAL_BUCKETS = 16;
+constexpr size_t RECLAIM_THRESHOLD = 64;  // Retired objects before a reclaim pass
+
+constexpr size_t MAX_ADDRESSES_PER_FAMILY = 255;
+constexpr size_t EVICTION_SAMPLES = 8;  // Entries compared per eviction
+
+size_t roundUpPowerOfTwo(size_t n) {
+    size_t p = 1;
+    while (p < n) p <<= 1;
+    return p;
+}
+
+}  // namespace
+
+ShardedCache::Clock::time_point ShardedCache::coarseNow() {
+#ifdef CLOCK_MONOTONIC_COARSE
+    // libstdc++'s steady_clock is CLOCK_MONOTONIC, which the coarse clock tracks
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return Clock::time_point(std::chrono::duration_cast<Clock::duration>(
+        std::chrono::seconds(ts.tv_sec) + std::chrono::nanoseconds(ts.tv_nsec)));
+#else
+    return Clock::now();
+#endif
+}
+
+ShardedCache::Table::Table(size_t bucket_count)
+    : mask(bucket_count - 1), buckets(new std::atomic<Node*>[bucket_count]) {
+    for (size_t i = 0; i < bucket_count; ++i) {
+        buckets[i].store(nullptr, std::memory_order_relaxed);
+    }
+}
+
+ShardedCache::ShardedCache(size_t shard_count, size_t max_entries)
+    : shard_count_(roundUpPowerOfTwo(shard_count == 0 ? 1 : shard_count)),
+      shard_capacity_(max_entries ? std::max<size_t>(1, max_entries / shard_count_) : 0),
+      shards_(new Shard[shard_count_]) {
+    for (size_t i = 0; i < shard_count_; ++i) {
+        shards_[i].table.store(new Table(INITIAL_BUCKETS), std::memory_order_release);
+    }
+}
+
+ShardedCache::~ShardedCache() {
+    // No reader may be using the cache while it is destroyed
+    for (size_t i = 0; i < shard_count_; ++i) {
+        deleteTableAndNodes(shards_[i].table.load(std::memory_order_relaxed));
+    }
+}
+
+bool ShardedCache::Node::matches(size_t h, std::string_view k) const {
+    return hash == h && key_length == k.size() && std::memcmp(key(), k.data(), key_length) == 0;
+}
+
+ShardedCache::Node* ShardedCache::allocateNode(size_t hash, std::string_view key,
+                                               const uint8_t* ipv4, size_t ipv4_count,
+                                               const uint8_t* ipv6, size_t ipv6_count,
+                                               Clock::time_point expiry, uint32_t ttl) {
+    size_t bytes = sizeof(Node) + key.size() + 4 * ipv4_count + 16 * ipv6_count;
+    Node* node = new (::operator new(bytes)) Node();
+    node->hash = hash;
+    node->expiry = expiry;
+    node->ttl = ttl;
+    node->key_length = static_cast<uint32_t>(key.size());
+    node->ipv4_count = static_cast<uint8_t>(ipv4_count);
+    node->ipv6_count = static_cast<uint8_t>(ipv6_count);
+    char* payload = const_cast<char*>(node->key());
+    std::memcpy(payload, key.data(), key.size());
+    payload += key.size();
+    std::memcpy(payload, ipv4, 4 * ipv4_count);
+    std::memcpy(payload + 4 * ipv4_count, ipv6, 16 * ipv6_count);
+    return node;
+}
+
+ShardedCache::Node* ShardedCache::copyNode(const Node* node) {
+    size_t bytes = node->allocationSize();
+    Node* copy = new (::operator new(bytes)) Node();
+    copy->hash = node->hash;
+    copy->expiry = node->expiry;
+    copy->ttl = node->ttl;
+    copy->hits.store(node->hits.load(std::memory_order_relaxed), std::memory_order_relaxed);
+    copy->refresh_claimed.store(node->refresh_claimed.load(std::memory_order_relaxed), std::memory_order_relaxed);
+    copy->key_length = node->key_length;
+    copy->ipv4_count = node->ipv4_count;
+    copy->ipv6_count = node->ipv6_count;
+    std::memcpy(const_cast<char*>(copy->key()), node->key(), bytes - sizeof(Node));
+    return copy;
+}
+
+void ShardedCache::deleteNode(void* node) {
+    static_cast<Node*>(node)->~Node();
+    ::operator delete(node);
+}
+
+void ShardedCache::deleteTableAndNodes(void* ptr) {
+    Table* table = static_cast<Table*>(ptr);
+    for (size_t b = 0; b <= table->mask; ++b) {
+        Node* node = table->buckets[b].load(std::memory_order_relaxed);
+        while (node) {
+            Node* next = node->next.load(std::memory_order_relaxed);
+            deleteNode(node);
+            node = next;
+        }
+    }
+    delete table;
+}
+
+void ShardedCache::retire(void* ptr, void (*deleter)(void*)) {
+    auto& epochs = EpochManager::instance();
+    epochs.retire(ptr, deleter);
+    if (epochs.pendingCount() >= RECLAIM_THRESHOLD) {
+        epochs.reclaim();
+    }
+}
+
+size_t ShardedCache::View::size() const {
+    return node_ ? node_->ipv4_count + node_->ipv6_count : 0;
+}
+
+bool ShardedCache::View::isIPv6(size_t index) const {
+    return index >= node_->ipv4_count;
+}
+
+const uint8_t* ShardedCache::View::addressBytes(size_t index) const {
+    if (index < node_->ipv4_count) return node_->addresses() + 4 * index;
+    return node_->addresses() + 4 * node_->ipv4_count + 16 * (index - node_->ipv4_count);
+}
+
+std::string ShardedCache::View::addressString(size_t index) const {
+    char text[INET6_ADDRSTRLEN];
+    inet_ntop(isIPv6(index) ? AF_INET6 : AF_INET, addressBytes(index), text, sizeof(text));
+    return text;
+}
+
+void ShardedCache::View::appendStrings(std::vector<std::string>& out) const {
+    for (size_t i = 0; i < size(); ++i) {
+        out.push_back(addressString(i));
+    }
+}
+
+ShardedCache::Clock::time_point ShardedCache::View::expiry() const {
+    return node_->expiry;
+}
+
+bool ShardedCache::View::expired() const {
+    return node_->expiry <= coarseNow();
+}
+
+uint32_t ShardedCache::View::ttl() const {
+    return node_->ttl;
+}
+
+uint32_t ShardedCache::View::hits() const {
+    return node_->hits.load(std::memory_order_relaxed);
+}
+
+bool ShardedCache::View::claimRefresh() const {
+    return !node_->refresh_claimed.load(std::memory_order_relaxed) &&
+           !node_->refresh_claimed.exchange(true, std::memory_order_relaxed);
+}
+
+const ShardedCache::Node* ShardedCache::findNode(std::string_view key, size_t hash,
+                                                 Clock::duration stale_allowance) const {
+    // Pointer loads are seq_cst so that, together with the seq_cst epoch
+    // publication, a reader can never reach a node retired before it pinned.
+    Shard& shard = shardFor(hash);
+    Table* table = shard.table.load(std::memory_order_seq_cst);
+    for (Node* node = table->buckets[hash & table->mask].load(std::memory_order_seq_cst); node;
+         node = node->next.load(std::memory_order_seq_cst)) {
+        if (node->matches(hash, key)) {
+            if (node->expiry + stale_allowance <= coarseNow()) return nullptr;
+            if (node->hits.load(std::memory_order_relaxed) < HIT_COUNT_LIMIT) {
+                node->hits.fetch_add(1, std::memory_order_relaxed);
+            }
+            return node;
+        }
+    }
+    return nullptr;
+}
+
+ShardedCache::View ShardedCache::find(const std::string& key, Clock::duration stale_allowance) const {
+    return find(key, std::hash<std::string_view>()(key), stale_allowance);
+}
+
+ShardedCache::View ShardedCache::find(std::string_view key, size_t hash, Clock::duration stale_allowance) const {
+    EpochManager::Guard guard;
+    const Node* node = findNode(key, hash, stale_allowance);
+    if (!node) return View();
+    return View(std::move(guard), node);
+}
+
+bool ShardedCache::lookup(const std::string& key, std::vector<std::string>& ip_addresses,
+                          Clock::time_point* expiry) const {
+    View view = find(key);
+    if (!view) return false;
+    ip_addresses.clear();
+    view.appendStrings(ip_addresses);
+    if (expiry) *expiry = view.expiry();
+    return true;
+}
+
+void ShardedCache::insert(const std::string& key, const std::vector<std::string>& ip_addresses,
+                          std::chrono::seconds ttl) {
+    const size_t hash = std::hash<std::string>()(key);
+    std::vector<uint8_t> ipv4, ipv6;
+    for (const auto& address : ip_addresses) {
+        uint8_t bytes[16];
+        if (inet_pton(AF_INET, address.c_str(), bytes) == 1) {
+            if (ipv4.size() < 4 * MAX_ADDRESSES_PER_FAMILY) ipv4.insert(ipv4.end(), bytes, bytes + 4);
+        } else if (inet_pton(AF_INET6, address.c_str(), bytes) == 1) {
+            if (ipv6.size() < 16 * MAX_ADDRESSES_PER_FAMILY) ipv6.insert(ipv6.end(), bytes, bytes + 16);
+        }
+    }
+    Node* fresh = allocateNode(hash, key, ipv4.data(), ipv4.size() / 4, ipv6.data(), ipv6.size() / 16,
+                               coarseNow() + ttl, static_cast<uint32_t>(std::min<int64_t>(ttl.count(), UINT32_MAX)));
+    publish(fresh);
+}
+
+void ShardedCache::insert(std::string_view key, const uint8_t* ipv4, size_t ipv4_count, const uint8_t* ipv6,
+                          size_t ipv6_count, Clock::time_point expiry, uint32_t ttl) {
+    const size_t hash = std::hash<std::string_view>()(key);
+    publish(allocateNode(hash, key, ipv4, std::min(ipv4_count, MAX_ADDRESSES_PER_FAMILY), ipv6,
+                      std::min(ipv6_count, MAX_ADDRESSES_PER_FAMILY), expiry, ttl));
+}
+
+void ShardedCache::publish(Node* fresh) {
+    const size_t hash = fresh->hash;
+    const std::string_view key(fresh->key(), fresh->key_length);
+    Shard& shard = shardFor(hash);
+    Node* replaced = nullptr;
+    Node* evicted = nullptr;
+    {
+        std::lock_guard<std::mutex> lock(shard.write_mutex);
+        Table* table = shard.table.load(std::memory_order_relaxed);
+        std::atomic<Node*>* link = &table->buckets[hash & table->mask];
+        for (Node* node = link->load(std::memory_order_relaxed); node;
+             node = node->next.load(std::memory_order_relaxed)) {
+            if (node->matches(hash, key)) {
+                replaced = node;
+                break;
+            }
+            link = &node->next;
+        }
+
+        if (replaced) {
+            // Swap the node in place: readers see either the old or the new one
+            fresh->next.store(replaced->next.load(std::memory_order_relaxed), std::memory_order_relaxed);
+            link->store(fresh, std::memory_order_seq_cst);
+        } else {
+            if (shard_capacity_ && shard.size >= shard_capacity_) {
+                evicted = evictOne(shard);
+            }
+            std::atomic<Node*>& head = table->buckets[hash & table->mask];
+            fresh->next.store(head.load(std::memory_order_relaxed), std::memory_order_relaxed);
+            head.store(fresh, std::memory_order_seq_cst);
+            if (++shard.size > table->mask + 1) {
+                grow(shard);
+            }
+        }
+    }
+    if (replaced) retire(replaced, &ShardedCache::deleteNode);
+    if (evicted) {
+        evictions_.fetch_add(1, std::memory_order_relaxed);
+        retire(evicted, &ShardedCache::deleteNode);
+    }
+}
+
+ShardedCache::Node* ShardedCache::evictOne(Shard& shard) {
+    Table* table = shard.table.load(std::memory_order_relaxed);
+    const auto now = coarseNow();
+    std::atomic<Node*>* victim_link = nullptr;
+    Node* victim = nullptr;
+    size_t sampled = 0;
+    for (size_t step = 0; step <= table->mask && sampled < EVICTION_SAMPLES; ++step) {
+        const size_t b = (shard.evict_cursor + step) & table->mask;
+        std::atomic<Node*>* link = &table->buckets[b];
+        for (Node* node = link->load(std::memory_order_relaxed); node && sampled < EVICTION_SAMPLES;
+             node = node->next.load(std::memory_order_relaxed)) {
+            ++sampled;
+            if (!victim || node->expiry < victim->expiry) {
+                victim = node;
+                victim_link = link;
+            }
+            if (node->expiry <= now) break;
+            link = &node->next;
+        }
+        if (victim && victim->expiry <= now) break;
+        shard.evict_cursor = b + 1;
+    }
+    if (!victim) return nullptr;
+    victim_link->store(victim->next.load(std::memory_order_relaxed), std::memory_order_seq_cst);
+    --shard.size;
+    return victim;
+}
+
+void ShardedCache::reserve(size_t entries) {
+    const size_t per_shard = roundUpPowerOfTwo(entries / shard_count_ + 1);
+    for (size_t i = 0; i < shard_count_; ++i) {
+        Shard& shard = shards_[i];
+        std::lock_guard<std::mutex> lock(shard.write_mutex);
+        while (shard.table.load(std::memory_order_relaxed)->mask + 1 < per_shard) {
+            grow(shard);
+        }
+    }
+}
+
+void ShardedCache::forEach(const std::function<void(std::string_view key, const View& view)>& fn) const {
+    for (size_t i = 0; i < shard_count_; ++i) {
+        Shard& shard = shards_[i];
+        // Nodes are only retired after being unlinked under this lock
+        std::lock_guard<std::mutex> lock(shard.write_mutex);
+        Table* table = shard.table.load(std::memory_order_relaxed);
+        for (size_t b = 0; b <= table->mask; ++b) {
+            for (Node* node = table->buckets[b].load(std::memory_order_relaxed); node;
+                 node = node->next.load(std::memory_order_relaxed)) {
+                fn(std::string_view(node->key(), node->key_length), View(node));
+            }
+        }
+    }
+}
+
+void ShardedCache::grow(Shard& shard) {
+    // Nodes are copied rather than relinked, because readers may still be
+    // walking the old chains.
+    Table* old_table = shard.table.load(std::memory_order_relaxed);
+    Table* table = new Table((old_table->mask + 1) * 2);
+    for (size_t b = 0; b <= old_table->mask; ++b) {
+        for (Node* node = old_table->buckets[b].load(std::memory_order_relaxed); node;
+             node = node->next.load(std::memory_order_relaxed)) {
+            Node* copy = copyNode(node);
+            std::atomic<Node*>& head = table->buckets[copy->hash & table->mask];
+            copy->next.store(head.load(std::memory_order_relaxed), std::memory_order_relaxed);
+            head.store(copy, std::memory_order_relaxed);
+        }
+    }
+    shard.table.store(table, std::memory_order_seq_cst);
+    retire(old_table, &ShardedCache::deleteTableAndNodes);
+}
+
+bool ShardedCache::erase(const std::string& key) {
+    const size_t hash = std::hash<std::string>()(key);
+    Shard& shard = shardFor(hash);
+    Node* removed = nullptr;
+    {
+        std::lock_guard<std::mutex> lock(shard.write_mutex);
+        Table* table = shard.table.load(std::memory_order_relaxed);
+        std::atomic<Node*>* link = &table->buckets[hash & table->mask];
+        for (Node* node = link->load(std::memory_order_relaxed); node;
+             node = node->next.load(std::memory_order_relaxed)) {
+            if (node->matches(hash, key)) {
+                link->store(node->next.load(std::memory_order_relaxed), std::memory_order_seq_cst);
+                removed = node;
+                --shard.size;
+                break;
+            }
+            link = &node->next;
+        }
+    }
+    if (removed) retire(removed, &ShardedCache::deleteNode);
+    return removed != nullptr;
+}
+
+size_t ShardedCache::removeExpired(Clock::duration grace) {
+    const auto now = coarseNow() - grace;
+    size_t removed = 0;
+    for (size_t i = 0; i < shard_count_; ++i) {
+        Shard& shard = shards_[i];
+        std::vector<Node*> unlinked;
+        {
+            std::lock_guard<std::mutex> lock(shard.write_mutex);
+            Table* table = shard.table.load(std::memory_order_relaxed);
+            for (size_t b = 0; b <= table->mask; ++b) {
+                std::atomic<Node*>* link = &table->buckets[b];
+                Node* node = link->load(std::memory_order_relaxed);
+                while (node) {
+                    Node* next = node->next.load(std::memory_order_relaxed);
+                    if (node->expiry <= now) {
+                        link->store(next, std::memory_order_seq_cst);
+                        unlinked.push_back(node);
+                        --shard.size;
+                    } else {
+                        link = &node->next;
+                    }
+                    node = next;
+                }
+            }
+        }
+        for (Node* node : unlinked) {
+            retire(node, &ShardedCache::deleteNode);
+        }
+        removed += unlinked.size();
+    }
+    return removed;
+}
+
+void ShardedCache::clear() {
+    for (size_t i = 0; i < shard_count_; ++i) {
+        Shard& shard = shards_[i];
+        Table* old_table;
+        {
+            std::lock_guard<std::mutex> lock(shard.write_mutex);
+            old_table = shard.table.load(std::memory_order_relaxed);
+            shard.table.store(new Table(INITIAL_BUCKETS), std::memory_order_seq_cst);
+            shard.size = 0;
+        }
+        EpochManager::instance().retire(old_table, &ShardedCache::deleteTableAndNodes);
+    }
+    EpochManager::instance().reclaim();
+}
+
+size_t ShardedCache::size() const {
+    size_t total = 0;
+    for (size_t i = 0; i < shard_count_; ++i) {
+        std::lock_guard<std::mutex> lock(shards_[i].write_mutex);
+        total += shards_[i].size;
+    }
+    return total;
+}
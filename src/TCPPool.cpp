@@ -0,0 +1,406 @@
+#include "TCPPool.h"
+#include "DNSMessage.h"
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cerrno>
+#include <condition_variable>
+#include <cstring>
+#include <iostream>
+#include <stdexcept>
+
+namespace {
+
+constexpr int MAX_EVENTS = 64;
+constexpr uint64_t WAKE_TAG = ~0ULL;
+constexpr size_t READ_CHUNK = 16384;
+constexpr size_t MAX_MESSAGE = 0xFFFF;  // The two-byte length prefix caps it
+
+}  // namespace
+
+TCPPool& TCPPool::global() {
+    static TCPPool* pool = new TCPPool();
+    return *pool;
+}
+
+TCPPool::TCPPool(const Options& options) : options_(options) {
+    epoll_fd_ = epoll_create1(EPOLL_CLOEXEC);
+    wake_fd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (epoll_fd_ < 0 || wake_fd_ < 0) {
+        throw std::runtime_error("TCPPool: failed to create epoll/eventfd");
+    }
+    epoll_event ev{};
+    ev.events = EPOLLIN;
+    ev.data.u64 = WAKE_TAG;
+    epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, wake_fd_, &ev);
+}
+
+TCPPool::~TCPPool() {
+    stop();
+    ::close(wake_fd_);
+    ::close(epoll_fd_);
+}
+
+void TCPPool::stop() {
+    bool started;
+    {
+        std::lock_guard<std::mutex> lock(submit_mutex_);
+        if (!running_) return;
+        running_ = false;
+        started = started_;
+    }
+    if (started) {
+        wake();
+        thread_.join();
+    }
+
+    // Callbacks may try to submit follow-up queries; those fail immediately
+    // because running_ is already false.
+    std::vector<Query> queued;
+    {
+        std::lock_guard<std::mutex> lock(submit_mutex_);
+        queued.swap(submissions_);
+    }
+    for (auto& query : queued) {
+        query.callback(Status::Shutdown, nullptr, 0);
+    }
+    auto connections = std::move(connections_);
+    connections_.clear();
+    by_server_.clear();
+    for (auto& entry : connections) {
+        ::close(entry.second->fd);
+        for (auto& pending : entry.second->pending) {
+            pending.second.callback(Status::Shutdown, nullptr, 0);
+        }
+    }
+    open_ = 0;
+}
+
+void TCPPool::submit(const UDPTransport::ServerAddress& server, const uint8_t* query, size_t length,
+                     Clock::time_point deadline, Callback callback) {
+    if (length < DNSMessage::HEADER_SIZE || length > MAX_MESSAGE) {
+        callback(Status::NetworkError, nullptr, 0);
+        return;
+    }
+    Query entry;
+    entry.server = server;
+    entry.message.resize(2 + length);
+    DNSMessage::writeU16(entry.message.data(), static_cast<uint16_t>(length));
+    std::memcpy(entry.message.data() + 2, query, length);
+    entry.id = DNSMessage::readU16(query);
+    entry.deadline = deadline;
+    entry.callback = std::move(callback);
+
+    bool accepted = false, wake_needed = false;
+    {
+        std::lock_guard<std::mutex> lock(submit_mutex_);
+        if (running_) {
+            if (!started_) {
+                started_ = true;
+                thread_ = std::thread([this] { run(); });
+            }
+            wake_needed = submissions_.empty();
+            submissions_.push_back(std::move(entry));
+            accepted = true;
+        }
+    }
+    if (!accepted) {
+        entry.callback(Status::Shutdown, nullptr, 0);
+    } else if (wake_needed) {
+        wake();
+    }
+}
+
+TCPPool::Status TCPPool::exchange(const UDPTransport::ServerAddress& server, const uint8_t* query,
+                                  size_t length, std::vector<uint8_t>& response,
+                                  Clock::time_point deadline) {
+    std::mutex mutex;
+    std::condition_variable answered;
+    bool done = false;
+    Status result = Status::NetworkError;
+    submit(server, query, length, deadline, [&](Status status, const uint8_t* data, size_t size) {
+        std::lock_guard<std::mutex> lock(mutex);
+        result = status;
+        if (status == Status::Ok) response.assign(data, data + size);
+        done = true;
+        answered.notify_one();
+    });
+    std::unique_lock<std::mutex> lock(mutex);
+    answered.wait(lock, [&] { return done; });
+    return result;
+}
+
+void TCPPool::wake() {
+    uint64_t one = 1;
+    (void)write(wake_fd_, &one, sizeof(one));
+}
+
+void TCPPool::run() {
+    epoll_event events[MAX_EVENTS];
+    while (running_) {
+        int n = epoll_wait(epoll_fd_, events, MAX_EVENTS, nextTimeoutMs());
+        if (n < 0 && errno != EINTR) {
+            std::cerr << "TCPPool: epoll_wait failed: " << std::strerror(errno) << std::endl;
+            break;
+        }
+        for (int i = 0; i < n; ++i) {
+            if (events[i].data.u64 == WAKE_TAG) {
+                uint64_t value;
+                while (read(wake_fd_, &value, sizeof(value)) > 0) {}
+            } else {
+                handle(events[i].data.u64, events[i].events);
+            }
+        }
+        drainSubmissions();
+        expire();
+    }
+}
+
+void TCPPool::drainSubmissions() {
+    std::vector<Query> batch;
+    {
+        std::lock_guard<std::mutex> lock(submit_mutex_);
+        batch.swap(submissions_);
+    }
+    for (auto& query : batch) {
+        assign(std::move(query));
+    }
+    // Everything queued on a connection since the last wakeup goes out in
+    // one write
+    std::vector<uint64_t> broken;
+    for (auto& entry : connections_) {
+        Connection& connection = *entry.second;
+        if (connection.connected && !connection.writing && !connection.out.empty() && !flushOut(connection)) {
+            broken.push_back(entry.first);
+        }
+    }
+    for (uint64_t tag : broken) closeConnection(tag, true);
+}
+
+void TCPPool::assign(Query query) {
+    if (query.deadline <= Clock::now()) {
+        query.callback(Status::Timeout, nullptr, 0);
+        return;
+    }
+    const std::string key = query.server.toString();
+    Connection* best = nullptr;
+    size_t count = 0;
+    auto found = by_server_.find(key);
+    if (found != by_server_.end()) {
+        count = found->second.size();
+        for (uint64_t tag : found->second) {
+            Connection* candidate = connections_[tag].get();
+            if (!best || candidate->pending.size() < best->pending.size()) best = candidate;
+        }
+    }
+    // Open another connection only once the existing ones are full
+    if (!best || (best->pending.size() >= options_.max_pipelined && count < options_.connections_per_server)) {
+        if (Connection* fresh = open(query.server, key)) best = fresh;
+    }
+    if (!best || best->pending.size() >= MAX_MESSAGE) {
+        query.callback(Status::NetworkError, nullptr, 0);
+        return;
+    }
+
+    uint16_t id = best->next_id;
+    while (best->pending.count(id)) ++id;
+    best->next_id = static_cast<uint16_t>(id + 1);
+    DNSMessage::writeU16(query.message.data() + 2, id);
+    query.generation = ++generation_;
+    timers_.push(Timer{query.deadline, best->tag, id, query.generation});
+    best->out.insert(best->out.end(), query.message.begin(), query.message.end());
+    best->pending.emplace(id, std::move(query));
+}
+
+TCPPool::Connection* TCPPool::open(const UDPTransport::ServerAddress& server, const std::string& key) {
+    int fd = socket(server.addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) return nullptr;
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    if (connect(fd, reinterpret_cast<const sockaddr*>(&server.addr), server.length) != 0 &&
+        errno != EINPROGRESS) {
+        ::close(fd);
+        return nullptr;
+    }
+
+    // Writable once the handshake completes
+    const uint64_t tag = next_tag_++;
+    epoll_event ev{};
+    ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP;
+    ev.data.u64 = tag;
+    if (epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, fd, &ev) != 0) {
+        ::close(fd);
+        return nullptr;
+    }
+    std::unique_ptr<Connection> connection(new Connection());
+    connection->tag = tag;
+    connection->fd = fd;
+    connection->key = key;
+    connection->writing = true;
+    connection->next_id = UDPTransport::randomId();
+    connection->idle_since = Clock::now();
+    Connection* raw = connection.get();
+    connections_.emplace(tag, std::move(connection));
+    by_server_[key].push_back(tag);
+    open_.fetch_add(1, std::memory_order_relaxed);
+    opened_.fetch_add(1, std::memory_order_relaxed);
+    return raw;
+}
+
+void TCPPool::handle(uint64_t tag, uint32_t events) {
+    auto it = connections_.find(tag);
+    if (it == connections_.end()) return;  // Closed earlier in this wakeup
+    Connection& connection = *it->second;
+    if (!connection.connected && (events & (EPOLLOUT | EPOLLERR | EPOLLHUP))) {
+        int error = 0;
+        socklen_t length = sizeof(error);
+        if (getsockopt(connection.fd, SOL_SOCKET, SO_ERROR, &error, &length) != 0 || error != 0) {
+            closeConnection(tag, true);
+            return;
+        }
+        connection.connected = true;
+    }
+    if ((events & EPOLLOUT) && !flushOut(connection)) {
+        closeConnection(tag, true);
+        return;
+    }
+    // Answers already received are delivered before a close is acted on
+    if ((events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) && !readIn(connection)) {
+        closeConnection(tag, true);
+    }
+}
+
+bool TCPPool::flushOut(Connection& connection) {
+    while (connection.written < connection.out.size()) {
+        ssize_t n = send(connection.fd, connection.out.data() + connection.written,
+                         connection.out.size() - connection.written, MSG_NOSIGNAL);
+        if (n > 0) {
+            connection.written += static_cast<size_t>(n);
+        } else if (n < 0 && errno == EINTR) {
+            continue;
+        } else if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            watch(connection, true);
+            return true;
+        } else {
+            return false;
+        }
+    }
+    connection.out.clear();
+    connection.written = 0;
+    watch(connection, false);
+    return true;
+}
+
+void TCPPool::watch(Connection& connection, bool writable) {
+    if (connection.writing == writable) return;
+    epoll_event ev{};
+    ev.events = EPOLLIN | EPOLLRDHUP;
+    if (writable) ev.events |= EPOLLOUT;
+    ev.data.u64 = connection.tag;
+    epoll_ctl(epoll_fd_, EPOLL_CTL_MOD, connection.fd, &ev);
+    connection.writing = writable;
+}
+
+bool TCPPool::readIn(Connection& connection) {
+    bool open = true;
+    uint8_t chunk[READ_CHUNK];
+    while (true) {
+        ssize_t n = recv(connection.fd, chunk, sizeof(chunk), 0);
+        if (n > 0) {
+            connection.in.insert(connection.in.end(), chunk, chunk + n);
+            if (static_cast<size_t>(n) < sizeof(chunk)) break;
+        } else if (n < 0 && errno == EINTR) {
+            continue;
+        } else {
+            open = n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+            break;
+        }
+    }
+
+    size_t offset = 0;
+    while (connection.in.size() - offset >= 2) {
+        const size_t length = DNSMessage::readU16(&connection.in[offset]);
+        if (connection.in.size() - offset - 2 < length) break;
+        uint8_t* message = &connection.in[offset + 2];
+        offset += 2 + length;
+        if (length < DNSMessage::HEADER_SIZE || (message[2] & 0x80) == 0) continue;
+        auto it = connection.pending.find(DNSMessage::readU16(message));
+        if (it == connection.pending.end()) continue;  // Timed out already
+        Callback callback = std::move(it->second.callback);
+        DNSMessage::writeU16(message, it->second.id);
+        connection.pending.erase(it);
+        if (connection.pending.empty()) connection.idle_since = Clock::now();
+        // Callbacks only queue new submissions, so the buffer stays put meanwhile
+        callback(Status::Ok, message, length);
+    }
+    connection.in.erase(connection.in.begin(), connection.in.begin() + static_cast<std::ptrdiff_t>(offset));
+    return open;
+}
+
+void TCPPool::closeConnection(uint64_t tag, bool retry) {
+    auto it = connections_.find(tag);
+    if (it == connections_.end()) return;
+    std::unique_ptr<Connection> connection = std::move(it->second);
+    connections_.erase(it);
+    epoll_ctl(epoll_fd_, EPOLL_CTL_DEL, connection->fd, nullptr);
+    ::close(connection->fd);
+    auto& tags = by_server_[connection->key];
+    tags.erase(std::remove(tags.begin(), tags.end(), tag), tags.end());
+    if (tags.empty()) by_server_.erase(connection->key);
+    open_.fetch_sub(1, std::memory_order_relaxed);
+
+    // A server may close a connection it considers idle just as queries are
+    // written to it (RFC 7766 section 6.2.3); those deserve a fresh one
+    for (auto& entry : connection->pending) {
+        Query& query = entry.second;
+        if (retry && !query.retried) {
+            query.retried = true;
+            assign(std::move(query));
+        } else {
+            query.callback(Status::NetworkError, nullptr, 0);
+        }
+    }
+}
+
+void TCPPool::expire() {
+    const auto now = Clock::now();
+    while (!timers_.empty() && timers_.top().deadline <= now) {
+        Timer timer = timers_.top();
+        timers_.pop();
+        auto connection = connections_.find(timer.connection);
+        if (connection == connections_.end()) continue;
+        auto& pending = connection->second->pending;
+        auto it = pending.find(timer.id);
+        if (it == pending.end() || it->second.generation != timer.generation) continue;
+        Callback callback = std::move(it->second.callback);
+        pending.erase(it);
+        if (pending.empty()) connection->second->idle_since = now;
+        callback(Status::Timeout, nullptr, 0);
+    }
+
+    std::vector<uint64_t> idle;
+    for (const auto& entry : connections_) {
+        const Connection& connection = *entry.second;
+        if (connection.pending.empty() && now - connection.idle_since >= options_.idle_timeout) {
+            idle.push_back(entry.first);
+        }
+    }
+    for (uint64_t tag : idle) closeConnection(tag, false);
+}
+
+int TCPPool::nextTimeoutMs() const {
+    Clock::time_point next = Clock::time_point::max();
+    if (!timers_.empty()) next = timers_.top().deadline;
+    for (const auto& entry : connections_) {
+        if (entry.second->pending.empty()) {
+            next = std::min(next, entry.second->idle_since + options_.idle_timeout);
+        }
+    }
+    if (next == Clock::time_point::max()) return -1;
+    auto wait = std::chrono::duration_cast<std::chrono::milliseconds>(next - Clock::now());
+    // Round up so the loop does not spin on sub-millisecond remainders
+    return wait.count() < 0 ? 0 : static_cast<int>(wait.count()) + 1;
+}
@@ -0,0 +1,301 @@
+#include "UDPTransport.h"
+#include "DNSMessage.h"
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <random>
+#include <sstream>
+
+namespace {
+
+bool parsePort(const std::string& text, uint16_t& port) {
+    if (text.empty() || text.size() > 5) return false;
+    char* end = nullptr;
+    unsigned long value = std::strtoul(text.c_str(), &end, 10);
+    if (*end != '\0' || value == 0 || value > 65535) return false;
+    port = static_cast<uint16_t>(value);
+    return true;
+}
+
+}  // namespace
+
+bool UDPTransport::ServerAddress::parse(const std::string& text, uint16_t default_port,
+                                        ServerAddress& out) {
+    std::string host = text;
+    uint16_t port = default_port;
+
+    if (!text.empty() && text[0] == '[') {
+        size_t close = text.find(']');
+        if (close == std::string::npos) return false;
+        host = text.substr(1, close - 1);
+        if (close + 1 < text.size()) {
+            if (text[close + 1] != ':' || !parsePort(text.substr(close + 2), port)) return false;
+        }
+    } else if (std::count(text.begin(), text.end(), ':') == 1) {
+        size_t colon = text.find(':');
+        host = text.substr(0, colon);
+        if (!parsePort(text.substr(colon + 1), port)) return false;
+    }
+
+    out = ServerAddress();
+    auto* v4 = reinterpret_cast<sockaddr_in*>(&out.addr);
+    if (inet_pton(AF_INET, host.c_str(), &v4->sin_addr) == 1) {
+        v4->sin_family = AF_INET;
+        v4->sin_port = htons(port);
+        out.length = sizeof(sockaddr_in);
+        return true;
+    }
+    auto* v6 = reinterpret_cast<sockaddr_in6*>(&out.addr);
+    if (inet_pton(AF_INET6, host.c_str(), &v6->sin6_addr) == 1) {
+        v6->sin6_family = AF_INET6;
+        v6->sin6_port = htons(port);
+        out.length = sizeof(sockaddr_in6);
+        return true;
+    }
+    return false;
+}
+
+std::string UDPTransport::ServerAddress::toString() const {
+    char buffer[INET6_ADDRSTRLEN] = {0};
+    if (addr.ss_family == AF_INET) {
+        auto* v4 = reinterpret_cast<const sockaddr_in*>(&addr);
+        inet_ntop(AF_INET, &v4->sin_addr, buffer, sizeof(buffer));
+        return std::string(buffer) + ":" + std::to_string(ntohs(v4->sin_port));
+    }
+    auto* v6 = reinterpret_cast<const sockaddr_in6*>(&addr);
+    inet_ntop(AF_INET6, &v6->sin6_addr, buffer, sizeof(buffer));
+    return "[" + std::string(buffer) + "]:" + std::to_string(ntohs(v6->sin6_port));
+}
+
+uint16_t UDPTransport::ServerAddress::port() const {
+    if (addr.ss_family == AF_INET) {
+        return ntohs(reinterpret_cast<const sockaddr_in*>(&addr)->sin_port);
+    }
+    return ntohs(reinterpret_cast<const sockaddr_in6*>(&addr)->sin6_port);
+}
+
+bool UDPTransport::ServerAddress::operator==(const ServerAddress& other) const {
+    return length == other.length && std::memcmp(&addr, &other.addr, length) == 0;
+}
+
+bool UDPTransport::ServerAddress::sameEndpoint(const sockaddr_storage& from) const {
+    if (addr.ss_family != from.ss_family) return false;
+    if (from.ss_family == AF_INET) {
+        auto* a = reinterpret_cast<const sockaddr_in*>(&addr);
+        auto* b = reinterpret_cast<const sockaddr_in*>(&from);
+        return a->sin_port == b->sin_port && a->sin_addr.s_addr == b->sin_addr.s_addr;
+    }
+    auto* a = reinterpret_cast<const sockaddr_in6*>(&addr);
+    auto* b = reinterpret_cast<const sockaddr_in6*>(&from);
+    return a->sin6_port == b->sin6_port &&
+           std::memcmp(&a->sin6_addr, &b->sin6_addr, sizeof(in6_addr)) == 0;
+}
+
+UDPTransport::Status UDPTransport::exchange(const ServerAddress& server,
+                                            const uint8_t* query, size_t query_length,
+                                            uint8_t* response, size_t capacity,
+                                            size_t& response_length,
+                                            std::chrono::milliseconds timeout) {
+    response_length = 0;
+    int fd = socket(server.addr.ss_family, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) return Status::NetworkError;
+
+    Status status = Status::NetworkError;
+    if (connect(fd, reinterpret_cast<const sockaddr*>(&server.addr), server.length) == 0 &&
+        send(fd, query, query_length, 0) == static_cast<ssize_t>(query_length)) {
+        const uint16_t id = DNSMessage::readU16(query);
+        const auto deadline = std::chrono::steady_clock::now() + timeout;
+        status = Status::Timeout;
+
+        while (true) {
+            auto remaining = std::chrono::duration_cast<std::chrono::milliseconds>(
+                deadline - std::chrono::steady_clock::now());
+            if (remaining.count() <= 0) break;
+
+            pollfd pfd{fd, POLLIN, 0};
+            int ready = poll(&pfd, 1, static_cast<int>(remaining.count()));
+            if (ready < 0 && errno == EINTR) continue;
+            if (ready <= 0) break;
+
+            ssize_t n = recv(fd, response, capacity, 0);
+            if (n < 0) {
+                // ICMP port unreachable surfaces as ECONNREFUSED on a connected socket
+                if (errno == EINTR) continue;
+                status = Status::NetworkError;
+                break;
+            }
+            if (static_cast<size_t>(n) >= DNSMessage::HEADER_SIZE &&
+                DNSMessage::readU16(response) == id && (response[2] & 0x80) != 0) {
+                response_length = static_cast<size_t>(n);
+                status = Status::Ok;
+                break;
+            }
+            // Stray or spoofed datagram: keep waiting for the real answer
+        }
+    }
+    close(fd);
+    return status;
+}
+
+UDPTransport::Status UDPTransport::exchange(const std::vector<ServerAddress>& servers,
+                                            const uint8_t* query, size_t query_length,
+                                            uint8_t* response, size_t capacity,
+                                            size_t& response_length,
+                                            RetransmitSchedule& schedule, const Acceptor& accept,
+                                            size_t* answered_by) {
+    using Clock = RetransmitSchedule::Clock;
+    struct Transmission {
+        size_t server;
+        uint16_t id;
+        Clock::time_point sent;
+    };
+
+    response_length = 0;
+    std::vector<int> sockets(servers.size(), -1);  // One connected socket per server, opened on first use
+    std::vector<bool> failed(servers.size(), false);
+    std::vector<Transmission> sent;
+    std::vector<uint8_t> packet(query, query + query_length);
+
+    Status status = Status::Timeout;
+    Clock::time_point next_at = Clock::now();
+    bool timer_armed = false;  // next_at is the last transmission's retransmit timer
+    bool exhausted = false;
+
+    auto fail = [&](size_t server) {
+        failed[server] = true;
+        schedule.failed(server);
+        if (!exhausted) {
+            timer_armed = false;
+            next_at = Clock::now();  // Move on without waiting
+        }
+    };
+    auto live = [&] {
+        return std::any_of(sent.begin(), sent.end(), [&](const Transmission& t) { return !failed[t.server]; });
+    };
+
+    while (status == Status::Timeout) {
+        auto now = Clock::now();
+        if (now >= schedule.deadline()) break;
+
+        if (!exhausted && now >= next_at) {
+            if (timer_armed) schedule.timerExpired();
+            size_t server;
+            Clock::time_point retransmit_at;
+            if (!schedule.next(server, retransmit_at)) {
+                exhausted = true;
+                timer_armed = false;
+                next_at = schedule.deadline();
+            } else {
+                timer_armed = true;
+                next_at = retransmit_at;
+                if (sockets[server] < 0) {
+                    int fd = socket(servers[server].addr.ss_family, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+                    if (fd >= 0 && connect(fd, reinterpret_cast<const sockaddr*>(&servers[server].addr),
+                                           servers[server].length) != 0) {
+                        close(fd);
+                        fd = -1;
+                    }
+                    sockets[server] = fd;
+                }
+                uint16_t id = randomId();
+                DNSMessage::writeU16(packet.data(), id);
+                if (sockets[server] >= 0 &&
+                    send(sockets[server], packet.data(), packet.size(), 0) == static_cast<ssize_t>(packet.size())) {
+                    sent.push_back(Transmission{server, id, Clock::now()});
+                } else {
+                    fail(server);
+                }
+                continue;
+            }
+        }
+        if (exhausted && !live()) {
+            status = Status::NetworkError;  // Every server failed
+            break;
+        }
+
+        std::vector<pollfd> pfds;
+        std::vector<size_t> polled;
+        for (size_t i = 0; i < sockets.size(); ++i) {
+            if (sockets[i] >= 0 && !failed[i]) {
+                pfds.push_back(pollfd{sockets[i], POLLIN, 0});
+                polled.push_back(i);
+            }
+        }
+        auto wait = std::chrono::duration_cast<std::chrono::milliseconds>(next_at - Clock::now()).count() + 1;
+        int ready = poll(pfds.data(), pfds.size(), static_cast<int>(std::max<long long>(wait, 0)));
+        if (ready < 0 && errno != EINTR) {
+            status = Status::NetworkError;
+            break;
+        }
+
+        for (size_t p = 0; p < pfds.size() && ready > 0; ++p) {
+            if (pfds[p].revents == 0) continue;
+            const size_t server = polled[p];
+            while (true) {
+                ssize_t n = recv(sockets[server], response, capacity, MSG_DONTWAIT);
+                if (n < 0) {
+                    // ICMP port unreachable surfaces as ECONNREFUSED on a connected socket
+                    if (errno == EINTR) continue;
+                    if (errno != EAGAIN && errno != EWOULDBLOCK) fail(server);
+                    break;
+                }
+                if (static_cast<size_t>(n) < DNSMessage::HEADER_SIZE || (response[2] & 0x80) == 0) continue;
+                const uint16_t id = DNSMessage::readU16(response);
+                auto t = std::find_if(sent.begin(), sent.end(), [&](const Transmission& tx) {
+                    return tx.server == server && tx.id == id;
+                });
+                if (t == sent.end()) continue;  // Stray or spoofed datagram
+
+                if (accept(server, response, static_cast<size_t>(n))) {
+                    schedule.answered(server, Clock::now() - t->sent);
+                    response_length = static_cast<size_t>(n);
+                    if (answered_by) *answered_by = server;
+                    status = Status::Ok;
+                } else {
+                    fail(server);
+                }
+                break;
+            }
+            if (status == Status::Ok) break;
+        }
+    }
+
+    for (int fd : sockets) {
+        if (fd >= 0) close(fd);
+    }
+    return status;
+}
+
+const std::vector<std::string>& UDPTransport::systemNameservers() {
+    static const std::vector<std::string> servers = [] {
+        std::vector<std::string> result;
+        std::ifstream resolv("/etc/resolv.conf");
+        std::string line;
+        while (std::getline(resolv, line)) {
+            std::istringstream fields(line);
+            std::string keyword, address;
+            if (fields >> keyword >> address && keyword == "nameserver") {
+                ServerAddress parsed;
+                if (ServerAddress::parse(address, DNS_PORT, parsed)) {
+                    result.push_back(address);
+                }
+            }
+        }
+        if (result.empty()) {
+            result.push_back("127.0.0.1");
+        }
+        return result;
+    }();
+    return servers;
+}
+
+uint16_t UDPTransport::randomId() {
+    thread_local std::mt19937 generator(std::random_device{}());
+    return static_cast<uint16_t>(generator());
+}
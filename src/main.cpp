@@ -1,305 +1,263 @@
-#include <bits/stdc++.h>
+// Command-line front end to the resolver.
+//
+// Usage: dns_resolver [options] [--type TYPE] NAME...
+//            Resolves each NAME and prints its addresses, or with --type its
+//            records of that type (CNAME, NS, PTR, MX, SRV, TXT, ...).
+//        dns_resolver --serve [options] [--listen IP] [--port N] [--threads N]
+//                     [--batch N] [--no-tcp] [--no-pin]
+//            Answers clients over UDP and TCP from one shared cache until
+//            interrupted, then prints what was served. --batch sets how many
+//            datagrams a worker moves per syscall (1 disables batching).
+//
+// Options: --upstream IP[:PORT]  forwarder to use (repeatable; default is
+//                                /etc/resolv.conf)
+//          --recursive           iterate from the root servers instead
+//          --timeout N           seconds per lookup, retransmits included
+//          --retries N           retransmits per lookup
+//          --cache-size N        entries the cache holds before it evicts
+//                                (per table; default 4000000)
+//          --cache-file PATH     load the cache from PATH at startup and save
+//                                it there on exit (and, when serving, every
+//                                --save-interval seconds; default 300)
+//          --hosts FILE          answer from a hosts file before anything else;
+//                                names mapped to 0.0.0.0 or :: are blocked
+//          --rpz FILE            apply a response policy zone (blocklist);
+//                                both are repeatable, and a server reloads
+//                                them on SIGHUP
+#include <algorithm>
+#include <chrono>
+#include <csignal>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
 #include "DNSResolver.h"
+#include "DNSServer.h"
 
-// ANSI color codes for terminal output
-namespace Color {
-    const std::string GREEN = "\033[32m";
-    const std::string RED = "\033[31m";
-    const std::string YELLOW = "\033[33m";
-    const std::string RESET = "\033[0m";
-    const std::string BOLD = "\033[1m";
-}
-
-// Test result structure
-struct TestResult {
-    std::string name;
-    bool passed;
-    std::string error_message;
-    double duration;
-};
-
-class TestRunner {
-private:
-    std::vector<TestResult> results;
-    std::chrono::steady_clock::time_point start_time;
-
-public:
-    void startTesting() {
-        start_time = std::chrono::steady_clock::now();
-        std::cout << Color::BOLD << "\n=================== DNS Resolver Test Suite ===================" 
-                  << Color::RESET << "\n" << std::endl;
-    }
-
-    void runTest(const std::string& testName, std::function<void()> testFunction) {
-        auto test_start = std::chrono::steady_clock::now();
-        TestResult result{testName, true, "", 0.0};
-        
-        try {
-            testFunction();
-        } catch (const std::exception& e) {
-            result.passed = false;
-            result.error_message = e.what();
-        }
-
-        auto test_end = std::chrono::steady_clock::now();
-        result.duration = std::chrono::duration<double>(test_end - test_start).count();
-        
-        // Print immediate result
-        std::cout << (result.passed ? Color::GREEN : Color::RED)
-                  << "[" << (result.passed ? "PASSED" : "FAILED") << "] " 
-                  << Color::RESET << testName 
-                  << " (" << std::fixed << std::setprecision(3) << result.duration << "s)";
-        
-        if (!result.passed) {
-            std::cout << "\n" << Color::RED << "    Error: " << result.error_message << Color::RESET;
-        }
-        std::cout << std::endl;
-        
-        results.push_back(result);
-    }
-
-    void printSummary() {
-        auto end_time = std::chrono::steady_clock::now();
-        double total_duration = std::chrono::duration<double>(end_time - start_time).count();
-        
-        int passed = std::count_if(results.begin(), results.end(), 
-                                 [](const TestResult& r) { return r.passed; });
-        int failed = results.size() - passed;
-
-        std::cout << "\n=================== Test Summary ===================" << std::endl;
-        
-        // Print failed tests summary if any
-        if (failed > 0) {
-            std::cout << Color::RED << "\nFailed Tests:" << Color::RESET << std::endl;
-            for (const auto& result : results) {
-                if (!result.passed) {
-                    std::cout << "  " << result.name << ": " << result.error_message << std::endl;
-                }
-            }
-        }
-
-        // Print statistics
-        std::cout << "\nTest Statistics:" << std::endl;
-        std::cout << "  Total Tests: " << results.size() << std::endl;
-        std::cout << Color::GREEN << "  Passed: " << passed << Color::RESET << std::endl;
-        if (failed > 0) {
-            std::cout << Color::RED << "  Failed: " << failed << Color::RESET << std::endl;
-        } else {
-            std::cout << "  Failed: " << failed << std::endl;
-        }
-        std::cout << "  Total Time: " << std::fixed << std::setprecision(2) 
-                  << total_duration << "s" << std::endl;
+namespace {
 
-        // Print final status
-        std::cout << "\n" << (failed == 0 ? Color::GREEN : Color::RED)
-                  << "================= " 
-                  << (failed == 0 ? "All Tests Passed" : "Some Tests Failed")
-                  << " =================" 
-                  << Color::RESET << std::endl;
-    }
-};
+volatile std::sig_atomic_t stop_requested = 0;
+volatile std::sig_atomic_t reload_requested = 0;
 
-// Test functions
-void testBasicResolution() {
-    DNSResolver resolver;
-    std::string domain = "github.com";
-    DNSResolver::ResolverOptions options;
-    auto result = resolver.resolve(domain, options);
-
-    if (result.empty()) {
-        throw std::runtime_error("Resolution failed for github.com");
-    }
+void requestStop(int) { stop_requested = 1; }
+void requestReload(int) { reload_requested = 1; }
 
-    // Verify that at least one valid IP address is returned
-    bool hasValidIP = false;
-    for (const auto& ip : result) {
-        if (!ip.empty()) {
-            hasValidIP = true;
-            break;
-        }
-    }
-    if (!hasValidIP) {
-        throw std::runtime_error("No valid IP addresses returned for github.com");
-    }
+int usage() {
+    std::cerr << "usage: dns_resolver [--upstream IP[:PORT]]... [--recursive] [--timeout N] [--retries N] [--type TYPE]\n"
+                 "                    [--cache-size N] [--cache-file PATH] [--hosts FILE]... [--rpz FILE]... NAME...\n"
+                 "       dns_resolver --serve [--listen IP] [--port N] [--threads N] [--batch N] [--no-tcp] [--no-pin]\n"
+                 "                    [--upstream IP[:PORT]]... [--recursive] [--timeout N] [--retries N]\n"
+                 "                    [--cache-size N] [--cache-file PATH] [--save-interval N] [--hosts FILE]... [--rpz FILE]..."
+              << std::endl;
+    return 2;
 }
 
-void testRecursiveResolution() {
-    DNSResolver resolver;
-    std::string domain = "github.com";
-    DNSResolver::ResolverOptions options;
-    options.recursive = true;
-    auto result = resolver.resolve(domain, options);
-
-    if (result.empty()) {
-        throw std::runtime_error("Recursive resolution failed for github.com");
+const char* statusText(DNSQuery::Status status) {
+    switch (status) {
+    case DNSQuery::Status::Success: return "ok";
+    case DNSQuery::Status::NXDomain: return "no such domain";
+    case DNSQuery::Status::NoData: return "no addresses";
+    case DNSQuery::Status::Failure: return "lookup failed";
     }
+    return "lookup failed";
 }
 
-void testCaching() {
-    DNSResolver resolver;
-    std::string domain = "github.com";
-    DNSResolver::ResolverOptions options;
-    options.use_cache = true;
-
-    // Clear any existing cache
-    resolver.clearCache();
-
-    // First resolution (should query DNS)
-    auto start_uncached = std::chrono::high_resolution_clock::now();
-    auto result1 = resolver.resolve(domain, options);
-    auto duration_uncached = std::chrono::duration_cast<std::chrono::microseconds>(
-        std::chrono::high_resolution_clock::now() - start_uncached);
-
-    if (result1.empty()) {
-        throw std::runtime_error("First resolution failed for " + domain);
-    }
-
-    // Small delay to ensure timing difference
-    std::this_thread::sleep_for(std::chrono::milliseconds(10));
-
-    // Second resolution (should use cache)
-    auto start_cached = std::chrono::high_resolution_clock::now();
-    auto result2 = resolver.resolve(domain, options);
-    auto duration_cached = std::chrono::duration_cast<std::chrono::microseconds>(
-        std::chrono::high_resolution_clock::now() - start_cached);
-
-    if (result2.empty()) {
-        throw std::runtime_error("Cached resolution failed for " + domain);
-    }
-
-    // Check if results match
-    if (result1 != result2) {
-        throw std::runtime_error("Cached result does not match uncached result for " + domain);
-    }
-
-    // Verify cached resolution is faster
-    if (duration_cached >= duration_uncached) {
-        throw std::runtime_error("Cached resolution is not faster than uncached resolution");
-    }
+// State kept outside the resolver: the cache snapshot and local zone files
+struct Persistence {
+    std::string cache_file;
+    int save_interval = 300;
+    std::vector<std::string> hosts_files;
+    std::vector<std::string> rpz_files;
+};
 
-    std::cout << "Uncached resolution took: " << duration_uncached.count() << " µs" << std::endl;
-    std::cout << "Cached resolution took: " << duration_cached.count() << " µs" << std::endl;
+void loadCache(DNSResolver& resolver, const Persistence& persistence) {
+    if (persistence.cache_file.empty()) return;
+    size_t loaded = resolver.persistCache(persistence.cache_file,
+                                          std::chrono::seconds(std::max(persistence.save_interval, 1)));
+    if (loaded) std::cerr << "Loaded " << loaded << " cached answers from " << persistence.cache_file << std::endl;
 }
 
-void testNonExistentDomain() {
-    DNSResolver resolver;
-    std::string domain = "thisdomaindoesnotexist123.com";
-    DNSResolver::ResolverOptions options;
-    auto result = resolver.resolve(domain, options);
-
-    if (!result.empty()) {
-        throw std::runtime_error("Resolution should have failed for non-existent domain");
+// Builds the local zone from every --hosts and --rpz file and swaps it in.
+// On any error the resolver keeps the zone it had.
+bool loadLocalZone(DNSResolver& resolver, const Persistence& persistence) {
+    if (persistence.hosts_files.empty() && persistence.rpz_files.empty()) return true;
+    LocalZone::Builder builder;
+    std::string error;
+    for (const auto& path : persistence.hosts_files) {
+        if (!builder.loadHosts(path, error)) {
+            std::cerr << "dns_resolver: " << error << std::endl;
+            return false;
+        }
     }
-}
-
-void testTimeout() {
-    DNSResolver resolver;
-    std::string domain = "google.com";
-    DNSResolver::ResolverOptions options;
-    options.timeout_seconds = 1;  // Very short timeout
-
-    auto start_time = std::chrono::steady_clock::now();
-    auto result = resolver.resolve(domain, options);
-    auto duration = std::chrono::duration_cast<std::chrono::seconds>(
-        std::chrono::steady_clock::now() - start_time).count();
-
-    if (duration > options.timeout_seconds + 1) {
-        throw std::runtime_error("Resolver did not respect timeout setting");
+    for (const auto& path : persistence.rpz_files) {
+        if (!builder.loadRpz(path, error)) {
+            std::cerr << "dns_resolver: " << error << std::endl;
+            return false;
+        }
     }
+    auto zone = builder.build();
+    std::cerr << "Loaded " << zone->size() << " local rules" << std::endl;
+    resolver.setLocalZone(std::move(zone));
+    return true;
 }
 
-void testMultipleRecords() {
-    DNSResolver resolver;
-    std::string domain = "example.com";
-    DNSResolver::ResolverOptions options;
-    auto result = resolver.resolve(domain, options);
-
-    if (result.empty()) {
-        throw std::runtime_error("Resolution failed for example.com");
+// Record data in presentation form
+std::string recordText(const DNSMessage::TypedRecord& record) {
+    switch (record.type) {
+    case DNSMessage::RecordType::MX:
+        return std::to_string(record.priority) + " " + record.data;
+    case DNSMessage::RecordType::SRV:
+        return std::to_string(record.priority) + " " + std::to_string(record.weight) + " " +
+               std::to_string(record.port) + " " + record.data;
+    case DNSMessage::RecordType::TXT: {
+        std::string text;
+        for (const auto& part : record.strings) text += (text.empty() ? "\"" : " \"") + part + "\"";
+        return text;
     }
-
-    if (result.size() < 2) {
-        throw std::runtime_error("Expected multiple IP addresses for example.com");
+    default:
+        return record.data;
     }
 }
 
-void testInvalidDomainFormat() {
-    DNSResolver resolver;
-    std::string domain = "invalid_domain";
-    DNSResolver::ResolverOptions options;
-    auto result = resolver.resolve(domain, options);
-
-    if (!result.empty()) {
-        throw std::runtime_error("Resolution should have failed for invalid domain format");
+int resolveRecords(DNSResolver& resolver, const std::vector<std::string>& names, DNSMessage::RecordType type,
+                   const DNSResolver::ResolverOptions& options) {
+    int failures = 0;
+    for (const auto& name : names) {
+        auto result = resolver.resolveRecords(name, type, options);
+        if (result.records.empty()) {
+            std::cout << name << ": "
+                      << (result.status == DNSQuery::Status::NoData ? "no records" : statusText(result.status))
+                      << std::endl;
+            ++failures;
+            continue;
+        }
+        for (const auto& record : result.records) {
+            std::cout << result.canonical_name << " " << result.ttl << " " << recordText(record) << std::endl;
+        }
     }
+    return failures ? 1 : 0;
 }
 
-void testLargeDomainResolution() {
-    DNSResolver resolver;
-    std::vector<std::string> domains = {
-        "google.com", "yahoo.com", "example.com", 
-        "github.com", "facebook.com"
-    };
-
-    std::vector<std::string> failedDomains;
-
-    for (const auto& domain : domains) {
-        DNSResolver::ResolverOptions options;
-        auto result = resolver.resolve(domain, options);
-
-        if (result.empty()) {
-            failedDomains.push_back(domain);
+int resolveNames(const std::vector<std::string>& names, const DNSResolver::ResolverOptions& options,
+                 const DNSCache::Options& cache, const Persistence& persistence, const std::string& type_name) {
+    DNSResolver resolver(cache);
+    if (!loadLocalZone(resolver, persistence)) return 1;
+    loadCache(resolver, persistence);
+    if (!type_name.empty()) {
+        DNSMessage::RecordType type;
+        if (!DNSMessage::parseType(type_name, type)) {
+            std::cerr << "dns_resolver: unknown record type " << type_name << std::endl;
+            return 2;
         }
+        return resolveRecords(resolver, names, type, options);
     }
-
-    if (!failedDomains.empty()) {
-        std::string errorMsg = "Resolution failed for domains: ";
-        for (const auto& domain : failedDomains) {
-            errorMsg += domain + " ";
+    int failures = 0;
+    for (const auto& name : names) {
+        auto result = resolver.resolveDetailed(name, options);
+        if (result.ip_addresses.empty()) {
+            std::cout << name << ": " << statusText(result.status) << std::endl;
+            ++failures;
+            continue;
+        }
+        for (const auto& address : result.ip_addresses) {
+            std::cout << name << " " << result.ttl << " " << address << std::endl;
         }
-        throw std::runtime_error(errorMsg);
     }
+    return failures ? 1 : 0;
 }
 
-void testIDNResolution() {
-    DNSResolver resolver;
-    std::string domain = "xn--ls8h.xn--zfr164b"; // Example IDN domain
-    DNSResolver::ResolverOptions options;
-    auto result = resolver.resolve(domain, options);
-
-    if (result.empty()) {
-        throw std::runtime_error("Resolution failed for internationalized domain");
+int serve(const DNSServer::Options& options, const DNSCache::Options& cache, const Persistence& persistence) {
+    DNSResolver resolver(cache);
+    if (!loadLocalZone(resolver, persistence)) return 1;
+    loadCache(resolver, persistence);
+    std::signal(SIGINT, requestStop);
+    std::signal(SIGTERM, requestStop);
+    std::signal(SIGHUP, requestReload);
+    try {
+        DNSServer server(resolver, options);
+        std::cout << "Serving on " << server.address() << " with " << server.threads() << " UDP workers"
+                  << (options.tcp ? " and TCP" : "") << std::endl;
+        while (!stop_requested) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(100));
+            if (reload_requested) {
+                reload_requested = 0;
+                loadLocalZone(resolver, persistence);
+            }
+        }
+        server.stop();
+        auto stats = resolver.stats();
+        std::cout << "Received " << server.queries() << " queries, answered " << server.responses()
+                  << ", ignored " << server.dropped() << "; cache hit ratio " << std::fixed
+                  << std::setprecision(1) << stats.hitRatio() * 100 << "%" << std::endl;
+    } catch (const std::exception& e) {
+        std::cerr << "dns_resolver: " << e.what() << std::endl;
+        return 1;
     }
+    return 0;
 }
 
-void testAnotherIDNResolution() {
-    DNSResolver resolver;
-    std::string domain = "xn--d1acufc.xn--p1ai.com"; // Another IDN domain
-    DNSResolver::ResolverOptions options;
-    auto result = resolver.resolve(domain, options);
+}  // namespace
+
+int main(int argc, char* argv[]) {
+    DNSServer::Options server;
+    auto& options = server.resolve;
+    bool serving = false;
+    DNSCache::Options cache;
+    Persistence persistence;
+    std::string type;
+    std::vector<std::string> names;
+
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "--serve") {
+            serving = true;
+        } else if (arg == "--recursive") {
+            options.recursive = true;
+        } else if (arg == "--no-tcp") {
+            server.tcp = false;
+        } else if (arg == "--no-pin") {
+            server.pin_threads = false;
+        } else if (arg.compare(0, 2, "--") == 0) {
+            if (i + 1 >= argc) return usage();
+            std::string value = argv[++i];
+            if (arg == "--upstream") {
+                options.nameservers.push_back(value);
+            } else if (arg == "--timeout") {
+                options.timeout_seconds = std::atoi(value.c_str());
+            } else if (arg == "--retries") {
+                options.retries = std::atoi(value.c_str());
+            } else if (arg == "--listen") {
+                server.address = value;
+            } else if (arg == "--port") {
+                server.port = static_cast<uint16_t>(std::atoi(value.c_str()));
+            } else if (arg == "--batch") {
+                server.batch_size = static_cast<size_t>(std::atoi(value.c_str()));
+            } else if (arg == "--cache-size") {
+                cache.max_entries = static_cast<size_t>(std::atoll(value.c_str()));
+            } else if (arg == "--cache-file") {
+                persistence.cache_file = value;
+            } else if (arg == "--type") {
+                type = value;
+            } else if (arg == "--hosts") {
+                persistence.hosts_files.push_back(value);
+            } else if (arg == "--rpz") {
+                persistence.rpz_files.push_back(value);
+            } else if (arg == "--save-interval") {
+                persistence.save_interval = std::atoi(value.c_str());
+            } else if (arg == "--threads") {
+                server.threads = static_cast<size_t>(std::atoi(value.c_str()));
+            } else {
+                return usage();
+            }
+        } else {
+            names.push_back(arg);
+        }
+    }
 
-    if (result.empty()) {
-        throw std::runtime_error("Resolution failed for another internationalized domain");
+    if (serving) {
+        return names.empty() ? serve(server, cache, persistence) : usage();
     }
+    return names.empty() ? usage() : resolveNames(names, options, cache, persistence, type);
 }
-
-int main() {
-    TestRunner runner;
-    runner.startTesting();
-
-    // Run all tests
-    runner.runTest("Basic Resolution", testBasicResolution);
-    runner.runTest("Recursive Resolution", testRecursiveResolution);
-    runner.runTest("Caching", testCaching);
-    runner.runTest("Non-Existent Domain", testNonExistentDomain);
-    runner.runTest("Timeout", testTimeout);
-    runner.runTest("Multiple Records", testMultipleRecords);
-    runner.runTest("Invalid Domain Format", testInvalidDomainFormat);
-    runner.runTest("Large Domain Resolution", testLargeDomainResolution);
-    runner.runTest("IDN Resolution", testIDNResolution);
-    runner.runTest("Another IDN Resolution", testAnotherIDNResolution);
-    // Print final summary
-    runner.printSummary();
-
-    return 0;
-}
\ No newline at end of file
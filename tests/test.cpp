@@ -1,5 +1,51 @@
 #include <bits/stdc++.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
 #include "DNSResolver.h"
+#include "DNSCache.h"
+#include "DNSMessage.h"
+#include "DNSQuery.h"
+#include "DNSServer.h"
+#include "DatagramBatch.h"
+#include "DomainName.h"
+#include "LatencyHistogram.h"
+#include "LocalZone.h"
+#include "MockDNSServer.h"
+#include "RetransmitSchedule.h"
+#include "RttEstimator.h"
+#include "ShardedCache.h"
+#include "TCPPool.h"
+#include "UDPTransport.h"
+
+#ifndef TEST_DATA_DIR
+#define TEST_DATA_DIR "tests/data"
+#endif
+
+// Counts each thread's heap allocations, so tests can check that hot paths
+// make none
+namespace {
+thread_local uint64_t thread_allocations = 0;
+}  // namespace
+
+void* operator new(size_t size) {
+    ++thread_allocations;
+    if (void* p = std::malloc(size ? size : 1)) return p;
+    throw std::bad_alloc();
+}
+void* operator new[](size_t size) { return operator new(size); }
+void* operator new(size_t size, const std::nothrow_t&) noexcept {
+    ++thread_allocations;
+    return std::malloc(size ? size : 1);
+}
+void* operator new[](size_t size, const std::nothrow_t& tag) noexcept { return operator new(size, tag); }
+// Out of line, or GCC takes the inlined free() for a mismatched deallocation
+__attribute__((noinline)) void operator delete(void* p) noexcept { std::free(p); }
+__attribute__((noinline)) void operator delete[](void* p) noexcept { std::free(p); }
+__attribute__((noinline)) void operator delete(void* p, size_t) noexcept { std::free(p); }
+__attribute__((noinline)) void operator delete[](void* p, size_t) noexcept { std::free(p); }
 
 // ANSI color codes for terminal output
 namespace Color {
@@ -99,11 +145,175 @@ public:
     }
 };
 
+// Minimal UDP DNS server on 127.0.0.1 for offline tests. The handler gets
+// each query and returns the response bytes (empty to stay silent).
+class LoopbackServer {
+public:
+    using Handler = std::function<std::vector<uint8_t>(const std::vector<uint8_t>&)>;
+
+    explicit LoopbackServer(Handler handler, const std::string& ip = "127.0.0.1", uint16_t port = 0)
+        : handler_(std::move(handler)) {
+        fd_ = socket(AF_INET, SOCK_DGRAM, 0);
+        int buffer_size = 4 << 20;  // Absorb bursts of async queries
+        setsockopt(fd_, SOL_SOCKET, SO_RCVBUF, &buffer_size, sizeof(buffer_size));
+        sockaddr_in addr{};
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(port);
+        inet_pton(AF_INET, ip.c_str(), &addr.sin_addr);
+        if (bind(fd_, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0) {
+            throw std::runtime_error("LoopbackServer: bind failed on " + ip);
+        }
+        socklen_t len = sizeof(addr);
+        getsockname(fd_, reinterpret_cast<sockaddr*>(&addr), &len);
+        port_ = ntohs(addr.sin_port);
+        address_ = ip + ":" + std::to_string(port_);
+        thread_ = std::thread([this] { run(); });
+    }
+
+    ~LoopbackServer() {
+        stop_ = true;
+        thread_.join();
+        close(fd_);
+    }
+
+    const std::string& address() const { return address_; }
+    uint16_t port() const { return port_; }
+    int queries() const { return queries_; }
+
+private:
+    void run() {
+        std::vector<uint8_t> buffer(4096);
+        while (!stop_) {
+            pollfd pfd{fd_, POLLIN, 0};
+            if (poll(&pfd, 1, 20) <= 0) continue;
+            sockaddr_storage peer{};
+            socklen_t peer_len = sizeof(peer);
+            ssize_t n = recvfrom(fd_, buffer.data(), buffer.size(), 0,
+                                 reinterpret_cast<sockaddr*>(&peer), &peer_len);
+            if (n <= 0) continue;
+            ++queries_;
+            auto response = handler_(std::vector<uint8_t>(buffer.begin(), buffer.begin() + n));
+            if (!response.empty()) {
+                sendto(fd_, response.data(), response.size(), 0,
+                       reinterpret_cast<sockaddr*>(&peer), peer_len);
+            }
+        }
+    }
+
+    Handler handler_;
+    int fd_ = -1;
+    uint16_t port_ = 0;
+    std::string address_;
+    std::atomic<bool> stop_{false};
+    std::atomic<int> queries_{0};
+    std::thread thread_;
+};
+
+// Builds responses for LoopbackServer handlers.
+struct TestRecord {
+    std::string name;
+    DNSMessage::RecordType type;
+    uint32_t ttl;
+    std::string data;  // Address text, target name for CNAME/NS, or "mname rname minimum" for SOA
+};
+
+void appendRecord(std::vector<uint8_t>& out, const TestRecord& record) {
+    uint8_t buffer[512];
+    size_t n = DNSMessage::encodeName(buffer, sizeof(buffer), record.name);
+    out.insert(out.end(), buffer, buffer + n);
+    uint8_t fixed[10];
+    DNSMessage::writeU16(fixed, static_cast<uint16_t>(record.type));
+    DNSMessage::writeU16(fixed + 2, DNSMessage::CLASS_IN);
+    DNSMessage::writeU32(fixed + 4, record.ttl);
+    uint8_t rdata[512];
+    size_t rdlength = 0;
+    if (record.type == DNSMessage::RecordType::A) {
+        inet_pton(AF_INET, record.data.c_str(), rdata);
+        rdlength = 4;
+    } else if (record.type == DNSMessage::RecordType::AAAA) {
+        inet_pton(AF_INET6, record.data.c_str(), rdata);
+        rdlength = 16;
+    } else if (record.type == DNSMessage::RecordType::SOA) {
+        std::istringstream fields(record.data);
+        std::string mname, rname;
+        uint32_t minimum = 0;
+        fields >> mname >> rname >> minimum;
+        rdlength = DNSMessage::encodeName(rdata, sizeof(rdata), mname);
+        rdlength += DNSMessage::encodeName(rdata + rdlength, sizeof(rdata) - rdlength, rname);
+        const uint32_t timers[5] = {1, 3600, 600, 86400, minimum};  // serial .. minimum
+        for (uint32_t value : timers) {
+            DNSMessage::writeU32(rdata + rdlength, value);
+            rdlength += 4;
+        }
+    } else {
+        rdlength = DNSMessage::encodeName(rdata, sizeof(rdata), record.data);
+    }
+    DNSMessage::writeU16(fixed + 8, static_cast<uint16_t>(rdlength));
+    out.insert(out.end(), fixed, fixed + 10);
+    out.insert(out.end(), rdata, rdata + rdlength);
+}
+
+std::vector<uint8_t> buildTestResponse(const std::vector<uint8_t>& query,
+                                       DNSMessage::RCode rcode,
+                                       const std::vector<TestRecord>& answers,
+                                       const std::vector<TestRecord>& authority = {},
+                                       const std::vector<TestRecord>& additional = {}) {
+    size_t question_end = DNSMessage::skipName(query.data(), query.size(), DNSMessage::HEADER_SIZE) + 4;
+    std::vector<uint8_t> out(query.begin(), query.begin() + question_end);
+    out[2] = static_cast<uint8_t>(0x80 | (query[2] & 0x01));  // QR, keep RD
+    out[3] = static_cast<uint8_t>(static_cast<uint8_t>(rcode));
+    DNSMessage::writeU16(out.data() + 6, static_cast<uint16_t>(answers.size()));
+    DNSMessage::writeU16(out.data() + 8, static_cast<uint16_t>(authority.size()));
+    DNSMessage::writeU16(out.data() + 10, static_cast<uint16_t>(additional.size()));
+    for (const auto& r : answers) appendRecord(out, r);
+    for (const auto& r : authority) appendRecord(out, r);
+    for (const auto& r : additional) appendRecord(out, r);
+    return out;
+}
+
+std::vector<uint8_t> buildAuthoritativeResponse(const std::vector<uint8_t>& query,
+                                                DNSMessage::RCode rcode,
+                                                const std::vector<TestRecord>& answers) {
+    auto out = buildTestResponse(query, rcode, answers);
+    out[2] |= 0x04;  // AA
+    return out;
+}
+
+DNSMessage::Question parseTestQuestion(const std::vector<uint8_t>& query) {
+    DNSMessage::Parser parser(query.data(), query.size());
+    DNSMessage::Question question;
+    if (!parser.parseHeader() || !parser.nextQuestion(question)) {
+        throw std::runtime_error("Loopback server received a malformed query");
+    }
+    return question;
+}
+
+MockDNSServer::Zone loadTestZone() {
+    MockDNSServer::Zone zone;
+    std::string error;
+    if (!zone.load(std::string(TEST_DATA_DIR) + "/test.zone", error)) {
+        throw std::runtime_error("Cannot load test zone: " + error);
+    }
+    return zone;
+}
+
+// Shared fault-free server for tests that only need answers
+MockDNSServer& testServer() {
+    static MockDNSServer server(loadTestZone());
+    return server;
+}
+
+DNSResolver::ResolverOptions mockOptions(const MockDNSServer& server = testServer()) {
+    DNSResolver::ResolverOptions options;
+    options.nameservers = {server.address()};
+    return options;
+}
+
 // Test functions
 void testBasicResolution() {
     DNSResolver resolver;
     std::string domain = "github.com";
-    DNSResolver::ResolverOptions options;
+    DNSResolver::ResolverOptions options = mockOptions();
     auto result = resolver.resolve(domain, options);
 
     if (result.empty()) {
@@ -128,17 +338,36 @@ void testRecursiveResolution() {
     std::string domain = "github.com";
     DNSResolver::ResolverOptions options;
     options.recursive = true;
+    // The mock server is authoritative for com., so the walk ends at the "root"
+    options.root_servers = {testServer().ip()};
+    options.iterative_port = testServer().port();
     auto result = resolver.resolve(domain, options);
 
     if (result.empty()) {
         throw std::runtime_error("Recursive resolution failed for github.com");
     }
+
+    // Async recursive misses queue for a bounded set of walkers
+    options.use_cache = false;
+    std::vector<std::future<std::vector<std::string>>> answers;
+    for (int i = 0; i < 40; ++i) {
+        answers.push_back(resolver.resolveAsync(i % 2 ? "github.com" : "nothere" + std::to_string(i) + ".com", options));
+    }
+    for (int i = 0; i < 40; ++i) {
+        if (answers[i].get().empty() == (i % 2 == 1)) {
+            throw std::runtime_error("Queued recursive lookup " + std::to_string(i) + " got the wrong answer");
+        }
+    }
 }
 
 void testCaching() {
+    MockDNSServer::Options server_options;
+    server_options.faults.latency = std::chrono::milliseconds(5);
+    MockDNSServer server(loadTestZone(), server_options);
+
     DNSResolver resolver;
     std::string domain = "github.com";
-    DNSResolver::ResolverOptions options;
+    DNSResolver::ResolverOptions options = mockOptions(server);
     options.use_cache = true;
 
     // Clear any existing cache
@@ -172,8 +401,8 @@ void testCaching() {
         throw std::runtime_error("Cached result does not match uncached result for " + domain);
     }
 
-    // Verify cached resolution is faster
-    if (duration_cached >= duration_uncached) {
+    // Verify cached resolution is faster and never reached the server
+    if (duration_cached >= duration_uncached || server.queries() != 2) {
         throw std::runtime_error("Cached resolution is not faster than uncached resolution");
     }
 
@@ -184,7 +413,7 @@ void testCaching() {
 void testNonExistentDomain() {
     DNSResolver resolver;
     std::string domain = "thisdomaindoesnotexist123.com";
-    DNSResolver::ResolverOptions options;
+    DNSResolver::ResolverOptions options = mockOptions();
     auto result = resolver.resolve(domain, options);
 
     if (!result.empty()) {
@@ -193,9 +422,13 @@ void testNonExistentDomain() {
 }
 
 void testTimeout() {
+    MockDNSServer::Options server_options;
+    server_options.faults.loss = 1;  // Never answers
+    MockDNSServer server(loadTestZone(), server_options);
+
     DNSResolver resolver;
     std::string domain = "google.com";
-    DNSResolver::ResolverOptions options;
+    DNSResolver::ResolverOptions options = mockOptions(server);
     options.timeout_seconds = 1;  // Very short timeout
 
     auto start_time = std::chrono::steady_clock::now();
@@ -203,7 +436,7 @@ void testTimeout() {
     auto duration = std::chrono::duration_cast<std::chrono::seconds>(
         std::chrono::steady_clock::now() - start_time).count();
 
-    if (duration > options.timeout_seconds + 1) {
+    if (!result.empty() || duration > options.timeout_seconds + 1) {
         throw std::runtime_error("Resolver did not respect timeout setting");
     }
 }
@@ -211,7 +444,7 @@ void testTimeout() {
 void testMultipleRecords() {
     DNSResolver resolver;
     std::string domain = "example.com";
-    DNSResolver::ResolverOptions options;
+    DNSResolver::ResolverOptions options = mockOptions();
     auto result = resolver.resolve(domain, options);
 
     if (result.empty()) {
@@ -226,7 +459,7 @@ void testMultipleRecords() {
 void testInvalidDomainFormat() {
     DNSResolver resolver;
     std::string domain = "invalid_domain";
-    DNSResolver::ResolverOptions options;
+    DNSResolver::ResolverOptions options = mockOptions();
     auto result = resolver.resolve(domain, options);
 
     if (!result.empty()) {
@@ -243,12 +476,11 @@ void testLargeDomainResolution() {
 
     std::vector<std::string> failedDomains;
 
-    for (const auto& domain : domains) {
-        DNSResolver::ResolverOptions options;
-        auto result = resolver.resolve(domain, options);
-
-        if (result.empty()) {
-            failedDomains.push_back(domain);
+    DNSResolver::ResolverOptions options = mockOptions();
+    auto results = resolver.resolveMany(domains, options);
+    for (size_t i = 0; i < domains.size(); ++i) {
+        if (results[i].empty()) {
+            failedDomains.push_back(domains[i]);
         }
     }
 
@@ -264,7 +496,7 @@ void testLargeDomainResolution() {
 void testIDNResolution() {
     DNSResolver resolver;
     std::string domain = "xn--d1acpjx3f.xn--p1ai"; // Example IDN domain for "пример.рф"
-    DNSResolver::ResolverOptions options;
+    DNSResolver::ResolverOptions options = mockOptions();
     auto result = resolver.resolve(domain, options);
 
     if (result.empty()) {
@@ -295,6 +527,1685 @@ void testIDNResolution() {
 //     std::cout << std::endl;
 // }
 
+void testMessageRoundTrip() {
+    uint8_t buffer[512];
+    size_t length = DNSMessage::buildQuery(buffer, sizeof(buffer), 0xBEEF, "WWW.Example.com.",
+                                           DNSMessage::RecordType::AAAA);
+    if (length == 0) {
+        throw std::runtime_error("Failed to encode query");
+    }
+
+    DNSMessage::Parser parser(buffer, length);
+    DNSMessage::Question question;
+    if (!parser.parseHeader() || !parser.nextQuestion(question)) {
+        throw std::runtime_error("Failed to parse encoded query");
+    }
+    if (parser.header().id != 0xBEEF || !parser.header().recursionDesired() ||
+        parser.header().isResponse() || parser.header().arcount != 1) {
+        throw std::runtime_error("Header fields did not round-trip");
+    }
+    if (question.type != DNSMessage::RecordType::AAAA || !question.name.equals("www.example.com") ||
+        question.name.toString() != "WWW.Example.com") {
+        throw std::runtime_error("Question did not round-trip");
+    }
+
+    DNSMessage::ResourceRecord opt;
+    if (!parser.nextRecord(opt) || opt.type != DNSMessage::RecordType::OPT ||
+        opt.section != DNSMessage::Section::Additional) {
+        throw std::runtime_error("EDNS0 OPT record missing");
+    }
+
+    std::string too_long(64, 'a');
+    if (DNSMessage::buildQuery(buffer, sizeof(buffer), 1, too_long + ".com", DNSMessage::RecordType::A) != 0) {
+        throw std::runtime_error("Label longer than 63 octets was accepted");
+    }
+}
+
+void testCompressedResponseParsing() {
+    // www.example.com A -> CNAME cdn.example.com (compressed) -> A 192.0.2.7
+    const uint8_t response[] = {
+        0x12, 0x34, 0x81, 0x80, 0x00, 0x01, 0x00, 0x02, 0x00, 0x00, 0x00, 0x00,
+        3, 'w', 'w', 'w', 7, 'e', 'x', 'a', 'm', 'p', 'l', 'e', 3, 'c', 'o', 'm', 0,
+        0x00, 0x01, 0x00, 0x01,
+        0xC0, 0x0C, 0x00, 0x05, 0x00, 0x01, 0x00, 0x00, 0x01, 0x2C, 0x00, 0x06,
+        3, 'c', 'd', 'n', 0xC0, 0x10,
+        0xC0, 0x2D, 0x00, 0x01, 0x00, 0x01, 0x00, 0x00, 0x00, 0x3C, 0x00, 0x04,
+        192, 0, 2, 7
+    };
+
+    DNSQuery::QueryResult result;
+    result.success = false;
+    if (!DNSQuery::parseResponse(response, sizeof(response), "www.example.com",
+                                 DNSMessage::RecordType::A, result)) {
+        throw std::runtime_error("Failed to parse compressed response");
+    }
+    if (!result.success || result.ip_addresses.size() != 1 || result.ip_addresses[0] != "192.0.2.7") {
+        throw std::runtime_error("CNAME chain was not followed to the address");
+    }
+    if (result.ttl != 60) {
+        throw std::runtime_error("Expected minimum TTL of 60, got " + std::to_string(result.ttl));
+    }
+
+    // A compression pointer that points at itself must be rejected
+    std::vector<uint8_t> looped(response, response + sizeof(response));
+    looped[34] = 33;
+    DNSQuery::QueryResult rejected;
+    rejected.success = false;
+    if (DNSQuery::parseResponse(looped.data(), looped.size(), "www.example.com",
+                                DNSMessage::RecordType::A, rejected)) {
+        throw std::runtime_error("Looping compression pointer was accepted");
+    }
+}
+
+void testLoopbackResolution() {
+    LoopbackServer server([](const std::vector<uint8_t>& query) {
+        auto question = parseTestQuestion(query);
+        if (!question.name.equals("loopback.test")) {
+            return buildTestResponse(query, DNSMessage::RCode::NXDomain, {});
+        }
+        if (question.type == DNSMessage::RecordType::AAAA) {
+            return buildTestResponse(query, DNSMessage::RCode::NoError,
+                                     {{"loopback.test", DNSMessage::RecordType::AAAA, 120, "2001:db8::1"}});
+        }
+        return buildTestResponse(query, DNSMessage::RCode::NoError,
+                                 {{"loopback.test", DNSMessage::RecordType::A, 120, "10.0.0.1"},
+                                  {"loopback.test", DNSMessage::RecordType::A, 120, "10.0.0.2"}});
+    });
+
+    DNSResolver resolver;
+    DNSResolver::ResolverOptions options;
+    options.nameservers = {server.address()};
+    auto result = resolver.resolve("loopback.test", options);
+
+    std::vector<std::string> expected = {"10.0.0.1", "10.0.0.2", "2001:db8::1"};
+    if (result != expected) {
+        throw std::runtime_error("Unexpected addresses from loopback server");
+    }
+    if (!resolver.resolve("missing.test", options).empty()) {
+        throw std::runtime_error("NXDOMAIN answer produced addresses");
+    }
+}
+
+void testIterativeResolution() {
+    using RT = DNSMessage::RecordType;
+
+    // Stand-in hierarchy: . on 127.0.0.1, test. on 127.0.0.2, example.test.
+    // on 127.0.0.3 and other.test. (delegated without glue) on 127.0.0.4.
+    LoopbackServer root([](const std::vector<uint8_t>& query) {
+        auto q = parseTestQuestion(query);
+        if (!q.name.isSubdomainOf("test")) return buildAuthoritativeResponse(query, DNSMessage::RCode::NXDomain, {});
+        return buildTestResponse(query, DNSMessage::RCode::NoError, {},
+                                 {{"test", RT::NS, 3600, "ns.test"}},
+                                 {{"ns.test", RT::A, 3600, "127.0.0.2"}});
+    });
+    const uint16_t port = root.port();
+
+    LoopbackServer tld([](const std::vector<uint8_t>& query) {
+        auto q = parseTestQuestion(query);
+        if (q.name.isSubdomainOf("example.test")) {
+            return buildTestResponse(query, DNSMessage::RCode::NoError, {},
+                                     {{"example.test", RT::NS, 3600, "ns.example.test"}},
+                                     {{"ns.example.test", RT::A, 3600, "127.0.0.3"}});
+        }
+        if (q.name.isSubdomainOf("other.test")) {
+            return buildTestResponse(query, DNSMessage::RCode::NoError, {},
+                                     {{"other.test", RT::NS, 3600, "ns.example.test"}});
+        }
+        if (q.name.isSubdomainOf("loop.test")) {
+            // Lame delegation back to the TLD itself
+            return buildTestResponse(query, DNSMessage::RCode::NoError, {},
+                                     {{"test", RT::NS, 3600, "ns.test"}},
+                                     {{"ns.test", RT::A, 3600, "127.0.0.2"}});
+        }
+        return buildAuthoritativeResponse(query, DNSMessage::RCode::NXDomain, {});
+    }, "127.0.0.2", port);
+
+    LoopbackServer example([](const std::vector<uint8_t>& query) {
+        auto q = parseTestQuestion(query);
+        if (q.name.equals("www.example.test")) {
+            return buildAuthoritativeResponse(query, DNSMessage::RCode::NoError,
+                                              {{"www.example.test", RT::CNAME, 600, "web.other.test"}});
+        }
+        if (q.name.equals("ns.example.test") && q.type == RT::A) {
+            return buildAuthoritativeResponse(query, DNSMessage::RCode::NoError,
+                                              {{"ns.example.test", RT::A, 3600, "127.0.0.4"}});
+        }
+        if (q.name.equals("host.example.test")) {
+            if (q.type == RT::AAAA) {
+                return buildAuthoritativeResponse(query, DNSMessage::RCode::NoError,
+                                                  {{"host.example.test", RT::AAAA, 300, "2001:db8::1"}});
+            }
+            return buildAuthoritativeResponse(query, DNSMessage::RCode::NoError,
+                                              {{"host.example.test", RT::A, 300, "192.0.2.1"}});
+        }
+        return buildAuthoritativeResponse(query, DNSMessage::RCode::NXDomain, {});
+    }, "127.0.0.3", port);
+
+    LoopbackServer other([](const std::vector<uint8_t>& query) {
+        auto q = parseTestQuestion(query);
+        if (q.name.equals("web.other.test") && q.type == RT::A) {
+            return buildAuthoritativeResponse(query, DNSMessage::RCode::NoError,
+                                              {{"web.other.test", RT::A, 60, "192.0.2.99"}});
+        }
+        return buildAuthoritativeResponse(query, DNSMessage::RCode::NoError, {});
+    }, "127.0.0.4", port);
+
+    DNSResolver resolver;
+    DNSResolver::ResolverOptions options;
+    options.recursive = true;
+    options.use_cache = false;
+    options.root_servers = {"127.0.0.1"};
+    options.iterative_port = port;
+
+    auto host = resolver.resolve("host.example.test", options);
+    if (host != std::vector<std::string>{"192.0.2.1", "2001:db8::1"}) {
+        throw std::runtime_error("Iterative walk did not reach the authoritative server");
+    }
+
+    // CNAME into a zone whose nameserver has no glue
+    auto web = resolver.resolve("www.example.test", options);
+    if (web != std::vector<std::string>{"192.0.2.99"}) {
+        throw std::runtime_error("CNAME chase through a glueless delegation failed");
+    }
+
+    if (!resolver.resolve("missing.example.test", options).empty()) {
+        throw std::runtime_error("NXDOMAIN from the authoritative server produced addresses");
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    if (!resolver.resolve("a.loop.test", options).empty()) {
+        throw std::runtime_error("Referral loop produced addresses");
+    }
+    if (std::chrono::steady_clock::now() - start > std::chrono::seconds(1)) {
+        throw std::runtime_error("Referral loop was not detected promptly");
+    }
+}
+
+void testAsyncResolution() {
+    LoopbackServer server([](const std::vector<uint8_t>& query) {
+        auto q = parseTestQuestion(query);
+        std::string name = q.name.toString();
+        if (q.type != DNSMessage::RecordType::A || name.rfind("host", 0) != 0) {
+            return buildTestResponse(query, DNSMessage::RCode::NoError, {});
+        }
+        int n = std::stoi(name.substr(4));
+        std::string address = "10.1." + std::to_string(n / 256) + "." + std::to_string(n % 256);
+        return buildTestResponse(query, DNSMessage::RCode::NoError,
+                                 {{name, DNSMessage::RecordType::A, 300, address}});
+    });
+
+    DNSResolver resolver;
+    DNSResolver::ResolverOptions options;
+    options.nameservers = {server.address()};
+
+    const int count = 500;
+    std::mutex mutex;
+    std::condition_variable done;
+    int completed = 0;
+    std::vector<std::string> mismatches;
+    for (int i = 0; i < count; ++i) {
+        std::string expected = "10.1." + std::to_string(i / 256) + "." + std::to_string(i % 256);
+        resolver.resolveAsync("host" + std::to_string(i) + ".async.test", options,
+                              [&, expected](const std::vector<std::string>& result) {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (result.size() != 1 || result[0] != expected) mismatches.push_back(expected);
+            if (++completed == count) done.notify_one();
+        });
+    }
+
+    std::unique_lock<std::mutex> lock(mutex);
+    if (!done.wait_for(lock, std::chrono::seconds(10), [&] { return completed == count; })) {
+        throw std::runtime_error("Only " + std::to_string(completed) + " of " +
+                                 std::to_string(count) + " async lookups completed");
+    }
+    if (!mismatches.empty()) {
+        throw std::runtime_error("Async lookup returned wrong address for " + mismatches.front());
+    }
+    lock.unlock();
+
+    // Cached now: the future is ready without a round trip
+    auto cached = resolver.resolveAsync("host7.async.test", options);
+    if (cached.wait_for(std::chrono::seconds(0)) != std::future_status::ready ||
+        cached.get() != std::vector<std::string>{"10.1.0.7"}) {
+        throw std::runtime_error("Cached async lookup did not complete inline");
+    }
+}
+
+void testBatchResolution() {
+    LoopbackServer server([](const std::vector<uint8_t>& query) {
+        auto q = parseTestQuestion(query);
+        std::string name = q.name.toString();
+        if (name.rfind("missing", 0) == 0) {
+            return buildTestResponse(query, DNSMessage::RCode::NXDomain, {});
+        }
+        if (q.type != DNSMessage::RecordType::A) {
+            return buildTestResponse(query, DNSMessage::RCode::NoError, {});
+        }
+        int n = std::stoi(name.substr(4));
+        return buildTestResponse(query, DNSMessage::RCode::NoError,
+                                 {{name, DNSMessage::RecordType::A, 300, "10.2.0." + std::to_string(n)}});
+    });
+
+    DNSResolver resolver;
+    DNSResolver::ResolverOptions options;
+    options.nameservers = {server.address()};
+    options.batch_window = 8;
+
+    // Pre-populate one name so the batch contains a cache hit
+    resolver.resolve("name0.batch.test", options);
+    int queries_before = server.queries();
+
+    std::vector<std::string> domains;
+    for (int i = 0; i < 50; ++i) {
+        domains.push_back("name" + std::to_string(i % 20) + ".batch.test");
+    }
+    domains.push_back("missing.batch.test");
+
+    auto results = resolver.resolveMany(domains, options);
+    if (results.size() != domains.size()) {
+        throw std::runtime_error("resolveMany returned the wrong number of results");
+    }
+    for (size_t i = 0; i + 1 < domains.size(); ++i) {
+        std::string expected = "10.2.0." + std::to_string(i % 20);
+        if (results[i] != std::vector<std::string>{expected}) {
+            throw std::runtime_error("Result out of order for " + domains[i]);
+        }
+    }
+    if (!results.back().empty()) {
+        throw std::runtime_error("NXDOMAIN name produced addresses in batch");
+    }
+
+    // 19 distinct misses plus the missing name, A and AAAA each; the cache
+    // hit and the duplicates must not reach the server.
+    int sent = server.queries() - queries_before;
+    if (sent != 2 * 20) {
+        throw std::runtime_error("Expected 40 upstream queries, server saw " + std::to_string(sent));
+    }
+}
+
+void testCacheEntryView() {
+    ShardedCache cache;
+    cache.insert("view.test", {"2001:db8::1", "10.0.0.1", "not-an-address", "10.0.0.2"}, std::chrono::hours(1));
+
+    auto view = cache.find("view.test");
+    if (!view || view.size() != 3) {
+        throw std::runtime_error("Expected three packed addresses");
+    }
+    const uint8_t expected_v4[4] = {10, 0, 0, 2};
+    if (view.isIPv6(1) || !view.isIPv6(2) || std::memcmp(view.addressBytes(1), expected_v4, 4) != 0) {
+        throw std::runtime_error("Addresses not packed IPv4 first");
+    }
+
+    // Replacing the entry must not disturb a view that is still held
+    cache.insert("view.test", {"192.0.2.1"}, std::chrono::hours(1));
+    std::vector<std::string> formatted;
+    view.appendStrings(formatted);
+    std::vector<std::string> expected = {"10.0.0.1", "10.0.0.2", "2001:db8::1"};
+    if (formatted != expected) {
+        throw std::runtime_error("View changed after the entry was replaced");
+    }
+    if (cache.find("view.tes") || cache.find("view.test").addressString(0) != "192.0.2.1") {
+        throw std::runtime_error("Lookup returned the wrong entry");
+    }
+}
+
+void testSingleFlight() {
+    LoopbackServer server([](const std::vector<uint8_t>& query) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        auto question = parseTestQuestion(query);
+        if (question.type == DNSMessage::RecordType::AAAA) {
+            return buildTestResponse(query, DNSMessage::RCode::NoError, {});
+        }
+        return buildTestResponse(query, DNSMessage::RCode::NoError,
+                                 {{question.name.toString(), DNSMessage::RecordType::A, 300, "10.0.0.7"}});
+    });
+
+    DNSResolver resolver;
+    DNSResolver::ResolverOptions options;
+    options.nameservers = {server.address()};
+
+    // A herd of blocking and async callers for one name: one A and one AAAA query
+    std::vector<std::future<std::vector<std::string>>> async_results;
+    for (int i = 0; i < 20; ++i) {
+        async_results.push_back(resolver.resolveAsync("herd.test", options));
+    }
+    std::atomic<int> wrong{0};
+    std::vector<std::thread> threads;
+    for (int i = 0; i < 50; ++i) {
+        threads.emplace_back([&] {
+            if (resolver.resolve("herd.test", options) != std::vector<std::string>{"10.0.0.7"}) ++wrong;
+        });
+    }
+    for (auto& t : threads) t.join();
+    for (auto& f : async_results) {
+        if (f.get() != std::vector<std::string>{"10.0.0.7"}) ++wrong;
+    }
+
+    if (wrong > 0) {
+        throw std::runtime_error(std::to_string(wrong.load()) + " callers got the wrong answer");
+    }
+    if (server.queries() != 2) {
+        throw std::runtime_error("Expected 2 upstream queries, got " + std::to_string(server.queries()));
+    }
+
+    // Callers forwarding to different upstreams do not share a flight
+    LoopbackServer other([](const std::vector<uint8_t>& query) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        return buildTestResponse(query, DNSMessage::RCode::NoError, {});
+    });
+    DNSResolver::ResolverOptions other_options;
+    other_options.nameservers = {other.address()};
+    auto via_server = resolver.resolveAsync("split.test", options);
+    auto via_other = resolver.resolveAsync("split.test", other_options);
+    via_server.get();
+    via_other.get();
+    if (other.queries() != 2) {
+        throw std::runtime_error("Lookup for another upstream joined a flight it did not ask for");
+    }
+}
+
+void testPrefetchAndServeStale() {
+    enum Mode { Normal, ServFail, Slow };
+    std::atomic<int> mode{Normal};
+    LoopbackServer server([&mode](const std::vector<uint8_t>& query) {
+        if (mode == ServFail) return buildTestResponse(query, DNSMessage::RCode::ServFail, {});
+        if (mode == Slow) std::this_thread::sleep_for(std::chrono::milliseconds(300));
+        auto question = parseTestQuestion(query);
+        if (question.type == DNSMessage::RecordType::AAAA) {
+            return buildTestResponse(query, DNSMessage::RCode::NoError, {});
+        }
+        uint32_t ttl = question.name.equals("hot.test") ? 2 : 1;
+        return buildTestResponse(query, DNSMessage::RCode::NoError,
+                                 {{question.name.toString(), DNSMessage::RecordType::A, ttl, "10.0.0.9"}});
+    });
+
+    DNSCache::Options cache_options;
+    cache_options.prefetch_fraction = 0.5;
+    cache_options.prefetch_min_hits = 2;
+    cache_options.serve_stale = true;
+    DNSResolver resolver(cache_options);
+    DNSResolver::ResolverOptions options;
+    options.nameservers = {server.address()};
+
+    // A hot entry in the last half of its TTL is refreshed in the background
+    resolver.resolve("hot.test", options);
+    resolver.resolve("hot.test", options);
+    resolver.resolve("hot.test", options);
+    int queries_before = server.queries();
+    std::this_thread::sleep_for(std::chrono::milliseconds(1100));
+    if (!resolver.resolveDetailed("hot.test", options).from_cache) {
+        throw std::runtime_error("Hot entry not served while refreshing");
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(200));
+    if (server.queries() != queries_before + 2) {
+        throw std::runtime_error("Hot entry was not prefetched");
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(900));
+    if (!resolver.resolveDetailed("hot.test", options).from_cache) {
+        throw std::runtime_error("Prefetched entry missing after the original TTL");
+    }
+
+    // Upstream failing: the expired answer is served with the stale TTL
+    resolver.resolve("stale.test", options);
+    std::this_thread::sleep_for(std::chrono::milliseconds(1100));
+    mode = ServFail;
+    options.stale_answer_timeout_ms = 0;
+    auto failed = resolver.resolveDetailed("stale.test", options);
+    if (!failed.stale || failed.ttl != 30 || failed.ip_addresses != std::vector<std::string>{"10.0.0.9"}) {
+        throw std::runtime_error("Stale answer not served while upstream fails");
+    }
+
+    // Upstream slow: answer stale after the client timeout, refresh anyway
+    mode = Slow;
+    options.stale_answer_timeout_ms = 50;
+    auto start = std::chrono::steady_clock::now();
+    auto slow = resolver.resolveDetailed("stale.test", options);
+    if (!slow.stale || std::chrono::steady_clock::now() - start > std::chrono::milliseconds(250)) {
+        throw std::runtime_error("Stale answer not served while upstream is slow");
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(700));
+    auto refreshed = resolver.resolveDetailed("stale.test", options);
+    if (!refreshed.from_cache || refreshed.stale) {
+        throw std::runtime_error("Slow upstream answer did not refresh the cache");
+    }
+}
+
+void testNegativeCaching() {
+    using RT = DNSMessage::RecordType;
+    const TestRecord soa{"test", RT::SOA, 3600, "ns.test hostmaster.test 60"};
+    LoopbackServer server([&soa](const std::vector<uint8_t>& query) {
+        auto q = parseTestQuestion(query);
+        if (q.name.equals("nx.test")) return buildTestResponse(query, DNSMessage::RCode::NXDomain, {}, {soa});
+        if (q.name.equals("nodata.test")) return buildTestResponse(query, DNSMessage::RCode::NoError, {}, {soa});
+        if (q.name.equals("nosoa.test")) return buildTestResponse(query, DNSMessage::RCode::NXDomain, {});
+        return buildTestResponse(query, DNSMessage::RCode::ServFail, {});
+    });
+
+    DNSResolver resolver;
+    DNSResolver::ResolverOptions options;
+    options.nameservers = {server.address()};
+
+    struct Case {
+        std::string name;
+        DNSQuery::Status status;
+        bool cached;
+    };
+    const Case cases[] = {
+        {"nx.test", DNSQuery::Status::NXDomain, true},
+        {"nodata.test", DNSQuery::Status::NoData, true},
+        {"nosoa.test", DNSQuery::Status::NXDomain, false},  // No SOA: must not be cached
+        {"fail.test", DNSQuery::Status::Failure, false},    // Transient: must not be cached
+    };
+    for (const auto& c : cases) {
+        auto first = resolver.resolveDetailed(c.name, options);
+        int queries = server.queries();
+        auto second = resolver.resolveDetailed(c.name, options);
+        if (first.status != c.status || second.status != c.status || !first.ip_addresses.empty()) {
+            throw std::runtime_error("Wrong status for " + c.name);
+        }
+        if (second.from_cache != c.cached || (server.queries() == queries) != c.cached) {
+            throw std::runtime_error(c.name + (c.cached ? " was not" : " was") + " negatively cached");
+        }
+        if (c.cached && (first.ttl != 60 || second.ttl > 60)) {
+            throw std::runtime_error("Negative TTL not taken from the SOA minimum for " + c.name);
+        }
+    }
+}
+
+void testRetransmitAndHedging() {
+    using namespace std::chrono;
+
+    // RFC 6298 arithmetic on a private estimator
+    RttEstimator estimator;
+    estimator.sample("s", milliseconds(100));
+    if (estimator.rto("s") != milliseconds(300) || estimator.hedgeDelay("s") != milliseconds(200)) {
+        throw std::runtime_error("Unexpected RTO after the first sample");
+    }
+    estimator.timedOut("s");
+    if (estimator.rto("s") != milliseconds(600)) {
+        throw std::runtime_error("RTO did not back off after a timeout");
+    }
+    estimator.sample("s", milliseconds(100));
+    if (estimator.rto("s") != milliseconds(250)) {
+        throw std::runtime_error("A new sample did not reset the backoff");
+    }
+
+    // Drops the first query for each name and type, so every lookup needs a retransmit
+    std::mutex mutex;
+    std::set<std::string> seen;
+    std::atomic<bool> slow{false};
+    auto handler = [&](const std::vector<uint8_t>& query, bool primary) {
+        auto q = parseTestQuestion(query);
+        if (q.name.equals("lossy.test") || q.name.equals("lossy-async.test")) {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (seen.insert(q.name.toString() + "/" + std::to_string(static_cast<int>(q.type))).second) {
+                return std::vector<uint8_t>();
+            }
+        }
+        if (q.name.equals("silent.test")) return std::vector<uint8_t>();
+        if (slow && primary) std::this_thread::sleep_for(milliseconds(300));
+        if (q.type == DNSMessage::RecordType::AAAA) return buildTestResponse(query, DNSMessage::RCode::NoError, {});
+        return buildTestResponse(query, DNSMessage::RCode::NoError,
+                                 {{q.name.toString(), DNSMessage::RecordType::A, 60, "10.1.1.1"}});
+    };
+    LoopbackServer primary([&](const std::vector<uint8_t>& query) { return handler(query, true); });
+    LoopbackServer secondary([&](const std::vector<uint8_t>& query) { return handler(query, false); });
+
+    DNSResolver resolver;
+    DNSResolver::ResolverOptions options;
+    options.nameservers = {primary.address()};
+    options.timeout_seconds = 2;
+
+    auto start = steady_clock::now();
+    if (resolver.resolve("lossy.test", options) != std::vector<std::string>{"10.1.1.1"}) {
+        throw std::runtime_error("Lost query was not retransmitted");
+    }
+    if (resolver.resolveAsync("lossy-async.test", options).get() != std::vector<std::string>{"10.1.1.1"}) {
+        throw std::runtime_error("Lost async query was not retransmitted");
+    }
+    if (steady_clock::now() - start > milliseconds(2500)) {
+        throw std::runtime_error("Retransmits waited for the whole timeout");
+    }
+
+    // Warm up the primary's RTT estimate, then slow it down: the hedge to
+    // the secondary should answer long before the primary does
+    options.use_cache = false;
+    for (int i = 0; i < 4; ++i) resolver.resolve("warm.test", options);
+    slow = true;
+    options.nameservers = {primary.address(), secondary.address()};
+    start = steady_clock::now();
+    if (resolver.resolve("hedge.test", options).empty()) {
+        throw std::runtime_error("Hedged lookup failed");
+    }
+    if (steady_clock::now() - start >= milliseconds(300)) {
+        throw std::runtime_error("Slow server was not hedged");
+    }
+    slow = false;
+
+    // A silent server: each family has its retry budget, and the one
+    // deadline covers both, since they are sent side by side
+    options.nameservers = {secondary.address()};
+    options.timeout_seconds = 1;
+    options.retries = 3;
+    int before = secondary.queries();
+    start = steady_clock::now();
+    if (!resolver.resolve("silent.test", options).empty()) {
+        throw std::runtime_error("Silent server produced addresses");
+    }
+    auto elapsed = steady_clock::now() - start;
+    if (elapsed > milliseconds(1300) || secondary.queries() - before > 2 * (options.retries + 1)) {
+        throw std::runtime_error("Lookup overran its deadline or retry budget");
+    }
+}
+
+void testUpstreamSelection() {
+    using namespace std::chrono;
+
+    RttEstimator estimator;
+    estimator.sample("slow", milliseconds(50));
+    estimator.sample("fast", milliseconds(5));
+    for (int i = 0; i < 3; ++i) estimator.timedOut("dead");
+    if (!estimator.estimate("dead").down() || estimator.estimate("slow").down()) {
+        throw std::runtime_error("Down marking does not follow consecutive failures");
+    }
+
+    // Unmeasured first, then fastest first, down last
+    RetransmitSchedule::Policy policy;
+    policy.probe_share = 0;
+    RetransmitSchedule ranked({"dead", "new", "slow", "fast"}, policy, estimator);
+    if (ranked.order() != std::vector<size_t>{1, 3, 2, 0}) {
+        throw std::runtime_error("Servers ranked in the wrong order");
+    }
+    policy.probe_share = 1;
+    RetransmitSchedule probing({"dead", "new", "slow", "fast"}, policy, estimator);
+    if (probing.order()[0] == 1 || probing.order()[0] == 0) {
+        throw std::runtime_error("Probe did not start with another server that is up");
+    }
+    policy.probe_share = 0;
+    policy.race = true;
+    RetransmitSchedule racing({"slow", "fast"}, policy, estimator);
+    size_t first, second;
+    RetransmitSchedule::Clock::time_point at;
+    if (!racing.next(first, at) || at > RetransmitSchedule::Clock::now() ||
+        !racing.next(second, at) || first != 1 || second != 0) {
+        throw std::runtime_error("Racing did not send to the top two at once");
+    }
+
+    // Live: a slow, a fast and one that never answers. The silent one is
+    // listed first on an address no other test uses, so it starts out
+    // unmeasured and ranked first until its timeouts mark it down.
+    auto answer = [](const std::vector<uint8_t>& query) {
+        auto q = parseTestQuestion(query);
+        if (q.type == DNSMessage::RecordType::AAAA) return buildTestResponse(query, DNSMessage::RCode::NoError, {});
+        return buildTestResponse(query, DNSMessage::RCode::NoError,
+                                 {{q.name.toString(), DNSMessage::RecordType::A, 60, "10.2.2.2"}});
+    };
+    LoopbackServer slow([&](const std::vector<uint8_t>& query) {
+        std::this_thread::sleep_for(milliseconds(20));
+        return answer(query);
+    });
+    LoopbackServer fast([&](const std::vector<uint8_t>& query) {
+        std::this_thread::sleep_for(milliseconds(2));
+        return answer(query);
+    });
+    LoopbackServer dead([](const std::vector<uint8_t>&) { return std::vector<uint8_t>(); }, "127.0.0.5");
+
+    DNSResolver resolver;
+    DNSResolver::ResolverOptions options;
+    options.use_cache = false;
+    // Each lookup waits for both families, and each warm-up asks a new
+    // name, so none joins a flight a previous one left running
+    options.resolution_delay_ms = -1;
+    options.nameservers = {dead.address(), slow.address(), fast.address()};
+    for (int i = 0; i < 4; ++i) resolver.resolve("warm" + std::to_string(i) + ".test", options);
+    if (!RttEstimator::global().estimate(dead.address()).down()) {
+        throw std::runtime_error("Unresponsive upstream was not marked down");
+    }
+
+    int slow_before = slow.queries(), fast_before = fast.queries(), dead_before = dead.queries();
+    for (int i = 0; i < 20; ++i) {
+        if (resolver.resolve("select.test", options).empty()) {
+            throw std::runtime_error("Lookup failed with a healthy upstream available");
+        }
+    }
+    if (fast.queries() - fast_before < 30 || dead.queries() - dead_before > 4 ||
+        slow.queries() - slow_before > 10) {
+        throw std::runtime_error("Queries did not go to the fastest healthy upstream");
+    }
+}
+
+void testMockServerFaults() {
+    using namespace std::chrono;
+    MockDNSServer server(loadTestZone());
+    UDPTransport::ServerAddress address;
+    UDPTransport::ServerAddress::parse(server.address(), 53, address);
+
+    // Sends one raw query; returns false if it went unanswered
+    auto exchange = [&](const std::string& name, DNSMessage::RecordType type, std::vector<uint8_t>& response) {
+        uint8_t query[DNSMessage::MAX_UDP_SIZE];
+        size_t length = DNSMessage::buildQuery(query, sizeof(query), UDPTransport::randomId(), name, type);
+        response.resize(4096);
+        size_t response_length = 0;
+        bool ok = UDPTransport::exchange(address, query, length, response.data(), response.size(),
+                                         response_length, milliseconds(100)) == UDPTransport::Status::Ok;
+        response.resize(response_length);
+        return ok;
+    };
+
+    // Zone features: CNAME chain, wildcard, MX/TXT/SRV data, negative answers with SOA
+    std::vector<uint8_t> response;
+    DNSQuery::QueryResult result;
+    result.success = false;
+    if (!exchange("www.example.com", DNSMessage::RecordType::A, response) ||
+        !DNSQuery::parseResponse(response.data(), response.size(), "www.example.com",
+                                 DNSMessage::RecordType::A, result) ||
+        result.ip_addresses != std::vector<std::string>{"192.0.2.20", "192.0.2.21"}) {
+        throw std::runtime_error("CNAME was not followed inside the zone");
+    }
+    DNSResolver resolver;
+    auto options = mockOptions(server);
+    if (resolver.resolve("anything.wild.com", options) != std::vector<std::string>{"192.0.2.60"}) {
+        throw std::runtime_error("Wildcard did not match");
+    }
+    for (auto type : {DNSMessage::RecordType::MX, DNSMessage::RecordType::TXT, DNSMessage::RecordType::SRV}) {
+        const char* name = type == DNSMessage::RecordType::MX    ? "mail.example.com"
+                           : type == DNSMessage::RecordType::TXT ? "txt.example.com"
+                                                                 : "_sip._udp.example.com";
+        if (!exchange(name, type, response) || DNSMessage::readU16(response.data() + 6) != 1) {
+            throw std::runtime_error(std::string("No answer for ") + name);
+        }
+    }
+    auto nodata = resolver.resolveDetailed("yahoo.com", options);
+    auto nxdomain = resolver.resolveDetailed("absent.example.com", options);
+    if (nodata.status != DNSQuery::Status::Success || nxdomain.status != DNSQuery::Status::NXDomain ||
+        !resolver.resolveDetailed("absent.example.com", options).from_cache) {
+        throw std::runtime_error("Negative answers were wrong or carried no SOA");
+    }
+
+    // Injected faults
+    MockDNSServer::Faults faults;
+    faults.ttl = 7;
+    server.setFaults(faults);
+    if (resolver.resolveDetailed("facebook.com", options).ttl != 7) {
+        throw std::runtime_error("TTL was not rewritten");
+    }
+    faults = MockDNSServer::Faults();
+    faults.truncate = 1;
+    server.setFaults(faults);
+    if (!exchange("github.com", DNSMessage::RecordType::A, response) || (response[2] & 0x02) == 0 ||
+        DNSMessage::readU16(response.data() + 6) != 0) {
+        throw std::runtime_error("Answer was not truncated");
+    }
+    faults = MockDNSServer::Faults();
+    faults.servfail = 1;
+    server.setFaults(faults);
+    if (resolver.resolveDetailed("google.com", options).status != DNSQuery::Status::Failure) {
+        throw std::runtime_error("SERVFAIL was not injected");
+    }
+    faults = MockDNSServer::Faults();
+    faults.latency = milliseconds(30);
+    server.setFaults(faults);
+    auto start = steady_clock::now();
+    if (!exchange("github.com", DNSMessage::RecordType::A, response) || steady_clock::now() - start < milliseconds(30)) {
+        throw std::runtime_error("Latency was not added");
+    }
+
+    // Loss follows the seed, so the same seed drops the same queries
+    faults = MockDNSServer::Faults();
+    faults.loss = 0.5;
+    faults.seed = 42;
+    std::string patterns[2];
+    for (auto& pattern : patterns) {
+        server.setFaults(faults);
+        for (int i = 0; i < 12; ++i) pattern += exchange("github.com", DNSMessage::RecordType::A, response) ? '1' : '0';
+    }
+    if (patterns[0] != patterns[1] || patterns[0].find('0') == std::string::npos ||
+        patterns[0].find('1') == std::string::npos) {
+        throw std::runtime_error("Loss was not reproducible from the seed");
+    }
+}
+
+void testTTLHonored() {
+    LoopbackServer server([](const std::vector<uint8_t>& query) {
+        auto question = parseTestQuestion(query);
+        if (question.type != DNSMessage::RecordType::A) {
+            return buildTestResponse(query, DNSMessage::RCode::NoError, {});
+        }
+        uint32_t ttl = question.name.equals("short.test") ? 1 : question.name.equals("zero.test") ? 0 : 3600;
+        return buildTestResponse(query, DNSMessage::RCode::NoError,
+                                 {{question.name.toString(), DNSMessage::RecordType::A, ttl, "10.0.0.1"},
+                                  {question.name.toString(), DNSMessage::RecordType::A, ttl + 60, "10.0.0.2"}});
+    });
+
+    DNSResolver resolver;
+    DNSResolver::ResolverOptions options;
+    options.nameservers = {server.address()};
+
+    // The RRset is cached for its smallest TTL and counts down from there
+    auto first = resolver.resolveDetailed("long.test", options);
+    auto second = resolver.resolveDetailed("long.test", options);
+    if (first.from_cache || first.ttl != 3600) {
+        throw std::runtime_error("Expected a fresh answer with the minimum TTL of the RRset");
+    }
+    if (!second.from_cache || second.ttl > 3600 || second.ttl < 3599) {
+        throw std::runtime_error("Cached answer did not report its remaining TTL");
+    }
+
+    resolver.resolve("zero.test", options);
+    if (resolver.resolveDetailed("zero.test", options).from_cache) {
+        throw std::runtime_error("Answer with TTL 0 was cached");
+    }
+
+    DNSCache::Options floor_options;
+    floor_options.min_ttl = std::chrono::seconds(5);
+    DNSResolver floored(floor_options);
+
+    resolver.resolve("short.test", options);
+    floored.resolve("short.test", options);
+    int queries_before = server.queries();
+    std::this_thread::sleep_for(std::chrono::milliseconds(1100));
+
+    if (resolver.resolveDetailed("short.test", options).from_cache || server.queries() == queries_before) {
+        throw std::runtime_error("Expired entry was served from the cache");
+    }
+    if (!floored.resolveDetailed("short.test", options).from_cache) {
+        throw std::runtime_error("min_ttl did not extend a short TTL");
+    }
+
+    DNSCache::Options cap_options;
+    cap_options.max_ttl = std::chrono::seconds(10);
+    DNSCache capped(cap_options);
+    capped.addEntry("capped.test", {"10.0.0.3"}, std::chrono::seconds(86400));
+    std::vector<std::string> addresses;
+    uint32_t remaining = 0;
+    if (!capped.getEntry("capped.test", addresses, remaining) || remaining > 10) {
+        throw std::runtime_error("max_ttl did not cap a long TTL");
+    }
+}
+
+void testConcurrentCache() {
+    ShardedCache cache(8);
+    const int keys = 512;
+    std::atomic<bool> stop{false};
+    std::atomic<int> torn{0};
+    std::atomic<long> hits{0};
+
+    // Writers keep replacing entries (and growing the shards) while readers
+    // check that every hit is a complete value belonging to its key. The
+    // key number is encoded in both the IPv4 and the IPv6 address.
+    auto ipv4For = [](int k) { return "10.0." + std::to_string(k / 256) + "." + std::to_string(k % 256); };
+    auto ipv6Prefix = [](int k) { return "2001:db8:" + std::to_string(k + 1) + ":"; };
+    std::vector<std::thread> threads;
+    for (int w = 0; w < 2; ++w) {
+        threads.emplace_back([&, w] {
+            for (int round = 0; !stop; ++round) {
+                for (int k = w; k < keys; k += 2) {
+                    std::string key = "key" + std::to_string(k);
+                    cache.insert(key, {ipv4For(k), ipv6Prefix(k) + ":" + std::to_string(round % 9999 + 1)},
+                                 std::chrono::seconds(60));
+                }
+                if (w == 0 && round % 50 == 49) cache.erase("key0");
+            }
+        });
+    }
+    for (int r = 0; r < 4; ++r) {
+        threads.emplace_back([&, r] {
+            std::vector<std::string> value;
+            for (int i = 0; !stop; ++i) {
+                int k = (i * 7 + r) % keys;
+                std::string key = "key" + std::to_string(k);
+                value.clear();
+                if (cache.lookup(key, value)) {
+                    ++hits;
+                    if (value.size() != 2 || value[0] != ipv4For(k) ||
+                        value[1].compare(0, ipv6Prefix(k).size(), ipv6Prefix(k)) != 0) {
+                        ++torn;
+                    }
+                }
+            }
+        });
+    }
+
+    std::this_thread::sleep_for(std::chrono::milliseconds(300));
+    stop = true;
+    for (auto& t : threads) t.join();
+
+    if (torn > 0) {
+        throw std::runtime_error(std::to_string(torn.load()) + " inconsistent cache reads");
+    }
+    if (hits == 0) {
+        throw std::runtime_error("Readers never hit the cache");
+    }
+    if (cache.size() < keys - 1) {
+        throw std::runtime_error("Cache lost entries: size " + std::to_string(cache.size()));
+    }
+
+    cache.clear();
+    std::vector<std::string> value;
+    if (cache.size() != 0 || cache.lookup("key1", value)) {
+        throw std::runtime_error("Cache not empty after clear");
+    }
+}
+
+void testCacheBounds() {
+    using namespace std::chrono;
+    // A full shard evicts rather than grows, and still takes new entries
+    ShardedCache cache(4, 32);
+    const uint8_t address[4] = {10, 0, 0, 1};
+    for (int i = 0; i < 200; ++i) {
+        cache.insert("fill" + std::to_string(i), {"10.0.0.1"}, seconds(60 + i));
+    }
+    if (cache.size() > 32 || cache.evictions() != 200 - cache.size()) {
+        throw std::runtime_error("Bounded cache holds " + std::to_string(cache.size()) + " entries");
+    }
+    cache.insert("kept", address, 1, nullptr, 0, ShardedCache::coarseNow() + seconds(60), 60);
+    std::vector<std::string> value;
+    if (!cache.lookup("kept", value) || cache.size() > 32) {
+        throw std::runtime_error("New entry did not displace an old one");
+    }
+
+    // Expired entries are reclaimed by the sweep, typed sets included
+    DNSCache::Options options;
+    options.shards = 4;
+    DNSCache dns(options);
+    dns.addEntry("live.test", {"10.0.0.2"}, seconds(60));
+    dns.addEntry("short.test", {"10.0.0.3"}, seconds(1));
+    dns.addNegative("absent.test", DNSMessage::RecordType::A, DNSCache::Negative::NXDomain, seconds(1));
+    DNSMessage::TypedRecord txt;
+    txt.type = DNSMessage::RecordType::TXT;
+    txt.ttl = 1;
+    txt.data = "v=1";
+    dns.addRecords("live.test", DNSMessage::RecordType::TXT, DNSMessage::CLASS_IN, {txt}, seconds(1));
+    if (dns.cleanup() != 0 || dns.size() != 4) {
+        throw std::runtime_error("Sweep removed unexpired entries");
+    }
+    std::this_thread::sleep_for(milliseconds(1100));
+    if (dns.cleanup() != 3 || dns.size() != 1 || !dns.find("live.test")) {
+        throw std::runtime_error("Sweep did not reclaim the expired entries");
+    }
+
+    // The resolver runs that sweep by itself once it has cached something
+    LoopbackServer server([](const std::vector<uint8_t>& query) {
+        auto question = parseTestQuestion(query);
+        if (question.type != DNSMessage::RecordType::A) {
+            return buildTestResponse(query, DNSMessage::RCode::NoError, {});
+        }
+        return buildTestResponse(query, DNSMessage::RCode::NoError,
+                                 {{question.name.toString(), DNSMessage::RecordType::A, 1, "10.0.0.1"}});
+    });
+    DNSCache::Options swept;
+    swept.cleanup_interval = seconds(1);
+    DNSResolver resolver(swept);
+    DNSResolver::ResolverOptions resolve_options;
+    resolve_options.nameservers = {server.address()};
+    resolver.resolve("one.test", resolve_options);
+    resolver.resolve("two.test", resolve_options);
+    if (resolver.stats().cache_entries != 2) {
+        throw std::runtime_error("Expected both answers to be cached");
+    }
+    // The sweep is counted as it finishes, just after the entries go
+    auto swept_all = [&resolver] {
+        auto stats = resolver.stats();
+        return stats.cache_entries == 0 && stats.counter(ResolverMetrics::Counter::CacheEvictions) == 2;
+    };
+    auto deadline = steady_clock::now() + seconds(5);
+    while (!swept_all() && steady_clock::now() < deadline) {
+        std::this_thread::sleep_for(milliseconds(50));
+    }
+    if (!swept_all()) {
+        throw std::runtime_error("Resolver never swept (or never counted) its expired entries");
+    }
+}
+
+void testLatencyHistogram() {
+    // Every value lands in a bucket whose top is within ~3% above it
+    for (uint64_t value : {0ull, 1ull, 63ull, 64ull, 65ull, 1000ull, 123456789ull, ~0ull}) {
+        size_t bucket = LatencyHistogram::bucketOf(value);
+        uint64_t top = LatencyHistogram::bucketTop(bucket);
+        if (bucket >= LatencyHistogram::BUCKETS || top < value || top - value > value / 32) {
+            throw std::runtime_error("Value " + std::to_string(value) + " maps to the wrong bucket");
+        }
+        if (bucket > 0 && LatencyHistogram::bucketTop(bucket - 1) >= value) {
+            throw std::runtime_error("Buckets overlap below " + std::to_string(value));
+        }
+    }
+
+    // 1..10000 uniformly: percentiles within a bucket's width of the truth
+    LatencyHistogram a, b;
+    for (uint64_t v = 1; v <= 10000; ++v) (v % 2 ? a : b).record(v);
+    a.merge(b);
+    if (a.count() != 10000 || a.max() != 10000 || std::abs(a.mean() - 5000.5) > 1e-6) {
+        throw std::runtime_error("Merged histogram has the wrong totals");
+    }
+    for (double q : {0.5, 0.99, 0.999}) {
+        double exact = q * 10000;
+        double reported = static_cast<double>(a.percentile(q));
+        if (reported < exact || reported > exact * 1.04) {
+            throw std::runtime_error("p" + std::to_string(q * 100) + " is " + std::to_string(reported));
+        }
+    }
+    if (a.percentile(1.0) != 10000 || LatencyHistogram().percentile(0.5) != 0) {
+        throw std::runtime_error("Edge percentiles are wrong");
+    }
+}
+
+void testResolverMetrics() {
+    using Counter = ResolverMetrics::Counter;
+    using Stage = ResolverMetrics::Stage;
+    DNSResolver resolver;
+    auto options = mockOptions();
+
+    resolver.resolve("github.com", options);   // Miss
+    resolver.resolve("github.com", options);   // Hit
+    resolver.resolve("nothere.com", options);  // Miss, NXDOMAIN
+    resolver.resolve("nothere.com", options);  // Negative hit
+    resolver.resolveAsync("yahoo.com", options).get();
+
+    // Hits from several threads land in separate slots and all add up, also
+    // when a short-lived thread takes over the slot of one that exited
+    std::vector<std::thread> threads;
+    for (int t = 0; t < 4; ++t) {
+        threads.emplace_back([&] {
+            for (int i = 0; i < 125; ++i) resolver.resolve("github.com", options);
+        });
+    }
+    for (auto& thread : threads) thread.join();
+    for (int t = 0; t < 4; ++t) {
+        std::thread([&] {
+            for (int i = 0; i < 125; ++i) resolver.resolve("github.com", options);
+        }).join();
+    }
+
+    auto stats = resolver.stats();
+    if (stats.counter(Counter::CacheHits) != 1001 || stats.counter(Counter::CacheNegativeHits) != 1 ||
+        stats.counter(Counter::CacheMisses) != 3) {
+        throw std::runtime_error("Wrong cache counters: " + std::to_string(stats.counter(Counter::CacheHits)) + " hits, " +
+                                 std::to_string(stats.counter(Counter::CacheMisses)) + " misses");
+    }
+    if (stats.counter(Counter::ResolvesStarted) != 1005 || stats.inFlight() != 0 ||
+        stats.hit_latency.count() != 1002 || stats.miss_latency.count() != 3) {
+        throw std::runtime_error("Resolve latencies were not all recorded");
+    }
+    if (stats.stage(Stage::Normalize).count() != 1005 || stats.stage(Stage::CacheLookup).count() != 1005 ||
+        stats.stage(Stage::Send).count() == 0 || stats.stage(Stage::Wait).count() == 0 ||
+        stats.stage(Stage::Parse).count() == 0 || stats.stage(Stage::Insert).count() != 3) {
+        throw std::runtime_error("Stage timings are missing");
+    }
+
+    auto upstream = stats.upstreams.find(testServer().address());
+    if (upstream == stats.upstreams.end()) {
+        throw std::runtime_error("No figures for the upstream");
+    }
+    // A and AAAA per miss, sent together
+    const auto& u = upstream->second;
+    if (u.queries != 6 || u.rcodes[static_cast<size_t>(DNSMessage::RCode::NoError)] != 4 ||
+        u.rcodes[static_cast<size_t>(DNSMessage::RCode::NXDomain)] != 2 || u.rtt.count() != 6 || u.timeouts != 0) {
+        throw std::runtime_error("Wrong upstream figures: " + std::to_string(u.queries) + " queries");
+    }
+
+    std::string text = resolver.prometheusStats();
+    for (const char* line : {"dns_resolver_cache_hits_total 1001\n", "dns_resolver_resolves_in_flight 0\n",
+                             "dns_resolver_stage_duration_seconds_count{stage=\"insert\"} 3\n",
+                             "# TYPE dns_resolver_upstream_rtt_seconds histogram\n"}) {
+        if (text.find(line) == std::string::npos) {
+            throw std::runtime_error(std::string("Prometheus dump lacks ") + line);
+        }
+    }
+    if (text.find("dns_resolver_upstream_responses_total{server=\"" + testServer().address() +
+                  "\",rcode=\"NXDOMAIN\"} 2") == std::string::npos) {
+        throw std::runtime_error("Prometheus dump lacks the NXDOMAIN count");
+    }
+}
+
+// Addresses in the answer section of response, with its rcode
+std::vector<std::string> answerAddresses(const uint8_t* response, size_t length, DNSMessage::RCode& rcode) {
+    DNSMessage::Parser parser(response, length);
+    if (!parser.parseHeader()) {
+        throw std::runtime_error("Server sent a malformed response");
+    }
+    rcode = parser.header().rcode();
+    std::vector<std::string> addresses;
+    DNSMessage::ResourceRecord record;
+    while (parser.nextRecord(record) && record.section == DNSMessage::Section::Answer) {
+        std::string address = record.addressToString();
+        if (!address.empty()) addresses.push_back(address);
+    }
+    return addresses;
+}
+
+void testDNSServer() {
+    DNSResolver resolver;
+    DNSServer::Options options;
+    options.address = "127.0.0.1";
+    options.port = 0;
+    options.threads = 2;
+    options.resolve = mockOptions();
+    DNSServer server(resolver, options);
+    if (server.threads() != 2 || server.port() == 0) {
+        throw std::runtime_error("Server did not start its workers");
+    }
+
+    UDPTransport::ServerAddress address;
+    UDPTransport::ServerAddress::parse(server.address(), 53, address);
+    auto ask = [&](const std::string& name, DNSMessage::RecordType type, std::vector<uint8_t>& response) {
+        uint8_t query[DNSMessage::MAX_UDP_SIZE];
+        size_t length = DNSMessage::buildQuery(query, sizeof(query), 0x1234, name, type);
+        response.resize(DNSMessage::EDNS_UDP_SIZE);
+        size_t response_length = 0;
+        if (UDPTransport::exchange(address, query, length, response.data(), response.size(), response_length,
+                                   std::chrono::milliseconds(2000)) != UDPTransport::Status::Ok) {
+            throw std::runtime_error("No UDP answer for " + name);
+        }
+        response.resize(response_length);
+    };
+
+    std::vector<uint8_t> response;
+    DNSMessage::RCode rcode;
+    for (int round = 0; round < 2; ++round) {  // Miss, then hit
+        ask("github.com", DNSMessage::RecordType::A, response);
+        auto addresses = answerAddresses(response.data(), response.size(), rcode);
+        if (rcode != DNSMessage::RCode::NoError || addresses != std::vector<std::string>{"192.0.2.10"}) {
+            throw std::runtime_error("Wrong UDP answer for github.com");
+        }
+    }
+    if (resolver.stats().counter(ResolverMetrics::Counter::CacheHits) != 1) {
+        throw std::runtime_error("Second query was not answered from the cache");
+    }
+
+    ask("nothere.com", DNSMessage::RecordType::A, response);
+    answerAddresses(response.data(), response.size(), rcode);
+    if (rcode != DNSMessage::RCode::NXDomain) {
+        throw std::runtime_error("Expected NXDOMAIN for nothere.com");
+    }
+
+    // Types the cache does not hold are relayed upstream
+    ask("mail.example.com", DNSMessage::RecordType::MX, response);
+    DNSMessage::Parser parser(response.data(), response.size());
+    if (!parser.parseHeader() || parser.header().ancount != 1 || DNSMessage::readU16(response.data()) != 0x1234) {
+        throw std::runtime_error("MX query was not relayed");
+    }
+
+    // TCP, length-prefixed
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (connect(fd, reinterpret_cast<const sockaddr*>(&address.addr), address.length) != 0) {
+        close(fd);
+        throw std::runtime_error("Cannot connect over TCP");
+    }
+    uint8_t query[2 + DNSMessage::MAX_UDP_SIZE];
+    size_t length = DNSMessage::buildQuery(query + 2, sizeof(query) - 2, 7, "example.com", DNSMessage::RecordType::AAAA);
+    DNSMessage::writeU16(query, static_cast<uint16_t>(length));
+    send(fd, query, length + 2, 0);
+    std::vector<uint8_t> stream;
+    uint8_t chunk[1024];
+    while (stream.size() < 2 || stream.size() < 2u + DNSMessage::readU16(stream.data())) {
+        pollfd pfd{fd, POLLIN, 0};
+        ssize_t n = poll(&pfd, 1, 2000) > 0 ? recv(fd, chunk, sizeof(chunk), 0) : -1;
+        if (n <= 0) break;
+        stream.insert(stream.end(), chunk, chunk + n);
+    }
+    close(fd);
+    if (stream.size() < 2) {
+        throw std::runtime_error("No TCP answer");
+    }
+    auto addresses = answerAddresses(stream.data() + 2, stream.size() - 2, rcode);
+    if (addresses != std::vector<std::string>{"2001:db8::20"}) {
+        throw std::runtime_error("Wrong TCP answer for example.com");
+    }
+
+    server.stop();
+    if (server.queries() != 5 || server.responses() != 5) {
+        throw std::runtime_error("Wrong server counters: " + std::to_string(server.queries()) + " queries");
+    }
+
+    // A slow relayed type does not hold up the worker that received it
+    MockDNSServer::Options slow_mx;
+    slow_mx.faults.slow_type = static_cast<uint16_t>(DNSMessage::RecordType::MX);
+    slow_mx.faults.slow_latency = std::chrono::milliseconds(500);
+    MockDNSServer slow_upstream(loadTestZone(), slow_mx);
+    options.threads = 1;
+    options.resolve = mockOptions(slow_upstream);
+    DNSServer single(resolver, options);
+    UDPTransport::ServerAddress::parse(single.address(), 53, address);
+    int client = socket(AF_INET, SOCK_DGRAM, 0);
+    length = DNSMessage::buildQuery(query, sizeof(query), 0x4321, "mail.example.com", DNSMessage::RecordType::MX);
+    sendto(client, query, length, 0, reinterpret_cast<const sockaddr*>(&address.addr), address.length);
+    auto start = std::chrono::steady_clock::now();
+    ask("example.com", DNSMessage::RecordType::A, response);  // A cache hit
+    auto waited = std::chrono::steady_clock::now() - start;
+    uint8_t relayed[DNSMessage::EDNS_UDP_SIZE];
+    pollfd pfd{client, POLLIN, 0};
+    ssize_t relayed_length = poll(&pfd, 1, 2000) > 0 ? recv(client, relayed, sizeof(relayed), 0) : -1;
+    close(client);
+    if (waited > std::chrono::milliseconds(300)) {
+        throw std::runtime_error("A query waited behind a relayed MX query");
+    }
+    if (relayed_length < static_cast<ssize_t>(DNSMessage::HEADER_SIZE) || DNSMessage::readU16(relayed) != 0x4321) {
+        throw std::runtime_error("Slow MX query was not relayed");
+    }
+}
+
+void testDatagramBatch() {
+    // Two loopback sockets; the receiver learns its port from the kernel
+    UDPTransport::ServerAddress receiver_address;
+    UDPTransport::ServerAddress::parse("127.0.0.1", 0, receiver_address);
+    int receiver = socket(AF_INET, SOCK_DGRAM, 0);
+    int sender = socket(AF_INET, SOCK_DGRAM, 0);
+    bind(receiver, reinterpret_cast<const sockaddr*>(&receiver_address.addr), receiver_address.length);
+    getsockname(receiver, reinterpret_cast<sockaddr*>(&receiver_address.addr), &receiver_address.length);
+
+    DatagramBatch out(5, 64);
+    for (uint8_t i = 0; i < 5; ++i) {
+        uint8_t payload[3] = {i, i, i};
+        if (!out.append(payload, sizeof(payload), &receiver_address.addr, receiver_address.length)) {
+            throw std::runtime_error("Append failed before the batch was full");
+        }
+    }
+    uint8_t too_many[1] = {0};
+    if (out.append(too_many, 1) || !out.full()) {
+        throw std::runtime_error("A full batch accepted another datagram");
+    }
+    std::vector<size_t> unsent;
+    size_t sent = out.flush(sender, &unsent);
+    if (sent != 5 || !unsent.empty() || !out.empty()) {
+        throw std::runtime_error("Flush sent " + std::to_string(sent) + " of 5 datagrams");
+    }
+
+    // A smaller receive batch takes them in two calls, in order
+    DatagramBatch in(4, 64);
+    pollfd pfd{receiver, POLLIN, 0};
+    poll(&pfd, 1, 1000);
+    size_t first = in.receive(receiver);
+    bool ordered = first == 4;
+    for (size_t i = 0; ordered && i < first; ++i) {
+        ordered = in.length(i) == 3 && in.data(i)[0] == i && in.peer(i).ss_family == AF_INET;
+    }
+    size_t second = in.receive(receiver);
+    ordered = ordered && second == 1 && in.data(0)[0] == 4;
+    size_t third = in.receive(receiver);
+    close(sender);
+    close(receiver);
+    if (!ordered || third != 0) {
+        throw std::runtime_error("Batched receive returned the wrong datagrams");
+    }
+}
+
+void testTCPFallback() {
+    using namespace std::chrono;
+    // Every UDP answer comes back truncated, so addresses only arrive over TCP
+    MockDNSServer::Options server_options;
+    server_options.faults.truncate = 1;
+    MockDNSServer server(loadTestZone(), server_options);
+    auto options = mockOptions(server);
+    DNSResolver resolver;
+    if (resolver.resolve("example.com", options) !=
+        std::vector<std::string>{"192.0.2.20", "192.0.2.21", "2001:db8::20"}) {
+        throw std::runtime_error("Truncated answer was not retried over TCP");
+    }
+    if (server.tcpConnections() != 1) {
+        throw std::runtime_error("A and AAAA retries opened " + std::to_string(server.tcpConnections()) +
+                                 " TCP connections instead of sharing one");
+    }
+
+    // Concurrent async lookups are pipelined on the same pooled connection
+    auto results = resolver.resolveMany({"github.com", "www.example.com", "anything.wild.com"}, options);
+    if (results[0] != std::vector<std::string>{"192.0.2.10", "2001:db8::10"} ||
+        results[1] != std::vector<std::string>{"192.0.2.20", "192.0.2.21", "2001:db8::20"} ||
+        results[2] != std::vector<std::string>{"192.0.2.60"}) {
+        throw std::runtime_error("Async lookups did not fall back to TCP");
+    }
+    if (server.tcpConnections() != 1) {
+        throw std::runtime_error("Pipelined retries opened " + std::to_string(server.tcpConnections() - 1) +
+                                 " more TCP connections");
+    }
+
+    // The caller's ID comes back, and an idle connection is closed
+    TCPPool::Options pool_options;
+    pool_options.idle_timeout = milliseconds(50);
+    TCPPool pool(pool_options);
+    UDPTransport::ServerAddress address;
+    UDPTransport::ServerAddress::parse(server.address(), 53, address);
+    uint8_t query[DNSMessage::MAX_UDP_SIZE];
+    size_t length = DNSMessage::buildQuery(query, sizeof(query), 0x4242, "github.com", DNSMessage::RecordType::A);
+    std::vector<uint8_t> response;
+    auto status = pool.exchange(address, query, length, response, TCPPool::Clock::now() + seconds(2));
+    if (status != TCPPool::Status::Ok || DNSMessage::readU16(response.data()) != 0x4242 ||
+        DNSMessage::readU16(response.data() + 6) != 1 || pool.openConnections() != 1) {
+        throw std::runtime_error("Pooled TCP exchange failed");
+    }
+    std::this_thread::sleep_for(milliseconds(200));
+    if (pool.openConnections() != 0 || pool.connectionsOpened() != 1) {
+        throw std::runtime_error("Idle TCP connection was not closed");
+    }
+}
+
+void testCacheSnapshot() {
+    using namespace std::chrono;
+    const std::string path = "/tmp/dns_cache_snapshot." + std::to_string(getpid());
+    DNSCache cache;
+    cache.addEntry("github.com", {"192.0.2.10", "2001:db8::10"}, seconds(300));
+    cache.addEntry("brief.test", {"192.0.2.99"}, seconds(1));
+    cache.addNegative("absent.test", DNSMessage::RecordType::A, DNSCache::Negative::NXDomain, seconds(600));
+    std::string error;
+    if (!cache.saveSnapshot(path, error)) {
+        throw std::runtime_error("Snapshot was not written: " + error);
+    }
+    std::this_thread::sleep_for(milliseconds(1100));  // brief.test expires on disk
+
+    DNSCache restored;
+    size_t loaded = restored.loadSnapshot(path, error);
+    std::vector<std::string> addresses;
+    uint32_t remaining = 0, negative_ttl = 0;
+    if (loaded != 2 || !error.empty() || !restored.getEntry("github.com", addresses, remaining) ||
+        addresses != std::vector<std::string>{"192.0.2.10", "2001:db8::10"} || remaining > 299 ||
+        remaining < 290) {
+        throw std::runtime_error("Snapshot did not restore the entry with its remaining TTL");
+    }
+    if (restored.getEntry("brief.test", addresses) ||
+        restored.findNegative("absent.test", DNSMessage::RecordType::A, negative_ttl) != DNSCache::Negative::NXDomain) {
+        throw std::runtime_error("Snapshot kept an expired entry or lost a negative one");
+    }
+
+    // An entry count the file cannot hold is refused before anything is reserved
+    {
+        std::fstream file(path, std::ios::in | std::ios::out | std::ios::binary);
+        uint64_t entries = uint64_t(1) << 40;
+        file.seekp(16);
+        file.write(reinterpret_cast<const char*>(&entries), sizeof(entries));
+    }
+    DNSCache inflated;
+    if (inflated.loadSnapshot(path, error) != 0 || error.find("claims") == std::string::npos) {
+        throw std::runtime_error("Snapshot with an impossible entry count was loaded");
+    }
+
+    // Another format version is refused as a whole
+    {
+        std::fstream file(path, std::ios::in | std::ios::out | std::ios::binary);
+        uint32_t version = 99;
+        file.seekp(8);
+        file.write(reinterpret_cast<const char*>(&version), sizeof(version));
+    }
+    DNSCache other;
+    if (other.loadSnapshot(path, error) != 0 || error.find("version") == std::string::npos) {
+        throw std::runtime_error("Snapshot of another version was loaded");
+    }
+
+    // A resolver saves on destruction and the next one starts warm
+    unlink(path.c_str());
+    auto options = mockOptions();
+    {
+        DNSResolver resolver;
+        resolver.persistCache(path, hours(1));
+        resolver.resolve("github.com", options);
+    }
+    bool warm;
+    {
+        DNSResolver restarted;
+        loaded = restarted.persistCache(path, hours(1));
+        warm = loaded >= 1 && restarted.resolveDetailed("github.com", options).from_cache;
+    }
+    unlink(path.c_str());
+    if (!warm) {
+        throw std::runtime_error("Restarted resolver did not answer from the saved cache");
+    }
+}
+
+void testLocalZone() {
+    using Action = LocalZone::Action;
+    std::istringstream hosts(
+        "# comment\n"
+        "192.0.2.1   github.com  gh.test   # override\n"
+        "2001:db8::1 github.com\n"
+        "0.0.0.0     ads.example.com\n");
+    std::istringstream rpz(
+        "$TTL 60\n"
+        "$ORIGIN rpz.local.\n"
+        "@            SOA  localhost. root.localhost. 1 3600 600 86400 60\n"
+        "             NS   localhost.\n"
+        "tracker.test      CNAME .\n"
+        "*.tracker.test    CNAME .\n"
+        "ok.tracker.test   CNAME rpz-passthru.\n"
+        "*.quiet.test.rpz.local. 30 IN CNAME *.\n"
+        "32.1.2.0.192.rpz-ip CNAME .\n");
+    LocalZone::Builder builder;
+    std::string error;
+    if (!builder.addHosts(hosts, error) || !builder.addRpz(rpz, error)) {
+        throw std::runtime_error("Local zone did not parse: " + error);
+    }
+    std::istringstream bad("tracker.test CNAME somewhere.else.\n");
+    if (builder.addRpz(bad, error) || error.find("line 1") == std::string::npos) {
+        throw std::runtime_error("Unsupported policy was accepted");
+    }
+    auto zone = builder.build();
+
+    LocalZone::Match match;
+    if (!zone->find("GitHub.com.", match) || match.action != Action::Answer || match.ipv4_count != 1 ||
+        match.ipv6_count != 1 || match.ttl != LocalZone::DEFAULT_TTL) {
+        throw std::runtime_error("Hosts entry did not match");
+    }
+    auto expect = [&](const char* name, bool found, Action action) {
+        bool matched = zone->find(name, match);
+        if (matched != found || (found && match.action != action)) {
+            throw std::runtime_error(std::string("Wrong local zone match for ") + name);
+        }
+    };
+    expect("ads.example.com", true, Action::NXDomain);
+    expect("example.com", false, Action::Answer);
+    expect("tracker.test", true, Action::NXDomain);
+    expect("a.b.tracker.test", true, Action::NXDomain);
+    expect("ok.tracker.test", true, Action::Passthru);
+    expect("x.ok.tracker.test", true, Action::NXDomain);
+    expect("quiet.test", false, Action::Answer);  // The wildcard covers names below only
+    expect("a.quiet.test", true, Action::NoData);
+    if (zone->find("a.quiet.test", match) && match.ttl != 30) {
+        throw std::runtime_error("RPZ record TTL was not kept");
+    }
+    expect("192.0.2.1.rpz-ip", false, Action::Answer);
+
+    // The resolver answers from it before the cache and network, and a
+    // passthru name still resolves normally
+    DNSResolver resolver;
+    resolver.setLocalZone(zone);
+    auto options = mockOptions();
+    auto result = resolver.resolveDetailed("github.com", options);
+    if (!result.local || result.ip_addresses != std::vector<std::string>{"192.0.2.1", "2001:db8::1"}) {
+        throw std::runtime_error("Hosts entry did not override upstream");
+    }
+    if (resolver.resolveDetailed("www.tracker.test", options).status != DNSQuery::Status::NXDomain ||
+        resolver.resolveDetailed("a.quiet.test", options).status != DNSQuery::Status::NoData) {
+        throw std::runtime_error("Blocklisted names were not blocked");
+    }
+    auto batch = resolver.resolveMany({"gh.test", "example.com"}, options);
+    if (batch[0] != std::vector<std::string>{"192.0.2.1"} || batch[1].size() != 3) {
+        throw std::runtime_error("resolveMany did not consult the local zone");
+    }
+    if (resolver.stats().counter(ResolverMetrics::Counter::LocalAnswers) != 4) {
+        throw std::runtime_error("Local answers were not counted");
+    }
+
+    // Reloading swaps the whole zone at once
+    LocalZone::Builder reload;
+    reload.add("example.com", false, Action::NXDomain);
+    resolver.setLocalZone(reload.build());
+    if (resolver.resolveDetailed("example.com", options).status != DNSQuery::Status::NXDomain ||
+        !resolver.resolveDetailed("github.com", options).ip_addresses.size() ||
+        resolver.resolveDetailed("github.com", options).local) {
+        throw std::runtime_error("Reloaded zone did not replace the old one");
+    }
+    resolver.setLocalZone(nullptr);
+    if (resolver.resolveDetailed("example.com", options).status != DNSQuery::Status::Success) {
+        throw std::runtime_error("Removing the zone did not restore normal resolution");
+    }
+
+    // A large blocklist stays compact and quick to probe
+    LocalZone::Builder large;
+    const size_t count = 200000;
+    for (size_t i = 0; i < count; ++i) {
+        large.add("host" + std::to_string(i) + ".blocked.test", i % 2 == 0, Action::NXDomain);
+    }
+    auto big = large.build();
+    if (big->size() != count || big->memoryUsage() / count > 96) {
+        throw std::runtime_error("Local zone uses " + std::to_string(big->memoryUsage() / count) +
+                                 " bytes per rule");
+    }
+    const std::string names[] = {"host1.blocked.test", "a.b.host1000.blocked.test", "www.github.com"};
+    size_t found = 0;
+    auto start = std::chrono::steady_clock::now();
+    const int lookups = 300000;
+    for (int i = 0; i < lookups; ++i) {
+        found += big->find(names[i % 3], match);
+    }
+    auto per_lookup = std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now() - start) / lookups;
+    std::cout << "  Local zone: " << big->memoryUsage() / count << " bytes per rule, " << per_lookup.count()
+              << " ns per lookup" << std::endl;
+    if (found != 2 * lookups / 3) {
+        throw std::runtime_error("Large local zone matched wrongly");
+    }
+}
+
+void testNameNormalization() {
+    // The word-at-a-time path agrees with a byte-at-a-time lower-casing for
+    // every ASCII character at every offset and tail length
+    for (size_t length = 0; length < 40; ++length) {
+        for (int c = 1; c < 0x80; ++c) {
+            std::string name(length, 'Q');
+            if (length) name[(c * 7) % length] = static_cast<char>(c);
+            std::string expected = name;
+            for (char& ch : expected) ch = static_cast<char>(std::tolower(static_cast<unsigned char>(ch)));
+            if (!expected.empty() && expected.back() == '.') expected.pop_back();
+            std::string out;
+            if (!DomainName::canonicalASCII(name, out) || out != expected) {
+                throw std::runtime_error("Wrong canonical form of \"" + name + "\": \"" + out + "\"");
+            }
+        }
+    }
+    std::string out;
+    if (DomainName::canonicalASCII("www.b\xC3\xBC" "cher.example", out)) {
+        throw std::runtime_error("Non-ASCII name took the ASCII path");
+    }
+
+    DomainName upper("WWW.Example.COM."), lower("www.example.com");
+    if (upper != lower || upper.str() != "www.example.com" ||
+        upper.hash() != std::hash<std::string_view>()("www.example.com")) {
+        throw std::runtime_error("Spellings of one name gave different keys");
+    }
+    const std::string idn = "b\xC3\xBC" "cher.example";
+    if (DomainName::toASCII(idn) != Poco::Net::DNS::encodeIDN(idn) ||
+        DomainName::toASCII(idn) != DomainName::toASCII(idn) || DomainName::toASCII("plain.test") != "plain.test") {
+        throw std::runtime_error("IDN conversion changed when memoized");
+    }
+    // A name the conversion leaves outside ASCII is kept as given, lower-cased
+    const std::string broken = "WWW.\xFF\xFE.Example.";
+    if (!DomainName::canonicalASCII(DomainName::toASCII(broken), out)) {
+        DomainName kept(broken);
+        if (kept.str() != "www.\xFF\xFE.example" || kept.hash() != std::hash<std::string_view>()(kept.str())) {
+            throw std::runtime_error("Unconvertible name was not kept whole");
+        }
+    }
+
+    // Every spelling shares one cache entry
+    DNSResolver resolver;
+    auto options = mockOptions();
+    auto first = resolver.resolveDetailed("GitHub.COM", options);
+    auto second = resolver.resolveDetailed("github.com.", options);
+    if (first.status != DNSQuery::Status::Success || !second.from_cache ||
+        second.ip_addresses != first.ip_addresses) {
+        throw std::runtime_error("Differently cased names were cached apart");
+    }
+    auto batch = resolver.resolveMany({"GITHUB.com", "github.COM."}, options);
+    if (batch[0] != first.ip_addresses || batch[1] != first.ip_addresses ||
+        resolver.stats().counter(ResolverMetrics::Counter::CacheMisses) != 1) {
+        throw std::runtime_error("resolveMany did not reuse the canonical entry");
+    }
+}
+
+void testTypedRecords() {
+    using RT = DNSMessage::RecordType;
+    auto makeZone = [](const std::string& text) {
+        MockDNSServer::Zone zone;
+        std::istringstream in("$TTL 300\n$ORIGIN typed.test.\n"
+                              "@ 3600 IN SOA ns.mock. hostmaster.mock. 1 3600 600 86400 60\n"
+                              "@ IN NS ns1.typed.test.\n" + text);
+        std::string error;
+        if (!zone.parse(in, error)) throw std::runtime_error("Cannot parse typed zone: " + error);
+        return zone;
+    };
+    const std::string tail = "c IN SRV 10 60 5060 sip.typed.test.\n"
+                             "c IN TXT \"v=1\" \"x\"\n"
+                             "c IN MX 5 MX.typed.test.\n"
+                             "ptr IN PTR host.typed.test.\n";
+    MockDNSServer server(makeZone("a IN CNAME b\nb IN CNAME c\n" + tail));
+    DNSResolver resolver;
+    auto options = mockOptions(server);
+
+    auto srv = resolver.resolveRecords("A.typed.test", RT::SRV, options);
+    if (srv.status != DNSQuery::Status::Success || srv.queries != 1 || srv.canonical_name != "c.typed.test" ||
+        srv.records.size() != 1 || srv.records[0].priority != 10 || srv.records[0].weight != 60 ||
+        srv.records[0].port != 5060 || srv.records[0].data != "sip.typed.test") {
+        throw std::runtime_error("SRV lookup through a CNAME chain failed");
+    }
+    uint64_t sent = server.queries();
+    auto again = resolver.resolveRecords("a.typed.test.", RT::SRV, options);
+    if (!again.from_cache || again.queries != 0 || !(again.records == srv.records) || server.queries() != sent) {
+        throw std::runtime_error("SRV answer was not cached");
+    }
+
+    // With a and b gone upstream, only the cached links lead to c: a lookup
+    // of another type must follow them and ask for c alone
+    server.setZone(makeZone(tail));
+    auto txt = resolver.resolveRecords("a.typed.test", RT::TXT, options);
+    if (txt.status != DNSQuery::Status::Success || txt.queries != 1 || txt.canonical_name != "c.typed.test" ||
+        txt.records.size() != 1 || txt.records[0].strings != std::vector<std::string>{"v=1", "x"} ||
+        txt.records[0].data != "v=1x") {
+        throw std::runtime_error("Cached CNAME links were not followed");
+    }
+    auto link = resolver.resolveRecords("a.typed.test", RT::CNAME, options);
+    if (!link.from_cache || link.records.size() != 1 || link.records[0].data != "b.typed.test") {
+        throw std::runtime_error("CNAME link was not cached by itself");
+    }
+
+    auto mx = resolver.resolveRecords("c.typed.test", RT::MX, options);
+    auto ns = resolver.resolveRecords("typed.test", RT::NS, options);
+    auto ptr = resolver.resolveRecords("ptr.typed.test", RT::PTR, options);
+    if (mx.records.size() != 1 || mx.records[0].priority != 5 || mx.records[0].data != "mx.typed.test" ||
+        ns.records.size() != 1 || ns.records[0].data != "ns1.typed.test" ||
+        ptr.records.size() != 1 || ptr.records[0].data != "host.typed.test") {
+        throw std::runtime_error("MX, NS or PTR records were decoded wrongly");
+    }
+
+    auto absent = resolver.resolveRecords("absent.typed.test", RT::MX, options);
+    auto cached_absent = resolver.resolveRecords("absent.typed.test", RT::MX, options);
+    auto nodata = resolver.resolveRecords("c.typed.test", RT::PTR, options);
+    if (absent.status != DNSQuery::Status::NXDomain || !cached_absent.from_cache ||
+        cached_absent.status != DNSQuery::Status::NXDomain || nodata.status != DNSQuery::Status::NoData) {
+        throw std::runtime_error("Negative typed answers were wrong");
+    }
+}
+
+void testHappyEyeballs() {
+    using Clock = std::chrono::steady_clock;
+    auto elapsedMs = [](Clock::time_point since) {
+        return std::chrono::duration_cast<std::chrono::milliseconds>(Clock::now() - since).count();
+    };
+    auto hasFamily = [](const std::vector<std::string>& addresses, bool v6) {
+        return std::any_of(addresses.begin(), addresses.end(), [v6](const std::string& address) {
+            return (address.find(':') != std::string::npos) == v6;
+        });
+    };
+    MockDNSServer::Options mock;
+    mock.faults.slow_type = static_cast<uint16_t>(DNSMessage::RecordType::AAAA);
+    mock.faults.slow_latency = std::chrono::milliseconds(600);
+    MockDNSServer server(loadTestZone(), mock);
+    auto options = mockOptions(server);
+
+    // Slow AAAA: the A answer is given after the resolution delay, and the
+    // AAAA answer joins it in the cache when it arrives
+    DNSResolver resolver;
+    auto start = Clock::now();
+    auto first = resolver.resolveDetailed("github.com", options);
+    if (!first.partial || first.from_cache || first.ip_addresses != std::vector<std::string>{"192.0.2.10"} ||
+        first.status != DNSQuery::Status::Success || elapsedMs(start) < 40 || elapsedMs(start) > 400) {
+        throw std::runtime_error("Slow AAAA held up the A answer");
+    }
+    // Until the AAAA answer is in, callers share the lookup still in flight
+    uint64_t sent = server.queries();
+    auto again = resolver.resolveDetailed("github.com", options);
+    if (!again.partial || again.ip_addresses != first.ip_addresses || server.queries() != sent) {
+        throw std::runtime_error("Caller during the resolution delay did not join the lookup");
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(900));
+    auto cached = resolver.resolveDetailed("github.com", options);
+    if (!cached.from_cache || cached.partial || !hasFamily(cached.ip_addresses, false) ||
+        !hasFamily(cached.ip_addresses, true)) {
+        throw std::runtime_error("Both families were not cached together");
+    }
+
+    // Slow A, with no delay at all: the AAAA answer is returned at once
+    mock.faults.slow_type = static_cast<uint16_t>(DNSMessage::RecordType::A);
+    server.setFaults(mock.faults);
+    options.resolution_delay_ms = 0;
+    start = Clock::now();
+    auto v6 = resolver.resolveDetailed("example.com", options);
+    if (!v6.partial || v6.ip_addresses != std::vector<std::string>{"2001:db8::20"} || elapsedMs(start) > 400) {
+        throw std::runtime_error("Slow A held up the AAAA answer");
+    }
+
+    // A negative delay waits for both families
+    options.resolution_delay_ms = -1;
+    DNSResolver patient;
+    start = Clock::now();
+    auto both = patient.resolveDetailed("github.com", options);
+    if (both.partial || both.ip_addresses.size() != 2 || elapsedMs(start) < 500) {
+        throw std::runtime_error("Resolve did not wait for both families");
+    }
+    // ... even when a lookup that takes one family early is already in flight
+    DNSResolver shared;
+    auto eager = options;
+    eager.resolution_delay_ms = 50;
+    std::promise<DNSResolver::ResolveResult> early;
+    auto early_result = early.get_future();
+    shared.resolveAsyncDetailed("github.com", eager, [&](const DNSResolver::ResolveResult& result) {
+        early.set_value(result);
+    });
+    auto waited = shared.resolveDetailed("github.com", options);
+    if (!early_result.get().partial || waited.partial || waited.ip_addresses.size() != 2) {
+        throw std::runtime_error("A caller waiting for both families got a partial answer");
+    }
+
+    // When both answer within the delay, the caller gets both
+    server.setFaults(MockDNSServer::Faults());
+    options.resolution_delay_ms = 50;
+    auto quick = patient.resolveDetailed("example.com", options);
+    if (quick.partial || quick.ip_addresses.size() != 3) {
+        throw std::runtime_error("Fast dual-stack answer was split");
+    }
+}
+
+void testAllocationFreeHits() {
+    MockDNSServer server(loadTestZone());
+    DNSResolver resolver;
+    auto options = mockOptions(server);
+    DNSResolver::ResultBuffer result;
+
+    // The first miss sizes the buffer and leaves its lookup in the pool
+    resolver.resolveInto("example.com", options, result);
+    if (result.status != DNSQuery::Status::Success || result.from_cache ||
+        result.addresses() != std::vector<std::string>{"192.0.2.20", "192.0.2.21", "2001:db8::20"}) {
+        throw std::runtime_error("resolveInto returned the wrong addresses");
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+
+    // A later miss reuses the pooled lookup state; what is left is the
+    // flight bookkeeping and the engine's callbacks
+    uint64_t before = thread_allocations;
+    resolver.resolveInto("github.com", options, result);
+    uint64_t miss = thread_allocations - before;
+    if (result.size() != 2 || result[1] != "2001:db8::10" || miss > 24) {
+        throw std::runtime_error("A miss made " + std::to_string(miss) + " allocations");
+    }
+
+    // Hits make none, however the name is spelled
+    before = thread_allocations;
+    for (int i = 0; i < 100; ++i) {
+        resolver.resolveInto(i % 2 ? "GitHub.com." : "github.com", options, result);
+    }
+    uint64_t hits = thread_allocations - before;
+    if (hits != 0 || !result.from_cache || result.size() != 2 || result[0] != "192.0.2.10" ||
+        result.name().str() != "github.com") {
+        throw std::runtime_error("Cache hits made " + std::to_string(hits) + " allocations");
+    }
+
+    // Nor do local answers
+    LocalZone::Builder builder;
+    builder.add("printer.lan", false, LocalZone::Action::Answer, {"10.0.0.5"});
+    resolver.setLocalZone(builder.build());
+    before = thread_allocations;
+    resolver.resolveInto("printer.lan", options, result);
+    if (thread_allocations != before || !result.local || result.size() != 1 || result[0] != "10.0.0.5") {
+        throw std::runtime_error("Local answer allocated or was wrong");
+    }
+}
+
 int main() {
     TestRunner runner;
     runner.startTesting();
@@ -310,6 +2221,33 @@ int main() {
     runner.runTest("Large Domain Resolution", testLargeDomainResolution);
     runner.runTest("IDN Resolution", testIDNResolution);
     //runner.runTest("Another IDN Resolution", testAnotherIDNResolution);
+    runner.runTest("Message Round Trip", testMessageRoundTrip);
+    runner.runTest("Compressed Response Parsing", testCompressedResponseParsing);
+    runner.runTest("Loopback Resolution", testLoopbackResolution);
+    runner.runTest("Iterative Resolution", testIterativeResolution);
+    runner.runTest("Async Resolution", testAsyncResolution);
+    runner.runTest("Batch Resolution", testBatchResolution);
+    runner.runTest("Concurrent Cache", testConcurrentCache);
+    runner.runTest("Cache Bounds", testCacheBounds);
+    runner.runTest("TTL Honored", testTTLHonored);
+    runner.runTest("Cache Entry View", testCacheEntryView);
+    runner.runTest("Single Flight", testSingleFlight);
+    runner.runTest("Prefetch And Serve Stale", testPrefetchAndServeStale);
+    runner.runTest("Negative Caching", testNegativeCaching);
+    runner.runTest("Retransmit And Hedging", testRetransmitAndHedging);
+    runner.runTest("Upstream Selection", testUpstreamSelection);
+    runner.runTest("Mock Server Faults", testMockServerFaults);
+    runner.runTest("Latency Histogram", testLatencyHistogram);
+    runner.runTest("Resolver Metrics", testResolverMetrics);
+    runner.runTest("DNS Server", testDNSServer);
+    runner.runTest("Datagram Batch", testDatagramBatch);
+    runner.runTest("TCP Fallback", testTCPFallback);
+    runner.runTest("Cache Snapshot", testCacheSnapshot);
+    runner.runTest("Local Zone", testLocalZone);
+    runner.runTest("Name Normalization", testNameNormalization);
+    runner.runTest("Typed Records", testTypedRecords);
+    runner.runTest("Happy Eyeballs", testHappyEyeballs);
+    runner.runTest("Allocation-Free Hits", testAllocationFreeHits);
     // Print final summary
     runner.printSummary();
 
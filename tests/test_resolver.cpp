@@ -1,8 +1,11 @@
 #include <cppunit/extensions/HelperMacros.h>
 #include "DNSResolver.h"
+#include "MockDNSServer.h"
+#include <memory>
 #include <vector>
 #include <string>
 #include <iostream>
+#include <thread>
 
 class DNSResolverTest : public CppUnit::TestFixture {
     CPPUNIT_TEST_SUITE(DNSResolverTest);
@@ -15,16 +18,22 @@ class DNSResolverTest : public CppUnit::TestFixture {
 
 public:
     void setUp() override {
-        // Initialize any necessary resources
+        // Answers from a loopback server instead of the internet; the 1s
+        // TTL lets testCacheStaleAfterTTL watch the entry expire
+        MockDNSServer::Zone zone;
+        std::string error;
+        CPPUNIT_ASSERT(zone.add("example.com", DNSMessage::RecordType::A, 1, "93.184.216.34", error));
+        server_.reset(new MockDNSServer(std::move(zone)));
     }
 
     void tearDown() override {
-        // Clean up resources
+        server_.reset();
     }
 
     void testResolveWithCache() {
         DNSResolver resolver;
         DNSResolver::ResolverOptions options;
+        options.nameservers = {server_->address()};
         options.use_cache = true;
 
         // Assume "example.com" resolves to a specific IP address
@@ -37,6 +46,7 @@ public:
     void testResolveWithoutCache() {
         DNSResolver resolver;
         DNSResolver::ResolverOptions options;
+        options.nameservers = {server_->address()};
         options.use_cache = false;
 
         std::vector<std::string> result = resolver.resolve("example.com", options);
@@ -48,6 +58,7 @@ public:
     void testCacheExpiration() {
         DNSResolver resolver;
         DNSResolver::ResolverOptions options;
+        options.nameservers = {server_->address()};
         options.use_cache = true;
 
         // First resolution
@@ -67,6 +78,7 @@ public:
     void testEmptyCache() {
         DNSResolver resolver;
         DNSResolver::ResolverOptions options;
+        options.nameservers = {server_->address()};
         options.use_cache = true;
 
         // Testing when the cache is empty
@@ -77,6 +89,7 @@ public:
     void testCacheStaleAfterTTL() {
         DNSResolver resolver;
         DNSResolver::ResolverOptions options;
+        options.nameservers = {server_->address()};
         options.use_cache = true;
 
         // Simulate a resolution with a TTL of 1 second
@@ -90,7 +103,11 @@ public:
         std::vector<std::string> resultAfterTTL = resolver.resolve("example.com", options);
         CPPUNIT_ASSERT_EQUAL(size_t(1), resultAfterTTL.size());
         CPPUNIT_ASSERT(resultAfterTTL[0] == "93.184.216.34");
+        CPPUNIT_ASSERT_EQUAL(uint64_t(4), server_->queries());  // A and AAAA, twice
     }
+
+private:
+    std::unique_ptr<MockDNSServer> server_;
 };
 
 CPPUNIT_TEST_SUITE_REGISTRATION(DNSResolverTest);
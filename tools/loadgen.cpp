@@ -0,0 +1,578 @@
+// dnsperf-style load generator. Replays a query log, or draws names from a
+// Zipf distribution, against the resolver library in-process or against a
+// DNS server over UDP, and reports throughput, cache hit ratio and the
+// latency distribution.
+//
+// Usage: dns_loadgen [--queries FILE | --zipf NAMES [--zipf-s S] [--domain D]]
+//                    [--server IP:PORT] [--upstream IP:PORT]... [--mock]
+//                    [--rate QPS] [--concurrency N] [--duration SECONDS]
+//                    [--count N] [--timeout-ms N] [--seed N] [--json]
+//                    [--pipeline N [--batch N]]
+//
+// Query log lines are "name [type]" as in dnsperf data files; '#' and ';'
+// start comments. The log is replayed in order and wraps around. Without a
+// log, --zipf names "n<rank>.<domain>" are drawn with exponent --zipf-s.
+//
+// With --server, queries go over UDP to that server; otherwise they go to
+// an in-process DNSResolver using --upstream (or the system nameservers).
+// --mock starts a loopback server answering every name under --domain and
+// uses it as the upstream; "--server mock" sends to it directly.
+//
+// With --rate, queries are scheduled open-loop at that rate and latency is
+// measured from each query's scheduled time, so a stalled target is not
+// hidden by the generator slowing down. Without it, each of the
+// --concurrency workers sends its next query as soon as the last finishes.
+//
+// --pipeline (with --server) instead keeps up to N queries outstanding per
+// worker, sent and received --batch at a time with sendmmsg/recvmmsg, so a
+// few workers can push a server to its packet-rate limit. The report
+// includes packets per second in each direction.
+#include <arpa/inet.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <deque>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+#include "DNSMessage.h"
+#include "DNSResolver.h"
+#include "DatagramBatch.h"
+#include "LatencyHistogram.h"
+#include "MockDNSServer.h"
+#include "UDPTransport.h"
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+struct Query {
+    std::string name;
+    DNSMessage::RecordType type;
+};
+
+struct Settings {
+    std::string queries_path;
+    size_t zipf_names = 10000;
+    double zipf_s = 1.0;
+    std::string domain = "example.com";
+    std::string server;
+    std::vector<std::string> upstreams;
+    bool mock = false;
+    double rate = 0;  // 0: as fast as the workers go
+    unsigned concurrency = 16;
+    double duration = 10;
+    uint64_t count = 0;  // 0: no limit
+    int timeout_ms = 2000;
+    uint32_t seed = 1;
+    bool json = false;
+    size_t pipeline = 0;  // Outstanding queries per worker; 0: one at a time
+    size_t batch = 32;    // Datagrams per sendmmsg/recvmmsg with --pipeline
+};
+
+// What each worker saw; merged for the report
+struct Tally {
+    LatencyHistogram latency;  // Nanoseconds
+    uint64_t sent = 0;
+    uint64_t answered = 0;  // Any response, including NXDOMAIN and SERVFAIL
+    uint64_t failed = 0;    // Timeouts and errors
+    uint64_t hits = 0;      // Library mode only
+    uint64_t noerror = 0;
+    uint64_t nxdomain = 0;
+    uint64_t servfail = 0;
+    uint64_t other_rcode = 0;
+};
+
+int usage() {
+    std::cerr << "usage: dns_loadgen [--queries FILE | --zipf NAMES [--zipf-s S] [--domain D]]\n"
+                 "                   [--server IP:PORT] [--upstream IP:PORT]... [--mock]\n"
+                 "                   [--rate QPS] [--concurrency N] [--duration SECONDS]\n"
+                 "                   [--count N] [--timeout-ms N] [--seed N] [--json]\n"
+                 "                   [--pipeline N [--batch N]]" << std::endl;
+    return 2;
+}
+
+bool loadQueries(const std::string& path, std::vector<Query>& queries) {
+    std::ifstream in(path);
+    if (!in) {
+        std::cerr << "dns_loadgen: cannot open " << path << std::endl;
+        return false;
+    }
+    std::string line;
+    size_t number = 0;
+    while (std::getline(in, line)) {
+        ++number;
+        line = line.substr(0, line.find_first_of("#;"));
+        std::istringstream fields(line);
+        Query query{"", DNSMessage::RecordType::A};
+        std::string type;
+        if (!(fields >> query.name)) continue;
+        if (fields >> type && !DNSMessage::parseType(type, query.type)) {
+            std::cerr << "dns_loadgen: " << path << ":" << number << ": unknown type " << type << std::endl;
+            return false;
+        }
+        if (query.name.size() > 1 && query.name.back() == '.') query.name.pop_back();
+        queries.push_back(std::move(query));
+    }
+    if (queries.empty()) {
+        std::cerr << "dns_loadgen: no queries in " << path << std::endl;
+        return false;
+    }
+    return true;
+}
+
+// A fixed sequence of Zipf-distributed names, long enough that replaying it
+// in a loop looks like a fresh draw
+std::vector<Query> zipfQueries(const Settings& settings) {
+    std::vector<double> cdf(settings.zipf_names);
+    double total = 0;
+    for (size_t rank = 0; rank < cdf.size(); ++rank) {
+        total += 1.0 / std::pow(static_cast<double>(rank + 1), settings.zipf_s);
+        cdf[rank] = total;
+    }
+    std::mt19937 random(settings.seed);
+    std::uniform_real_distribution<double> uniform(0, total);
+    const size_t length = std::max<size_t>(settings.zipf_names * 16, 1 << 16);
+    std::vector<Query> queries;
+    queries.reserve(length);
+    for (size_t i = 0; i < length; ++i) {
+        size_t rank = std::lower_bound(cdf.begin(), cdf.end(), uniform(random)) - cdf.begin();
+        rank = std::min(rank, cdf.size() - 1);
+        queries.push_back(Query{"n" + std::to_string(rank + 1) + "." + settings.domain, DNSMessage::RecordType::A});
+    }
+    return queries;
+}
+
+MockDNSServer::Zone mockZone(const std::string& domain) {
+    std::istringstream text("$TTL 300\n$ORIGIN " + domain + ".\n"
+                            "@ IN SOA ns.mock. hostmaster.mock. 1 3600 600 86400 60\n"
+                            "* IN A 192.0.2.1\n"
+                            "* IN AAAA 2001:db8::1\n");
+    MockDNSServer::Zone zone;
+    std::string error;
+    if (!zone.parse(text, error)) throw std::runtime_error(error);
+    return zone;
+}
+
+void countRcode(Tally& tally, DNSMessage::RCode rcode) {
+    switch (rcode) {
+    case DNSMessage::RCode::NoError: ++tally.noerror; break;
+    case DNSMessage::RCode::NXDomain: ++tally.nxdomain; break;
+    case DNSMessage::RCode::ServFail: ++tally.servfail; break;
+    default: ++tally.other_rcode; break;
+    }
+}
+
+// Sends queries to a DNS server over one connected UDP socket.
+class SocketTarget {
+public:
+    SocketTarget(const UDPTransport::ServerAddress& server, int timeout_ms) : timeout_ms_(timeout_ms) {
+        fd_ = socket(server.addr.ss_family, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+        if (fd_ >= 0 && connect(fd_, reinterpret_cast<const sockaddr*>(&server.addr), server.length) != 0) {
+            close(fd_);
+            fd_ = -1;
+        }
+    }
+    ~SocketTarget() {
+        if (fd_ >= 0) close(fd_);
+    }
+
+    void run(const Query& query, Tally& tally) {
+        uint8_t packet[512];
+        const uint16_t id = UDPTransport::randomId();
+        size_t length = DNSMessage::buildQuery(packet, sizeof(packet), id, query.name, query.type);
+        if (fd_ < 0 || length == 0 || send(fd_, packet, length, 0) != static_cast<ssize_t>(length)) {
+            ++tally.failed;
+            return;
+        }
+        const auto deadline = Clock::now() + std::chrono::milliseconds(timeout_ms_);
+        while (true) {
+            auto remaining = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - Clock::now());
+            pollfd pfd{fd_, POLLIN, 0};
+            int ready = remaining.count() > 0 ? poll(&pfd, 1, static_cast<int>(remaining.count())) : 0;
+            if (ready < 0 && errno == EINTR) continue;
+            if (ready <= 0) break;
+            ssize_t n = recv(fd_, response_, sizeof(response_), 0);
+            if (n < 0) {
+                if (errno == EINTR) continue;
+                break;
+            }
+            // Late answers to earlier, timed-out queries are skipped
+            if (static_cast<size_t>(n) < DNSMessage::HEADER_SIZE || DNSMessage::readU16(response_) != id) continue;
+            ++tally.answered;
+            countRcode(tally, static_cast<DNSMessage::RCode>(response_[3] & 0x0F));
+            return;
+        }
+        ++tally.failed;
+    }
+
+private:
+    int fd_ = -1;
+    int timeout_ms_;
+    uint8_t response_[4096];
+};
+
+// Resolves through an in-process DNSResolver.
+class LibraryTarget {
+public:
+    LibraryTarget(DNSResolver& resolver, const DNSResolver::ResolverOptions& options)
+        : resolver_(resolver), options_(options) {}
+
+    void run(const Query& query, Tally& tally) {
+        DNSResolver::ResolveResult result;
+        try {
+            result = resolver_.resolveDetailed(query.name, options_);
+        } catch (const std::exception&) {
+            ++tally.failed;
+            return;
+        }
+        if (result.from_cache) ++tally.hits;
+        switch (result.status) {
+        case DNSQuery::Status::Success:
+        case DNSQuery::Status::NoData: ++tally.answered; ++tally.noerror; break;
+        case DNSQuery::Status::NXDomain: ++tally.answered; ++tally.nxdomain; break;
+        case DNSQuery::Status::Failure: ++tally.failed; break;
+        }
+    }
+
+private:
+    DNSResolver& resolver_;
+    const DNSResolver::ResolverOptions& options_;
+};
+
+template <typename MakeTarget>
+void runWorkers(const Settings& settings, const std::vector<Query>& queries, MakeTarget make_target,
+                std::vector<Tally>& tallies, double& elapsed) {
+    std::atomic<uint64_t> next{0};
+    const auto start = Clock::now();
+    const auto end = start + std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(settings.duration));
+    std::vector<std::thread> workers;
+    for (unsigned w = 0; w < settings.concurrency; ++w) {
+        workers.emplace_back([&, w] {
+            auto target = make_target();
+            Tally& tally = tallies[w];
+            while (true) {
+                const uint64_t i = next.fetch_add(1, std::memory_order_relaxed);
+                if (settings.count && i >= settings.count) break;
+                Clock::time_point scheduled;
+                if (settings.rate > 0) {
+                    scheduled = start + std::chrono::duration_cast<Clock::duration>(
+                                            std::chrono::duration<double>(i / settings.rate));
+                    if (scheduled >= end) break;
+                    std::this_thread::sleep_until(scheduled);
+                } else {
+                    scheduled = Clock::now();
+                    if (scheduled >= end) break;
+                }
+                ++tally.sent;
+                target->run(queries[i % queries.size()], tally);
+                tally.latency.record(static_cast<uint64_t>(
+                    std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - scheduled).count()));
+            }
+        });
+    }
+    for (auto& worker : workers) worker.join();
+    elapsed = std::chrono::duration<double>(Clock::now() - start).count();
+}
+
+// Keeps settings.pipeline queries in flight on each worker's connected UDP
+// socket, moving them settings.batch at a time. IDs match responses to
+// their send times; a query unanswered after the timeout counts as failed.
+void runPipelined(const Settings& settings, const std::vector<Query>& queries,
+                  const UDPTransport::ServerAddress& server, std::vector<Tally>& tallies, double& elapsed) {
+    std::atomic<uint64_t> next{0};
+    const auto start = Clock::now();
+    const auto end = start + std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(settings.duration));
+    const auto timeout = std::chrono::milliseconds(settings.timeout_ms);
+    std::vector<std::thread> workers;
+    for (unsigned w = 0; w < settings.concurrency; ++w) {
+        workers.emplace_back([&, w] {
+            Tally& tally = tallies[w];
+            int fd = socket(server.addr.ss_family, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+            if (fd < 0 || connect(fd, reinterpret_cast<const sockaddr*>(&server.addr), server.length) != 0) {
+                if (fd >= 0) close(fd);
+                return;
+            }
+            DatagramBatch out(settings.batch, DNSMessage::MAX_UDP_SIZE);
+            DatagramBatch in(settings.batch, 4096);
+            std::vector<uint16_t> batch_ids;
+            std::vector<size_t> unsent;
+            std::vector<Clock::time_point> sent_at(65536);
+            std::vector<uint8_t> waiting(65536, 0);
+            std::deque<std::pair<uint16_t, Clock::time_point>> order;  // Send order, for timeouts
+            size_t outstanding = 0;
+            uint16_t next_id = UDPTransport::randomId();
+            bool sending = true;
+            auto flush = [&] {
+                unsent.clear();
+                out.flush(fd, &unsent);
+                for (size_t slot : unsent) {
+                    waiting[batch_ids[slot]] = 0;
+                    --outstanding;
+                    ++tally.failed;
+                }
+                batch_ids.clear();
+            };
+
+            while (sending || outstanding > 0) {
+                auto now = Clock::now();
+                if (now >= end) sending = false;
+                while (sending && outstanding < settings.pipeline) {
+                    const uint64_t i = next.fetch_add(1, std::memory_order_relaxed);
+                    if (settings.count && i >= settings.count) {
+                        sending = false;
+                        break;
+                    }
+                    while (waiting[next_id]) ++next_id;
+                    const Query& query = queries[i % queries.size()];
+                    ++tally.sent;
+                    size_t length = DNSMessage::buildQuery(out.prepare(), out.bufferSize(), next_id,
+                                                           query.name, query.type);
+                    if (length == 0) {
+                        ++tally.failed;
+                        continue;
+                    }
+                    out.commit(length);
+                    batch_ids.push_back(next_id);
+                    waiting[next_id] = 1;
+                    sent_at[next_id] = now;
+                    order.emplace_back(next_id, now);
+                    ++outstanding;
+                    ++next_id;
+                    if (out.full()) flush();
+                }
+                flush();
+
+                pollfd pfd{fd, POLLIN, 0};
+                if (poll(&pfd, 1, 1) > 0) {
+                    size_t received;
+                    while ((received = in.receive(fd)) > 0) {
+                        now = Clock::now();
+                        for (size_t r = 0; r < received; ++r) {
+                            if (in.length(r) < DNSMessage::HEADER_SIZE) continue;
+                            const uint16_t id = DNSMessage::readU16(in.data(r));
+                            if (!waiting[id]) continue;  // Late answer to a timed-out query
+                            waiting[id] = 0;
+                            --outstanding;
+                            ++tally.answered;
+                            countRcode(tally, static_cast<DNSMessage::RCode>(in.data(r)[3] & 0x0F));
+                            tally.latency.record(static_cast<uint64_t>(
+                                std::chrono::duration_cast<std::chrono::nanoseconds>(now - sent_at[id]).count()));
+                        }
+                        if (received < in.capacity()) break;
+                    }
+                }
+
+                now = Clock::now();
+                while (!order.empty()) {
+                    const auto& oldest = order.front();
+                    if (waiting[oldest.first] && sent_at[oldest.first] == oldest.second) {
+                        if (now - oldest.second < timeout) break;
+                        waiting[oldest.first] = 0;
+                        --outstanding;
+                        ++tally.failed;
+                    }
+                    order.pop_front();
+                }
+            }
+            close(fd);
+        });
+    }
+    for (auto& worker : workers) worker.join();
+    elapsed = std::chrono::duration<double>(Clock::now() - start).count();
+}
+
+double millis(uint64_t nanoseconds) { return nanoseconds / 1e6; }
+
+void report(const Settings& settings, const Tally& total, double elapsed, bool library) {
+    const double qps = elapsed > 0 ? total.answered / elapsed : 0;
+    const double sent_pps = elapsed > 0 ? total.sent / elapsed : 0;
+    const double hit_ratio = total.sent ? static_cast<double>(total.hits) / total.sent : 0;
+    const std::pair<const char*, double> quantiles[] = {
+        {"p50", 0.5}, {"p90", 0.9}, {"p99", 0.99}, {"p99.9", 0.999}, {"p99.99", 0.9999},
+    };
+
+    if (settings.json) {
+        std::cout << std::fixed << std::setprecision(3)
+                  << "{\n  \"mode\": \"" << (library ? "library" : "socket") << "\",\n"
+                  << "  \"target_rate\": " << settings.rate << ",\n"
+                  << "  \"concurrency\": " << settings.concurrency << ",\n"
+                  << "  \"elapsed_s\": " << elapsed << ",\n"
+                  << "  \"sent\": " << total.sent << ",\n"
+                  << "  \"answered\": " << total.answered << ",\n"
+                  << "  \"failed\": " << total.failed << ",\n"
+                  << "  \"qps\": " << qps << ",\n"
+                  << "  \"packets_per_s\": {\"sent\": " << sent_pps << ", \"received\": " << qps << "},\n"
+                  << "  \"hit_ratio\": " << (library ? std::to_string(hit_ratio) : "null") << ",\n"
+                  << "  \"rcodes\": {\"NOERROR\": " << total.noerror << ", \"NXDOMAIN\": " << total.nxdomain
+                  << ", \"SERVFAIL\": " << total.servfail << ", \"other\": " << total.other_rcode << "},\n"
+                  << "  \"latency_ms\": {\"mean\": " << total.latency.mean() / 1e6;
+        for (const auto& q : quantiles) {
+            std::cout << ", \"" << q.first << "\": " << millis(total.latency.percentile(q.second));
+        }
+        std::cout << ", \"max\": " << millis(total.latency.max()) << "}\n}" << std::endl;
+        return;
+    }
+
+    std::cout << std::fixed << std::setprecision(2)
+              << "Queries sent:      " << total.sent << "\n"
+              << "Queries answered:  " << total.answered << "\n"
+              << "Queries failed:    " << total.failed << " (timeouts and errors)\n"
+              << "Run time:          " << elapsed << " s\n"
+              << "Answered QPS:      " << qps;
+    if (settings.rate > 0) std::cout << " (target " << settings.rate << ")";
+    if (!library) std::cout << "\nPackets/s:         " << sent_pps << " sent, " << qps << " received";
+    std::cout << "\nResponse codes:    NOERROR " << total.noerror << ", NXDOMAIN " << total.nxdomain
+              << ", SERVFAIL " << total.servfail << ", other " << total.other_rcode << "\n";
+    if (library) std::cout << "Cache hit ratio:   " << hit_ratio * 100 << "%\n";
+    std::cout << std::setprecision(3) << "Latency (ms):      mean " << total.latency.mean() / 1e6;
+    for (const auto& q : quantiles) std::cout << ", " << q.first << " " << millis(total.latency.percentile(q.second));
+    std::cout << ", max " << millis(total.latency.max()) << "\n\nLatency distribution (ms):\n";
+
+    // One line per populated bucket, merged into roughly 2x steps
+    uint64_t cumulative = 0, step_count = 0;
+    uint64_t step_top = 0;
+    for (size_t b = 0; b < LatencyHistogram::BUCKETS && cumulative < total.latency.count(); ++b) {
+        uint64_t n = total.latency.bucketCount(b);
+        if (n == 0) continue;
+        step_count += n;
+        cumulative += n;
+        uint64_t top = LatencyHistogram::bucketTop(b);
+        if (top < step_top * 2 && cumulative < total.latency.count()) continue;
+        std::cout << "  <= " << std::setw(10) << millis(top) << std::setw(12) << step_count
+                  << std::setw(9) << std::setprecision(2) << 100.0 * cumulative / total.latency.count() << "%\n"
+                  << std::setprecision(3);
+        step_top = std::max<uint64_t>(top, 1);
+        step_count = 0;
+    }
+    std::cout << std::flush;
+}
+
+}  // namespace
+
+int main(int argc, char* argv[]) {
+    Settings settings;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "--mock") {
+            settings.mock = true;
+            continue;
+        }
+        if (arg == "--json") {
+            settings.json = true;
+            continue;
+        }
+        if (i + 1 >= argc) return usage();
+        std::string value = argv[++i];
+        if (arg == "--queries") {
+            settings.queries_path = value;
+        } else if (arg == "--zipf") {
+            settings.zipf_names = std::strtoul(value.c_str(), nullptr, 10);
+        } else if (arg == "--zipf-s") {
+            settings.zipf_s = std::atof(value.c_str());
+        } else if (arg == "--domain") {
+            settings.domain = value;
+        } else if (arg == "--server") {
+            settings.server = value;
+        } else if (arg == "--upstream") {
+            settings.upstreams.push_back(value);
+        } else if (arg == "--rate") {
+            settings.rate = std::atof(value.c_str());
+        } else if (arg == "--concurrency") {
+            settings.concurrency = static_cast<unsigned>(std::atoi(value.c_str()));
+        } else if (arg == "--duration") {
+            settings.duration = std::atof(value.c_str());
+        } else if (arg == "--count") {
+            settings.count = std::strtoull(value.c_str(), nullptr, 10);
+        } else if (arg == "--timeout-ms") {
+            settings.timeout_ms = std::atoi(value.c_str());
+        } else if (arg == "--pipeline") {
+            settings.pipeline = std::strtoul(value.c_str(), nullptr, 10);
+        } else if (arg == "--batch") {
+            settings.batch = std::strtoul(value.c_str(), nullptr, 10);
+        } else if (arg == "--seed") {
+            settings.seed = static_cast<uint32_t>(std::strtoul(value.c_str(), nullptr, 10));
+        } else {
+            return usage();
+        }
+    }
+    if (settings.concurrency == 0 || settings.zipf_names == 0 || settings.duration <= 0) return usage();
+    // The window is bounded by the 16-bit ID space; pipelining is closed-loop
+    if (settings.pipeline > 60000 || settings.batch == 0 || (settings.pipeline && settings.rate > 0)) return usage();
+
+    std::vector<Query> queries;
+    if (!settings.queries_path.empty()) {
+        if (!loadQueries(settings.queries_path, queries)) return 1;
+    } else {
+        queries = zipfQueries(settings);
+    }
+
+    try {
+        std::unique_ptr<MockDNSServer> mock;
+        if (settings.mock || settings.server == "mock") {
+            mock.reset(new MockDNSServer(mockZone(settings.domain)));
+            if (settings.server == "mock") {
+                settings.server = mock->address();
+            } else if (settings.server.empty() && settings.upstreams.empty()) {
+                settings.upstreams.push_back(mock->address());
+            }
+        }
+
+        std::vector<Tally> tallies(settings.concurrency);
+        double elapsed = 0;
+        const bool library = settings.server.empty();
+        if (library) {
+            DNSResolver resolver;
+            DNSResolver::ResolverOptions options;
+            options.nameservers = settings.upstreams;
+            options.timeout_seconds = std::max(1, (settings.timeout_ms + 999) / 1000);
+            runWorkers(settings, queries, [&] {
+                return std::unique_ptr<LibraryTarget>(new LibraryTarget(resolver, options));
+            }, tallies, elapsed);
+        } else {
+            UDPTransport::ServerAddress server;
+            if (!UDPTransport::ServerAddress::parse(settings.server, UDPTransport::DNS_PORT, server)) {
+                std::cerr << "dns_loadgen: bad server address " << settings.server << std::endl;
+                return 1;
+            }
+            if (settings.pipeline) {
+                runPipelined(settings, queries, server, tallies, elapsed);
+            } else {
+                runWorkers(settings, queries, [&] {
+                    return std::unique_ptr<SocketTarget>(new SocketTarget(server, settings.timeout_ms));
+                }, tallies, elapsed);
+            }
+        }
+
+        Tally total;
+        for (const Tally& t : tallies) {
+            total.latency.merge(t.latency);
+            total.sent += t.sent;
+            total.answered += t.answered;
+            total.failed += t.failed;
+            total.hits += t.hits;
+            total.noerror += t.noerror;
+            total.nxdomain += t.nxdomain;
+            total.servfail += t.servfail;
+            total.other_rcode += t.other_rcode;
+        }
+        report(settings, total, elapsed, library);
+    } catch (const std::exception& e) {
+        std::cerr << "dns_loadgen: " << e.what() << std::endl;
+        return 1;
+    }
+    return 0;
+}
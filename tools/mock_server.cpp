@@ -0,0 +1,101 @@
+// Serves a zone file on a loopback UDP port (and TCP on the same port),
+// optionally injecting faults, so the resolver can be tested and
+// benchmarked without the internet.
+//
+// Usage: dns_mock_server --zone FILE [--address IP] [--port N]
+//                        [--latency-ms N] [--jitter-ms N] [--loss P]
+//                        [--truncate P] [--servfail P] [--ttl N] [--seed N]
+//                        [--slow-type TYPE --slow-ms N]
+//
+// P is a probability between 0 and 1. --slow-type delays the answers to
+// one query type (A, AAAA, ...) by a further --slow-ms. Runs until interrupted, then prints
+// how many queries were answered and dropped.
+#include <csignal>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <thread>
+#include "DNSMessage.h"
+#include "MockDNSServer.h"
+
+namespace {
+
+volatile std::sig_atomic_t stop_requested = 0;
+
+void requestStop(int) { stop_requested = 1; }
+
+int usage() {
+    std::cerr << "usage: dns_mock_server --zone FILE [--address IP] [--port N] [--latency-ms N]\n"
+                 "                       [--jitter-ms N] [--loss P] [--truncate P] [--servfail P]\n"
+                 "                       [--ttl N] [--seed N] [--slow-type TYPE --slow-ms N]" << std::endl;
+    return 2;
+}
+
+}  // namespace
+
+int main(int argc, char* argv[]) {
+    std::string zone_path;
+    MockDNSServer::Options options;
+    options.port = 5353;
+    auto& faults = options.faults;
+
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (i + 1 >= argc) return usage();
+        std::string value = argv[++i];
+        if (arg == "--zone") {
+            zone_path = value;
+        } else if (arg == "--address") {
+            options.address = value;
+        } else if (arg == "--port") {
+            options.port = static_cast<uint16_t>(std::atoi(value.c_str()));
+        } else if (arg == "--latency-ms") {
+            faults.latency = std::chrono::microseconds(static_cast<int64_t>(std::atof(value.c_str()) * 1000));
+        } else if (arg == "--jitter-ms") {
+            faults.jitter = std::chrono::microseconds(static_cast<int64_t>(std::atof(value.c_str()) * 1000));
+        } else if (arg == "--loss") {
+            faults.loss = std::atof(value.c_str());
+        } else if (arg == "--truncate") {
+            faults.truncate = std::atof(value.c_str());
+        } else if (arg == "--servfail") {
+            faults.servfail = std::atof(value.c_str());
+        } else if (arg == "--ttl") {
+            faults.ttl = std::atoll(value.c_str());
+        } else if (arg == "--slow-type") {
+            DNSMessage::RecordType type;
+            if (!DNSMessage::parseType(value, type)) return usage();
+            faults.slow_type = static_cast<uint16_t>(type);
+        } else if (arg == "--slow-ms") {
+            faults.slow_latency = std::chrono::microseconds(static_cast<int64_t>(std::atof(value.c_str()) * 1000));
+        } else if (arg == "--seed") {
+            faults.seed = static_cast<uint32_t>(std::strtoul(value.c_str(), nullptr, 10));
+        } else {
+            return usage();
+        }
+    }
+    if (zone_path.empty()) return usage();
+
+    MockDNSServer::Zone zone;
+    std::string error;
+    if (!zone.load(zone_path, error)) {
+        std::cerr << "dns_mock_server: " << error << std::endl;
+        return 1;
+    }
+
+    std::signal(SIGINT, requestStop);
+    std::signal(SIGTERM, requestStop);
+    try {
+        const size_t records = zone.size();
+        MockDNSServer server(std::move(zone), options);
+        std::cout << "Serving " << records << " records on " << server.address() << std::endl;
+        while (!stop_requested) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        }
+        std::cout << server.answered() << " answered, " << server.dropped() << " dropped of "
+                  << server.queries() << " queries" << std::endl;
+    } catch (const std::exception& e) {
+        std::cerr << "dns_mock_server: " << e.what() << std::endl;
+        return 1;
+    }
+    return 0;
+}